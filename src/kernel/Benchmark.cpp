@@ -0,0 +1,1319 @@
+#include "Benchmark.h"
+#include <Assert.h>
+#include "kernel/Kernel.h"
+#include "kernel/hal/x64/x64.h"
+#include "kernel/objects/KEvent.h"
+#include "kernel/mem/TlbShootdown.h"
+#include "kernel/drivers/io/UartDriver.h"
+#include "kernel/io/disk/DiskManager.h"
+#include "kernel/drivers/io/AHCIPort.h"
+#include "mem/PageTables.h"
+#include <intrin.h>
+#include <map>
+#include <algorithm>
+
+#define LOAD_THREADS		3
+#define LATENCY_SAMPLES		32
+#define LATENCY_DELAY		(3 * 1000 * 1000) //3ms
+#define SIMD_THREADS		2
+#define SIMD_RUNTIME		1000 //ms per policy
+#define LOCK_THREADS		3
+#define LOCK_RUNTIME		500 //ms per lock type
+#define IRQ_SAMPLES			64
+#define IRQ_DELAY			(1300 * 1000) //1.3ms, drifts against the 10ms tick
+#define TICK_WORK			(200 * 1000) //200us of tick handler work
+#define WORK_BURSTS			16
+#define WORK_BURST_SIZE		32
+#define DISPATCH_LOOKUPS	100000
+#define IPI_SAMPLES			256
+#define TLB_PAGES			64
+#define IDLE_SAMPLES		32
+#define SERIAL_LINES		64
+#define DISK_BYTES			(4 * 1024 * 1024)
+#define DISK_CHUNK			(64 * 1024)
+#define DISK_IOS			2048 //Per queue depth
+#define DISK_IO_SIZE		4096
+#define CACHE_LOOKUPS		64
+#define FILE_CHUNK			(64 * 1024)
+#define SEEK_READS			256
+#define SEEK_SIZE			4096
+#define PATH_LOOKUPS		256
+#define APPEND_WRITES		512
+#define APPEND_SIZE			100 //Not a multiple of the sector size, most appends merge a partial sector
+#define MAP_PASSES			4 //Warm passes over the mapping
+#define BENCH_LOG			"b:\\bench.log" //Written by FileAppend, rewritten through a mapping by FileMap
+
+size_t Benchmark::Run(void* unused)
+{
+	//FileMap rewrites the log FileAppend leaves behind, keep the order
+	static const struct
+	{
+		const char* Name;
+		void (*Routine)();
+	} benchmarks[] =
+	{
+		{ "InputLatency", InputLatency },
+		{ "SimdSwitch", SimdSwitch },
+		{ "LockContention", LockContention },
+		{ "InterruptLatency", InterruptLatency },
+		{ "WorkQueueLatency", WorkQueueLatency },
+		{ "InterruptDispatch", InterruptDispatch },
+		{ "IpiLatency", IpiLatency },
+		{ "TlbShootdownLatency", TlbShootdownLatency },
+		{ "IdleWakeup", IdleWakeup },
+		{ "SerialThroughput", SerialThroughput },
+		{ "DiskThroughput", DiskThroughput },
+		{ "DiskIops", DiskIops },
+		{ "DiskCompletion", DiskCompletion },
+		{ "BlockQueue", BlockQueue },
+		{ "MetadataCache", MetadataCache },
+		{ "FileRead", FileRead },
+		{ "FileSeek", FileSeek },
+		{ "PathLookup", PathLookup },
+		{ "FileAppend", FileAppend },
+		{ "FileMap", FileMap },
+	};
+
+	Printf("==== Benchmarks ====\r\n");
+	for (const auto& benchmark : benchmarks)
+	{
+		const uint64_t start = __rdtsc();
+		benchmark.Routine();
+		Printf("  %s: done in %d ms\r\n", benchmark.Name, Micros(__rdtsc() - start) / 1000);
+	}
+	Printf("==== Benchmarks done, all checks passed ====\r\n");
+	return 0;
+}
+
+uint64_t Benchmark::Micros(uint64_t cycles)
+{
+	return x64::TSCFreq != 0 ? cycles / x64::TSCFreq : 0;
+}
+
+void Benchmark::DisplayCycles(const char* name, uint64_t cycles)
+{
+	Printf("    %s: %d cycles\r\n", name, cycles);
+}
+
+void Benchmark::DisplayTime(const char* name, uint64_t cycles)
+{
+	Printf("    %s: %d us\r\n", name, Micros(cycles));
+}
+
+void Benchmark::DisplayRate(const char* name, uint64_t bytes, uint64_t cycles)
+{
+	const uint64_t us = Micros(cycles);
+	Printf("    %s: %d us, %d MB/s\r\n", name, us, us != 0 ? bytes / us : 0);
+}
+
+void Benchmark::DisplayOps(const char* name, uint64_t ops, uint64_t cycles, uint64_t failed)
+{
+	const uint64_t us = Micros(cycles);
+	Printf("    %s: %d IOPS, %d failed\r\n", name, us != 0 ? (ops * 1000000) / us : 0, failed);
+}
+
+void Benchmark::LatencyStats::Add(uint64_t value)
+{
+	if (Count == 0 || value < Min)
+		Min = value;
+	if (value > Max)
+		Max = value;
+	Total += value;
+	Count++;
+}
+
+void Benchmark::LatencyStats::Display(const char* name) const
+{
+	if (Count == 0 || x64::TSCFreq == 0)
+		return;
+
+	Printf("    %s: min %d us, avg %d us, max %d us (%d samples)\r\n", name,
+		Micros(Min), Micros(Total / Count), Micros(Max), Count);
+}
+
+void Benchmark::LatencyStats::DisplayCycles(const char* name) const
+{
+	if (Count == 0)
+		return;
+
+	Printf("    %s: min %d, avg %d, max %d cycles (%d samples)\r\n", name, Min, Total / Count, Max, Count);
+}
+
+namespace
+{
+	struct InputLatencyContext
+	{
+		volatile bool Stop;
+		volatile uint64_t Raised;
+		KEvent Event;
+	};
+
+	//Stand-in for a keyboard interrupt, timestamps and wakes the bottom half
+	uint32_t OnSimulatedInput(void* arg)
+	{
+		InputLatencyContext* ctx = (InputLatencyContext*)arg;
+		ctx->Raised = __rdtsc();
+		ctx->Event.Set();
+		return 0;
+	}
+
+	volatile bool SimdStop;
+	volatile float SimdResult;
+	volatile long SimdCorrupted;
+
+	//Keeps XMM registers busy so every switch has state to carry. The integer lanes count along with the loop,
+	//state lost or mixed up between threads across a switch shows up as a mismatch.
+	size_t SimdThread(void* arg)
+	{
+		const int seed = (int)(uintptr_t)arg << 24;
+		__m128 acc = _mm_set1_ps(1.0f);
+		const __m128 inc = _mm_set1_ps(0.5f);
+		__m128i lanes = _mm_set1_epi32(seed);
+		const __m128i one = _mm_set1_epi32(1);
+		uint32_t iterations = 0;
+		while (!SimdStop)
+		{
+			acc = _mm_add_ps(acc, inc);
+			lanes = _mm_add_epi32(lanes, one);
+			iterations++;
+		}
+		SimdResult = _mm_cvtss_f32(acc);
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(lanes, _mm_set1_epi32(seed + (int)iterations))) != 0xFFFF)
+			_InterlockedIncrement(&SimdCorrupted);
+		return 0;
+	}
+
+	size_t IntegerThread(void* arg)
+	{
+		volatile uint64_t counter = 0;
+		while (!SimdStop)
+			counter++;
+		return 0;
+	}
+
+	enum class LockKind { Spin, Ticket, Mutex };
+
+	struct LockContext
+	{
+		volatile bool Stop;
+		LockKind Kind;
+		uint64_t Operations; //Plain increment, loses counts if two threads get in at once
+		volatile long long Entries;
+		KSpinLock& Spin;
+		KTicketLock& Ticket;
+		KMutex& Mutex;
+	};
+
+	//Takes the lock without disabling interrupts, so the timer can preempt a holder and make the others wait
+	size_t LockThread(void* arg)
+	{
+		LockContext* ctx = (LockContext*)arg;
+		while (!ctx->Stop)
+		{
+			//Spinning locks are held with interrupts off like everywhere else, a holder preempted
+			//mid section would make the others spin out their quantum instead of measuring the lock
+			switch (ctx->Kind)
+			{
+			case LockKind::Spin:
+			{
+				const cpu_flags_t flags = ctx->Spin.AcquireIrqSave();
+				ctx->Operations++;
+				_InterlockedIncrement64(&ctx->Entries);
+				ctx->Spin.ReleaseIrqRestore(flags);
+				break;
+			}
+			case LockKind::Ticket:
+			{
+				const cpu_flags_t flags = ctx->Ticket.AcquireIrqSave();
+				ctx->Operations++;
+				_InterlockedIncrement64(&ctx->Entries);
+				ctx->Ticket.ReleaseIrqRestore(flags);
+				break;
+			}
+			case LockKind::Mutex:
+				kernel.KeAcquireMutex(ctx->Mutex);
+				ctx->Operations++;
+				_InterlockedIncrement64(&ctx->Entries);
+				kernel.KeReleaseMutex(ctx->Mutex);
+				break;
+			}
+		}
+		return 0;
+	}
+
+	//Tick handler that stands in for slow bottom half work (FIFO draining, accounting)
+	class SlowTickHandler : public TickEventHandler
+	{
+	public:
+		void onTimerTick(uint64_t totalTicks) override
+		{
+			kernel.GetHAL()->GetHPET()->Stall(TICK_WORK);
+			Calls++;
+		}
+
+		volatile uint64_t Calls = 0;
+	};
+
+	volatile uint64_t IrqRaised;
+	volatile bool IrqFired;
+
+	uint32_t OnLatencyTimer(void* arg)
+	{
+		IrqRaised = __rdtsc();
+		IrqFired = true;
+		return 0;
+	}
+
+	size_t LoadThread(void* arg)
+	{
+		InputLatencyContext* ctx = (InputLatencyContext*)arg;
+		while (!ctx->Stop)
+			_mm_pause();
+		return 0;
+	}
+}
+
+void Benchmark::InputLatency()
+{
+	HPET* hpet = kernel.GetHAL()->GetHPET();
+	if (!hpet->IsPresent())
+	{
+		Printf("InputLatency: no HPET, skipped\r\n");
+		return;
+	}
+
+	InputLatencyContext ctx = { false, 0, KEvent(false, false) };
+	for (int i = 0; i < LOAD_THREADS; i++)
+		kernel.KeCreateThread(LoadThread, &ctx, "Benchmark::Load");
+
+	const ThreadPriority priorities[] = { ThreadPriority::Normal, ThreadPriority::RealTime };
+	const char* names[] = { "Normal", "RealTime" };
+
+	Printf("InputLatency: %d CPU bound threads\r\n", LOAD_THREADS);
+	KThread& current = kernel.KeGetCurrentThread();
+	const ThreadPriority previous = current.GetPriority();
+	for (int p = 0; p < 2; p++)
+	{
+		//Run the bottom half on this thread with the priority under test
+		current.SetPriority(priorities[p]);
+		Assert(current.GetPriority() == priorities[p]);
+
+		//The wakeup has to come from the interrupt, not a timeout or a stale signal
+		LatencyStats stats = {};
+		for (int i = 0; i < LATENCY_SAMPLES; i++)
+		{
+			ctx.Raised = 0;
+			ctx.Event.Reset();
+			hpet->ArmOneShot(0, LATENCY_DELAY, { OnSimulatedInput, &ctx });
+			Assert(kernel.KeWait(ctx.Event) == WaitStatus::Signaled);
+			const uint64_t woken = __rdtsc();
+			AssertOp(ctx.Raised, !=, 0);
+			stats.Add(woken - ctx.Raised);
+		}
+		stats.Display(names[p]);
+	}
+	current.SetPriority(previous);
+	Assert(current.GetPriority() == previous);
+
+	ctx.Stop = true;
+	//Let load threads exit before ctx goes out of scope
+	kernel.Sleep(100);
+}
+
+void Benchmark::SimdSwitch()
+{
+	Scheduler* scheduler = kernel.GetScheduler();
+	const SimdPolicy previous = scheduler->GetSimdPolicy();
+
+	const SimdPolicy policies[] = { SimdPolicy::Eager, SimdPolicy::Lazy };
+	Printf("SimdSwitch: %d SIMD threads, 1 integer thread, %d ms each\r\n", SIMD_THREADS, SIMD_RUNTIME);
+	for (int p = 0; p < 2; p++)
+	{
+		scheduler->SetSimdPolicy(policies[p]);
+		scheduler->ResetSimdStats();
+
+		SimdStop = false;
+		SimdCorrupted = 0;
+		for (int i = 0; i < SIMD_THREADS; i++)
+			kernel.KeCreateThread(SimdThread, (void*)(uintptr_t)(i + 1), "Benchmark::Simd");
+		kernel.KeCreateThread(IntegerThread, nullptr, "Benchmark::Integer");
+
+		kernel.Sleep(SIMD_RUNTIME);
+		SimdStop = true;
+		kernel.Sleep(50);
+
+		scheduler->DisplaySimdStats();
+		AssertEqual(SimdCorrupted, 0);
+	}
+
+	scheduler->SetSimdPolicy(previous);
+}
+
+void Benchmark::LockContention()
+{
+	KSpinLock spin("Benchmark::Spin");
+	KTicketLock ticket("Benchmark::Ticket");
+	KMutex mutex("Benchmark::Mutex");
+	LockContext ctx = { false, LockKind::Spin, 0, 0, spin, ticket, mutex };
+
+	const LockKind kinds[] = { LockKind::Spin, LockKind::Ticket, LockKind::Mutex };
+	const LockStats* stats[] = { spin.Stats(), ticket.Stats(), mutex.Stats() };
+	Printf("LockContention: %d threads, %d ms each\r\n", LOCK_THREADS, LOCK_RUNTIME);
+	for (int k = 0; k < 3; k++)
+	{
+		ctx.Stop = false;
+		ctx.Kind = kinds[k];
+		ctx.Operations = 0;
+		ctx.Entries = 0;
+		for (int i = 0; i < LOCK_THREADS; i++)
+			kernel.KeCreateThread(LockThread, &ctx, "Benchmark::Lock");
+
+		kernel.Sleep(LOCK_RUNTIME);
+		ctx.Stop = true;
+		kernel.Sleep(50);
+
+		Printf("    %d ops\r\n", ctx.Operations);
+		AssertOp(ctx.Operations, !=, 0);
+		AssertEqual(ctx.Operations, (uint64_t)ctx.Entries);
+		stats[k]->Display();
+	}
+
+	//Everything else that was named, heap, scheduler, filesystems...
+	LockStats::DisplayAll();
+}
+
+void Benchmark::InterruptLatency()
+{
+	HAL* hal = kernel.GetHAL();
+	HPET* hpet = hal->GetHPET();
+	if (!hpet->IsPresent())
+	{
+		Printf("InterruptLatency: no HPET, skipped\r\n");
+		return;
+	}
+
+	SlowTickHandler slow;
+	hal->GetClock()->RegisterTickHandler(&slow);
+
+	const bool inlined[] = { true, false };
+	const char* names[] = { "Inline", "Deferred" };
+	Printf("InterruptLatency: timer to ISR entry, %d us of tick work\r\n", TICK_WORK / 1000);
+	for (int m = 0; m < 2; m++)
+	{
+		hal->SetDpcInline(inlined[m]);
+		hal->ResetInterruptStats();
+		slow.Calls = 0;
+
+		LatencyStats stats = {};
+		for (int i = 0; i < IRQ_SAMPLES; i++)
+		{
+			IrqFired = false;
+			hpet->ArmOneShot(0, IRQ_DELAY, { OnLatencyTimer, nullptr });
+			const uint64_t expected = __rdtsc() + (IRQ_DELAY / 1000) * x64::TSCFreq;
+			while (!IrqFired)
+				_mm_pause();
+			stats.Add(IrqRaised > expected ? IrqRaised - expected : 0);
+		}
+
+		//Samples span several ticks, the tick work has to have run inline or from the DPC
+		AssertOp(slow.Calls, !=, 0);
+		stats.Display(names[m]);
+		hal->DisplayInterruptStats();
+	}
+
+	hal->SetDpcInline(false);
+	hal->GetClock()->UnregisterTickHandler(&slow);
+}
+
+void Benchmark::WorkQueueLatency()
+{
+	WorkQueue* queue = kernel.GetWorkQueue();
+	queue->ResetStats();
+
+	volatile uint64_t completed = 0;
+	Printf("WorkQueueLatency: %d bursts of %d items\r\n", WORK_BURSTS, WORK_BURST_SIZE);
+	for (int b = 0; b < WORK_BURSTS; b++)
+	{
+		for (int i = 0; i < WORK_BURST_SIZE; i++)
+			queue->Submit([&completed]() { completed++; });
+		queue->Flush();
+	}
+
+	//Delayed item has to show up after at least its delay
+	const uint64_t start = kernel.GetHAL()->GetClock()->GetTicks();
+	volatile uint64_t fired = 0;
+	KWorkItem delayed([](void* arg) { *(volatile uint64_t*)arg = kernel.GetHAL()->GetClock()->GetTicks(); }, (void*)&fired);
+	queue->QueueDelayed(delayed, 50);
+	kernel.Sleep(100);
+	queue->Cancel(delayed);
+	queue->Flush();
+
+	Printf("    Completed %d, delayed item after %d ticks\r\n", completed, fired ? fired - start : 0);
+	AssertEqual(completed, (uint64_t)(WORK_BURSTS * WORK_BURST_SIZE));
+	AssertOp(fired, !=, 0);
+	queue->Display();
+}
+
+static void DispatchNop(void* arg)
+{
+	(*(volatile uint64_t*)arg)++;
+}
+
+void Benchmark::InterruptDispatch()
+{
+	//Roughly what a boot registers: timer, keyboard, mouse, AHCI, SCI, HPET
+	const uint8_t vectors[] = { 0x20, 0x21, 0x29, 0x2B, 0x2C, 0x81, 0x88, 0x89 };
+	const size_t count = sizeof(vectors) / sizeof(vectors[0]);
+
+	volatile uint64_t calls = 0;
+	std::map<uint8_t, InterruptContext> map;
+	InterruptContext table[256] = {};
+	for (size_t i = 0; i < count; i++)
+	{
+		map.insert({ vectors[i], { DispatchNop, (void*)&calls } });
+		table[vectors[i]] = { DispatchNop, (void*)&calls };
+	}
+
+	uint64_t start = __rdtsc();
+	for (size_t i = 0; i < DISPATCH_LOOKUPS; i++)
+	{
+		const auto& it = map.find(vectors[i % count]);
+		if (it != map.end())
+			it->second.Handler(it->second.Context);
+	}
+	const uint64_t mapCycles = __rdtsc() - start;
+
+	start = __rdtsc();
+	for (size_t i = 0; i < DISPATCH_LOOKUPS; i++)
+	{
+		const InterruptContext& ctx = table[vectors[i % count]];
+		if (ctx.Handler)
+			ctx.Handler(ctx.Context);
+	}
+	const uint64_t tableCycles = __rdtsc() - start;
+
+	//Both have to reach the handler every time
+	AssertEqual(calls, (uint64_t)(2 * DISPATCH_LOOKUPS));
+
+	Printf("InterruptDispatch: %d lookups, per dispatch\r\n", DISPATCH_LOOKUPS);
+	DisplayCycles("std::map", mapCycles / DISPATCH_LOOKUPS);
+	DisplayCycles("Table", tableCycles / DISPATCH_LOOKUPS);
+
+	//What real interrupts cost since boot
+	kernel.GetHAL()->DisplayInterrupts();
+}
+
+static volatile uint64_t IpiReceived;
+static volatile uint32_t IpiCount;
+static uint32_t OnBenchmarkIpi(void* arg)
+{
+	IpiReceived = __rdtsc();
+	IpiCount++;
+	return 0;
+}
+
+void Benchmark::IpiLatency()
+{
+	HAL* hal = kernel.GetHAL();
+	const uint8_t vector = hal->AllocateVector();
+	if (!vector)
+	{
+		Printf("IpiLatency: no free vector, skipped\r\n");
+		return;
+	}
+	hal->RegisterInterrupt(vector, { OnBenchmarkIpi, nullptr });
+
+	LatencyStats send = {};
+	LatencyStats delivery = {};
+	IpiCount = 0;
+	for (int i = 0; i < IPI_SAMPLES; i++)
+	{
+		IpiReceived = 0;
+
+		//Interrupts off so the send cost is measured apart from the delivery
+		const cpu_flags_t flags = SaveAndDisableInterrupts();
+		const uint64_t start = __rdtsc();
+		hal->SelfIpi(vector);
+		const uint64_t sent = __rdtsc();
+		RestoreInterrupts(flags);
+
+		while (!IpiReceived)
+			_mm_pause();
+
+		send.Add(sent - start);
+		delivery.Add(IpiReceived - start);
+	}
+
+	//Exactly one delivery per send, none lost or doubled
+	AssertEqual(IpiCount, (uint32_t)IPI_SAMPLES);
+
+	Printf("IpiLatency: %d self IPIs, %s\r\n", IPI_SAMPLES, hal->GetAPIC()->GetLocalAPIC()->IsX2Apic() ? "x2APIC" : "xAPIC");
+	send.DisplayCycles("Send");
+	delivery.DisplayCycles("Delivery");
+
+	hal->FreeVector(vector);
+}
+
+static void TouchPages(volatile uint8_t* base, const size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+		base[i << PageShift];
+}
+
+void Benchmark::TlbShootdownLatency()
+{
+	HAL* hal = kernel.GetHAL();
+	static paddr_t scratch = kernel.AllocatePhysical(TLB_PAGES);
+
+	PageTables tables;
+	tables.OpenCurrent();
+	TlbShootdown::ResetStats();
+
+	//Frames stay with the benchmark for reruns. Their window in the I/O range is fixed, both runs map and unmap
+	//the same addresses, so nothing is left mapped afterwards.
+	volatile uint8_t* const base = (volatile uint8_t*)kernel.DriverMapPages(scratch, TLB_PAGES);
+
+	//One shootdown per page, what every unmap did without batching
+	TouchPages(base, TLB_PAGES);
+	uint64_t start = __rdtsc();
+	for (size_t i = 0; i < TLB_PAGES; i++)
+	{
+		tables.UnmapPages((uintptr_t)base + (i << PageShift), 1);
+		TlbShootdown shootdown;
+		shootdown.Add((uintptr_t)base + (i << PageShift));
+	}
+	const uint64_t single = __rdtsc() - start;
+
+	//Same range, one IPI round
+	Assert(tables.MapPages((uintptr_t)base, scratch, TLB_PAGES, true));
+	TouchPages(base, TLB_PAGES);
+	start = __rdtsc();
+	{
+		tables.UnmapPages((uintptr_t)base, TLB_PAGES);
+		TlbShootdown shootdown;
+		shootdown.Add((uintptr_t)base, TLB_PAGES);
+	}
+	const uint64_t batched = __rdtsc() - start;
+
+	//Both runs have to leave the range unmapped
+	for (size_t i = 0; i < TLB_PAGES; i++)
+	{
+		paddr_t physical;
+		Assert(!tables.TryResolveAddress((uintptr_t)base + (i << PageShift), physical));
+	}
+
+	Printf("TlbShootdownLatency: %d pages, %d CPUs online, per page\r\n", TLB_PAGES, __popcnt64(hal->GetOnlineCpus()));
+	DisplayCycles("Per page", single / TLB_PAGES);
+	DisplayCycles("Batched", batched / TLB_PAGES);
+	TlbShootdown::DisplayStats();
+}
+
+void Benchmark::IdleWakeup()
+{
+	HAL* hal = kernel.GetHAL();
+	HPET* hpet = hal->GetHPET();
+	CpuIdle* idle = hal->GetCpuIdle();
+	if (!hpet->IsPresent())
+		return;
+
+	InputLatencyContext ctx = { false, 0, KEvent(false, false) };
+	const size_t limits[] = { 0, IDLE_MAX_STATES };
+	const char* names[] = { "C1", "Deepest" };
+	Printf("IdleWakeup: HPET interrupt to thread, %d states\r\n", idle->StateCount());
+	for (int m = 0; m < 2; m++)
+	{
+		idle->SetMaxState(limits[m]);
+		idle->ResetStats();
+
+		//Nothing else runs while we wait, the CPU idles until the HPET fires
+		LatencyStats stats = {};
+		for (int i = 0; i < IDLE_SAMPLES; i++)
+		{
+			ctx.Raised = 0;
+			hpet->ArmOneShot(0, LATENCY_DELAY, { OnSimulatedInput, &ctx });
+			const uint64_t expected = __rdtsc() + (LATENCY_DELAY / 1000) * x64::TSCFreq;
+			Assert(kernel.KeWait(ctx.Event) == WaitStatus::Signaled);
+			const uint64_t woken = __rdtsc();
+			AssertOp(ctx.Raised, !=, 0);
+			AssertOp(woken, >=, ctx.Raised);
+			stats.Add(woken > expected ? woken - expected : 0);
+		}
+
+		//The waits have to have been spent idle, in whatever states the limit allows
+		AssertOp(idle->TotalResidency(), !=, 0);
+		stats.Display(names[m]);
+		idle->Display();
+	}
+
+	idle->SetMaxState(IDLE_MAX_STATES);
+}
+
+void Benchmark::SerialThroughput()
+{
+	UartDriver* serial = kernel.GetHAL()->GetSerial();
+	if (!serial->IsPresent())
+		return;
+
+	//Divisor 1 is the fastest a 16550 with the standard clock goes
+	const uint32_t rates[] = { UART_CLOCK, UART_CLOCK / 2, UART_CLOCK / 3 };
+	char line[64];
+	memset(line, '#', sizeof(line) - 2);
+	line[sizeof(line) - 2] = '\r';
+	line[sizeof(line) - 1] = '\n';
+
+	serial->Flush();
+	Printf("SerialThroughput: %d lines of %d bytes\r\n", SERIAL_LINES, sizeof(line));
+	for (const uint32_t baud : rates)
+	{
+		serial->Flush();
+		serial->SetBaudRate(baud);
+		AssertEqual(serial->GetBaudRate(), baud);
+		serial->ResetStats();
+
+		LatencyStats enqueue = {};
+		const uint64_t start = __rdtsc();
+		for (int i = 0; i < SERIAL_LINES; i++)
+		{
+			const uint64_t begin = __rdtsc();
+			serial->Write(line, sizeof(line));
+			enqueue.Add(__rdtsc() - begin);
+		}
+
+		while (!serial->IsIdle())
+			kernel.Sleep(1);
+		const uint64_t elapsed = __rdtsc() - start;
+
+		//The ring holds all of it, every byte queued has to have gone out. Nothing else prints while benchmarks run.
+		AssertEqual(serial->BytesDropped(), (uint64_t)0);
+		AssertEqual(serial->BytesSent(), serial->BytesQueued());
+		AssertOp(serial->BytesSent(), >=, (uint64_t)(SERIAL_LINES * sizeof(line)));
+
+		//8N1 is 10 bits a byte on the wire
+		const uint64_t us = Micros(elapsed);
+		Printf("    %d baud: %d bytes/s, wire limit %d bytes/s, enqueue avg %d cycles max %d\r\n", baud,
+			us != 0 ? (SERIAL_LINES * sizeof(line) * 1000000) / us : 0, baud / 10, enqueue.Total / enqueue.Count, enqueue.Max);
+		serial->Display();
+	}
+
+	serial->Flush();
+	serial->SetBaudRate(UART_CLOCK);
+}
+
+static Disk* FindHardDisk()
+{
+	for (Disk* disk : *kernel.GetDiskManager()->GetDisks())
+	{
+		if (disk->GetType() == HardDisk && disk->GetSize() >= DISK_BYTES)
+			return disk;
+	}
+	return nullptr;
+}
+
+void Benchmark::DiskThroughput()
+{
+	Disk* disk = FindHardDisk();
+	if (!disk)
+		return;
+
+	const uint32_t blockSize = disk->GetBlockSize();
+	const uint32_t blocks = DISK_BYTES / blockSize;
+	uint8_t* buffer = new uint8_t[DISK_BYTES];
+	uint8_t* check = new uint8_t[DISK_BYTES];
+
+	//One command per sector, what every read did before
+	uint64_t start = __rdtsc();
+	for (uint32_t i = 0; i < blocks; i++)
+		Assert(disk->ReadSector(i, buffer + (size_t)i * blockSize) == 0);
+	const uint64_t single = __rdtsc() - start;
+
+	start = __rdtsc();
+	for (uint32_t i = 0; i < blocks; i += DISK_CHUNK / blockSize)
+		Assert(disk->ReadSectors(i, DISK_CHUNK / blockSize, check + (size_t)i * blockSize) == 0);
+	const uint64_t chunked = __rdtsc() - start;
+	Assert(memcmp(buffer, check, DISK_BYTES) == 0);
+
+	Printf("DiskThroughput: %s, %d KB sequential\r\n", disk->identifier, DISK_BYTES / 1024);
+	DisplayRate("Per sector", DISK_BYTES, single);
+	DisplayRate("Chunked", DISK_BYTES, chunked);
+
+	delete[] check;
+	delete[] buffer;
+}
+
+static AHCIPort* FindSataPort()
+{
+	for (Driver* driver : kernel.GetHAL()->driverManager->Drivers)
+	{
+		if (driver->get_device_type() != DeviceType::Harddrive)
+			continue;
+
+		AHCIDriver* ahci = static_cast<AHCIDriver*>(driver);
+		for (uint8_t i = 0; i < ahci->get_port_count(); i++)
+		{
+			AHCIPort* port = ahci->GetPort(i);
+			if (port && port->GetType() == PORT_TYPE_SATA)
+				return port;
+		}
+	}
+	return nullptr;
+}
+
+void Benchmark::DiskIops()
+{
+	AHCIPort* port = FindSataPort();
+	if (!port || port->GetSectorCount() * port->GetSectorSize() < DISK_BYTES)
+		return;
+
+	const uint32_t sectors = DISK_IO_SIZE / port->GetSectorSize();
+	const uint64_t blocks = port->GetSectorCount() / sectors;
+	uint8_t* buffer = new uint8_t[32 * DISK_IO_SIZE];
+	AHCIRequest requests[32] = {};
+	bool active[32];
+	uint64_t seed = __rdtsc() | 1;
+
+	Printf("DiskIops: random %d KB reads, %d per depth\r\n", DISK_IO_SIZE / 1024, DISK_IOS);
+	const uint32_t depths[] = { 1, 8, 32 };
+	for (const uint32_t depth : depths)
+	{
+		const uint32_t queued = std::min(depth, port->GetQueueDepth());
+		port->ResetStats();
+		memset(active, 0, sizeof(active));
+
+		uint32_t submitted = 0;
+		uint32_t completed = 0;
+		uint32_t failed = 0;
+		const uint64_t start = __rdtsc();
+		while (completed < DISK_IOS)
+		{
+			for (uint32_t i = 0; i < queued; i++)
+			{
+				AHCIRequest& request = requests[i];
+				if (active[i] && request.Done)
+				{
+					active[i] = false;
+					completed++;
+					if (request.Failed)
+						failed++;
+				}
+
+				if (!active[i] && submitted < DISK_IOS)
+				{
+					//xorshift, spread over the whole disk
+					seed ^= seed << 13;
+					seed ^= seed >> 7;
+					seed ^= seed << 17;
+					request.DirIn = true;
+					request.Sector = (seed % blocks) * sectors;
+					request.Count = sectors;
+					request.Data = buffer + i * DISK_IO_SIZE;
+					if (port->Submit(request))
+					{
+						active[i] = true;
+						submitted++;
+					}
+				}
+			}
+			port->Poll();
+		}
+		const uint64_t elapsed = __rdtsc() - start;
+
+		char name[16];
+		sprintf(name, "QD %d", queued);
+		DisplayOps(name, DISK_IOS, elapsed, failed);
+		AssertEqual(failed, (uint32_t)0);
+		port->Display();
+	}
+
+	delete[] buffer;
+}
+
+void Benchmark::DiskCompletion()
+{
+	AHCIPort* port = FindSataPort();
+	if (!port || port->GetSectorCount() * port->GetSectorSize() < DISK_BYTES)
+		return;
+
+	HAL* hal = kernel.GetHAL();
+	CpuIdle* idle = hal->GetCpuIdle();
+	const uint32_t sectorSize = port->GetSectorSize();
+	const uint32_t sectors = DISK_CHUNK / sectorSize;
+	uint8_t* buffers[] = { new uint8_t[DISK_BYTES], new uint8_t[DISK_BYTES] };
+
+	Printf("DiskCompletion: %d KB sequential in %d KB reads\r\n", DISK_BYTES / 1024, DISK_CHUNK / 1024);
+	const char* names[] = { "Polled", "Interrupt" };
+	for (int m = 0; m < 2; m++)
+	{
+		port->SetPolled(m == 0);
+		port->ResetStats();
+		idle->ResetStats();
+
+		//A transfer may come back short when the buffer needs more PRDT entries than a command has
+		const uint64_t start = __rdtsc();
+		for (uint64_t sector = 0; sector < DISK_BYTES / sectorSize;)
+		{
+			const uint32_t count = std::min<uint32_t>(sectors, (uint32_t)(DISK_BYTES / sectorSize - sector));
+			const uint32_t bytes = port->TransferData(true, sector, count, buffers[m] + sector * sectorSize);
+			AssertOp(bytes, !=, 0);
+			sector += bytes / sectorSize;
+		}
+		const uint64_t elapsed = __rdtsc() - start;
+
+		//Idle time is summed over all CPUs
+		const uint64_t total = elapsed * __popcnt64(hal->GetOnlineCpus());
+		DisplayRate(names[m], DISK_BYTES, elapsed);
+		Printf("    CPU idle %d%%\r\n", total != 0 ? (idle->TotalResidency() * 100) / total : 0);
+		port->Display();
+	}
+
+	//Both completion paths have to have delivered the same data
+	port->SetPolled(false);
+	Assert(memcmp(buffers[0], buffers[1], DISK_BYTES) == 0);
+	delete[] buffers[1];
+	delete[] buffers[0];
+}
+
+namespace
+{
+	struct BlockBatch
+	{
+		volatile long Completed;
+		long Target;
+		volatile long Failed;
+		KEvent Event;
+	};
+
+	void OnBlockDone(BlockRequest* request, void* context)
+	{
+		BlockBatch* batch = (BlockBatch*)context;
+		if (request->Result != 0)
+			_InterlockedIncrement(&batch->Failed);
+		if (_InterlockedIncrement(&batch->Completed) == batch->Target)
+			batch->Event.Set();
+	}
+
+	void RunBatch(Disk* disk, BlockBatch& batch, BlockRequest* requests, long count)
+	{
+		batch.Completed = 0;
+		batch.Target = count;
+		disk->Plug();
+		for (long i = 0; i < count; i++)
+			disk->Submit(&requests[i]);
+		disk->Unplug();
+
+		while (batch.Completed != batch.Target)
+		{
+			if (kernel.KeWait(batch.Event, BLOCK_WAIT_TIMEOUT) != WaitStatus::Signaled)
+				disk->Poll();
+		}
+	}
+}
+
+void Benchmark::BlockQueue()
+{
+	Disk* disk = FindHardDisk();
+	if (!disk)
+		return;
+
+	const uint32_t blockSize = disk->GetBlockSize();
+	const uint32_t blocks = DISK_IO_SIZE / blockSize;
+	const uint64_t span = disk->GetSize() / DISK_IO_SIZE;
+	const long burst = DISK_CHUNK * 4 / DISK_IO_SIZE;
+
+	uint8_t* buffer = new uint8_t[burst * DISK_IO_SIZE];
+	BlockSegment* segments = new BlockSegment[burst];
+	BlockRequest* requests = new BlockRequest[burst];
+	BlockBatch batch = { 0, 0, 0, KEvent(false, false) };
+	for (long i = 0; i < burst; i++)
+	{
+		segments[i] = { buffer + i * DISK_IO_SIZE, DISK_IO_SIZE };
+		requests[i] = {};
+		requests[i].Count = blocks;
+		requests[i].Segments = &segments[i];
+		requests[i].SegmentCount = 1;
+		requests[i].Completion = OnBlockDone;
+		requests[i].Context = &batch;
+	}
+
+	uint64_t seed = __rdtsc() | 1;
+	Printf("BlockQueue: random %d KB reads, %d per depth\r\n", DISK_IO_SIZE / 1024, DISK_IOS);
+	const long depths[] = { 1, 8, 32 };
+	for (const long depth : depths)
+	{
+		disk->ResetQueueStats();
+		batch.Failed = 0;
+
+		const uint64_t start = __rdtsc();
+		for (uint32_t done = 0; done < DISK_IOS; done += depth)
+		{
+			for (long i = 0; i < depth; i++)
+			{
+				seed ^= seed << 13;
+				seed ^= seed >> 7;
+				seed ^= seed << 17;
+				requests[i].Lba = (seed % span) * blocks;
+			}
+			RunBatch(disk, batch, requests, depth);
+		}
+		const uint64_t elapsed = __rdtsc() - start;
+
+		char name[16];
+		sprintf(name, "QD %d", depth);
+		DisplayOps(name, DISK_IOS, elapsed, batch.Failed);
+		AssertEqual(batch.Failed, 0);
+		disk->DisplayQueue();
+	}
+
+	//Submitted back to front so nothing arrives in order, the elevator has to sort and merge them
+	disk->ResetQueueStats();
+	batch.Failed = 0;
+	for (long i = 0; i < burst; i++)
+		requests[i].Lba = (uint64_t)(burst - 1 - i) * blocks;
+
+	const uint64_t start = __rdtsc();
+	RunBatch(disk, batch, requests, burst);
+	const uint64_t elapsed = __rdtsc() - start;
+
+	Printf("    Burst of %d adjacent reads, %d failed\r\n", burst, batch.Failed);
+	DisplayRate("Merged", burst * DISK_IO_SIZE, elapsed);
+	disk->DisplayQueue();
+
+	//Each read has to have landed in its own buffer, merged or not
+	AssertEqual(batch.Failed, 0);
+	uint8_t* check = new uint8_t[burst * DISK_IO_SIZE];
+	Assert(disk->ReadSectors(0, burst * blocks, check) == 0);
+	Assert(memcmp(buffer, check, burst * DISK_IO_SIZE) == 0);
+	delete[] check;
+
+	delete[] requests;
+	delete[] segments;
+	delete[] buffer;
+}
+
+void Benchmark::MetadataCache()
+{
+	VFSManager* vfs = kernel.VFS();
+	if (vfs->bootPartitionID < 0)
+		return;
+
+	BufferCache* cache = kernel.GetBufferCache();
+	const char* file = "b:\\efi\\boot\\vsoskrnl.exe";
+	const char* directory = "b:\\efi\\boot\\";
+
+	//Mount and the boot partition search already pulled these sectors in
+	cache->Purge();
+	cache->ResetStats();
+
+	uint64_t start = __rdtsc();
+	Assert(vfs->FileExists(file));
+	const uint64_t coldExists = __rdtsc() - start;
+
+	start = __rdtsc();
+	std::list<VFSEntry>* entries = vfs->DirectoryList(directory);
+	const uint64_t coldList = __rdtsc() - start;
+	Assert(entries != nullptr);
+	const size_t count = entries->size();
+	delete entries;
+
+	//Cached sectors have to give the same answers
+	start = __rdtsc();
+	for (size_t i = 0; i < CACHE_LOOKUPS; i++)
+		Assert(vfs->FileExists(file));
+	const uint64_t warmExists = (__rdtsc() - start) / CACHE_LOOKUPS;
+
+	start = __rdtsc();
+	for (size_t i = 0; i < CACHE_LOOKUPS; i++)
+	{
+		entries = vfs->DirectoryList(directory);
+		Assert(entries != nullptr && entries->size() == count);
+		delete entries;
+	}
+	const uint64_t warmList = (__rdtsc() - start) / CACHE_LOOKUPS;
+
+	Printf("MetadataCache: %d lookups of %s\r\n", CACHE_LOOKUPS, file);
+	DisplayTime("FileExists, cold", coldExists);
+	DisplayTime("FileExists, warm", warmExists);
+	DisplayTime("DirectoryList, cold", coldList);
+	DisplayTime("DirectoryList, warm", warmList);
+	cache->Display();
+}
+
+void Benchmark::FileRead()
+{
+	VFSManager* vfs = kernel.VFS();
+	if (vfs->bootPartitionID < 0)
+		return;
+
+	VirtualFileSystem* fs = vfs->Filesystems->at(vfs->bootPartitionID);
+	const char* file = "b:\\efi\\boot\\vsoskrnl.pdb";
+	const uint32_t size = vfs->GetFileSize(file);
+	if (size == 0 || size == (uint32_t)-1)
+		return;
+
+	uint8_t* buffer = new uint8_t[size];
+	uint8_t* check = new uint8_t[size];
+	const uint32_t chunks = (size + FILE_CHUNK - 1) / FILE_CHUNK;
+	Printf("FileRead: %s, %d KB\r\n", file, size / 1024);
+
+	fs->ResetStats();
+	uint64_t start = __rdtsc();
+	Assert(vfs->ReadFile(file, buffer) == 0);
+	uint64_t cycles = __rdtsc() - start;
+	DisplayRate("Whole file", size, cycles);
+	fs->DisplayStats();
+
+	//Chunks have to put together the same file in either order
+	fs->ResetStats();
+	start = __rdtsc();
+	for (uint32_t i = 0; i < chunks; i++)
+		Assert(vfs->ReadFile(file, check + i * FILE_CHUNK, i * FILE_CHUNK, FILE_CHUNK) == 0);
+	cycles = __rdtsc() - start;
+	Assert(memcmp(buffer, check, size) == 0);
+	DisplayRate("Chunks, sequential", size, cycles);
+	fs->DisplayStats();
+
+	//Backwards never looks sequential, nothing is prefetched
+	memset(check, 0, size);
+	fs->ResetStats();
+	start = __rdtsc();
+	for (uint32_t i = chunks; i != 0; i--)
+		Assert(vfs->ReadFile(file, check + (i - 1) * FILE_CHUNK, (i - 1) * FILE_CHUNK, FILE_CHUNK) == 0);
+	cycles = __rdtsc() - start;
+	Assert(memcmp(buffer, check, size) == 0);
+	DisplayRate("Chunks, backwards", size, cycles);
+	fs->DisplayStats();
+
+	delete[] check;
+	delete[] buffer;
+}
+
+void Benchmark::FileSeek()
+{
+	VFSManager* vfs = kernel.VFS();
+	if (vfs->bootPartitionID < 0)
+		return;
+
+	VirtualFileSystem* fs = vfs->Filesystems->at(vfs->bootPartitionID);
+	const char* file = "b:\\efi\\boot\\vsoskrnl.pdb";
+	const uint32_t size = vfs->GetFileSize(file);
+	if (size == (uint32_t)-1 || size < SEEK_SIZE * 16)
+		return;
+
+	uint8_t* buffer = new uint8_t[SEEK_SIZE];
+	uint8_t* whole = new uint8_t[size];
+	Printf("FileSeek: %d KB reads at random offsets of %s, %d KB\r\n", SEEK_SIZE / 1024, file, size / 1024);
+	fs->ResetStats();
+
+	//First one builds the extent map
+	uint64_t start = __rdtsc();
+	Assert(vfs->ReadFile(file, buffer, 0, SEEK_SIZE) == 0);
+	DisplayTime("First read", __rdtsc() - start);
+
+	//What every read is checked against
+	Assert(vfs->ReadFile(file, whole) == 0);
+	Assert(memcmp(buffer, whole, SEEK_SIZE) == 0);
+
+	//Alternating ends so neither benefits from readahead or the disk's own cache more than the other
+	LatencyStats head = {};
+	LatencyStats tail = {};
+	const uint32_t span = size / 10 - SEEK_SIZE;
+	uint64_t seed = __rdtsc() | 1;
+	for (uint32_t i = 0; i < SEEK_READS; i++)
+	{
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		const uint32_t offset = (uint32_t)(seed % span);
+
+		start = __rdtsc();
+		Assert(vfs->ReadFile(file, buffer, offset, SEEK_SIZE) == 0);
+		head.Add(__rdtsc() - start);
+		Assert(memcmp(buffer, whole + offset, SEEK_SIZE) == 0);
+
+		start = __rdtsc();
+		Assert(vfs->ReadFile(file, buffer, size - SEEK_SIZE - offset, SEEK_SIZE) == 0);
+		tail.Add(__rdtsc() - start);
+		Assert(memcmp(buffer, whole + size - SEEK_SIZE - offset, SEEK_SIZE) == 0);
+	}
+
+	head.Display("First 10%");
+	tail.Display("Last 10%");
+	fs->DisplayStats();
+
+	delete[] whole;
+	delete[] buffer;
+}
+
+void Benchmark::PathLookup()
+{
+	VFSManager* vfs = kernel.VFS();
+	if (vfs->bootPartitionID < 0)
+		return;
+
+	DentryCache* dentries = vfs->GetDentries();
+	const char* paths[] = { "b:\\efi\\boot\\vsoskrnl.exe", "b:\\efi\\boot\\missing.exe" };
+	const bool exists[] = { true, false };
+
+	Printf("PathLookup: %d lookups each, per lookup\r\n", PATH_LOOKUPS);
+	for (const bool enabled : { false, true })
+	{
+		dentries->SetEnabled(enabled);
+		dentries->ResetStats();
+		for (size_t p = 0; p < 2; p++)
+		{
+			//Warm the buffer cache, and the dentry cache if it's on. Negative entries have to stay negative.
+			AssertEqual(vfs->FileExists(paths[p]), exists[p]);
+
+			const uint64_t start = __rdtsc();
+			for (size_t i = 0; i < PATH_LOOKUPS; i++)
+				AssertEqual(vfs->FileExists(paths[p]), exists[p]);
+			const uint64_t cycles = (__rdtsc() - start) / PATH_LOOKUPS;
+
+			char name[64];
+			sprintf(name, "%s, cache %s", paths[p], enabled ? "on" : "off");
+			DisplayCycles(name, cycles);
+		}
+		dentries->Display();
+	}
+}
+
+namespace
+{
+	//APPEND_SIZE byte lines, one letter each
+	void FillLog(uint8_t* log, const uint32_t size)
+	{
+		for (uint32_t i = 0; i < size; i++)
+			log[i] = (i % APPEND_SIZE) == APPEND_SIZE - 1 ? '\n' : 'a' + (i / APPEND_SIZE) % 26;
+	}
+
+	//Whole file through the handle from the start, then through the path API
+	void CheckContents(VFSManager* vfs, KFile& handle, const char* file, const uint8_t* expected, const uint32_t size)
+	{
+		uint8_t* check = new uint8_t[size];
+		Assert(vfs->Seek(handle, 0));
+		Assert(vfs->Read(handle, check, size) == (int)size);
+		Assert(memcmp(check, expected, size) == 0);
+
+		memset(check, 0, size);
+		AssertEqual(vfs->GetFileSize(file), size);
+		Assert(vfs->ReadFile(file, check) == 0);
+		Assert(memcmp(check, expected, size) == 0);
+		delete[] check;
+	}
+}
+
+void Benchmark::FileAppend()
+{
+	VFSManager* vfs = kernel.VFS();
+	if (vfs->bootPartitionID < 0)
+		return;
+
+	VirtualFileSystem* fs = vfs->Filesystems->at(vfs->bootPartitionID);
+	const char* file = BENCH_LOG;
+	const uint32_t size = APPEND_WRITES * APPEND_SIZE;
+	uint8_t* log = new uint8_t[size];
+	FillLog(log, size);
+
+	//Empty it, the chain of an earlier run is kept and reused
+	Assert(vfs->WriteFile(file, log, 0) == 0);
+	KFile handle;
+	Assert(vfs->Open(handle, file, GenericAccess::ReadWrite));
+
+	//Flat from first to last quarter if an append costs what it writes, not the size of the file
+	Printf("FileAppend: %d appends of %d bytes to %s\r\n", APPEND_WRITES, APPEND_SIZE, file);
+	fs->ResetStats();
+	LatencyStats first = {};
+	LatencyStats last = {};
+	for (uint32_t i = 0; i < APPEND_WRITES; i++)
+	{
+		const uint64_t start = __rdtsc();
+		const int written = vfs->Write(handle, log + i * APPEND_SIZE, APPEND_SIZE);
+		const uint64_t cycles = __rdtsc() - start;
+		AssertEqual(written, APPEND_SIZE);
+
+		if (i < APPEND_WRITES / 4)
+			first.Add(cycles);
+		else if (i >= APPEND_WRITES - APPEND_WRITES / 4)
+			last.Add(cycles);
+	}
+	first.Display("First quarter");
+	last.Display("Last quarter");
+	fs->DisplayStats();
+
+	//What was appended has to come back through the handle, the path and a mapping of the file
+	CheckContents(vfs, handle, file, log, size);
+	const uint8_t* mapping = (const uint8_t*)vfs->MapFile(handle, 0, size);
+	Assert(mapping != nullptr);
+	Assert(memcmp(mapping, log, size) == 0);
+	vfs->UnmapFile((void*)mapping);
+
+	vfs->Close(handle);
+	delete[] log;
+}
+
+void Benchmark::FileMap()
+{
+	VFSManager* vfs = kernel.VFS();
+	if (vfs->bootPartitionID < 0)
+		return;
+
+	PageCache* pages = vfs->GetPages();
+	const char* file = "b:\\efi\\boot\\vsoskrnl.pdb";
+	KFile handle;
+	if (!vfs->Open(handle, file, GenericAccess::Read))
+		return;
+
+	const size_t size = handle.Length;
+	const uint8_t* mapping = (const uint8_t*)vfs->MapFile(handle, 0, size);
+	Assert(size != 0 && mapping != nullptr);
+
+	//A byte per page, every page faults once on the first pass
+	const volatile uint8_t* touch = mapping;
+	Printf("FileMap: %s, %d KB\r\n", file, size / 1024);
+	pages->ResetStats();
+	uint64_t start = __rdtsc();
+	for (size_t offset = 0; offset < size; offset += PageSize)
+		touch[offset];
+	DisplayRate("Mapped, cold", size, __rdtsc() - start);
+
+	start = __rdtsc();
+	for (size_t pass = 0; pass < MAP_PASSES; pass++)
+	{
+		for (size_t offset = 0; offset < size; offset += PageSize)
+			touch[offset];
+	}
+	DisplayTime("Mapped, warm, per pass", (__rdtsc() - start) / MAP_PASSES);
+
+	//Same pages, copied out once more through the handle
+	uint8_t* buffer = new uint8_t[size];
+	start = __rdtsc();
+	const int read = vfs->Read(handle, buffer, (uint32_t)size);
+	DisplayRate("Handle read, cached", size, __rdtsc() - start);
+	AssertEqual(read, (int)size);
+	Assert(memcmp(buffer, mapping, size) == 0);
+	pages->Display();
+
+	vfs->UnmapFile((void*)mapping);
+	vfs->Close(handle);
+	delete[] buffer;
+
+	//Writes through a mapping of the log FileAppend left behind have to reach the handle, and the disk after Sync
+	if (!vfs->Open(handle, BENCH_LOG, GenericAccess::ReadWrite))
+		return;
+
+	const uint32_t length = (uint32_t)handle.Length;
+	uint8_t* expected = new uint8_t[length];
+	uint8_t* log = (uint8_t*)vfs->MapFile(handle, 0, length);
+	Assert(length != 0 && log != nullptr);
+	for (uint32_t i = 0; i < length; i++)
+	{
+		log[i] = log[i] == '\n' ? '\n' : 'A' + (i / APPEND_SIZE) % 26;
+		expected[i] = log[i];
+	}
+	Assert(vfs->Sync(handle) == 0);
+	CheckContents(vfs, handle, BENCH_LOG, expected, length);
+
+	vfs->UnmapFile(log);
+	vfs->Close(handle);
+	delete[] expected;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdint>
+
+//Kernel self benchmarks, started as a kernel thread from Kernel::Initialize when KERNEL_BENCHMARKS is set.
+//Each one also asserts that what it measured behaved, a failed check bugchecks.
+class Benchmark
+{
+public:
+	Benchmark() = delete;
+
+	static size_t Run(void* unused);
+
+	//Interrupt to thread wakeup latency with CPU bound threads competing
+	static void InputLatency();
+
+	//Context switch cost of eager vs lazy FPU/SIMD state switching
+	static void SimdSwitch();
+
+	//Throughput and contention of spin, ticket and sleeping locks under preemption
+	static void LockContention();
+
+	//Timer to ISR latency with tick work run inline in the ISR vs. deferred to a DPC
+	static void InterruptLatency();
+
+	//Submission to execution latency of the system work queue
+	static void WorkQueueLatency();
+
+	//Handler lookup cost of a std::map against a flat vector table, then the live dispatch stats
+	static void InterruptDispatch();
+
+	//Send to handler latency of a self IPI, xAPIC MMIO or x2APIC MSR path
+	static void IpiLatency();
+
+	//Cost of unmapping pages one shootdown at a time against one batched shootdown, run with -smp 4
+	static void TlbShootdownLatency();
+
+	//Timer expiry to thread wakeup latency from C1 only against the deepest usable C-state, then residency
+	static void IdleWakeup();
+
+	//Sustained serial log throughput and per line enqueue cost at several baud rates
+	static void SerialThroughput();
+
+	//Sequential disk reads one sector per command against large scatter-gather reads into the caller's buffer
+	static void DiskThroughput();
+
+	//Random read IOPS with 1, 8 and 32 commands outstanding on an AHCI port
+	static void DiskIops();
+
+	//Sequential read throughput and CPU left idle with completions polled against interrupt driven
+	static void DiskCompletion();
+
+	//Random reads through Disk's request queue at several depths, then a burst of adjacent reads for the elevator to merge
+	static void BlockQueue();
+
+	//Cold against warm path lookups and directory listings on the boot partition through the buffer cache
+	static void MetadataCache();
+
+	//Loads the kernel PDB from the boot partition whole, in sequential chunks with readahead and in chunks backwards without
+	static void FileRead();
+
+	//Small reads at random offsets near the start and near the end of the kernel PDB, flat with extent maps
+	static void FileSeek();
+
+	//Resolving an existing and a missing path on the boot partition with the dentry cache off and on
+	static void PathLookup();
+
+	//Appending lines to a log through a file handle, early appends against late ones
+	static void FileAppend();
+
+	//Touching every page of the kernel PDB through a file mapping cold and warm, against reading it through a handle,
+	//then rewriting the FileAppend log through a mapping
+	static void FileMap();
+
+private:
+	struct LatencyStats
+	{
+		uint64_t Min;
+		uint64_t Max;
+		uint64_t Total;
+		uint32_t Count;
+
+		void Add(uint64_t value);
+		void Display(const char* name) const;
+		void DisplayCycles(const char* name) const;
+	};
+
+	//One result line each. TSCFreq is in MHz, so cycles / TSCFreq is microseconds and bytes per microsecond is MB/s.
+	static uint64_t Micros(uint64_t cycles);
+	static void DisplayCycles(const char* name, uint64_t cycles);
+	static void DisplayTime(const char* name, uint64_t cycles);
+	static void DisplayRate(const char* name, uint64_t bytes, uint64_t cycles);
+	static void DisplayOps(const char* name, uint64_t ops, uint64_t cycles, uint64_t failed);
+};
@@ -18,6 +18,14 @@
 #include "drivers\io\KeyboardDriver.h"
 #include "drivers\io\AHCI.h"
 #include "drivers\io\AHCIPort.h"
+#include "drivers\io\UartDriver.h"
+#include "Benchmark.h"
+
+//Run kernel self benchmarks after boot
+#define KERNEL_BENCHMARKS 0
+
+//Worker threads of the system work queue
+#define SYSTEM_WORKERS 2
 
 
 class MouseDummyDrawer : public MouseEventHandler
@@ -105,6 +113,7 @@ Kernel::Kernel(const LoaderParams& params, BootHeap& bootHeap) :
 
 	m_display((void*)KernelGraphicsDevice, params.Display.VerticalResolution, params.Display.HorizontalResolution),
 	m_loadingScreen(&m_display),
+	m_serial(nullptr),
 	//Page tables
 	m_pool((void*)KernelPageTablesPool, params.PageTablesPoolAddress, params.PageTablesPoolPageCount),
 	m_memoryMap(params.MemoryMap.Table, params.MemoryMap.Size, params.MemoryMap.DescriptorSize),
@@ -121,7 +130,8 @@ Kernel::Kernel(const LoaderParams& params, BootHeap& bootHeap) :
 	m_runtimeSpace(KernelRuntimeStart, KernelRuntimeEnd, true),
 	m_windowsSpace(KernelWindowsStart, KernelWindowsEnd, true),
 	m_HAL(&m_configTables),
-	m_scheduler(&m_HAL)
+	m_scheduler(&m_HAL),
+	m_workQueue("SystemWork")
 {
 
 }
@@ -181,8 +191,12 @@ void Kernel::Initialize()
 	m_windowsSpace.Initialize();
 
 	m_DiskManager = new DiskManager();
+	m_bufferCache = new BufferCache();
 	m_VFSManager = new VFSManager();
 
+	//Boot thread has to exist before drivers run, filesystems take KMutexes while mounting
+	m_scheduler.Init();
+
 	m_HAL.InitDevices();
 
 	Printf("Current CPU id: %d, total: %d CPU(s)\r\n", m_HAL.CurrentCPU(), m_HAL.CPUCount());
@@ -190,12 +204,20 @@ void Kernel::Initialize()
 
 	m_HAL.ActivateDrivers();
 
+	//Serial log only queues, the THR empty interrupt sends it
+	if (m_HAL.GetSerial()->IsPresent())
+		m_serial = m_HAL.GetSerial();
+
 
 	//Process and thread containers
-	m_scheduler.Init();
-	kernel.KeCreateThread(&Kernel::IdleThread, this, "Idle");
+	kernel.KeCreateThread(&Kernel::IdleThread, this, "Idle", ThreadPriority::Idle);
+	kernel.KeCreateThread(&Kernel::DpcThread, this, "DPC", ThreadPriority::RealTime);
+	m_bufferCache->Start();
 	m_HAL.GetClock()->RegisterTickHandler(&m_scheduler);
 
+	//One worker per CPU once APs are brought up
+	m_workQueue.Start(SYSTEM_WORKERS);
+
 
 	MouseDummyDrawer* drawer = new MouseDummyDrawer();
 	DummyKeyboardOutput* keys = new DummyKeyboardOutput();
@@ -221,6 +243,10 @@ void Kernel::Initialize()
 
 
 	m_scheduler.Enabled = true;
+
+#if KERNEL_BENCHMARKS
+	KeCreateThread(&Benchmark::Run, nullptr, "Benchmark");
+#endif
 	
 	Printf("\r\n\r\n ===== For now you should see a black screen with some text. This means we have a SVGA-II display in 1440x900 resolution with mouse and keyboard support!\r\n\r\n");
 	m_HAL.GetVideoDevice()->UpdateRect({ 0,0,m_HAL.GetVideoDevice()->GetScreenWidth(), m_HAL.GetVideoDevice()->GetScreenHeight() });
@@ -270,6 +296,13 @@ void Kernel::Printf(const char* format, va_list args)
 {
 	//if ((m_debugger != nullptr) && m_debugger->IsBrokenIn())
 		//m_debugger->KdpDprintf(format, args);
+	if (m_serial)
+	{
+		va_list copy;
+		va_copy(copy, args);
+		m_serial->Printf(format, copy);
+		va_end(copy);
+	}
 	m_printer->Printf(format, args);
 
 	//Hack to get some text output until we have a proper window manager
@@ -309,6 +342,10 @@ void Kernel::Bugcheck(const char* file, const char* line, const char* format, va
 	}
 	inBugcheck = true;
 
+	//Serial log is queued behind a lock another CPU may hold, get it out and write directly from here on
+	if (m_serial)
+		m_HAL.GetSerial()->EnterPolledMode();
+
 	this->Printf("Kernel Bugcheck\n");
 	this->Printf("\n%s\n%s\n", file, line);
 
@@ -444,10 +481,10 @@ void Kernel::KernelThreadInitThunk()
 	kernel.KeExitThread();
 }
 
-std::shared_ptr<KThread> Kernel::KeCreateThread(const ThreadStart start, void* const arg, const std::string& name /*= ""*/)
+std::shared_ptr<KThread> Kernel::KeCreateThread(const ThreadStart start, void* const arg, const std::string& name /*= ""*/, const ThreadPriority priority /*= ThreadPriority::Normal*/)
 {
 	//Add kernel thread
-	std::shared_ptr<KThread> thread = std::make_shared<KThread>(start, arg);
+	std::shared_ptr<KThread> thread = std::make_shared<KThread>(start, arg, priority);
 	thread->Init(&Kernel::KernelThreadInitThunk);
 	thread->Name = name;
 	Printf("    Name: %s\n", name.c_str());
@@ -479,6 +516,64 @@ KThread& Kernel::KeGetCurrentThread()
 	return m_scheduler.GetCurrentThread();
 }
 
+WaitStatus Kernel::KeWait(KSignalObject& object, const milli_t timeout /*= std::numeric_limits<milli_t>::max()*/)
+{
+	return m_scheduler.ObjectWait(object, timeout);
+}
+
+void Kernel::KeAcquireMutex(KMutex& mutex)
+{
+	m_scheduler.AcquireMutex(mutex);
+}
+
+void Kernel::KeReleaseMutex(KMutex& mutex)
+{
+	m_scheduler.ReleaseMutex(mutex);
+}
+
+bool Kernel::KeCreateFile(KFile& file, const std::string& path, const GenericAccess access)
+{
+	return m_VFSManager->Open(file, path.c_str(), access, (access & GenericAccess::Write) != 0);
+}
+
+bool Kernel::KeReadFile(KFile& file, void* const buffer, const size_t bytesToRead, size_t* bytesRead)
+{
+	Assert(bytesToRead <= std::numeric_limits<uint32_t>::max());
+	const int result = m_VFSManager->Read(file, (uint8_t*)buffer, (uint32_t)bytesToRead);
+	if (bytesRead)
+		*bytesRead = result < 0 ? 0 : result;
+	return result >= 0;
+}
+
+bool Kernel::KeWriteFile(KFile& file, const void* const buffer, const size_t bytesToWrite, size_t* bytesWritten)
+{
+	Assert(bytesToWrite <= std::numeric_limits<uint32_t>::max());
+	const int result = m_VFSManager->Write(file, (const uint8_t*)buffer, (uint32_t)bytesToWrite);
+	if (bytesWritten)
+		*bytesWritten = result < 0 ? 0 : result;
+	return result >= 0;
+}
+
+bool Kernel::KeSetFilePosition(KFile& file, const size_t position)
+{
+	return m_VFSManager->Seek(file, position);
+}
+
+void Kernel::KeCloseFile(KFile& file)
+{
+	m_VFSManager->Close(file);
+}
+
+void* Kernel::KeMapFile(KFile& file, const size_t offset, const size_t length)
+{
+	return m_VFSManager->MapFile(file, offset, length);
+}
+
+void Kernel::KeUnmapFile(void* address)
+{
+	m_VFSManager->UnmapFile(address);
+}
+
 void Kernel::Sleep(const uint32_t milliseconds)
 {
 	if (!milliseconds)
@@ -507,6 +602,16 @@ size_t Kernel::IdleThread(void* unused)
 {
 	while (true)
 	{
-		kernel.m_HAL.Wait();
+		kernel.m_HAL.Idle(kernel.m_scheduler.PredictIdle());
+	}
+}
+
+//Picks up DPCs left over when the interrupt exit budget ran out
+size_t Kernel::DpcThread(void* unused)
+{
+	while (true)
+	{
+		kernel.KeWait(kernel.m_HAL.GetDpcEvent());
+		kernel.m_HAL.DrainDpcs();
 	}
 }
@@ -25,6 +25,7 @@ extern "C"
 #include "kernel/mem/VAS.h"
 #include "kernel/mem/VMM.h"
 #include "kernel/sched/Scheduler.h"
+#include "kernel/sched/WorkQueue.h"
 #include "kernel/mem/KHeap.h"
 #include <queue>
 #include "Pdb/Pdb.h"
@@ -43,12 +44,13 @@ extern "C"
 #include <memory>
 //#include "drivers\DriverManager.h"
 //#include "devices\SMBios.h"
-//#include "obj\KFile.h"
+#include "objects\KFile.h"
 //#include "devices\LocalAPIC.h"
 #include "kernel/drivers/HyperV/HyperVPlatform.h"
 #include "hal\x64\interrupt.h"
 #include "hal\HAL.h"
 #include "io\disk\DiskManager.h"
+#include "io\disk\BufferCache.h"
 #include "vfs\VFSManager.h"
 
 class Kernel
@@ -75,6 +77,8 @@ public:
 	__declspec(noreturn) void Panic(const char* message);
 
 	HAL* GetHAL() { return &m_HAL; }
+	Scheduler* GetScheduler() { return &m_scheduler; }
+	WorkQueue* GetWorkQueue() { return &m_workQueue; } //Shared pool for async kernel jobs
 
 	uint32_t PrepareShutdown();
 
@@ -123,7 +127,7 @@ public:
 #pragma region Internal Interface
 
 	//Threads
-	std::shared_ptr<KThread> KeCreateThread(const ThreadStart start, void* const arg, const std::string& name = "");
+	std::shared_ptr<KThread> KeCreateThread(const ThreadStart start, void* const arg, const std::string& name = "", const ThreadPriority priority = ThreadPriority::Normal);
 	void KeSleepThread(const nano_t value);
 	void KeExitThread();
 	std::shared_ptr<KThread> CreateThread(UserProcess& process, size_t stackSize, ThreadStart startAddress, void* arg, void* entry);
@@ -132,6 +136,22 @@ public:
 	//KeModule& KeLoadLibrary(const std::string& path);
 
 	KThread& KeGetCurrentThread();
+
+	//Synchronization
+	WaitStatus KeWait(KSignalObject& object, const milli_t timeout = std::numeric_limits<milli_t>::max());
+	void KeAcquireMutex(KMutex& mutex);
+	void KeReleaseMutex(KMutex& mutex);
+
+	//Files, paths include the partition like b:\efi\boot\vsoskrnl.exe. Write access creates missing files.
+	bool KeCreateFile(KFile& file, const std::string& path, const GenericAccess access);
+	bool KeReadFile(KFile& file, void* const buffer, const size_t bytesToRead, size_t* bytesRead);
+	bool KeWriteFile(KFile& file, const void* const buffer, const size_t bytesToWrite, size_t* bytesWritten);
+	bool KeSetFilePosition(KFile& file, const size_t position);
+	void KeCloseFile(KFile& file);
+	//Maps the file into the kernel from a page aligned offset, pages come from the page cache as they are touched.
+	//The file stays open until KeUnmapFile.
+	void* KeMapFile(KFile& file, const size_t offset, const size_t length);
+	void KeUnmapFile(void* address);
 #pragma endregion
 
 #pragma region System Calls
@@ -139,6 +159,7 @@ public:
 #pragma endregion
 
 	DiskManager* GetDiskManager() { return m_DiskManager; }
+	BufferCache* GetBufferCache() { return m_bufferCache; }
 	VFSManager* VFS(){ return m_VFSManager; }
 
 	LoadingScreen* GetLoadingScreen() { return &m_loadingScreen; }
@@ -146,6 +167,7 @@ public:
 	void HexDump(uint8_t* buffer, size_t size, size_t lineLength = 16);
 
 	static size_t IdleThread(void* unused);
+	static size_t DpcThread(void* unused);
 private:
 
 	
@@ -164,6 +186,7 @@ private:
 
 	//EarlyUart m_uart;
 	StringPrinter* m_printer;
+	StringPrinter* m_serial; //Copy of the log once COM1 is up
 	//SMBios m_SMBios;
 
 	//Page tables
@@ -178,6 +201,7 @@ private:
 	ConfigTables m_configTables;
 
 	DiskManager* m_DiskManager;
+	BufferCache* m_bufferCache;
 	VFSManager* m_VFSManager;
 
 	VMM m_virtualMemory;
@@ -193,6 +217,7 @@ private:
 
 	//Process and Thread management
 	Scheduler m_scheduler;
+	WorkQueue m_workQueue;
 	std::map<std::string, UserRingBuffer*>* m_objectsRingBuffers;
 	std::list<std::shared_ptr<UserProcess>>* m_processes;
 
@@ -209,4 +234,25 @@ private:
 };
 
 //TODO: find a better way to access kernel object from any class!
-extern Kernel kernel;
\ No newline at end of file
+extern Kernel kernel;
+
+//Scoped KMutex ownership
+class KMutexGuard
+{
+public:
+	KMutexGuard(KMutex& mutex) :
+		m_mutex(mutex)
+	{
+		kernel.KeAcquireMutex(m_mutex);
+	}
+
+	~KMutexGuard()
+	{
+		kernel.KeReleaseMutex(m_mutex);
+	}
+
+private:
+	KMutex& m_mutex;
+
+	::NO_COPY_OR_ASSIGN(KMutexGuard);
+};
\ No newline at end of file
@@ -38,7 +38,8 @@ Driver* VmBusDriver::CreateInstance(Device* device)
 Result VmBusDriver::Initialize()
 {
 	//Initialize
-	kernel.KeCreateThread(VmBusDriver::ThreadLoop, this, "VmBusDriver::ThreadLoop");
+	//Bottom half of the VMBus interrupt
+	kernel.KeCreateThread(VmBusDriver::ThreadLoop, this, "VmBusDriver::ThreadLoop", ThreadPriority::RealTime);
 
 	HyperV::SetSintVector(VMBUS_MESSAGE_SINT, (uint32_t)X64_INTERRUPT_VECTOR::HypervisorVmBus);
 	kernel.KeRegisterInterrupt(X64_INTERRUPT_VECTOR::HypervisorVmBus, { &VmBusDriver::OnInterrupt, this });
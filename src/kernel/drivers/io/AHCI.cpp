@@ -1,6 +1,7 @@
 #include "AHCI.h"
 #include "AHCIPort.h"
 #include "kernel/Kernel.h"
+#include <algorithm>
 
 AHCIDriver::AHCIDriver(PCIDevice* device)
 	: Driver(device)
@@ -13,8 +14,8 @@ DriverResult AHCIDriver::Activate()
 {
 	PCIDevice* dev = static_cast<PCIDevice*>(m_device);
 
-	// Enable BUS Mastering
-	dev->writeBus(0x04, 0x0006);
+	// Enable BUS Mastering, keep the pin masked if MSI is in use
+	dev->writeBus(0x04, 0x0006 | (dev->GetDeviceDescriptor().command & PCI_COMMAND_INTX_DISABLE));
 
 	// Disable interrupts for now
 	abar->global_host_control &= ~(1<<1);
@@ -87,7 +88,10 @@ DriverResult AHCIDriver::Initialize()
 	abar = (hba_memory*)kernel.MapPhysicalMemory((uint32_t)descr.bars[5].address, sizeof(hba_memory));
 	Assert(abar);
 
-	kernel.GetHAL()->RegisterInterrupt( 0x20 + dev->GetDeviceDescriptor().interruptLine, { &AHCIDriver::HandleInterrupt, this });
+	//The HBA has a single interrupt for all ports, give it a vector of its own if it can do MSI
+	const InterruptContext handler = { &AHCIDriver::HandleInterrupt, this };
+	if (dev->EnableMsi(&handler, 1, kernel.GetHAL()->CurrentCPU()) == 0)
+		kernel.GetHAL()->RegisterInterrupt( 0x20 + dev->GetDeviceDescriptor().interruptLine, handler);
 
 	return DriverResult::Success;
 }
@@ -146,34 +150,85 @@ uint8_t AHCIDriver::get_port_count()
 
 char AHCIDriver::ReadSector(uint16_t drive, uint64_t sector, uint8_t* buffer) const
 {
-	Assert(drive < 32);
-	if (ahci_ports[drive])
-	{
-		uint32_t res = ahci_ports[drive]->TransferData(true, sector, 1);
-		if (res > 0)
-		{
-			memcpy(buffer, ahci_ports[drive]->GetBuffer(), res);
-			return 0;
-		}
-		return 1;
-	}
+	return Transfer(true, drive, sector, 1, buffer);
 }
 
 char AHCIDriver::WriteSector(uint16_t drive, uint64_t sector, uint8_t* buffer) const
+{
+	return Transfer(false, drive, sector, 1, buffer);
+}
+
+char AHCIDriver::ReadSectors(uint16_t drive, uint64_t sector, uint32_t count, uint8_t* buffer) const
+{
+	return Transfer(true, drive, sector, count, buffer);
+}
+
+char AHCIDriver::WriteSectors(uint16_t drive, uint64_t sector, uint32_t count, uint8_t* buffer) const
+{
+	return Transfer(false, drive, sector, count, buffer);
+}
+
+char AHCIDriver::Transfer(bool dirIn, uint16_t drive, uint64_t sector, uint32_t count, uint8_t* buffer) const
 {
 	Assert(drive < 32);
-	if (ahci_ports[drive])
+	AHCIPort* port = ahci_ports[drive];
+	if (!port)
+		return 1;
+
+	const uint32_t sectorSize = port->GetSectorSize();
+	//PRDT entries need word aligned addresses, go through a bounce buffer otherwise. Not the port's, other
+	//requests may be in flight on it.
+	uint8_t* bounce = ((uintptr_t)buffer & 1) == 0 ? nullptr : new uint8_t[AHCI_BOUNCE_SIZE];
+	while (count != 0)
 	{
-		memcpy(ahci_ports[drive]->GetBuffer(), buffer, 512);
+		uint32_t bytes;
+		if (!bounce)
+		{
+			bytes = port->TransferData(dirIn, sector, std::min<uint32_t>(count, AHCI_MAX_SECTORS), buffer);
+		}
+		else
+		{
+			const uint32_t sectors = std::min<uint32_t>(count, AHCI_BOUNCE_SIZE / sectorSize);
+			if (!dirIn)
+				memcpy(bounce, buffer, sectors * sectorSize);
+			bytes = port->TransferData(dirIn, sector, sectors, bounce);
+			if (dirIn && bytes != 0)
+				memcpy(buffer, bounce, bytes);
+		}
 
-		uint8_t res = ahci_ports[drive]->TransferData(false, sector, 1);
-		if (res > 0)
+		if (bytes == 0)
 		{
-			return 0;
+			delete[] bounce;
+			return 1;
 		}
-		return 1;
+
+		const uint32_t sectors = bytes / sectorSize;
+		sector += sectors;
+		count -= sectors;
+		buffer += bytes;
 	}
-	
+
+	delete[] bounce;
+	return 0;
+}
+
+bool AHCIDriver::SubmitRequest(uint16_t drive, BlockRequest* request)
+{
+	Assert(drive < 32 && ahci_ports[drive]);
+	return ahci_ports[drive]->SubmitBlock(request);
+}
+
+uint32_t AHCIDriver::GetQueueDepth(uint16_t drive) const
+{
+	Assert(drive < 32);
+	return ahci_ports[drive] ? ahci_ports[drive]->GetQueueDepth() : 1;
+}
+
+void AHCIDriver::Poll(uint16_t drive)
+{
+	Assert(drive < 32);
+	if (ahci_ports[drive])
+		ahci_ports[drive]->Poll();
 }
 
 bool AHCIDriver::EjectDrive(uint8_t drive)
@@ -199,7 +254,6 @@ uint32_t AHCIDriver::OnInterrupt()
 
 	// clear pending interrupts
 	abar->interrupt_status = interruptPending;
-	Printf("AHCI Interrupt\r\n");
 	return 0;
 }
 
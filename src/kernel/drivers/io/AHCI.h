@@ -15,6 +15,7 @@
 #define HBA_PxCMD_FRE		0x0010		// FIS Receive Enable
 #define HBA_PxCMD_FR		0x4000		// FIS Receive Running
 #define HBA_PxCMD_ST		0x0001		// Start DMA
+#define HBA_PxCMD_CLO		0x0008		// Command List Override
 #define HBA_PxCMD_ATAPI		(1 << 24)	// Device is ATAPI
 #define HBA_PxCMD_POD		0x0004		// Power on Device
 #define HBA_PxCMD_SUD		0x0002		// Spin-up Device
@@ -24,6 +25,11 @@
 #define ATA_CMD_IDENTIFY 0xEC
 #define ATA_CMD_IDENTIFY_PACKET   0xA1
 #define ATA_CMD_PACKET 0xA0
+#define ATA_CMD_READ_FPDMA_QUEUED 0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+#define ATA_CMD_READ_LOG_EXT 0x2F
+
+#define ATA_LOG_NCQ_ERROR 0x10
 
 #define ATA_DEV_BUSY 0x80
 #define ATA_DEV_DRQ 0x08
@@ -31,6 +37,11 @@
 
 #define ATAPI_READ_CMD 0xA8
 
+#define AHCI_MAX_PRDT		32 //Entries in hba_command_table
+#define AHCI_PRDT_MAX_BYTES	(4 * 1024 * 1024)
+#define AHCI_MAX_SECTORS	0xFFFF //16 bit count in the FIS
+#define AHCI_BOUNCE_SIZE	4096
+
 #define ATA_IDENT_DEVICETYPE   0
 #define ATA_IDENT_CYLINDERS    2
 #define ATA_IDENT_HEADS        6
@@ -40,7 +51,11 @@
 #define ATA_IDENT_CAPABILITIES 98
 #define ATA_IDENT_FIELDVALID   106
 #define ATA_IDENT_MAX_LBA      120
+#define ATA_IDENT_QUEUE_DEPTH  150
+#define ATA_IDENT_SATA_CAPS    152
 #define ATA_IDENT_COMMANDSETS  164
+
+#define ATA_SATA_CAP_NCQ (1 << 8)
 #define ATA_IDENT_MAX_LBA_EXT  200
 
 enum {
@@ -128,6 +143,9 @@ enum {
                                         | PORT_INT_IPM | PORT_INT_PRC | PORT_INT_PC \
                                         | PORT_INT_UF)
 
+//Stop the command list, outstanding commands are lost
+#define PORT_INT_FATAL	(PORT_INT_TFE | PORT_INT_HBF | PORT_INT_HBD | PORT_INT_IF)
+
 #define PORT_INT_MASK	(PORT_INT_ERROR | PORT_INT_DP | PORT_INT_SDB \
                                         | PORT_INT_DS | PORT_INT_PS | PORT_INT_DHR)
 
@@ -271,13 +289,21 @@ public:
 
 	char ReadSector(uint16_t drive, uint64_t sector, uint8_t* buffer) const override;
 	char WriteSector(uint16_t drive, uint64_t sector, uint8_t* buffer) const override;
+	char ReadSectors(uint16_t drive, uint64_t sector, uint32_t count, uint8_t* buffer) const override;
+	char WriteSectors(uint16_t drive, uint64_t sector, uint32_t count, uint8_t* buffer) const override;
 	bool EjectDrive(uint8_t drive) override;
 
+	bool SubmitRequest(uint16_t drive, BlockRequest* request) override;
+	uint32_t GetQueueDepth(uint16_t drive) const override;
+	void Poll(uint16_t drive) override;
+
 private:
 
 	uint32_t OnInterrupt();
 	static uint32_t HandleInterrupt(void* context);
 
+	char Transfer(bool dirIn, uint16_t drive, uint64_t sector, uint32_t count, uint8_t* buffer) const;
+
 	void probe_ports(hba_memory* abar);
 	//void configure_port(ahci_port* port);
 	//void port_start_command(ahci_port* port);
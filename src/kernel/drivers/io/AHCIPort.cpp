@@ -4,9 +4,15 @@
 #include <OS.System.h>
 #include "kernel/Kernel.h"
 #include <kernel\io\disk\Disk.h>
+#include <mem\pagetables.h>
+#include <algorithm>
+
+//Polls of HBA registers give up after this many reads
+#define AHCI_SPIN_LIMIT		1000000
 
 AHCIPort::AHCIPort(AHCIDriver* driver, hba_port* port, uint8_t portNumber)
-	: m_Driver(driver), m_HBAPort(port), port_number(portNumber)
+	: m_Driver(driver), m_HBAPort(port), port_number(portNumber), m_lock("AHCIPort"), m_requests(), m_blocks(), m_counts(),
+	m_recovery(&AHCIPort::OnRecover, this), m_slotFreed(false, false)
 {
 }
 
@@ -35,18 +41,21 @@ bool AHCIPort::ConfigurePort()
 	memset(new_fis_base, 0, 256);
 
 	command_header = (struct hba_command_header*)(new_base);
+	m_slots = ((m_Driver->abar->host_capabilities >> CAP_NCS_SHIFT) & CAP_NCS_MASK) + 1;
 
+	//One page per table, room for AHCI_MAX_PRDT entries
+	pageCount = SizeToPages(sizeof(hba_command_table));
 	for (int i = 0; i < 32; i++) {
-		command_header[i].prdt_length = 8;
+		command_header[i].prdt_length = AHCI_MAX_PRDT;
 
 		paddr_t cmd_table_address_phys = kernel.AllocatePhysical(pageCount);
 		void* cmd_table_address = kernel.DriverMapPages(cmd_table_address_phys, pageCount);
 		command_table[i] = (hba_command_table*)cmd_table_address;
 
-		uint64_t address = (uint64_t)cmd_table_address_phys + ((uint64_t)(i) << 8);
+		uint64_t address = (uint64_t)cmd_table_address_phys;
 		command_header[i].command_table_base_address = (uint32_t)address;
 		command_header[i].command_table_base_address_upper = (uint32_t)(address >> 32);
-		memset(cmd_table_address, 0, 256);
+		memset(cmd_table_address, 0, sizeof(hba_command_table));
 
 	}
 
@@ -65,10 +74,10 @@ bool AHCIPort::ConfigurePort()
 
 bool AHCIPort::StartupPort()
 {
-	constexpr auto pageCount = SizeToPages(4096);
+	constexpr auto pageCount = SizeToPages(AHCI_BOUNCE_SIZE);
 	bufferPhysicalAddr = kernel.AllocatePhysical(pageCount);
 	buffer = (uint8_t*)kernel.DriverMapPages(bufferPhysicalAddr, pageCount);
-	memset(buffer, 0, 4096);
+	memset(buffer, 0, AHCI_BOUNCE_SIZE);
 
 	if (this->Enable() == false)
 		return false;
@@ -112,7 +121,16 @@ bool AHCIPort::StartupPort()
 		}
 		diskModel[40] = 0; // Terminate String.
 
-		Printf("AHCI: Found %s drive %s\r\n", this->isATATPI ? "ATAPI" : "ATA", diskModel);
+		m_sectorCount = diskSize;
+
+		//Queue as deep as both the HBA and the device go
+		const uint16_t sataCaps = *((uint16_t*)&buffer[ATA_IDENT_SATA_CAPS]);
+		const uint32_t queueDepth = (*((uint16_t*)&buffer[ATA_IDENT_QUEUE_DEPTH]) & 0x1F) + 1;
+		m_ncq = !isATATPI && (m_Driver->abar->host_capabilities & CAP_SNCQ) && sataCaps != 0xFFFF && (sataCaps & ATA_SATA_CAP_NCQ);
+		if (m_ncq)
+			m_slots = std::min(m_slots, queueDepth);
+
+		Printf("AHCI: Found %s drive %s, %d slots%s\r\n", this->isATATPI ? "ATAPI" : "ATA", diskModel, m_slots, m_ncq ? " NCQ" : "");
 		uint32_t sectSize = this->isATATPI ? 2048 : 512;
 		
 		//Create Disk Object
@@ -163,7 +181,6 @@ bool AHCIPort::Identify()
 	
 	m_HBAPort->interrupt_status = (uint32_t)-1;
 
-	int spin = 0;
 	int slot = (int)FindFreeCMDSlot();
 	if (slot == -1) {
 		Printf("No free command slots\n");
@@ -171,7 +188,7 @@ bool AHCIPort::Identify()
 	}
 
 	//struct hba_command_header* command_header = (struct hba_command_header*)kernel.PhysicalToVirtual((uint64_t)(port->hba_port->command_list_base | (((uint64_t)port->hba_port->command_list_base_upper) << 32)));
-	hba_command_header ch = this->command_header[slot];
+	hba_command_header& ch = this->command_header[slot];
 	//command_header += slot;
 	ch.command_fis_length = 5;
 	ch.write = 0;
@@ -195,21 +212,34 @@ bool AHCIPort::Identify()
 	command_fis->command_control = 1;
 	command_fis->command = isATATPI ? ATA_CMD_IDENTIFY_PACKET : ATA_CMD_IDENTIFY;
 
-	while (m_HBAPort->task_file_data & (ATA_DEV_BUSY | ATA_DEV_DRQ) && spin < 1000000) {
+	const bool result = ExecutePolled((uint8_t)slot);
+
+	KLockGuard<KSpinLock> guard(m_lock);
+	ReleaseSlot((uint8_t)slot);
+	return result;
+}
+
+bool AHCIPort::ExecutePolled(uint8_t slot)
+{
+	int spin = 0;
+	while (m_HBAPort->task_file_data & (ATA_DEV_BUSY | ATA_DEV_DRQ) && spin < AHCI_SPIN_LIMIT) {
 		spin++;
 	};
-	if (spin == 1000000) {
+	if (spin == AHCI_SPIN_LIMIT) {
 		Printf("AHCI: Port is hung\n");
 		return false;
 	}
 
-	m_HBAPort->command_issue = 1;
+	m_HBAPort->command_issue = (1u << slot);
 
-	while (1) {
-		if ((m_HBAPort->command_issue & (1 << slot)) == 0) break;
+	for (spin = 0; m_HBAPort->command_issue & (1u << slot); spin++) {
 		if (m_HBAPort->interrupt_status & HBA_PxIS_TFES) {
 			return false;
 		}
+		if (spin == AHCI_SPIN_LIMIT) {
+			Printf("AHCI: Port %d command timed out\n", port_number);
+			return false;
+		}
 	}
 
 	if (m_HBAPort->interrupt_status & HBA_PxIS_TFES) {
@@ -219,54 +249,164 @@ bool AHCIPort::Identify()
 	return true;
 }
 
-uint32_t AHCIPort::TransferData(bool dirIn, uint64_t sector, uint32_t count /*= 1*/)
+uint32_t AHCIPort::TransferData(bool dirIn, uint64_t sector, uint32_t count /*= 1*/, void* data /*= nullptr*/)
 {
-	//if ((uint64_t)abar == 0) return 0;
+	KEvent event(false, false);
+	AHCIRequest request = { dirIn, sector, count, data };
+	request.Event = &event;
+
+	//All slots are taken by other callers. Sleep until one is freed where Wait would sleep, otherwise reap.
+	const bool canBlock = !m_polled && (__readeflags() & RFLAGS_IF) && kernel.GetScheduler()->Enabled;
+	bool waited = false;
+	while (!Submit(request))
+	{
+		if (request.Failed)
+			return 0;
 
-	uint32_t count2 = count;
-	//Assert(port_no < port_count);
-	//struct ahci_port* port = &ahci_ports[port_no];
-	//Assert(count < (isATATPI ? 2 : 8));
-	uint32_t sector_low = (uint32_t)sector;
-	uint32_t sector_high = (uint32_t)(sector >> 32);
+		if (!canBlock)
+		{
+			Poll();
+			_mm_pause();
+		}
+		else if (kernel.KeWait(m_slotFreed, AHCI_WAIT_TIMEOUT) == WaitStatus::Timeout)
+		{
+			m_slotWaitTimeouts++;
+			Poll();
+		}
+		else
+		{
+			m_slotWaits++;
+		}
+		waited = canBlock;
+	}
 
-	//Write-clear all bits in interrupt status
-	m_HBAPort->interrupt_status = 0xFFFFFFFF;
+	//One Set wakes one waiter even if several slots were freed, pass it on
+	if (waited)
+		m_slotFreed.Set();
+
+	Wait(request);
+	return request.Failed ? 0 : request.Bytes;
+}
+
+bool AHCIPort::Submit(AHCIRequest& request)
+{
+	Assert(request.Count != 0 && request.Count <= AHCI_MAX_SECTORS);
+	const uint32_t sectorSize = GetSectorSize();
+	uint32_t count = request.Count;
+
+	request.Bytes = 0;
+	request.Failed = false;
+	request.Done = false;
 
-	int spin = 0;
 	int slot = (int)FindFreeCMDSlot();
-	if (slot == -1) {
-		Printf("No free command slots\n");
-		return 0;
+	if (slot == -1)
+		return false;
+
+	hba_command_table* ct = command_table[slot];
+	memset(ct, 0, sizeof(struct hba_command_table));
+
+	uint16_t entries;
+	if (request.Data == nullptr)
+	{
+		//Bounce buffer is physically contiguous, a single entry does
+		Assert(count * sectorSize <= AHCI_BOUNCE_SIZE);
+		ct->prdt_entry[0].data_base_address = (uint32_t)bufferPhysicalAddr;
+		ct->prdt_entry[0].data_base_address_upper = (uint32_t)(bufferPhysicalAddr >> 32);
+		ct->prdt_entry[0].byte_count = (count * sectorSize) - 1;
+		entries = 1;
+	}
+	else
+	{
+		Assert(((uintptr_t)request.Data & 1) == 0);
+		const size_t bytes = BuildPrdt(ct, (uintptr_t)request.Data, (size_t)count * sectorSize, entries);
+		if (bytes == 0)
+		{
+			KLockGuard<KSpinLock> guard(m_lock);
+			ReleaseSlot((uint8_t)slot);
+			request.Failed = true;
+			return false;
+		}
+		count = (uint32_t)(bytes / sectorSize);
 	}
+	request.Bytes = count * sectorSize;
 
-	//struct hba_command_header* command_header = (struct hba_command_header*)(uint64_t)(port->hba_port->command_list_base | (((uint64_t)port->hba_port->command_list_base_upper) << 32));
-	hba_command_header ch = command_header[slot];
-	//command_header += slot;
-	ch.command_fis_length = sizeof(struct hba_command_fis) / sizeof(uint32_t);
-	ch.write = 0;
-	ch.prdt_length = (uint16_t)((count - 1) >> 4) + 1;
+	SetupCommand((uint8_t)slot, request.DirIn, request.Sector, count, entries);
+	Issue((uint8_t)slot, &request, nullptr, count);
+	return true;
+}
 
-	//struct hba_command_table* command_table = (struct hba_command_table*)(uint64_t)(command_header->command_table_base_address | ((uint64_t)command_header->command_table_base_address_upper << 32));
-	hba_command_table* ct = command_table[slot];
-	memset(ct, 0, sizeof(struct hba_command_table) + (ch.prdt_length - 1) * sizeof(struct hba_prdt_entry));
+bool AHCIPort::SubmitBlock(BlockRequest* request)
+{
+	const uint32_t sectorSize = GetSectorSize();
+	int slot = (int)FindFreeCMDSlot();
+	if (slot == -1)
+		return false;
 
-	paddr_t buffer = bufferPhysicalAddr;
+	hba_command_table* ct = command_table[slot];
+	memset(ct, 0, sizeof(struct hba_command_table));
+
+	//Skip what earlier commands transferred, fill the table from the extents of the whole chain. Disk resolved
+	//them when they were submitted, this may run in any address space.
+	const size_t length = (size_t)std::min<uint32_t>(request->MergedCount - request->Progress, AHCI_MAX_SECTORS) * sectorSize;
+	size_t skip = (size_t)request->Progress * sectorSize;
+	size_t covered = 0;
+	uint16_t entries = 0;
+	paddr_t next = 0;
+	bool full = false;
+
+	for (BlockRequest* current = request; current && !full && covered < length; current = current->MergeNext)
+	{
+		for (uint32_t i = 0; i < current->ExtentCount && !full && covered < length; i++)
+		{
+			const BlockExtent& extent = current->Extents[i];
+			if (skip >= extent.Length)
+			{
+				skip -= extent.Length;
+				continue;
+			}
+
+			Assert(((extent.Address + skip) & 1) == 0);
+			const size_t wanted = std::min<size_t>(extent.Length - skip, length - covered);
+			const size_t added = AppendRun(ct, extent.Address + skip, wanted, entries, next);
+			covered += added;
+			full = added < wanted;
+			skip = 0;
+		}
+	}
+	covered = TrimPrdt(ct, covered, entries);
 
-	int i;
-	for (i = 0; i < ch.prdt_length - 1; i++) {
-		ct->prdt_entry[i].data_base_address = (uint32_t)buffer;
-		ct->prdt_entry[i].data_base_address_upper = (uint32_t)(buffer >> 32);
-		ct->prdt_entry[i].byte_count = 8 * 1024 - 1;
-		ct->prdt_entry[i].interrupt_on_completion = 1;
-		buffer = (buffer + 0x1000);
-		count -= 16;
+	if (covered == 0)
+	{
+		{
+			KLockGuard<KSpinLock> guard(m_lock);
+			ReleaseSlot((uint8_t)slot);
+		}
+		request->Target->CompleteRequest(request, 0, true);
+		return true;
 	}
 
-	ct->prdt_entry[i].data_base_address = (uint32_t)(uint64_t)buffer;
-	ct->prdt_entry[i].data_base_address_upper = (uint32_t)((uint64_t)buffer >> 32);
-	ct->prdt_entry[i].byte_count = (count << 9) - 1;
-	ct->prdt_entry[i].interrupt_on_completion = 1;
+	const uint32_t count = (uint32_t)(covered / sectorSize);
+	SetupCommand((uint8_t)slot, !request->Write, request->Lba + request->Progress, count, entries);
+	Issue((uint8_t)slot, nullptr, request, count);
+	return true;
+}
+
+void AHCIPort::SetupCommand(uint8_t slot, bool dirIn, uint64_t sector, uint32_t count, uint16_t entries)
+{
+	uint32_t sector_low = (uint32_t)sector;
+	uint32_t sector_high = (uint32_t)(sector >> 32);
+
+	hba_command_header& ch = command_header[slot];
+	ch.command_fis_length = sizeof(struct hba_command_fis) / sizeof(uint32_t);
+	ch.write = dirIn ? 0 : 1;
+	ch.atapi = 0;
+	ch.prefetchable = 0;
+	ch.clear_busy_on_ok = 0;
+	ch.prdb_count = 0;
+	ch.prdt_length = entries;
+
+	hba_command_table* ct = command_table[slot];
+	ct->prdt_entry[entries - 1].interrupt_on_completion = 1;
 
 	struct hba_command_fis* command_fis = (struct hba_command_fis*)ct->command_fis;
 
@@ -299,8 +439,6 @@ uint32_t AHCIPort::TransferData(bool dirIn, uint64_t sector, uint32_t count /*=
 	}
 	else
 	{
-		command_fis->command = dirIn ? ATA_CMD_READ_DMA_EX : ATA_CMD_WRITE_DMA_EX;
-
 		command_fis->lba0 = (uint8_t)sector_low;
 		command_fis->lba1 = (uint8_t)(sector_low >> 8);
 		command_fis->lba2 = (uint8_t)(sector_low >> 16);
@@ -311,33 +449,347 @@ uint32_t AHCIPort::TransferData(bool dirIn, uint64_t sector, uint32_t count /*=
 		command_fis->lba4 = (uint8_t)(sector_high);
 		command_fis->lba5 = (uint8_t)(sector_high >> 8);
 
-		command_fis->count_low = count & 0xFF;
-		command_fis->count_high = (count >> 8);
+		if (m_ncq)
+		{
+			//FPDMA QUEUED moves the count to the feature field, the tag goes in count bits 7:3
+			command_fis->command = dirIn ? ATA_CMD_READ_FPDMA_QUEUED : ATA_CMD_WRITE_FPDMA_QUEUED;
+			command_fis->feature_low = count & 0xFF;
+			command_fis->feature_high = (count >> 8);
+			command_fis->count_low = (uint8_t)(slot << 3);
+		}
+		else
+		{
+			command_fis->command = dirIn ? ATA_CMD_READ_DMA_EX : ATA_CMD_WRITE_DMA_EX;
+			command_fis->count_low = count & 0xFF;
+			command_fis->count_high = (count >> 8);
+		}
 	}
-	
+}
+
+void AHCIPort::Issue(uint8_t slot, AHCIRequest* request, BlockRequest* block, uint32_t count)
+{
+	KLockGuard<KSpinLock> guard(m_lock);
+	m_requests[slot] = request;
+	m_blocks[slot] = block;
+	m_counts[slot] = count;
+	m_issued |= (1u << slot);
+
+	m_submitted++;
+	const uint32_t outstanding = __popcnt(m_issued);
+	if (outstanding > m_maxOutstanding)
+		m_maxOutstanding = outstanding;
+
+	//Writing zeroes has no effect on either register, SACT has to be set before CI
+	if (m_ncq)
+		m_HBAPort->sata_active = (1u << slot);
+	m_HBAPort->command_issue = (1u << slot);
+}
+
+void AHCIPort::Wait(AHCIRequest& request)
+{
+	Assert(request.Completion == nullptr);
+
+	const bool canBlock = request.Event && !m_polled && (__readeflags() & RFLAGS_IF) && kernel.GetScheduler()->Enabled;
+	if (canBlock)
+		m_blocked++;
+
+	while (!request.Done)
+	{
+		if (!canBlock)
+		{
+			Poll();
+			_mm_pause();
+		}
+		else if (kernel.KeWait(*request.Event, AHCI_WAIT_TIMEOUT) == WaitStatus::Timeout && !request.Done)
+		{
+			m_timeouts++;
+			Poll();
+		}
+	}
+
+	//Done may be seen while the completing CPU is still about to set the event
+	KLockGuard<KSpinLock> guard(m_lock);
+}
+
+void AHCIPort::Poll()
+{
+	PollPort(false);
+}
+
+void AHCIPort::PollPort(bool deferRecovery)
+{
+	FinishedBlocks finished;
+	finished.Count = 0;
+	bool failed;
+	{
+		KLockGuard<KSpinLock> guard(m_lock);
+		failed = Reap(finished);
+	}
+
+	//Outside the lock, the disk queue dispatches the next requests from here
+	for (uint32_t i = 0; i < finished.Count; i++)
+		finished.Requests[i]->Target->CompleteRequest(finished.Requests[i], finished.Counts[i], finished.Failed[i]);
+
+	if (!failed)
+		return;
 
-	while (m_HBAPort->task_file_data & (ATA_DEV_BUSY | ATA_DEV_DRQ) && spin < 1000000) {
+	//Nothing runs the work queue in polled mode or before the scheduler starts
+	if (deferRecovery && !m_polled && kernel.GetScheduler()->Enabled)
+		kernel.GetWorkQueue()->Queue(m_recovery);
+	else
+		Recover();
+}
+
+bool AHCIPort::Reap(FinishedBlocks& finished)
+{
+	//Recovery owns the port, what is outstanding is failed there
+	if (m_recovering)
+		return false;
+
+	//Clear first, anything finishing after the reads below raises the interrupt again
+	const uint32_t status = m_HBAPort->interrupt_status;
+	m_HBAPort->interrupt_status = status;
+
+	if (status & PORT_INT_FATAL)
+	{
+		m_recovering = true;
+		return true;
+	}
+
+	//NCQ commands finish when the device clears their SACT bit, others when the HBA clears CI
+	const uint32_t pending = m_HBAPort->sata_active | m_HBAPort->command_issue;
+	Complete(m_issued & ~pending, false, finished);
+	return false;
+}
+
+void AHCIPort::Complete(uint32_t slots, bool failed, FinishedBlocks& finished)
+{
+	if (slots != 0)
+		m_slotFreed.Set();
+
+	unsigned long slot;
+	for (; _BitScanForward(&slot, slots); slots &= slots - 1)
+	{
+		AHCIRequest* request = m_requests[slot];
+		BlockRequest* block = m_blocks[slot];
+		m_requests[slot] = nullptr;
+		m_blocks[slot] = nullptr;
+		m_issued &= ~(1u << slot);
+		m_busy &= ~(1u << slot);
+
+		if (block)
+		{
+			finished.Requests[finished.Count] = block;
+			finished.Counts[finished.Count] = failed ? 0 : m_counts[slot];
+			finished.Failed[finished.Count] = failed;
+			finished.Count++;
+			continue;
+		}
+
+		request->Failed = failed;
+		if (request->Completion)
+		{
+			request->Completion(request, request->Context);
+		}
+		else
+		{
+			//Blocked waiters take the lock before returning, the event outlives this
+			request->Done = true;
+			if (request->Event)
+			{
+				request->Event->Set();
+				kernel.GetHAL()->RequestReschedule();
+			}
+		}
+	}
+}
+
+void AHCIPort::OnRecover(void* context)
+{
+	((AHCIPort*)context)->Recover();
+}
+
+void AHCIPort::Recover()
+{
+	//The command list stops on a fatal error and so does the device's queue, everything outstanding is lost.
+	//Nothing is issued or reaped while m_recovering is set, m_issued doesn't change under us.
+	Assert(m_recovering);
+	const uint32_t failed = m_issued;
+	m_errors++;
+	Printf("AHCI: Port %d error, IS 0x%x TFD 0x%x SERR 0x%x, failing %d commands\r\n", port_number,
+		m_HBAPort->interrupt_status, m_HBAPort->task_file_data, m_HBAPort->sata_error, __popcnt(failed));
+
+	//Clearing ST clears SACT and CI
+	m_HBAPort->command_status &= ~HBA_PxCMD_ST;
+	int spin = 0;
+	while ((m_HBAPort->command_status & HBA_PxCMD_CR) && spin < AHCI_SPIN_LIMIT)
 		spin++;
-	};
-	if (spin == 1000000) {
-		Printf(__FUNCTION__": Port is hung\n");
+
+	m_HBAPort->sata_error = (uint32_t)-1;
+	m_HBAPort->interrupt_status = (uint32_t)-1;
+
+	//Device still reports busy, let the HBA issue commands regardless
+	if ((m_HBAPort->task_file_data & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && (m_Driver->abar->host_capabilities & CAP_SCLO))
+	{
+		m_HBAPort->command_status |= HBA_PxCMD_CLO;
+		spin = 0;
+		while ((m_HBAPort->command_status & HBA_PxCMD_CLO) && spin < AHCI_SPIN_LIMIT)
+			spin++;
+	}
+	m_HBAPort->command_status |= HBA_PxCMD_ST;
+
+	FinishedBlocks finished;
+	finished.Count = 0;
+	unsigned long slot;
+	bool readLog;
+	{
+		KLockGuard<KSpinLock> guard(m_lock);
+		Complete(failed, true, finished);
+
+		//An NCQ device aborts every queued command until the error log is read
+		const uint32_t free = ~m_busy & (uint32_t)(((uint64_t)1 << m_slots) - 1);
+		readLog = m_ncq && _BitScanForward(&slot, free);
+		if (readLog)
+		{
+			m_busy |= (1u << slot);
+		}
+		else
+		{
+			m_recovering = false;
+			m_slotFreed.Set();
+		}
+	}
+
+	for (uint32_t i = 0; i < finished.Count; i++)
+		finished.Requests[i]->Target->CompleteRequest(finished.Requests[i], finished.Counts[i], finished.Failed[i]);
+
+	if (!readLog)
+		return;
+
+	hba_command_header& ch = command_header[slot];
+	ch.command_fis_length = sizeof(struct hba_command_fis) / sizeof(uint32_t);
+	ch.write = 0;
+	ch.atapi = 0;
+	ch.prdb_count = 0;
+	ch.prdt_length = 1;
+
+	hba_command_table* ct = command_table[slot];
+	memset(ct, 0, sizeof(struct hba_command_table));
+	ct->prdt_entry[0].data_base_address = (uint32_t)bufferPhysicalAddr;
+	ct->prdt_entry[0].data_base_address_upper = (uint32_t)(bufferPhysicalAddr >> 32);
+	ct->prdt_entry[0].byte_count = 512 - 1;
+
+	struct hba_command_fis* command_fis = (struct hba_command_fis*)ct->command_fis;
+	command_fis->fis_type = FIS_TYPE_REG_H2D;
+	command_fis->command_control = 1;
+	command_fis->command = ATA_CMD_READ_LOG_EXT;
+	command_fis->lba0 = ATA_LOG_NCQ_ERROR;
+	command_fis->count_low = 1;
+
+	ExecutePolled((uint8_t)slot);
+	m_HBAPort->interrupt_status = (uint32_t)-1;
+
+	KLockGuard<KSpinLock> guard(m_lock);
+	m_recovering = false;
+	ReleaseSlot((uint8_t)slot);
+}
+
+size_t AHCIPort::BuildPrdt(hba_command_table* ct, uintptr_t data, size_t length, uint16_t& entries)
+{
+	PageTables tables;
+	tables.OpenCurrent();
+
+	entries = 0;
+	paddr_t next = 0;
+	bool unmapped = false;
+	const size_t covered = AppendPrdt(tables, ct, data, length, entries, next, unmapped);
+	if (unmapped)
 		return 0;
+
+	return TrimPrdt(ct, covered, entries);
+}
+
+size_t AHCIPort::AppendPrdt(PageTables& tables, hba_command_table* ct, uintptr_t data, size_t length, uint16_t& entries, paddr_t& next, bool& unmapped)
+{
+	size_t covered = 0;
+	while (covered < length)
+	{
+		const uintptr_t address = data + covered;
+		const size_t chunk = std::min(PageSize - (address & (PageSize - 1)), length - covered);
+
+		//The device would transfer to whatever a stale entry points at
+		paddr_t physical;
+		if (!tables.TryResolveAddress(address, physical))
+		{
+			unmapped = true;
+			break;
+		}
+
+		const size_t added = AppendRun(ct, physical, chunk, entries, next);
+		covered += added;
+		if (added < chunk)
+			break;
 	}
 
-	m_HBAPort->command_issue = (1 << slot);
+	return covered;
+}
 
-	while (1) {
-		if ((m_HBAPort->command_issue & (1 << slot)) == 0) break;
-		if (m_HBAPort->interrupt_status & HBA_PxIS_TFES) {
-			return 0;
+size_t AHCIPort::AppendRun(hba_command_table* ct, paddr_t physical, size_t length, uint16_t& entries, paddr_t& next)
+{
+	size_t covered = 0;
+	while (covered < length)
+	{
+		const paddr_t address = physical + covered;
+		hba_prdt_entry* last = entries != 0 ? &ct->prdt_entry[entries - 1] : nullptr;
+		const size_t used = last ? (size_t)last->byte_count + 1 : 0;
+
+		size_t chunk;
+		if (last && address == next && used < AHCI_PRDT_MAX_BYTES)
+		{
+			chunk = std::min<size_t>(AHCI_PRDT_MAX_BYTES - used, length - covered);
+			last->byte_count += (uint32_t)chunk;
 		}
+		else
+		{
+			if (entries == AHCI_MAX_PRDT)
+				break;
+
+			chunk = std::min<size_t>(AHCI_PRDT_MAX_BYTES, length - covered);
+			hba_prdt_entry& entry = ct->prdt_entry[entries++];
+			entry.data_base_address = (uint32_t)address;
+			entry.data_base_address_upper = (uint32_t)(address >> 32);
+			entry.byte_count = (uint32_t)chunk - 1;
+		}
+
+		next = address + chunk;
+		covered += chunk;
 	}
 
-	if (m_HBAPort->interrupt_status & HBA_PxIS_TFES) {
-		return 0;
+	return covered;
+}
+
+size_t AHCIPort::TrimPrdt(hba_command_table* ct, size_t covered, uint16_t& entries)
+{
+	//Table ran out, only transfer whole sectors
+	size_t excess = covered % GetSectorSize();
+	covered -= excess;
+	while (excess != 0)
+	{
+		hba_prdt_entry& entry = ct->prdt_entry[entries - 1];
+		const size_t bytes = (size_t)entry.byte_count + 1;
+		if (bytes <= excess)
+		{
+			excess -= bytes;
+			entries--;
+		}
+		else
+		{
+			entry.byte_count -= (uint32_t)excess;
+			excess = 0;
+		}
 	}
 
-	return (count2 * (isATATPI ? 2048 : 512));
+	return covered;
 }
 
 bool AHCIPort::Eject()
@@ -349,18 +801,28 @@ bool AHCIPort::Eject()
 	return true;
 }
 
+void AHCIPort::ReleaseSlot(uint8_t slot)
+{
+	//Caller holds m_lock
+	m_busy &= ~(1u << slot);
+	m_slotFreed.Set();
+}
+
 int8_t AHCIPort::FindFreeCMDSlot()
 {
-	uint32_t slots = (m_HBAPort->sata_active | m_HBAPort->command_issue);
-	int cmd_slots = (m_Driver->abar->host_capabilities & 0x0f00) >> 8;
-	for (int i = 0; i < cmd_slots; i++) {
+	KLockGuard<KSpinLock> guard(m_lock);
+	if (m_recovering)
+		return -1;
+
+	uint32_t slots = (m_busy | m_HBAPort->sata_active | m_HBAPort->command_issue);
+	for (uint32_t i = 0; i < m_slots; i++) {
 		if ((slots & 1) == 0) {
+			m_busy |= (1u << i);
 			return i;
 		}
 		slots >>= 1;
 	}
 
-	Printf("Cannot find free command list entry\n");
 	return -1;
 }
 
@@ -390,9 +852,23 @@ port_type AHCIPort::check_port_type()
 
 void AHCIPort::HandleExternalInterrupt()
 {
-	uint32_t status = m_HBAPort->interrupt_status;
+	PollPort(true);
+}
 
-	//TODO
+void AHCIPort::Display() const
+{
+	Printf("AHCI port %d: %s, %d slots, %d commands, max %d outstanding, %d errors, %d waits slept, %d timed out\r\n", port_number,
+		m_ncq ? "NCQ" : "no NCQ", m_slots, m_submitted, m_maxOutstanding, m_errors, m_blocked, m_timeouts);
+	Printf("    %d slot waits slept, %d timed out\r\n", m_slotWaits, m_slotWaitTimeouts);
+}
 
-	m_HBAPort->interrupt_status = status;
+void AHCIPort::ResetStats()
+{
+	m_submitted = 0;
+	m_maxOutstanding = 0;
+	m_errors = 0;
+	m_blocked = 0;
+	m_timeouts = 0;
+	m_slotWaits = 0;
+	m_slotWaitTimeouts = 0;
 }
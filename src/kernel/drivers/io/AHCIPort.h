@@ -1,6 +1,36 @@
 #pragma once
+#include "os.System.h"
 #include "AHCI.h"
+#include "kernel/objects/KSpinLock.h"
+#include "kernel/objects/KEvent.h"
+#include "kernel/sched/WorkQueue.h"
 
+//Blocked waiters poll the port after this long in case the interrupt got lost
+#define AHCI_WAIT_TIMEOUT	20 //ms
+
+class PageTables;
+struct AHCIRequest;
+typedef void (*AHCICompletion)(AHCIRequest* request, void* context);
+
+//One read or write in flight on a port, owned by the submitter until it completes
+struct AHCIRequest
+{
+	bool DirIn;
+	uint64_t Sector;
+	uint32_t Count;
+	void* Data; //Word aligned, nullptr for the port's bounce buffer
+
+	//Runs with the port lock held, from the interrupt handler or a poller. Done is only set without one,
+	//along with Event if there is one to block on.
+	AHCICompletion Completion;
+	void* Context;
+	KEvent* Event;
+
+	//Set by Submit and on completion
+	uint32_t Bytes; //May be fewer sectors than Count, see TransferData
+	bool Failed;
+	volatile bool Done;
+};
 
 class AHCIPort
 {
@@ -19,8 +49,30 @@ public:
 	// Send Identify command to port
 	bool Identify();
 
-	// Read or write sectors to device
-	uint32_t TransferData(bool dirIn, uint64_t sector, uint32_t count = 1);
+	// Read or write sectors to device. Without data the port's bounce buffer is used, otherwise the PRDT points
+	// straight at data, which has to be word aligned. Returns the bytes transferred, which may be fewer sectors
+	// than count if data is too fragmented for one command table.
+	uint32_t TransferData(bool dirIn, uint64_t sector, uint32_t count = 1, void* data = nullptr);
+
+	// Queue request without waiting for it, false if all slots are taken. With NCQ the device may complete
+	// requests in any order.
+	bool Submit(AHCIRequest& request);
+	// Wait for a request without completion callback. Blocks on its event if it has one, spins in polled mode,
+	// with interrupts disabled or before the scheduler runs.
+	void Wait(AHCIRequest& request);
+	// Start a request of Disk's queue, completes through Disk::CompleteRequest
+	bool SubmitBlock(BlockRequest* request);
+	// Reap finished commands. A port error is recovered right here, the interrupt handler defers that.
+	void Poll();
+
+	bool UsesNcq() const { return m_ncq; }
+	// Busy poll for completions instead of sleeping, for crash paths where interrupts can't be trusted
+	void SetPolled(bool polled) { m_polled = polled; }
+	uint32_t GetQueueDepth() const { return m_slots; }
+	void Display() const;
+	void ResetStats();
+	uint32_t GetSectorSize() const { return isATATPI ? 2048 : 512; }
+	uint64_t GetSectorCount() const { return m_sectorCount; }
 
 	// Eject drive if it is a ATAPI device
 	bool Eject();
@@ -28,9 +80,40 @@ public:
 	uint8_t* GetBuffer() { return buffer; }
 
 private:
-	// Find a CMD slot which is ready for commands
+	// Find a CMD slot which is ready for commands and reserve it
 	int8_t FindFreeCMDSlot();
+	// Caller holds m_lock. Hands the slot back and wakes a TransferData caller waiting for one.
+	void ReleaseSlot(uint8_t slot);
+	//Block requests finished under the lock, reported to their disk after releasing it
+	struct FinishedBlocks
+	{
+		BlockRequest* Requests[32];
+		uint32_t Counts[32];
+		bool Failed[32];
+		uint32_t Count;
+	};
+
+	void SetupCommand(uint8_t slot, bool dirIn, uint64_t sector, uint32_t count, uint16_t entries);
+	void Issue(uint8_t slot, AHCIRequest* request, BlockRequest* block, uint32_t count);
+	void PollPort(bool deferRecovery);
+	// Caller holds m_lock. True if the port hit a fatal error and the caller now owns its recovery.
+	bool Reap(FinishedBlocks& finished);
+	void Complete(uint32_t slots, bool failed, FinishedBlocks& finished);
+	// Restarts the command list and fails everything outstanding. Spins on the HBA, so not under m_lock and
+	// not from the interrupt handler.
+	void Recover();
+	static void OnRecover(void* context);
+	bool ExecutePolled(uint8_t slot);
 	port_type check_port_type();
+	// Fill the PRDT from physically contiguous runs of data, returns the bytes covered, 0 if a page isn't mapped
+	size_t BuildPrdt(hba_command_table* ct, uintptr_t data, size_t length, uint16_t& entries);
+	// Add data after the entries already there, next is the physical address following the last one.
+	// Stops at the first page that isn't mapped and sets unmapped.
+	size_t AppendPrdt(PageTables& tables, hba_command_table* ct, uintptr_t data, size_t length, uint16_t& entries, paddr_t& next, bool& unmapped);
+	// Same for a physically contiguous run, split at the PRDT entry limit
+	size_t AppendRun(hba_command_table* ct, paddr_t physical, size_t length, uint16_t& entries, paddr_t& next);
+	// Cut the table back to whole sectors
+	size_t TrimPrdt(hba_command_table* ct, size_t covered, uint16_t& entries);
 
 	AHCIDriver* m_Driver;
 	
@@ -43,6 +126,30 @@ private:
 	hba_command_table* command_table[32];
 	bool isATATPI = false;
 	bool useLBA48 = true;
+	uint64_t m_sectorCount = 0;
+	bool m_ncq = false;
+	volatile bool m_polled = false;
+	uint32_t m_slots = 1; //Usable command slots, HBA and device queue depth
+
+	//Slots handed out by FindFreeCMDSlot, and those of them the HBA has been given
+	KSpinLock m_lock;
+	uint32_t m_busy = 0;
+	uint32_t m_issued = 0;
+	AHCIRequest* m_requests[32];
+	BlockRequest* m_blocks[32];
+	uint32_t m_counts[32]; //Sectors of the command in the slot
+	bool m_recovering = false; //No new commands and no reaping until Recover is done
+	KWorkItem m_recovery;
+	KEvent m_slotFreed; //Auto reset, TransferData callers sleep on it while every slot is taken
+
+	//Stats
+	uint64_t m_submitted = 0;
+	uint64_t m_errors = 0;
+	uint64_t m_blocked = 0; //Waits that slept
+	uint64_t m_timeouts = 0; //Woke without the request done, interrupt missing
+	uint64_t m_slotWaits = 0; //Submissions that slept for a free slot
+	uint64_t m_slotWaitTimeouts = 0;
+	uint32_t m_maxOutstanding = 0;
 public:
 	void HandleExternalInterrupt();
 };
\ No newline at end of file
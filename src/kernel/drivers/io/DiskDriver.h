@@ -4,11 +4,23 @@
 #include <string>
 #include <memory>
 #include <kernel\drivers\Driver.h>
+#include <kernel\io\disk\BlockRequest.h>
 
 class DiskDriver
 {
 public:
 	virtual char ReadSector(uint16_t drive, uint64_t sector, uint8_t* buffer) const = 0;
 	virtual char WriteSector(uint16_t drive, uint64_t sector, uint8_t* buffer) const = 0;
+	//Whole runs of sectors, DMA straight to and from buffer where the controller can
+	virtual char ReadSectors(uint16_t drive, uint64_t sector, uint32_t count, uint8_t* buffer) const = 0;
+	virtual char WriteSectors(uint16_t drive, uint64_t sector, uint32_t count, uint8_t* buffer) const = 0;
 	virtual bool EjectDrive(uint8_t drive) = 0;
+
+	//Asynchronous path used by Disk's queue. Start request, with its merged chain, from its Progress on and report
+	//through Disk::CompleteRequest, possibly covering fewer blocks. False if the drive can't take more right now.
+	virtual bool SubmitRequest(uint16_t drive, BlockRequest* request) = 0;
+	//Requests the drive works on at once
+	virtual uint32_t GetQueueDepth(uint16_t drive) const = 0;
+	//Reap completions without waiting for the interrupt
+	virtual void Poll(uint16_t drive) = 0;
 };
\ No newline at end of file
@@ -1,36 +1,30 @@
 #include "UartDriver.h"
 
-#include "kernel/Kernel.h"
+#include "kernel/hal/HAL.h"
+#include "kernel/hal/x64/interrupt.h"
+#include <Assert.h>
+#include <intrin.h>
 
-UartDriver::UartDriver(Device& device)
-	: Driver(device), m_port(), m_index(), m_rxBuffer()
+UartDriver::UartDriver(HAL* hal, const uint16_t port, const uint8_t irq)
+	: Driver(nullptr), m_HAL(hal), m_port(port), m_irq(irq), m_baud(UART_CLOCK), m_present(),
+	m_rxLock("UartRx"), m_rxBuffer(), m_txLock("UartTx"), m_txBuffer(), m_txBusy(), m_polled(),
+	m_txQueued(), m_txSent(), m_txBursts(), m_txDropped(), m_rxDropped()
 {
-	const ACPI_RESOURCE* resource = (ACPI_RESOURCE*)device.GetResource(ACPI_RESOURCE_TYPE_IO);
-	Assert(resource->Data.Io.AddressLength == 8);
-	m_port = resource->Data.Io.Minimum;
 }
 
-const std::string UartDriver::GetCompatHID()
+DriverResult UartDriver::Initialize()
 {
-	return "PNP0501";
-}
-
-Driver* UartDriver::CreateInstance(Device* device)
-{
-	UartDriver* driver = new UartDriver(*device);
-	return driver;
-}
-
-Result UartDriver::Initialize()
-{
-	Printf("UartDriver::Initialize\n");
-
-	m_device.Type = DeviceType::Serial;
+	//Nothing decodes the port if the scratch register doesn't keep its value
+	Write(Reg::ScratchPad, 0xAE);
+	if (Read(Reg::ScratchPad) != 0xAE)
+		return DriverResult::Failed;
 
 	//Disable interrupts
 	InterruptEnableReg ier = { 0 };
 	Write(Reg::InterruptEnable, ier.AsUint8);
 
+	SetBaudRate(m_baud);
+
 	//Enable FIFO, clear RX/TX queues, set interrupt watermark at 14 bytes
 	FifoControlReg fcr = { 0 };
 	fcr.TriggerLevel = FifoTriggerLevel::FourteenBytes;
@@ -46,90 +40,288 @@ Result UartDriver::Initialize()
 	mcr.DTR = 1;
 	Write(Reg::ModemControl, mcr.AsUint8);
 
-	//Enable interrupts
+	m_present = true;
+	return DriverResult::Success;
+}
+
+DriverResult UartDriver::Activate()
+{
+	if (!m_present)
+		return DriverResult::Failed;
+
+	const uint8_t vector = (uint8_t)(m_port == UART_COM1_PORT ? X64_INTERRUPT_VECTOR::COM1 : X64_INTERRUPT_VECTOR::COM2);
+	m_HAL->RegisterInterrupt(vector, { UartDriver::OnInterrupt, this });
+
+	interrupt_redirect_t redirect;
+	redirect.type = 0x1;
+	redirect.index = m_irq;
+	redirect.interrupt = vector;
+	redirect.destination = m_HAL->CurrentCPU();
+	redirect.flags = 0x0;
+	redirect.mask = false;
+	m_HAL->SetInterruptRedirect(&redirect);
+
+	//THR is empty now, so this fires right away and finds nothing to send
+	InterruptEnableReg ier = { 0 };
 	ier.DataReady = 1;
+	ier.ThrEmpty = 1;
 	Write(Reg::InterruptEnable, ier.AsUint8);
 
-	return Result::Success;
+	Printf("Serial 0x%x: %d baud, IRQ %d\r\n", m_port, m_baud, m_irq);
+	return DriverResult::Success;
 }
 
-void UartDriver::OnInterrupt()
+DriverResult UartDriver::Deactivate()
 {
+	if (!m_present)
+		return DriverResult::Success;
+
+	Flush();
+	Write(Reg::InterruptEnable, 0);
+	m_HAL->UnRegisterInterrupt((uint8_t)(m_port == UART_COM1_PORT ? X64_INTERRUPT_VECTOR::COM1 : X64_INTERRUPT_VECTOR::COM2));
+	return DriverResult::Success;
+}
+
+DriverResult UartDriver::Reset()
+{
+	return DriverResult::NotImplemented;
+}
+
+std::string UartDriver::get_vendor_name()
+{
+	return "Generic";
+}
+
+std::string UartDriver::get_device_name()
+{
+	return "16550 UART";
+}
+
+DeviceType UartDriver::get_device_type()
+{
+	return DeviceType::Serial;
+}
+
+uint32_t UartDriver::OnInterrupt(void* arg)
+{
+	((UartDriver*)arg)->HandleInterrupt();
+	return 0;
+}
+
+void UartDriver::HandleInterrupt()
+{
+	//Several sources may be pending, ISR reports the highest priority one until it is cleared
 	InterruptStatusReg isr = { 0 };
 	isr.AsUint8 = Read(Reg::InterruptStatus);
-	Assert(isr.Status == false);//Interrupt is pending
-	//Assert(isr.Type == InterruptType::ReceivedDataReady); ReceptionTimeout?
-
-	kernel.Printf("ISR: 0x%x\n", isr.AsUint8);
-	//Read all characters into a buffer
-	LineStatusReg status = { 0 };
-	status.AsUint8 = Read(Reg::LineStatus);
-	while (status.DataReady)
+	while (!isr.Status)
 	{
-		Assert(!m_rxBuffer.IsFull());
+		switch (isr.Type)
+		{
+		case InterruptType::ReceivedDataReady:
+		case InterruptType::ReceptionTimeout:
+		{
+			KLockGuard<KSpinLock> guard(m_rxLock);
+			LineStatusReg status = { 0 };
+			status.AsUint8 = Read(Reg::LineStatus);
+			while (status.DataReady)
+			{
+				if (!m_rxBuffer.Write(Read(Reg::ReceiverHolding)))
+					m_rxDropped++;
+				status.AsUint8 = Read(Reg::LineStatus);
+			}
+		}
+		break;
 
-		m_rxBuffer.Write(Read(Reg::ReceiverHolding));
-		status.AsUint8 = Read(Reg::LineStatus);
-	}
+		case InterruptType::ThrEmpty:
+		{
+			//Reading ISR cleared it, FIFO is empty
+			KLockGuard<KSpinLock> guard(m_txLock);
+			FillFifo();
+		}
+		break;
 
-	//Ensure interrupts are handled
-	isr.AsUint8 = Read(Reg::InterruptStatus);
-	Assert(isr.Status == true);
+		case InterruptType::ReceiverLineStatus:
+			Read(Reg::LineStatus);
+			break;
 
-	kernel.Printf("RxBuffer: 0x%x of 0x%x\n", m_rxBuffer.Count(), m_rxBuffer.Size());
-	kernel.PrintBytes((char*)&m_rxBuffer, sizeof(m_rxBuffer));
+		default:
+			Read(Reg::ModemStatus);
+			break;
+		}
 
+		isr.AsUint8 = Read(Reg::InterruptStatus);
+	}
 }
 
-Result UartDriver::Read(char* buffer, size_t length, size_t* bytesRead /*= nullptr*/)
+void UartDriver::FillFifo()
 {
-	if (length > m_rxBuffer.Count())
-		return Result::Failed;
+	//Caller holds m_txLock and knows the FIFO is empty
+	size_t burst = 0;
+	uint8_t c;
+	while (burst < UART_FIFO_DEPTH && m_txBuffer.Read(c))
+	{
+		Write(Reg::TransmitterHolding, c);
+		burst++;
+	}
 
+	m_txBusy = burst != 0;
+	if (burst != 0)
+	{
+		m_txSent += burst;
+		m_txBursts++;
+	}
+}
+
+size_t UartDriver::Read(char* buffer, size_t length)
+{
 	Assert(buffer != nullptr);
-	uint8_t* pBuffer = reinterpret_cast<uint8_t*>(buffer);
+	KLockGuard<KSpinLock> guard(m_rxLock);
 
 	size_t count = 0;
-	while (count < length)
+	uint8_t c;
+	while (count < length && m_rxBuffer.Read(c))
+		buffer[count++] = (char)c;
+
+	return count;
+}
+
+void UartDriver::Write(const char* buffer, size_t length)
+{
+	if (!m_present)
+		return;
+
+	if (m_polled)
 	{
-		if (!m_rxBuffer.Read(*pBuffer))
+		for (size_t i = 0; i < length; i++)
+			WritePolled(static_cast<uint8_t>(buffer[i]));
+		return;
+	}
+
+	KLockGuard<KSpinLock> guard(m_txLock);
+	for (size_t i = 0; i < length; i++)
+	{
+		if (!m_txBuffer.Write(static_cast<uint8_t>(buffer[i])))
+		{
+			m_txDropped += length - i;
 			break;
-		pBuffer++;
-		count++;
+		}
+		m_txQueued++;
 	}
 
-	if (bytesRead != nullptr)
-		*bytesRead = count;
+	//Idle transmitter raises no interrupt, start it
+	if (!m_txBusy)
+		FillFifo();
+}
 
-	return Result::Success;
+void UartDriver::Write(const std::string& string)
+{
+	this->Write(string.c_str(), string.length());
 }
 
-uint8_t UartDriver::Read(Reg reg)
+bool UartDriver::IsIdle()
 {
-	return ArchReadPort(m_port + static_cast<uint8_t>(reg), std::numeric_limits<uint8_t>::digits);
+	KLockGuard<KSpinLock> guard(m_txLock);
+	return !m_txBusy && m_txBuffer.IsEmpty();
 }
 
-Result UartDriver::Write(const char* buffer, size_t length)
+void UartDriver::Flush()
 {
-	for (size_t i = 0; i < length; i++)
+	if (!m_present || m_polled)
+		return;
+
+	KLockGuard<KSpinLock> guard(m_txLock);
+	DrainTransmitter();
+}
+
+void UartDriver::EnterPolledMode()
+{
+	if (!m_present)
+		return;
+
+	//Best effort, whoever holds the lock may still be in FillFifo
+	m_polled = true;
+	uint8_t c;
+	while (m_txBuffer.Read(c))
+		WritePolled(c);
+}
+
+void UartDriver::DrainTransmitter()
+{
+	//Caller holds m_txLock. Works with interrupts disabled, refills the FIFO itself whenever it runs empty.
+	LineStatusReg status = { 0 };
+	while (!m_txBuffer.IsEmpty())
+	{
+		status.AsUint8 = Read(Reg::LineStatus);
+		if (status.ThrEmpty)
+			FillFifo();
+		else
+			_mm_pause();
+	}
+
+	//Last burst has to leave the FIFO and the shift register too
+	status.AsUint8 = Read(Reg::LineStatus);
+	while (!status.TransmitterEmpty)
 	{
-		Write(Reg::TransmitterHolding, static_cast<uint8_t>(buffer[i]));
+		_mm_pause();
+		status.AsUint8 = Read(Reg::LineStatus);
 	}
+	m_txBusy = false;
+}
 
-	return Result::Success;
+void UartDriver::WritePolled(const uint8_t c)
+{
+	LineStatusReg status = { 0 };
+	status.AsUint8 = Read(Reg::LineStatus);
+	while (!status.ThrEmpty)
+	{
+		_mm_pause();
+		status.AsUint8 = Read(Reg::LineStatus);
+	}
+	Write(Reg::TransmitterHolding, c);
 }
 
-void UartDriver::Write(const std::string& string)
+void UartDriver::SetBaudRate(const uint32_t baud)
 {
-	this->Write(string.c_str(), string.length());
+	Assert(baud != 0 && baud <= UART_CLOCK);
+	const uint16_t divisor = (uint16_t)(UART_CLOCK / baud);
+
+	KLockGuard<KSpinLock> guard(m_txLock);
+	DrainTransmitter();
+
+	//8N1
+	LineControlReg lcr = { 0 };
+	lcr.WordLength = LcrWordLength::Eight;
+	lcr.DivisorLatchAccess = 1;
+	Write(Reg::LineControl, lcr.AsUint8);
+	Write(Reg::DivisorLatchLeastSig, divisor & 0xFF);
+	Write(Reg::DivisorLatchMostSig, divisor >> 8);
+	lcr.DivisorLatchAccess = 0;
+	Write(Reg::LineControl, lcr.AsUint8);
+
+	m_baud = UART_CLOCK / divisor;
 }
 
-void UartDriver::Write(Reg reg, uint8_t value)
+void UartDriver::Display() const
+{
+	Printf("Serial 0x%x: %d baud, queued %d, sent %d in %d bursts (avg %d), dropped %d, rx dropped %d\r\n", m_port, m_baud,
+		m_txQueued, m_txSent, m_txBursts, m_txBursts != 0 ? m_txSent / m_txBursts : 0, m_txDropped, m_rxDropped);
+}
+
+void UartDriver::ResetStats()
+{
+	m_txQueued = 0;
+	m_txSent = 0;
+	m_txBursts = 0;
+	m_txDropped = 0;
+	m_rxDropped = 0;
+}
+
+uint8_t UartDriver::Read(Reg reg)
 {
-	ArchWritePort(m_port + static_cast<uint8_t>(reg), value, std::numeric_limits<uint8_t>::digits);
+	return (uint8_t)m_HAL->ReadPort(m_port + static_cast<uint8_t>(reg), 8);
 }
 
-Result UartDriver::EnumerateChildren()
+void UartDriver::Write(Reg reg, uint8_t value)
 {
-	return Result::NotImplemented;
+	m_HAL->WritePort(m_port + static_cast<uint8_t>(reg), value, 8);
 }
@@ -4,24 +4,57 @@
 #include <string>
 #include "kernel/drivers/Driver.h"
 #include "kernel/io/StringPrinter.h"
-#include "kernel/obj/KRingBuffer.h"
+#include "kernel/objects/KRingBuffer.h"
+#include "kernel/objects/KSpinLock.h"
 
+#define UART_COM1_PORT		0x3F8
+#define UART_COM1_IRQ		4
+#define UART_CLOCK			115200 //Baud at divisor 1
+#define UART_FIFO_DEPTH		16
+#define UART_TX_BUFFER		0x2000
+
+//16550 compatible serial port. Transmit is a non-blocking enqueue into a ring the THR empty interrupt drains
+//a FIFO worth at a time. Bytes are dropped when the ring is full.
+class HAL;
 class UartDriver : public Driver, public StringPrinter
 {
 
 public:
-	UartDriver(Device& device);
+	UartDriver(HAL* hal, const uint16_t port = UART_COM1_PORT, const uint8_t irq = UART_COM1_IRQ);
+
+	DriverResult Activate() override;
+	DriverResult Deactivate() override;
+	DriverResult Initialize() override;
+	DriverResult Reset() override;
 
-	const std::string GetCompatHID() override;
-	Driver* CreateInstance(Device* device) override;
-	Result Initialize() override;
-	Result Read(char* buffer, size_t length, size_t* bytesRead = nullptr) override;
-	Result Write(const char* buffer, size_t length) override;
-	Result EnumerateChildren() override;
+	std::string get_vendor_name() override;
+	std::string get_device_name() override;
+	DeviceType get_device_type() override;
 
+	bool IsPresent() const { return m_present; }
+
+	//Non-blocking, safe from any context
+	size_t Read(char* buffer, size_t length);
+	void Write(const char* buffer, size_t length);
 	void Write(const std::string& string) override;
 
-	static void OnInterrupt(void* arg) { ((UartDriver*)arg)->OnInterrupt(); };
+	//Spins until everything queued went out on the wire, for measurements
+	void Flush();
+	bool IsIdle();
+	//Bugcheck, another CPU may hold m_txLock for good. Drains the ring without it, later writes are polled.
+	void EnterPolledMode();
+
+	//Waits for the transmitter to go idle first, a divisor change mid byte garbles it
+	void SetBaudRate(const uint32_t baud);
+	uint32_t GetBaudRate() const { return m_baud; }
+
+	void Display() const;
+	void ResetStats();
+	uint64_t BytesQueued() const { return m_txQueued; }
+	uint64_t BytesSent() const { return m_txSent; }
+	uint64_t BytesDropped() const { return m_txDropped; }
+
+	static uint32_t OnInterrupt(void* arg);
 
 private:
 	enum class Reg
@@ -123,7 +156,7 @@ private:
 		Five = 0b00,
 		Six = 0b01,
 		Seven = 0b10,
-		Eight = 0b00
+		Eight = 0b11
 	};
 
 	struct LineControlReg
@@ -203,12 +236,32 @@ private:
 	};
 	static_assert(sizeof(ModemStatusReg) == sizeof(uint8_t));
 
-	void OnInterrupt();
+	void HandleInterrupt();
+	void FillFifo();
+	void DrainTransmitter();
+	void WritePolled(const uint8_t c);
 	uint8_t Read(Reg reg);
 	void Write(Reg reg, uint8_t value);
 
+	HAL* m_HAL;
 	uint16_t m_port;
-	size_t m_index;
+	uint8_t m_irq;
+	uint32_t m_baud;
+	bool m_present;
+
+	KSpinLock m_rxLock;
 	KRingBuffer<uint8_t, 0x100> m_rxBuffer;
 
+	//Held with interrupts disabled, nothing in here may Printf
+	KSpinLock m_txLock;
+	KRingBuffer<uint8_t, UART_TX_BUFFER> m_txBuffer;
+	bool m_txBusy; //A burst is in the FIFO, THR empty interrupt refills
+	volatile bool m_polled; //Bugcheck, no ring and no lock anymore
+
+	//Stats
+	uint64_t m_txQueued;
+	uint64_t m_txSent;
+	uint64_t m_txBursts;
+	uint64_t m_txDropped;
+	uint64_t m_rxDropped;
 };
\ No newline at end of file
@@ -23,7 +23,7 @@ uint32_t OnTimer0Interrupt(void* arg)
 }
 
 Clock::Clock(HAL* hal)
-: m_HAL(hal), Driver(nullptr)
+: m_HAL(hal), Driver(nullptr), m_tickDpc(Clock::OnTickDpc, this)
 {
 }
 
@@ -31,10 +31,23 @@ void Clock::OnAPICTimerTick()
 {
 	// Increment the number of ticks and decrement the number of ticks until the next event
 	m_ticks++;
+	m_lastTickTsc = __rdtsc();
 	
-	for(auto handler = m_Handlers->begin(); handler != m_Handlers->end(); handler++)
-		(*handler)->onTimerTick(m_ticks);
+	// Handlers (scheduler accounting etc.) run deferred
+	m_HAL->QueueDpc(m_tickDpc);
+}
 
+void Clock::OnTickDpc(void* context)
+{
+	Clock* clock = (Clock*)context;
+
+	// Catch up one tick at a time if the DPC was delayed
+	while (clock->m_handledTicks < clock->m_ticks)
+	{
+		clock->m_handledTicks++;
+		for(auto handler = clock->m_Handlers->begin(); handler != clock->m_Handlers->end(); handler++)
+			(*handler)->onTimerTick(clock->m_handledTicks);
+	}
 }
 
 
@@ -127,7 +140,23 @@ Time Clock::get_time()
 
 void Clock::RegisterTickHandler(TickEventHandler* handler)
 {
+	const cpu_flags_t flags = SaveAndDisableInterrupts();
 	m_Handlers->push_back(handler);
+	RestoreInterrupts(flags);
+}
+
+void Clock::UnregisterTickHandler(TickEventHandler* handler)
+{
+	const cpu_flags_t flags = SaveAndDisableInterrupts();
+	for (auto it = m_Handlers->begin(); it != m_Handlers->end(); it++)
+	{
+		if (*it == handler)
+		{
+			m_Handlers->erase(it);
+			break;
+		}
+	}
+	RestoreInterrupts(flags);
 }
 
 uint8_t Clock::ReadRTC(uint8_t addr)
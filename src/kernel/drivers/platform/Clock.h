@@ -2,6 +2,7 @@
 
 #include "kernel/drivers/Driver.h"
 #include "kernel/time.h"
+#include "kernel/hal/Dpc.h"
 #include <vector>
 
 class TickEventHandler
@@ -33,17 +34,26 @@ public:
 	void delay(uint32_t milliseconds);
 	Time get_time();
 
+	//Handlers run from a DPC, not in the ISR
 	void RegisterTickHandler(TickEventHandler* handler);
+	void UnregisterTickHandler(TickEventHandler* handler);
 
 	const uint64_t GetTicks() const { return m_ticks; }
+	//TSC of the last tick, for time left until the next one
+	const uint64_t GetLastTickTsc() const { return m_lastTickTsc; }
 
 private:
 
+	static void OnTickDpc(void* context);
+
 	uint8_t ReadRTC(uint8_t addr);
 
 	uint8_t binary_representation(uint8_t number);
 
 	uint64_t m_ticks{ 0 };
+	uint64_t m_handledTicks{ 0 }; //Ticks the handlers have seen
+	uint64_t m_lastTickTsc{ 0 };
+	KDpc m_tickDpc;
 	HAL* m_HAL;
 
 	bool m_binary;
@@ -0,0 +1,266 @@
+#include "CpuIdle.h"
+#include "HAL.h"
+#include "x64\x64.h"
+#include <Assert.h>
+#include <intrin.h>
+#include <cstring>
+
+//CPUID.05h:ECX, MWAIT extensions
+#define MWAIT_ECX_EXTENSIONS		(1 << 0)
+#define MWAIT_ECX_INTERRUPT_BREAK	(1 << 1)
+//CPUID.06h:EAX, APIC timer keeps running in deep C-states
+#define PM_EAX_ARAT					(1 << 2)
+
+//MWAIT ECX, wake on an interrupt even with IF clear
+#define MWAIT_BREAK_ON_INTERRUPT	(1 << 0)
+
+#pragma pack(push, 1)
+//Generic Register Descriptor resource as found in the buffer of a _CST entry
+struct CstRegister
+{
+	uint8_t Descriptor;
+	uint16_t Length;
+	uint8_t SpaceId;
+	uint8_t BitWidth;
+	uint8_t BitOffset;
+	uint8_t AccessSize;
+	uint64_t Address;
+};
+#pragma pack(pop)
+
+CpuIdle::CpuIdle(HAL* hal) :
+	m_hal(hal),
+	m_states(),
+	m_count(),
+	m_maxState(IDLE_MAX_STATES),
+	m_breakOnMasked(),
+	m_timerStops(),
+	m_flagWakeups(),
+	m_interruptWakeups(),
+	m_wakeupCycles(),
+	m_maxWakeupCycles()
+{
+
+}
+
+void CpuIdle::Initialize()
+{
+	int regs[4];
+	const bool hasMwait = x64::HasECXFeature(ECX_MONITOR);
+	if (hasMwait)
+	{
+		__cpuid(regs, 0x05);
+		m_breakOnMasked = (regs[2] & MWAIT_ECX_EXTENSIONS) && (regs[2] & MWAIT_ECX_INTERRUPT_BREAK);
+	}
+
+	__cpuid(regs, 0);
+	const bool hasPm = regs[0] >= 0x06;
+	if (hasPm)
+		__cpuid(regs, 0x06);
+	m_timerStops = !hasPm || !(regs[0] & PM_EAX_ARAT);
+
+	//Processor objects are either Processor() declarations or ACPI0007 devices
+	ACPI_HANDLE processor = nullptr;
+	AcpiWalkNamespace(ACPI_TYPE_PROCESSOR, ACPI_ROOT_OBJECT, ACPI_UINT32_MAX, CpuIdle::OnProcessor, nullptr, nullptr, &processor);
+	if (!processor)
+		AcpiGetDevices("ACPI0007", CpuIdle::OnProcessor, nullptr, &processor);
+
+	if (!processor || !ParseCst(processor))
+	{
+		//C1 is always there
+		m_count = 0;
+		if (hasMwait && m_breakOnMasked)
+			AddState(IdleEntry::Mwait, 1, 0, 1);
+		else
+			AddState(IdleEntry::Halt, 1, 0, 1);
+	}
+
+	Printf("CpuIdle: %d states from %s, MWAIT %s, APIC timer %s in deep states\r\n", m_count, m_count > 1 ? "_CST" : "defaults",
+		hasMwait ? (m_breakOnMasked ? "yes" : "no interrupt break") : "no", m_timerStops ? "stops" : "runs");
+	for (size_t i = 0; i < m_count; i++)
+		Printf("    %s: type %d, %s 0x%x, exit latency %d us\r\n", m_states[i].Name, m_states[i].Type,
+			m_states[i].Entry == IdleEntry::Mwait ? "mwait" : (m_states[i].Entry == IdleEntry::IoPort ? "port" : "hlt"), m_states[i].Hint, m_states[i].ExitLatency);
+}
+
+ACPI_STATUS CpuIdle::OnProcessor(ACPI_HANDLE object, UINT32 level, void* context, void** returnValue)
+{
+	*returnValue = object;
+	return AE_CTRL_TERMINATE;
+}
+
+bool CpuIdle::ParseCst(ACPI_HANDLE processor)
+{
+	ACPI_BUFFER result = { ACPI_ALLOCATE_BUFFER, nullptr };
+	if (ACPI_FAILURE(AcpiEvaluateObjectTyped(processor, "_CST", nullptr, &result, ACPI_TYPE_PACKAGE)))
+		return false;
+
+	//Package { Count, Package { Register, Type, Latency, Power }, ... }
+	const ACPI_OBJECT* cst = (ACPI_OBJECT*)result.Pointer;
+	for (UINT32 i = 1; i < cst->Package.Count && m_count < IDLE_MAX_STATES; i++)
+	{
+		const ACPI_OBJECT& entry = cst->Package.Elements[i];
+		if (entry.Type != ACPI_TYPE_PACKAGE || entry.Package.Count < 4)
+			continue;
+
+		const ACPI_OBJECT* fields = entry.Package.Elements;
+		if (fields[0].Type != ACPI_TYPE_BUFFER || fields[0].Buffer.Length < sizeof(CstRegister)
+			|| fields[1].Type != ACPI_TYPE_INTEGER || fields[2].Type != ACPI_TYPE_INTEGER)
+			continue;
+
+		const CstRegister* reg = (CstRegister*)fields[0].Buffer.Pointer;
+		const uint8_t type = (uint8_t)fields[1].Integer.Value;
+		const uint32_t latency = (uint32_t)fields[2].Integer.Value;
+		if (type == 0 || type > 3)
+			continue;
+
+		//Without ARAT the tick would be lost
+		if (type > 2 && m_timerStops)
+			continue;
+
+		if (reg->SpaceId == ACPI_ADR_SPACE_FIXED_HARDWARE)
+		{
+			if (!x64::HasECXFeature(ECX_MONITOR) || !m_breakOnMasked)
+				continue;
+			AddState(IdleEntry::Mwait, type, (uint32_t)reg->Address, latency);
+		}
+		else if (reg->SpaceId == ACPI_ADR_SPACE_SYSTEM_IO)
+		{
+			//C1 is HLT by definition, C3 by port would need bus master arbitration which we don't do
+			if (type == 1)
+				AddState(IdleEntry::Halt, type, 0, latency);
+			else if (type == 2)
+				AddState(IdleEntry::IoPort, type, (uint32_t)reg->Address, latency);
+		}
+	}
+
+	AcpiOsFree(result.Pointer);
+	return m_count != 0;
+}
+
+void CpuIdle::AddState(const IdleEntry entry, const uint8_t type, const uint32_t hint, const uint32_t latency)
+{
+	AssertOp(m_count, <, IDLE_MAX_STATES);
+	IdleState& state = m_states[m_count];
+	state.Name[0] = 'C';
+	state.Name[1] = '0' + (char)(m_count + 1);
+	state.Name[2] = '\0';
+	state.Entry = entry;
+	state.Type = type;
+	state.Hint = hint;
+	state.ExitLatency = latency;
+	m_count++;
+}
+
+IdleState& CpuIdle::Select(const nano_t predicted)
+{
+	//_CST is ordered by depth
+	size_t index = 0;
+	for (size_t i = 1; i < m_count && i <= m_maxState; i++)
+	{
+		if ((nano_t)m_states[i].ExitLatency * 1000 * IDLE_LATENCY_FACTOR > predicted)
+			break;
+		index = i;
+	}
+	return m_states[index];
+}
+
+bool CpuIdle::Enter(const IdleState& state, const volatile bool* flag)
+{
+	bool flagged = false;
+
+	_disable();
+	switch (state.Entry)
+	{
+	case IdleEntry::Mwait:
+		//Arm before checking, a store in between still ends the MWAIT
+		_mm_monitor((const void*)flag, 0, 0);
+		if (!*flag)
+			_mm_mwait(MWAIT_BREAK_ON_INTERRUPT, state.Hint);
+		flagged = *flag;
+		_enable();
+		break;
+
+	case IdleEntry::IoPort:
+		//Chipset enters the state on the read and leaves it on the next interrupt
+		if (!*flag)
+			m_hal->ReadPort(state.Hint, 8);
+		flagged = *flag;
+		_enable();
+		break;
+
+	default:
+		if (*flag)
+		{
+			flagged = true;
+			_enable();
+		}
+		else
+		{
+			//STI holds off interrupts for one instruction, nothing gets between it and HLT
+			_enable();
+			__halt();
+		}
+		break;
+	}
+
+	return flagged;
+}
+
+void CpuIdle::Account(IdleState& state, const uint64_t residency, const bool flagged)
+{
+	state.Entries++;
+	state.Residency += residency;
+	if (!flagged)
+		m_interruptWakeups++;
+}
+
+void CpuIdle::RecordWakeup(const uint64_t cycles)
+{
+	m_flagWakeups++;
+	m_wakeupCycles += cycles;
+	if (cycles > m_maxWakeupCycles)
+		m_maxWakeupCycles = cycles;
+}
+
+void CpuIdle::SetMaxState(const size_t index)
+{
+	m_maxState = index;
+}
+
+uint64_t CpuIdle::TotalResidency() const
+{
+	uint64_t residency = 0;
+	for (size_t i = 0; i < m_count; i++)
+		residency += m_states[i].Residency;
+	return residency;
+}
+
+void CpuIdle::Display() const
+{
+	Printf("CpuIdle: %d interrupt wakeups, %d flag wakeups", m_interruptWakeups, m_flagWakeups);
+	if (m_flagWakeups != 0 && x64::TSCFreq != 0)
+		Printf(", wakeup latency avg %d cycles, max %d us", m_wakeupCycles / m_flagWakeups, m_maxWakeupCycles / x64::TSCFreq);
+	Printf("\r\n");
+
+	for (size_t i = 0; i < m_count; i++)
+	{
+		const IdleState& state = m_states[i];
+		const uint64_t residency = x64::TSCFreq != 0 ? state.Residency / x64::TSCFreq : 0;
+		Printf("    %s: %d entries, %d us resident, avg %d us\r\n", state.Name, state.Entries, residency,
+			state.Entries != 0 ? residency / state.Entries : 0);
+	}
+}
+
+void CpuIdle::ResetStats()
+{
+	for (size_t i = 0; i < m_count; i++)
+	{
+		m_states[i].Entries = 0;
+		m_states[i].Residency = 0;
+	}
+
+	m_flagWakeups = 0;
+	m_interruptWakeups = 0;
+	m_wakeupCycles = 0;
+	m_maxWakeupCycles = 0;
+}
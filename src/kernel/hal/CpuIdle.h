@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstdint>
+#include <os.internal.h>
+#include "kernel/os/Time.h"
+
+extern "C"
+{
+#include <acpi.h>
+}
+
+#define IDLE_MAX_STATES		8
+
+//Only enter a state if the predicted idle time covers its exit latency this many times
+#define IDLE_LATENCY_FACTOR	3
+
+enum class IdleEntry : uint8_t
+{
+	Halt,
+	Mwait,	//Monitors the wakeup flag, a store to it wakes the CPU without an IPI
+	IoPort	//Chipset C-state, entered by reading the port
+};
+
+struct IdleState
+{
+	char Name[8];
+	IdleEntry Entry;
+	uint8_t Type; //ACPI C-state type, 1-3
+	uint32_t Hint; //MWAIT hint or I/O port
+	uint32_t ExitLatency; //Microseconds
+
+	//Stats
+	uint64_t Entries;
+	uint64_t Residency; //Cycles
+};
+
+//C-states of the processor from ACPI _CST, C1 if there is none. All CPUs share the table of the first processor object.
+class HAL;
+class CpuIdle
+{
+public:
+	CpuIdle(HAL* hal);
+
+	//Needs the ACPI namespace loaded
+	void Initialize();
+
+	//Deepest state worth entering for the predicted idle time, never deeper than the limit
+	IdleState& Select(const nano_t predicted);
+
+	//Sleeps until an interrupt arrives or, for MWAIT states, flag gets set. Returns true if the flag ended the sleep.
+	//An interrupt that ends it is handled before this returns, possibly with other threads run in between.
+	bool Enter(const IdleState& state, const volatile bool* flag);
+
+	//Residency in cycles up to the wakeup
+	void Account(IdleState& state, const uint64_t residency, const bool flagged);
+	//Flag set by another CPU to this CPU running again
+	void RecordWakeup(const uint64_t cycles);
+
+	//Caps state selection, 0 only ever uses C1. For latency comparisons.
+	void SetMaxState(const size_t index);
+	size_t StateCount() const { return m_count; }
+	//Cycles spent in all states since the last ResetStats
+	uint64_t TotalResidency() const;
+
+	void Display() const;
+	void ResetStats();
+
+private:
+	static ACPI_STATUS OnProcessor(ACPI_HANDLE object, UINT32 level, void* context, void** returnValue);
+	bool ParseCst(ACPI_HANDLE processor);
+	void AddState(const IdleEntry entry, const uint8_t type, const uint32_t hint, const uint32_t latency);
+
+	HAL* m_hal;
+	IdleState m_states[IDLE_MAX_STATES];
+	size_t m_count;
+	size_t m_maxState;
+	bool m_breakOnMasked; //MWAIT can wake on an interrupt while they are disabled
+	bool m_timerStops; //No always running APIC timer, C3 and deeper would lose the tick
+
+	//Stats
+	uint64_t m_flagWakeups;
+	uint64_t m_interruptWakeups;
+	uint64_t m_wakeupCycles; //Flag set to thread running again
+	uint64_t m_maxWakeupCycles;
+
+	::NO_COPY_OR_ASSIGN(CpuIdle);
+};
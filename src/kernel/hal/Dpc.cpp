@@ -0,0 +1,104 @@
+#include "Dpc.h"
+#include <Assert.h>
+#include <intrin.h>
+#include "kernel/hal/x64/x64.h"
+
+DpcQueue::DpcQueue() :
+	m_lock(),
+	m_head(),
+	m_tail(),
+	m_draining(),
+	m_inserted(),
+	m_executed(),
+	m_totalLatency(),
+	m_maxLatency(),
+	m_maxRuntime()
+{
+
+}
+
+bool DpcQueue::Insert(KDpc& dpc)
+{
+	Assert(dpc.Routine);
+	KLockGuard<KSpinLock> guard(m_lock);
+
+	if (dpc.m_queued)
+		return false;
+
+	dpc.m_queued = true;
+	dpc.m_queuedAt = __rdtsc();
+	dpc.m_next = nullptr;
+	if (m_tail)
+		m_tail->m_next = &dpc;
+	else
+		m_head = &dpc;
+	m_tail = &dpc;
+
+	m_inserted++;
+	return true;
+}
+
+size_t DpcQueue::Drain(const size_t budget)
+{
+	m_draining = true;
+
+	size_t count = 0;
+	while (count < budget)
+	{
+		KDpc* dpc = Pop();
+		if (!dpc)
+			break;
+
+		const uint64_t start = __rdtsc();
+		const uint64_t latency = start - dpc->m_queuedAt;
+		dpc->Routine(dpc->Context);
+		const uint64_t runtime = __rdtsc() - start;
+
+		m_executed++;
+		m_totalLatency += latency;
+		if (latency > m_maxLatency)
+			m_maxLatency = latency;
+		if (runtime > m_maxRuntime)
+			m_maxRuntime = runtime;
+
+		count++;
+	}
+
+	m_draining = false;
+	return count;
+}
+
+KDpc* DpcQueue::Pop()
+{
+	KLockGuard<KSpinLock> guard(m_lock);
+
+	KDpc* dpc = m_head;
+	if (!dpc)
+		return nullptr;
+
+	m_head = dpc->m_next;
+	if (!m_head)
+		m_tail = nullptr;
+
+	//Clear before running so the routine, or an ISR, may queue it again
+	dpc->m_next = nullptr;
+	dpc->m_queued = false;
+	return dpc;
+}
+
+void DpcQueue::ResetStats()
+{
+	m_inserted = 0;
+	m_executed = 0;
+	m_totalLatency = 0;
+	m_maxLatency = 0;
+	m_maxRuntime = 0;
+}
+
+void DpcQueue::Display() const
+{
+	Printf("DPC: queued %d, executed %d\n", m_inserted, m_executed);
+	if (m_executed != 0 && x64::TSCFreq != 0)
+		Printf("    Latency: avg %d us, max %d us, longest routine %d us\n",
+			(m_totalLatency / m_executed) / x64::TSCFreq, m_maxLatency / x64::TSCFreq, m_maxRuntime / x64::TSCFreq);
+}
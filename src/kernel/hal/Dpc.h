@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <os.internal.h>
+#include "kernel/objects/KSpinLock.h"
+
+typedef void(*DpcRoutine)(void* context);
+
+//Deferred procedure call. ISRs acknowledge the hardware and queue one of these, the routine
+//runs later at interrupt exit with interrupts enabled, or in the DPC thread if the exit budget ran out.
+//Embed it in the owning object, queuing never allocates. Routines must not block.
+class KDpc
+{
+	friend class DpcQueue;
+public:
+	KDpc(DpcRoutine routine = nullptr, void* context = nullptr) :
+		Routine(routine),
+		Context(context),
+		m_next(),
+		m_queued(),
+		m_queuedAt()
+	{
+
+	}
+
+	bool IsQueued() const { return m_queued; }
+
+	DpcRoutine Routine;
+	void* Context;
+
+private:
+	KDpc* m_next;
+	volatile bool m_queued;
+	uint64_t m_queuedAt; //TSC
+};
+
+//FIFO of pending DPCs for one CPU
+class DpcQueue
+{
+public:
+	DpcQueue();
+
+	//Safe from any context. Returns false if dpc was already pending, it will still run once.
+	bool Insert(KDpc& dpc);
+
+	//Runs up to budget DPCs with the caller's interrupt state, returns how many ran
+	size_t Drain(const size_t budget);
+
+	bool IsEmpty() const { return m_head == nullptr; }
+	bool IsDraining() const { return m_draining; }
+
+	void ResetStats();
+	void Display() const;
+
+private:
+	KDpc* Pop();
+
+	KSpinLock m_lock;
+	KDpc* m_head;
+	KDpc* m_tail;
+	volatile bool m_draining;
+
+	//Stats, cycles
+	uint64_t m_inserted;
+	uint64_t m_executed;
+	uint64_t m_totalLatency;
+	uint64_t m_maxLatency;
+	uint64_t m_maxRuntime;
+
+	::NO_COPY_OR_ASSIGN(DpcQueue);
+};
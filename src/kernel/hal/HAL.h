@@ -2,10 +2,15 @@
 #include "os.System.h"
 #include <map>
 #include "Interrupt.h"
+#include "Dpc.h"
+#include "Ipi.h"
+#include "CpuIdle.h"
+#include "kernel/objects/KEvent.h"
 #include "devices/acpi/ACPI.h"
 #include "devices/apic/APIC.h"
 #include "devices\CPU.h"
 #include "devices\SMBios.h"
+#include "devices\HPET.h"
 #include "devices\pci\PCIBus.h"
 #include "kernel\drivers\platform\Clock.h"
 #include <kernel\drivers\DriverManager.h>
@@ -28,6 +33,7 @@ struct CPU_CONTEXT
 
 
 class Device;
+class UartDriver;
 class HAL
 {
 public:
@@ -38,10 +44,22 @@ public:
 	void SetupPaging(paddr_t root);
 	void Wait();
 
+	//Idle loop body. Sleeps in the deepest C-state worth it for the predicted time, runs the reschedule handler
+	//if another CPU asked for it through WakeCpu.
+	void Idle(const nano_t predicted);
+	//Makes cpu reschedule. An MWAIT idle CPU only needs the store to its flag, anything else gets an IPI.
+	void WakeCpu(uint8_t cpu);
+	CpuIdle* GetCpuIdle() { return &m_idle; }
+
 	void HandleInterrupt(uint8_t vector, INTERRUPT_FRAME* frame);
 
+	//Replaces all handlers of vector
 	void RegisterInterrupt(uint8_t vector, InterruptContext context);
 	void UnRegisterInterrupt(uint8_t vector);
+	//Share a vector between devices, every handler in the chain runs on each interrupt
+	void AddInterruptHandler(uint8_t vector, InterruptContext context);
+	void RemoveInterruptHandler(uint8_t vector, InterruptContext context);
+	void DisplayInterrupts();
 
 	void SetInterruptStack(void* stack);
 
@@ -56,6 +74,7 @@ public:
 	uint64_t ReadMSR(uint32_t port);
 
 	ACPI* GetACPI() { return &m_ACPI; }
+	APIC* GetAPIC() { return &m_APIC; }
 
 	void RegisterCPU(uint8_t id);
 
@@ -64,19 +83,49 @@ public:
 
 	void RegisterVideoDevice(VideoDevice* dev);
 	VideoDevice* GetVideoDevice();
+	UartDriver* GetSerial() { return m_serial; }
 
 	void ActivateDrivers();
 
 	void SetInterruptRedirect(const interrupt_redirect_t* redirectStruct);
 
+	//Inter processor interrupts, cpu is the local APIC ID as returned by CurrentCPU
+	void SendIpi(uint8_t cpu, uint8_t vector);
+	void BroadcastIpi(uint8_t vector); //All CPUs except the current one
+	void SelfIpi(uint8_t vector);
+
+	//Runs routine on every online CPU in cpus (bit per APIC ID) with interrupts disabled, including this one
+	//if it is in the set. Returns when all of them are done, so context may live on the caller's stack.
+	void CallCpus(uint64_t cpus, IpiRoutine routine, void* context);
+	uint64_t GetOnlineCpus() const { return m_onlineCpus; }
+
+	//Dedicated vectors for message signalled interrupts, 0 if none are left
+	uint8_t AllocateVector();
+	void FreeVector(uint8_t vector);
+
 	Clock* GetClock() { return &m_Clock; }
 
+	HPET* GetHPET() { return &m_HPET; }
+
 	PCIBus* GetPCIController() { return &m_PCI; }
 
 	size_t StackReserve();
 
 	int EOIPending();
 	void EOI();
+
+	// Deferred procedure calls, see Dpc.h
+	bool QueueDpc(KDpc& dpc);
+	void DrainDpcs(); //Called by the DPC thread
+	KEvent& GetDpcEvent();
+	//Run DPCs inside the ISR with interrupts disabled, the old behaviour. Only for latency comparisons.
+	void SetDpcInline(bool inlined) { m_dpcInline = inlined; }
+	void DisplayInterruptStats();
+	void ResetInterruptStats();
+
+	//Handler is called at the outermost interrupt exit after DPCs ran, if requested since the last exit
+	void SetRescheduleHandler(InterruptContext handler) { m_rescheduleHandler = handler; }
+	void RequestReschedule();
 	// Context handling
 
 	void InitContext(void* context, void* const entry, void* const stack);
@@ -84,15 +133,91 @@ public:
 	bool LoadContext(void* context);
 	void SetUserCpuContext(void* teb);
 
+	// Extended FPU/SIMD state, saved separately from the integer context
+	size_t SimdContextSize();
+	void SimdInitContext(void* context);
+	void SimdSaveContext(void* context);
+	void SimdRestoreContext(void* context);
+	void SimdSetTrap(bool trap); //Fault on next FPU/SIMD instruction
+
 	DriverManager* driverManager;
 
 private:
-	
+	void CalibrateTSC();
+	struct InterruptCpu;
+	void OnInterruptExit(InterruptCpu& cpu, const uint64_t start, const uint64_t dispatch);
+	static uint32_t OnIpiCall(void* arg);
+	void DrainMailbox(IpiMailbox& mailbox);
+
+	//Per CPU interrupt exit state
+	struct InterruptCpu
+	{
+		InterruptCpu() :
+			Dpcs(),
+			Mailbox(),
+			DpcEvent(false, false),
+			Reschedule(),
+			ExitDraining(),
+			Monitoring(),
+			WakeRequested(),
+			LastInterrupt(),
+			MaxIsrCycles(),
+			Interrupts(),
+			DispatchCycles(),
+			VectorCounts()
+		{}
+
+		DpcQueue Dpcs;
+		IpiMailbox Mailbox;
+		KEvent DpcEvent;
+		volatile bool Reschedule;
+		bool ExitDraining; //Dpcs is drained by an interrupt exit, which reschedules once it's done
+		volatile bool Monitoring; //In MWAIT on Reschedule
+		volatile uint64_t WakeRequested; //TSC of the WakeCpu store
+		uint64_t LastInterrupt; //TSC at entry, ends an idle period
+		uint64_t MaxIsrCycles; //Longest handler + EOI with interrupts disabled
+		uint64_t Interrupts;
+		uint64_t DispatchCycles; //Entry to first handler
+		uint64_t VectorCounts[256];
+	};
+
+	struct InterruptHandlerEntry
+	{
+		InterruptContext Context;
+		InterruptHandlerEntry* volatile Next;
+		InterruptHandlerEntry* Retired;
+
+		//Stats
+		uint64_t Count;
+		uint64_t Cycles;
+		uint64_t MaxCycles;
+	};
+
+	//Runs the reschedule handler if one was requested, interrupts disabled
+	void HonorReschedule(InterruptCpu& cpu);
+
+	void RetireHandlers(InterruptHandlerEntry* entry);
+	//Called where this CPU can't be walking a handler chain, frees the batch once every CPU passed
+	void QuiesceHandlers();
+
 
 	//Interrupts
-	std::map<uint8_t, InterruptContext>* m_interruptHandlers;
+	//Flat dispatch table. ISRs walk the chains without locking, writers publish with single pointer stores
+	//under m_vectorLock. Unlinked entries collect on m_retired, move to m_retiring as a batch and are freed once
+	//every CPU online at that point went through an interrupt exit or idle, so no walk can still see them.
+	InterruptHandlerEntry* volatile m_vectors[256];
+	KSpinLock m_vectorLock;
+	InterruptHandlerEntry* volatile m_retired;
+	InterruptHandlerEntry* m_retiring;
+	volatile uint64_t m_retiringCpus; //Bit per APIC ID that still has to pass a quiescent point
+	uint64_t m_allocatedVectors; //Bit per vector from MSI_BASE
+	uint64_t m_onlineCpus; //Bit per APIC ID, APs add themselves once they are started
+	InterruptCpu m_interruptCpus[MAX_CPUS];
+	InterruptContext m_rescheduleHandler;
+	bool m_dpcInline;
 	ACPI m_ACPI;
 	APIC m_APIC;
+	CpuIdle m_idle;
 
 	CPU* m_CPUS[MAX_CPUS];
 	uint8_t m_NumCPUs;
@@ -102,9 +227,12 @@ private:
 
 	PCIBus m_PCI;
 
+	HPET m_HPET;
+
 	ConfigTables* m_ConfigTables;
 
 	//assume we always have a RTC (TODO: add check)
 	Clock m_Clock;
 	VideoDevice* m_VideoDevice;
+	UartDriver* m_serial;
 };
\ No newline at end of file
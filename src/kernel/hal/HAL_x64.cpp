@@ -4,11 +4,13 @@
 #if defined(PLATFORM_X64)
 #include "x64\x64.h"
 #include <intrin.h>
+#include <limits>
 #include "x64\interrupt.h"
 #include "kernel\kernel.h"
 #include "kernel\hal\devices\apic\APIC.h"
 #include <kernel\drivers\io\KeyboardDriver.h>
 #include <kernel\drivers\io\MouseDriver.h>
+#include <kernel\drivers\io\UartDriver.h>
 
 //defined in context.asm
 extern "C" extern bool _x64_save_context(void* context);
@@ -16,11 +18,18 @@ extern "C" extern void _x64_init_context(void* context, void* const entry, void*
 extern "C" extern __declspec(noreturn) bool _x64_load_context(void* context);
 extern "C" extern __declspec(noreturn) void _x64_user_thread_start(void* context, void* teb);
 
+#define TSC_CALIBRATION_TIME	(2 * 1000 * 1000) //2ms
+
+//DPCs run at interrupt exit before handing the rest to the DPC thread
+#define DPC_EXIT_BUDGET			16
+
 
 
 HAL::HAL(ConfigTables* configTables)
 : m_ACPI(this, configTables), m_APIC(this), m_NumCPUs(0), m_ConfigTables(configTables),
-	m_PCI(this), m_Clock(this), m_VideoDevice(nullptr)
+	m_PCI(this), m_HPET(this), m_Clock(this), m_VideoDevice(nullptr), m_serial(nullptr), m_idle(this),
+	m_vectors(), m_vectorLock("Interrupts"), m_retired(), m_retiring(), m_retiringCpus(), m_allocatedVectors(), m_onlineCpus(),
+	m_rescheduleHandler({ nullptr, nullptr }), m_dpcInline(false)
 {
 }
 
@@ -28,8 +37,6 @@ void HAL::initialize()
 {
 	x64::InitSIMD();
 	x64::SetupDescriptorTables();
-
-	m_interruptHandlers = new std::map<uint8_t, InterruptContext>();
 }
 
 void HAL::SetupPaging(paddr_t root)
@@ -46,6 +53,61 @@ void HAL::Wait()
 	__halt();
 }
 
+void HAL::Idle(const nano_t predicted)
+{
+	InterruptCpu& cpu = m_interruptCpus[CurrentCPU()];
+	IdleState& state = m_idle.Select(predicted);
+
+	//Pairs with the fence in WakeCpu, either we see the flag or the waker sees us monitoring
+	cpu.Monitoring = state.Entry == IdleEntry::Mwait;
+	_mm_mfence();
+
+	const uint64_t start = __rdtsc();
+	const bool flagged = m_idle.Enter(state, &cpu.Reschedule);
+	cpu.Monitoring = false;
+
+	const uint64_t end = cpu.LastInterrupt > start ? cpu.LastInterrupt : __rdtsc();
+	m_idle.Account(state, end - start, flagged);
+
+	//No interrupt exit will pick this up, do what it would have done
+	const cpu_flags_t flags = SaveAndDisableInterrupts();
+	if (cpu.WakeRequested != 0)
+	{
+		if (flagged)
+			m_idle.RecordWakeup(__rdtsc() - cpu.WakeRequested);
+		cpu.WakeRequested = 0;
+	}
+
+	//Not inside any handler walk here
+	QuiesceHandlers();
+
+	if (cpu.Reschedule && m_rescheduleHandler.Handler)
+	{
+		cpu.Reschedule = false;
+		m_rescheduleHandler.Handler(m_rescheduleHandler.Context);
+	}
+	RestoreInterrupts(flags);
+}
+
+void HAL::WakeCpu(uint8_t cpu)
+{
+	AssertOp(cpu, <, MAX_CPUS);
+	InterruptCpu& target = m_interruptCpus[cpu];
+	if (cpu == CurrentCPU())
+	{
+		target.Reschedule = true;
+		return;
+	}
+
+	target.WakeRequested = __rdtsc();
+	target.Reschedule = true;
+	_mm_mfence();
+
+	//Any vector ends a HLT, the IPI handler has nothing to do and the exit reschedules
+	if (!target.Monitoring)
+		SendIpi(cpu, (uint8_t)X64_INTERRUPT_VECTOR::IpiCall);
+}
+
 bool HAL::SaveContext(void* context)
 {
 	return _x64_save_context(context);
@@ -181,12 +243,34 @@ void HAL::HandleInterrupt(uint8_t vector, INTERRUPT_FRAME* frame)
 		//return;
 	}
 	if (vector > 32) m_APIC.GetLocalAPIC()->NotifyEOIRequired(vector);
-	const auto& it = m_interruptHandlers->find(vector);
-	if (it != m_interruptHandlers->end())
+	const uint64_t start = __rdtsc();
+	InterruptHandlerEntry* entry = m_vectors[vector];
+	if (entry)
 	{
-		InterruptContext ctx = it->second;
-		ctx.Handler(ctx.Context);
+		InterruptCpu& cpu = m_interruptCpus[CurrentCPU()];
+		cpu.VectorCounts[vector]++;
+		const uint64_t dispatched = __rdtsc();
+
+		uint64_t handlerStart = dispatched;
+		while (entry)
+		{
+			//Handlers may (un)register, entries they unlink stay valid until the exit
+			InterruptHandlerEntry* next = entry->Next;
+			entry->Context.Handler(entry->Context.Context);
+
+			const uint64_t end = __rdtsc();
+			const uint64_t cycles = end - handlerStart;
+			entry->Count++;
+			entry->Cycles += cycles;
+			if (cycles > entry->MaxCycles)
+				entry->MaxCycles = cycles;
+
+			handlerStart = end;
+			entry = next;
+		}
+
 		EOI(); 
+		if (vector > 32) OnInterruptExit(cpu, start, dispatched - start);
 		return;
 	}
 
@@ -197,19 +281,279 @@ void HAL::HandleInterrupt(uint8_t vector, INTERRUPT_FRAME* frame)
 		return;
 	}
 
+	//Not present pages of file mappings are filled from the page cache
+	if (x64Vector == X64_INTERRUPT_VECTOR::PageFault && kernel.VFS() &&
+		kernel.VFS()->GetPages()->OnPageFault(__readcr2(), x64Frame->ErrorCode, (x64Frame->RFlags & RFLAGS_IF) != 0))
+		return;
+
 	OnUnhandledInterrupt(x64Frame, x64Vector);
 }
 
+void HAL::OnInterruptExit(InterruptCpu& cpu, const uint64_t start, const uint64_t dispatch)
+{
+	const uint64_t cycles = __rdtsc() - start;
+	if (cycles > cpu.MaxIsrCycles)
+		cpu.MaxIsrCycles = cycles;
+	cpu.Interrupts++;
+	cpu.DispatchCycles += dispatch;
+	cpu.LastInterrupt = start;
+
+	//Interrupted a DPC drain, don't start another one. An exit that is draining reschedules after it, but the
+	//DPC thread has no exit coming, so a tick that expired its quantum preempts it here.
+	if (cpu.Dpcs.IsDraining())
+	{
+		if (!cpu.ExitDraining)
+			HonorReschedule(cpu);
+		return;
+	}
+
+	//No handler walk is in progress on this CPU anymore
+	QuiesceHandlers();
+
+	cpu.ExitDraining = true;
+	if (m_dpcInline)
+	{
+		cpu.Dpcs.Drain(SIZE_MAX);
+	}
+	else if (!cpu.Dpcs.IsEmpty())
+	{
+		//Hardware has been acknowledged, let other interrupts in while DPCs run
+		_enable();
+		cpu.Dpcs.Drain(DPC_EXIT_BUDGET);
+		_disable();
+
+		if (!cpu.Dpcs.IsEmpty())
+		{
+			cpu.DpcEvent.Set();
+			cpu.Reschedule = true;
+		}
+	}
+	cpu.ExitDraining = false;
+
+	HonorReschedule(cpu);
+}
+
+void HAL::HonorReschedule(InterruptCpu& cpu)
+{
+	if (cpu.Reschedule && m_rescheduleHandler.Handler)
+	{
+		cpu.Reschedule = false;
+		m_rescheduleHandler.Handler(m_rescheduleHandler.Context);
+	}
+}
+
+bool HAL::QueueDpc(KDpc& dpc)
+{
+	return m_interruptCpus[CurrentCPU()].Dpcs.Insert(dpc);
+}
+
+void HAL::DrainDpcs()
+{
+	InterruptCpu& cpu = m_interruptCpus[CurrentCPU()];
+	while (cpu.Dpcs.Drain(DPC_EXIT_BUDGET) != 0)
+		;
+
+	//Ticks that ran in this drain may have expired a quantum, no interrupt exit saw that
+	const cpu_flags_t flags = SaveAndDisableInterrupts();
+	HonorReschedule(m_interruptCpus[CurrentCPU()]);
+	RestoreInterrupts(flags);
+}
+
+KEvent& HAL::GetDpcEvent()
+{
+	return m_interruptCpus[CurrentCPU()].DpcEvent;
+}
+
+void HAL::RequestReschedule()
+{
+	m_interruptCpus[CurrentCPU()].Reschedule = true;
+}
+
+void HAL::DisplayInterruptStats()
+{
+	InterruptCpu& cpu = m_interruptCpus[CurrentCPU()];
+	Printf("Interrupts (CPU %d): DPCs %s, longest ISR %d cycles, IPI calls %d\n", CurrentCPU(), m_dpcInline ? "inline" : "deferred", cpu.MaxIsrCycles, cpu.Mailbox.Received());
+	cpu.Dpcs.Display();
+}
+
+void HAL::ResetInterruptStats()
+{
+	InterruptCpu& cpu = m_interruptCpus[CurrentCPU()];
+	cpu.MaxIsrCycles = 0;
+	cpu.Interrupts = 0;
+	cpu.DispatchCycles = 0;
+	cpu.Dpcs.ResetStats();
+}
+
 void HAL::RegisterInterrupt(uint8_t vector, InterruptContext context)
 {
-	UnRegisterInterrupt(vector);
-	m_interruptHandlers->insert({ vector, context });
+	KLockGuard<KSpinLock> guard(m_vectorLock);
+
+	//Drivers like HPET re-register on every use, keep the entry and its stats
+	InterruptHandlerEntry* head = m_vectors[vector];
+	if (head && !head->Next && head->Context.Handler == context.Handler && head->Context.Context == context.Context)
+		return;
+
+	InterruptHandlerEntry* entry = new InterruptHandlerEntry{ context, nullptr, nullptr, 0, 0, 0 };
+	_WriteBarrier();
+	m_vectors[vector] = entry;
+	RetireHandlers(head);
 }
 
 void HAL::UnRegisterInterrupt(uint8_t vector)
 {
-	if (m_interruptHandlers->find(vector) != m_interruptHandlers->end())
-		m_interruptHandlers->erase(vector);
+	KLockGuard<KSpinLock> guard(m_vectorLock);
+
+	InterruptHandlerEntry* head = m_vectors[vector];
+	m_vectors[vector] = nullptr;
+	RetireHandlers(head);
+}
+
+void HAL::AddInterruptHandler(uint8_t vector, InterruptContext context)
+{
+	KLockGuard<KSpinLock> guard(m_vectorLock);
+
+	InterruptHandlerEntry* entry = new InterruptHandlerEntry{ context, nullptr, nullptr, 0, 0, 0 };
+	_WriteBarrier();
+
+	InterruptHandlerEntry* tail = m_vectors[vector];
+	if (!tail)
+	{
+		m_vectors[vector] = entry;
+		return;
+	}
+
+	while (tail->Next)
+		tail = tail->Next;
+	tail->Next = entry;
+}
+
+void HAL::RemoveInterruptHandler(uint8_t vector, InterruptContext context)
+{
+	KLockGuard<KSpinLock> guard(m_vectorLock);
+
+	InterruptHandlerEntry* volatile* link = &m_vectors[vector];
+	while (*link)
+	{
+		InterruptHandlerEntry* entry = *link;
+		if (entry->Context.Handler == context.Handler && entry->Context.Context == context.Context)
+		{
+			//Walkers holding entry still see a valid Next
+			*link = entry->Next;
+			entry->Retired = m_retired;
+			m_retired = entry;
+			return;
+		}
+		link = &entry->Next;
+	}
+}
+
+void HAL::RetireHandlers(InterruptHandlerEntry* entry)
+{
+	while (entry)
+	{
+		entry->Retired = m_retired;
+		m_retired = entry;
+		entry = entry->Next;
+	}
+}
+
+void HAL::QuiesceHandlers()
+{
+	const uint64_t self = 1ULL << CurrentCPU();
+	if (!(m_retiringCpus & self) && !m_retired)
+		return;
+
+	InterruptHandlerEntry* batches[2] = {};
+	{
+		KLockGuard<KSpinLock> guard(m_vectorLock);
+		m_retiringCpus &= ~self;
+		if (m_retiringCpus != 0)
+			return;
+
+		//Grace period of the batch is over
+		batches[0] = m_retiring;
+		m_retiring = nullptr;
+
+		//Start the next one with what was retired meanwhile, this CPU has passed for it already
+		if (m_retired)
+		{
+			const uint64_t others = m_onlineCpus & ~self;
+			if (others != 0)
+			{
+				m_retiring = m_retired;
+				m_retiringCpus = others;
+			}
+			else
+				batches[1] = m_retired;
+			m_retired = nullptr;
+		}
+	}
+
+	for (InterruptHandlerEntry* entry : batches)
+	{
+		while (entry)
+		{
+			InterruptHandlerEntry* next = entry->Retired;
+			delete entry;
+			entry = next;
+		}
+	}
+}
+
+void HAL::DisplayInterrupts()
+{
+	//CPUs are indexed by APIC ID, which need not be dense
+	for (uint8_t i = 0; i < 64; i++)
+	{
+		if (!(m_onlineCpus & (1ULL << i)))
+			continue;
+
+		const InterruptCpu& cpu = m_interruptCpus[i];
+		if (cpu.Interrupts == 0)
+			continue;
+
+		Printf("CPU %d: %d interrupts, dispatch avg %d cycles, longest ISR %d cycles\n",
+			i, cpu.Interrupts, cpu.DispatchCycles / cpu.Interrupts, cpu.MaxIsrCycles);
+	}
+
+	//Copy each chain out under the lock, Printf is far too slow to run with interrupts off
+	const size_t MaxShown = 8;
+	InterruptHandlerEntry shown[MaxShown];
+	for (size_t vector = 0; vector < 256; vector++)
+	{
+		size_t count = 0;
+		size_t total = 0;
+		{
+			const cpu_flags_t flags = m_vectorLock.AcquireIrqSave();
+			for (const InterruptHandlerEntry* entry = m_vectors[vector]; entry != nullptr; entry = entry->Next)
+			{
+				if (count < MaxShown)
+					shown[count++] = *entry;
+				total++;
+			}
+			m_vectorLock.ReleaseIrqRestore(flags);
+		}
+		if (total == 0)
+			continue;
+
+		uint64_t interrupts = 0;
+		for (uint8_t i = 0; i < 64; i++)
+			if (m_onlineCpus & (1ULL << i))
+				interrupts += m_interruptCpus[i].VectorCounts[vector];
+
+		Printf("  Vector 0x%02x: %d\n", vector, interrupts);
+		for (size_t i = 0; i < count; i++)
+		{
+			const InterruptHandlerEntry& entry = shown[i];
+			Printf("    0x%016x(0x%016x): %d calls", entry.Context.Handler, entry.Context.Context, entry.Count);
+			if (entry.Count != 0)
+				Printf(", avg %d cycles, max %d cycles", entry.Cycles / entry.Count, entry.MaxCycles);
+			Printf("\n");
+		}
+		if (total > count)
+			Printf("    ... %d more\n", total - count);
+	}
 }
 
 void HAL::SetInterruptStack(void* stack)
@@ -221,10 +565,34 @@ void HAL::InitDevices()
 {
 	driverManager = new DriverManager();
 
-	m_ACPI.Init();
+	m_ACPI.InitTables();
+
+	//HPET has to be up before the APIC and the ACPI namespace, it is the calibration reference for both
+	ACPI_TABLE_DESC* hpetDescr = m_ACPI.GetAcpiTableBySignature(ACPI_SIG_HPET);
+	if (hpetDescr)
+	{
+		ACPI_TABLE_HPET* hpet = nullptr;
+		if (hpetDescr->Flags & ACPI_TABLE_ORIGIN_INTERNAL_PHYSICAL)
+			hpet = (ACPI_TABLE_HPET*)(KernelAcpiStart + hpetDescr->Address);
+		else
+			hpet = (ACPI_TABLE_HPET*)(hpetDescr->Address);
+
+		m_HPET.Initialize(hpet);
+	}
+	else
+		Printf("No HPET found, falling back to PIT\r\n");
+
+	//Otherwise the CPUID estimate stays
+	if (m_HPET.IsPresent())
+		CalibrateTSC();
 
+	m_ACPI.Init();
 	m_APIC.Init();
 
+	AssertOp(CurrentCPU(), <, 64);
+	m_onlineCpus |= 1ULL << CurrentCPU();
+	RegisterInterrupt((uint8_t)X64_INTERRUPT_VECTOR::IpiCall, { HAL::OnIpiCall, this });
+
 	uint64_t eps = (uint64_t)m_ConfigTables->GetSMBiosTable();
 	if(!(m_HasSMBIOS = m_SMBios.Init(eps)))
 	{
@@ -232,6 +600,7 @@ void HAL::InitDevices()
 	}
 
 	m_ACPI.EnumerateDevices();
+	m_idle.Initialize();
 
 	m_PCI.Initialize(nullptr);
 
@@ -240,6 +609,9 @@ void HAL::InitDevices()
 	driverManager->AddDriver(keyboardDriver);
 	
 	DefaultKeyboardInterpreter* interpreter = new DefaultKeyboardInterpreter();
+
+	m_serial = new UartDriver(this);
+	driverManager->AddDriver(m_serial);
 	keyboardDriver->SetKeyboardInterpreter(interpreter);
 
 	MouseDriver* mouseDriver = new MouseDriver(this);
@@ -323,7 +695,10 @@ void HAL::ActivateDrivers()
 
 		driver->Activate();
 	}
-	
+
+	//Clock is active now, a 32bit HPET counter needs its ticks
+	if (m_HPET.IsPresent())
+		m_Clock.RegisterTickHandler(&m_HPET);
 }
 
 void HAL::SetInterruptRedirect(const interrupt_redirect_t* redirectStruct)
@@ -331,6 +706,100 @@ void HAL::SetInterruptRedirect(const interrupt_redirect_t* redirectStruct)
 	m_APIC.GetIOAPIC()->SetRedirection(redirectStruct);
 }
 
+void HAL::SendIpi(uint8_t cpu, uint8_t vector)
+{
+	m_APIC.GetLocalAPIC()->ipi(cpu, vector);
+}
+
+void HAL::BroadcastIpi(uint8_t vector)
+{
+	m_APIC.GetLocalAPIC()->broadcastIpi(vector);
+}
+
+void HAL::SelfIpi(uint8_t vector)
+{
+	m_APIC.GetLocalAPIC()->selfIpi(vector);
+}
+
+void HAL::CallCpus(uint64_t cpus, IpiRoutine routine, void* context)
+{
+	const uint8_t self = CurrentCPU();
+	cpus &= m_onlineCpus;
+
+	const bool local = (cpus & (1ULL << self)) != 0;
+	cpus &= ~(1ULL << self);
+
+	IpiCall call = { routine, context, (long)__popcnt64(cpus) };
+	IpiMailbox& own = m_interruptCpus[self].Mailbox;
+
+	unsigned long cpu;
+	for (uint64_t targets = cpus; _BitScanForward64(&cpu, targets); targets &= targets - 1)
+	{
+		//Target may itself be spinning on a full mailbox of ours, keep ours moving meanwhile
+		while (!m_interruptCpus[cpu].Mailbox.Post(call))
+			DrainMailbox(own);
+
+		SendIpi((uint8_t)cpu, (uint8_t)X64_INTERRUPT_VECTOR::IpiCall);
+	}
+
+	if (local)
+	{
+		const cpu_flags_t flags = SaveAndDisableInterrupts();
+		routine(context);
+		RestoreInterrupts(flags);
+	}
+
+	//Others may wait on us the same way while we spin with interrupts disabled
+	while (call.Pending != 0)
+	{
+		DrainMailbox(own);
+		_mm_pause();
+	}
+}
+
+void HAL::DrainMailbox(IpiMailbox& mailbox)
+{
+	//Routines run as they would from the IPI, and the IPI handler can't drain the same mailbox under us
+	const cpu_flags_t flags = SaveAndDisableInterrupts();
+	mailbox.Drain();
+	RestoreInterrupts(flags);
+}
+
+uint32_t HAL::OnIpiCall(void* arg)
+{
+	HAL* hal = (HAL*)arg;
+	hal->m_interruptCpus[hal->CurrentCPU()].Mailbox.Drain();
+	return 0;
+}
+
+uint8_t HAL::AllocateVector()
+{
+	static_assert((uint8_t)X64_INTERRUPT_VECTOR::MSI_LAST - (uint8_t)X64_INTERRUPT_VECTOR::MSI_BASE < 64, "Vector bitmap too small");
+	const size_t count = (uint8_t)X64_INTERRUPT_VECTOR::MSI_LAST - (uint8_t)X64_INTERRUPT_VECTOR::MSI_BASE + 1;
+	KLockGuard<KSpinLock> guard(m_vectorLock);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (m_allocatedVectors & (1ULL << i))
+			continue;
+
+		m_allocatedVectors |= (1ULL << i);
+		return (uint8_t)X64_INTERRUPT_VECTOR::MSI_BASE + (uint8_t)i;
+	}
+	return 0;
+}
+
+void HAL::FreeVector(uint8_t vector)
+{
+	AssertOp(vector, >=, (uint8_t)X64_INTERRUPT_VECTOR::MSI_BASE);
+	AssertOp(vector, <=, (uint8_t)X64_INTERRUPT_VECTOR::MSI_LAST);
+
+	UnRegisterInterrupt(vector);
+
+	KLockGuard<KSpinLock> guard(m_vectorLock);
+	m_allocatedVectors &= ~(1ULL << (vector - (uint8_t)X64_INTERRUPT_VECTOR::MSI_BASE));
+}
+
 
 size_t HAL::StackReserve()
 {
@@ -352,6 +821,49 @@ void HAL::SetUserCpuContext(void* teb)
 	_writegsbase_u64((uintptr_t)teb);
 }
 
+size_t HAL::SimdContextSize()
+{
+	return x64::SIMDContextSize;
+}
+
+void HAL::SimdInitContext(void* context)
+{
+	x64::SIMD_InitContext(context);
+}
+
+void HAL::SimdSaveContext(void* context)
+{
+	x64::SIMD_SaveContext(context);
+}
+
+void HAL::SimdRestoreContext(void* context)
+{
+	x64::SIMD_RestoreContext(context);
+}
+
+void HAL::SimdSetTrap(bool trap)
+{
+	x64::SIMD_SetTrap(trap);
+}
+
+void HAL::CalibrateTSC()
+{
+	//CPUID leaf 0x15/0x16 is often missing or wrong under hypervisors, measure against the HPET instead
+	const uint64_t hpetStart = m_HPET.ReadCounter();
+	const uint64_t tscStart = x64::ReadTSC();
+	m_HPET.Stall(TSC_CALIBRATION_TIME);
+	const uint64_t tscEnd = x64::ReadTSC();
+	const uint64_t hpetEnd = m_HPET.ReadCounter();
+
+	//Cycles per us, rounded
+	const nano_t elapsed = m_HPET.ToNano(hpetEnd - hpetStart);
+	const uint64_t frequency = ((tscEnd - tscStart) * 1000 + elapsed / 2) / elapsed;
+	AssertOp(frequency, <=, std::numeric_limits<uint32_t>::max());
+	x64::TSCFreq = (uint32_t)frequency;
+
+	Printf("TSC Freq: %d MHz\r\n", x64::TSCFreq);
+}
+
 void HAL::EOI()
 {
 	m_APIC.EOI();
@@ -362,6 +874,16 @@ extern "C" void INTERRUPT_HANDLER(X64_INTERRUPT_VECTOR vector, X64_INTERRUPT_FRA
 	kernel.GetHAL()->HandleInterrupt((uint8_t)vector, frame);
 }
 
+extern "C" void INTERRUPT_SIMD_RELEASE()
+{
+	kernel.GetScheduler()->ReleaseSimd();
+}
+
+extern "C" void SIMD_TRAP_HANDLER()
+{
+	kernel.GetScheduler()->OnSimdTrap();
+}
+
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,55 @@
+#include "Ipi.h"
+#include <Assert.h>
+#include <intrin.h>
+
+IpiMailbox::IpiMailbox() :
+	m_lock(),
+	m_calls(),
+	m_head(),
+	m_count(),
+	m_received()
+{
+
+}
+
+bool IpiMailbox::Post(IpiCall& call)
+{
+	Assert(call.Routine);
+	KLockGuard<KSpinLock> guard(m_lock);
+
+	if (m_count == IPI_MAILBOX_SIZE)
+		return false;
+
+	m_calls[(m_head + m_count) % IPI_MAILBOX_SIZE] = &call;
+	m_count++;
+	return true;
+}
+
+size_t IpiMailbox::Drain()
+{
+	size_t count = 0;
+	while (IpiCall* call = Pop())
+	{
+		call->Routine(call->Context);
+
+		//Sender may return and pop call off its stack right after this
+		_InterlockedDecrement(&call->Pending);
+		count++;
+	}
+
+	m_received += count;
+	return count;
+}
+
+IpiCall* IpiMailbox::Pop()
+{
+	KLockGuard<KSpinLock> guard(m_lock);
+
+	if (m_count == 0)
+		return nullptr;
+
+	IpiCall* call = m_calls[m_head];
+	m_head = (m_head + 1) % IPI_MAILBOX_SIZE;
+	m_count--;
+	return call;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <os.internal.h>
+#include "kernel/objects/KSpinLock.h"
+
+#define IPI_MAILBOX_SIZE	16
+
+typedef void(*IpiRoutine)(void* context);
+
+//Function call for other CPUs. It lives on the sender's stack, HAL::CallCpus returns once every target ran it.
+struct IpiCall
+{
+	IpiRoutine Routine;
+	void* Context;
+	volatile long Pending; //Targets that haven't finished yet
+};
+
+//Incoming calls of one CPU, drained by the IPI handler with interrupts disabled
+class IpiMailbox
+{
+public:
+	IpiMailbox();
+
+	//Safe from any context. Returns false if the mailbox is full, the sender has to retry.
+	bool Post(IpiCall& call);
+
+	//Runs everything posted so far, returns how many ran
+	size_t Drain();
+
+	uint64_t Received() const { return m_received; }
+
+private:
+	IpiCall* Pop();
+
+	KSpinLock m_lock;
+	IpiCall* m_calls[IPI_MAILBOX_SIZE];
+	size_t m_head;
+	size_t m_count;
+
+	uint64_t m_received;
+
+	::NO_COPY_OR_ASSIGN(IpiMailbox);
+};
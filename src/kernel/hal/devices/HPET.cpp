@@ -0,0 +1,233 @@
+#include "HPET.h"
+#include <Assert.h>
+#include <os.internal.h>
+#include "kernel/Kernel.h"
+#include "kernel/hal/HAL.h"
+#include "kernel/hal/x64/interrupt.h"
+#include <intrin.h>
+
+// General Capabilities and ID Register
+#define HPET_CAP_NUM_TIM_SHIFT		8
+#define HPET_CAP_NUM_TIM_MASK		0x1F
+#define HPET_CAP_COUNT_SIZE			(1 << 13)
+#define HPET_CAP_PERIOD_SHIFT		32
+
+// General Configuration Register
+#define HPET_CNF_ENABLE				(1 << 0)
+#define HPET_CNF_LEGACY_ROUTE		(1 << 1)
+
+// Timer N Configuration and Capability Register
+#define HPET_TN_INT_TYPE_LEVEL		(1 << 1)
+#define HPET_TN_INT_ENABLE			(1 << 2)
+#define HPET_TN_PERIODIC			(1 << 3)
+#define HPET_TN_32BIT_MODE			(1 << 8)
+#define HPET_TN_INT_ROUTE_SHIFT		9
+#define HPET_TN_INT_ROUTE_MASK		(0x1F << HPET_TN_INT_ROUTE_SHIFT)
+#define HPET_TN_FSB_ENABLE			(1 << 14)
+#define HPET_TN_INT_ROUTE_CAP_SHIFT	32
+
+#define FEMTO_PER_SECOND			1'000'000'000'000'000ULL
+
+HPET::HPET(HAL* hal)
+: Device(), m_HAL(hal), m_Addr(0), m_PhysicalAddr(0), m_Period(0), m_Frequency(0), m_Wide(false),
+	m_MinimumTick(0), m_CounterLock("HPET"), m_LastLow(0), m_High(0), m_NumComparators(0), m_Comparators()
+{
+	Name = "HPET";
+	Description = "High Precision Event Timer";
+	sprintf(Path, "ACPI/HPET");
+	Type = DeviceType::System;
+}
+
+void HPET::Initialize(void* context)
+{
+	Assert(m_HAL);
+	Assert(context);
+
+	ACPI_TABLE_HPET* table = (ACPI_TABLE_HPET*)context;
+	if (table->Address.SpaceId != ACPI_ADR_SPACE_SYSTEM_MEMORY)
+	{
+		Printf(__FUNCTION__": HPET not memory mapped, ignoring\r\n");
+		return;
+	}
+
+	m_PhysicalAddr = table->Address.Address;
+	m_Addr = (uint64_t)kernel.VirtualMapRT(0x0, { m_PhysicalAddr });
+	m_MinimumTick = table->MinimumTick;
+
+	const uint64_t caps = read(Capabilities);
+	m_Period = (uint32_t)(caps >> HPET_CAP_PERIOD_SHIFT);
+	m_Wide = (caps & HPET_CAP_COUNT_SIZE) != 0;
+
+	//Spec limits the period to 100ns
+	if (m_Period == 0 || m_Period > 100'000'000)
+	{
+		Printf(__FUNCTION__": invalid period %d fs, ignoring\r\n", m_Period);
+		m_Addr = 0;
+		return;
+	}
+	m_Frequency = FEMTO_PER_SECOND / m_Period;
+
+	const uint8_t timers = ((caps >> HPET_CAP_NUM_TIM_SHIFT) & HPET_CAP_NUM_TIM_MASK) + 1;
+	m_NumComparators = timers < HPET_MAX_COMPARATORS ? timers : HPET_MAX_COMPARATORS;
+
+	//Halt counter, no legacy replacement routing. We route comparators through the IOAPIC ourselves
+	write(Configuration, read(Configuration) & ~(uint64_t)(HPET_CNF_ENABLE | HPET_CNF_LEGACY_ROUTE));
+
+	for (uint8_t i = 0; i < timers; i++)
+	{
+		uint64_t config = read(TimerReg(TimerConfig, i));
+		config &= ~(uint64_t)(HPET_TN_INT_ENABLE | HPET_TN_PERIODIC | HPET_TN_FSB_ENABLE | HPET_TN_INT_TYPE_LEVEL);
+		write(TimerReg(TimerConfig, i), config);
+
+		if (i >= m_NumComparators)
+			continue;
+
+		//Pick the first IOAPIC pin the comparator can be routed to, prefer pins above the ISA range
+		const uint32_t routes = (uint32_t)(config >> HPET_TN_INT_ROUTE_CAP_SHIFT);
+		const uint32_t pciRoutes = routes & 0xFFFF0000;
+		unsigned long pin = 0;
+		const bool routable = _BitScanForward(&pin, pciRoutes ? pciRoutes : routes) != 0;
+		if (!routable)
+			Printf(__FUNCTION__": comparator %d has no IOAPIC route, unusable\r\n", i);
+
+		m_Comparators[i] = { this, i, (uint8_t)pin, (uint8_t)((uint8_t)X64_INTERRUPT_VECTOR::HPET + i), routable, { nullptr, nullptr } };
+	}
+
+	//Reset and start main counter
+	write(MainCounter, 0);
+	write(InterruptStatus, read(InterruptStatus));
+	write(Configuration, read(Configuration) | HPET_CNF_ENABLE);
+
+	Printf("HPET Addr: 0x%16x, Freq: %d Hz, Timers: %d, %s\r\n", m_Addr, m_Frequency, timers, m_Wide ? "64bit" : "32bit");
+}
+
+const void* HPET::GetResource(uint32_t type) const
+{
+	return nullptr;
+}
+
+void HPET::DisplayDetails() const
+{
+	Printf("HPET: Addr: 0x%016x, Period: %d fs, Freq: %d Hz, Comparators: %d\r\n", m_Addr, m_Period, m_Frequency, m_NumComparators);
+	for (uint8_t i = 0; i < m_NumComparators; i++)
+		Printf("    T%d: pin %d, vec: 0x%x, routable: %d, armed: %d\r\n", i, m_Comparators[i].Pin, m_Comparators[i].Vector,
+			m_Comparators[i].Routable, m_Comparators[i].Callback.Handler != nullptr);
+}
+
+uint64_t HPET::ReadCounter()
+{
+	Assert(IsPresent());
+
+	if (m_Wide)
+		return read(MainCounter);
+
+	//32bit counter wraps after ~5 minutes at 14.3 MHz, extend it in software. The tick handler reads it often
+	//enough that at most one wrap lies between two reads.
+	const cpu_flags_t flags = m_CounterLock.AcquireIrqSave();
+	const uint32_t low = *(volatile uint32_t*)(m_Addr + MainCounter);
+	if (low < m_LastLow)
+		m_High += (1ULL << 32);
+	m_LastLow = low;
+	const uint64_t counter = m_High | low;
+	m_CounterLock.ReleaseIrqRestore(flags);
+	return counter;
+}
+
+void HPET::onTimerTick(uint64_t totalTicks)
+{
+	if (IsPresent() && !m_Wide)
+		ReadCounter();
+}
+
+nano_t HPET::ToNano(uint64_t counterTicks) const
+{
+	//Split to avoid overflowing 64bits with femtoseconds
+	const uint64_t perNano = 1'000'000;
+	return (counterTicks / perNano) * m_Period + ((counterTicks % perNano) * m_Period) / perNano;
+}
+
+nano_t HPET::GetNanoTime()
+{
+	return ToNano(ReadCounter());
+}
+
+void HPET::Stall(nano_t time)
+{
+	const uint64_t start = ReadCounter();
+	const uint64_t ticks = (time * 1'000'000) / m_Period;
+	while (ReadCounter() - start < ticks)
+		_mm_pause();
+}
+
+bool HPET::ArmOneShot(uint8_t comparator, nano_t delay, InterruptContext context)
+{
+	if (!IsPresent() || comparator >= m_NumComparators)
+		return false;
+
+	Comparator& cmp = m_Comparators[comparator];
+	if (!cmp.Routable)
+		return false;
+
+	Disarm(comparator);
+	cmp.Callback = context;
+
+	m_HAL->RegisterInterrupt(cmp.Vector, { HPET::OnInterrupt, &cmp });
+
+	interrupt_redirect_t redirect;
+	redirect.type = 0xFF; //ISA source for override lookup, comparator pins are GSIs and have none
+	redirect.index = cmp.Pin;
+	redirect.interrupt = cmp.Vector;
+	redirect.destination = m_HAL->CurrentCPU();
+	redirect.flags = 0x0;
+	redirect.mask = false;
+	m_HAL->SetInterruptRedirect(&redirect);
+
+	uint64_t ticks = (delay * 1'000'000) / m_Period;
+	if (ticks < m_MinimumTick)
+		ticks = m_MinimumTick;
+
+	//Edge triggered, non-periodic
+	uint64_t config = read(TimerReg(TimerConfig, comparator));
+	config &= ~(uint64_t)(HPET_TN_INT_ROUTE_MASK | HPET_TN_PERIODIC | HPET_TN_INT_TYPE_LEVEL);
+	config |= ((uint64_t)cmp.Pin << HPET_TN_INT_ROUTE_SHIFT) | HPET_TN_INT_ENABLE;
+	write(TimerReg(TimerConfig, comparator), config);
+	write(TimerReg(TimerComparator, comparator), ReadCounter() + ticks);
+
+	return true;
+}
+
+void HPET::Disarm(uint8_t comparator)
+{
+	if (!IsPresent() || comparator >= m_NumComparators)
+		return;
+
+	const uint64_t config = read(TimerReg(TimerConfig, comparator));
+	write(TimerReg(TimerConfig, comparator), config & ~(uint64_t)HPET_TN_INT_ENABLE);
+	m_Comparators[comparator].Callback = { nullptr, nullptr };
+}
+
+uint32_t HPET::OnInterrupt(void* arg)
+{
+	Comparator* cmp = (Comparator*)arg;
+	HPET* hpet = cmp->Owner;
+
+	//One-shot: clear status and disable before calling out so the callback may re-arm
+	const InterruptContext callback = cmp->Callback;
+	hpet->write(InterruptStatus, 1ULL << cmp->Index);
+	hpet->Disarm(cmp->Index);
+
+	if (callback.Handler)
+		callback.Handler(callback.Context);
+
+	return 0;
+}
+
+uint64_t HPET::read(uint32_t reg)
+{
+	return *(volatile uint64_t*)(m_Addr + reg);
+}
+
+void HPET::write(uint32_t reg, uint64_t value)
+{
+	*(volatile uint64_t*)(m_Addr + reg) = value;
+}
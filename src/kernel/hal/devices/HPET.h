@@ -1 +1,86 @@
 #pragma once
+
+#include "kernel/hal/devices/Device.h"
+#include "kernel/hal/Interrupt.h"
+#include "kernel/os/Time.h"
+#include "kernel/objects/KSpinLock.h"
+#include "kernel/drivers/platform/Clock.h"
+
+//Number of comparators we expose for one-shot events
+#define HPET_MAX_COMPARATORS	4
+
+class HAL;
+class HPET : public Device, public TickEventHandler
+{
+public:
+	HPET(HAL* hal);
+
+	//context is the ACPI_TABLE_HPET found by ACPICA
+	void Initialize(void* context) override;
+	const void* GetResource(uint32_t type) const override;
+	void DisplayDetails() const override;
+
+	bool IsPresent() const { return m_Addr != 0; }
+
+	//Monotonic main counter
+	uint64_t ReadCounter();
+	uint64_t GetFrequency() const { return m_Frequency; }
+	nano_t ToNano(uint64_t counterTicks) const;
+	nano_t GetNanoTime();
+
+	//Busy wait using the main counter
+	void Stall(nano_t time);
+
+	//Reads the counter every tick so a 32bit one can't wrap twice between reads
+	void onTimerTick(uint64_t totalTicks) override;
+
+	//Fires context once after delay through the IOAPIC. Only valid after APIC init, fails if the comparator
+	//can't be routed to an IOAPIC pin.
+	bool ArmOneShot(uint8_t comparator, nano_t delay, InterruptContext context);
+	void Disarm(uint8_t comparator);
+	uint8_t ComparatorCount() const { return m_NumComparators; }
+
+private:
+	enum HpetReg
+	{
+		Capabilities = 0x000,
+		Configuration = 0x010,
+		InterruptStatus = 0x020,
+		MainCounter = 0x0F0,
+		TimerConfig = 0x100,
+		TimerComparator = 0x108
+	};
+
+	struct Comparator
+	{
+		HPET* Owner;
+		uint8_t Index;
+		uint8_t Pin;
+		uint8_t Vector;
+		bool Routable; //Pin is valid
+		InterruptContext Callback;
+	};
+
+	static uint32_t OnInterrupt(void* arg);
+
+	uint64_t read(uint32_t reg);
+	void write(uint32_t reg, uint64_t value);
+	static uint32_t TimerReg(uint32_t reg, uint8_t index) { return reg + 0x20 * index; }
+
+	HAL* m_HAL;
+	uint64_t m_Addr;
+	uint64_t m_PhysicalAddr;
+
+	uint32_t m_Period; //femtoseconds per tick
+	uint64_t m_Frequency;
+	bool m_Wide; //64-bit main counter
+	uint16_t m_MinimumTick;
+
+	//Extend a 32bit main counter to 64bits, readers come from any CPU and from interrupts
+	KSpinLock m_CounterLock;
+	uint32_t m_LastLow;
+	uint64_t m_High;
+
+	uint8_t m_NumComparators;
+	Comparator m_Comparators[HPET_MAX_COMPARATORS];
+};
@@ -5,6 +5,10 @@
 #include <kernel\hal\x64\ctrlregs.h>
 
 #include "kernel/hal/devices/pci/PCIBus.h"
+#include "kernel/hal/x64/x64.h"
+#include "kernel/objects/KSpinLock.h"
+#include "kernel/objects/KSemaphore.h"
+#include <intrin.h>
 
 extern "C"
 {
@@ -111,12 +115,14 @@ extern "C"
 
 
 
-//Acpi is single threaded, just stub these out
-typedef int semaphore_t;
-typedef int spinlock_t;
-
 static ACPI* acpi;
 
+//Blocking only works once the scheduler runs, ACPICA is initialized before that on the boot thread
+static bool CanBlock()
+{
+	return kernel.GetScheduler()->Enabled;
+}
+
 ACPI::ACPI(HAL* hal, ConfigTables* configTables)
 : m_HAL(hal)
 {
@@ -196,8 +202,11 @@ ACPI_STATUS ACPI::AcpiOsGetPhysicalAddress(void* LogicalAddress, ACPI_PHYSICAL_A
 {
 	PageTables tables;
 	tables.OpenCurrent();
-	*PhysicalAddress = tables.ResolveAddress((uintptr_t)LogicalAddress);
-	
+	paddr_t physical;
+	if (!tables.TryResolveAddress((uintptr_t)LogicalAddress, physical))
+		return AE_BAD_ADDRESS;
+
+	*PhysicalAddress = physical;
 	return AE_OK;
 
 }
@@ -236,32 +245,39 @@ BOOLEAN AcpiOsWritable(void* Memory, ACPI_SIZE Length)
 
 ACPI_THREAD_ID AcpiOsGetThreadId()
 {
-	//ACPI is single-threaded, just return 1
-	//TODO: support multithreading
-	return 1;
+	//Boot thread exists before ACPICA is initialized, ids start at 1
+	return kernel.KeGetCurrentThread().Id;
 }
 
 ACPI_STATUS AcpiOsExecute(ACPI_EXECUTE_TYPE Type, ACPI_OSD_EXEC_CALLBACK Function, void* Context)
 {
-	//Create a new thread (or process) with entry point at Function using parameter Context. Type is not really useful. 
-	//When the scheduler chooses this thread it has to pass in Context to the first argument (RDI for x86-64, stack for x86-32 (using System V ABI)
-	NotImplemented();
-	return AE_ERROR;
+	//Notify and GPE handlers run asynchronously on the system work queue. Type is not really useful.
+	if (!Function)
+		return AE_BAD_PARAMETER;
+
+	kernel.GetWorkQueue()->Submit((WorkRoutine)Function, Context);
+	return AE_OK;
 }
 
 void AcpiOsSleep(UINT64 Milliseconds)
 {
-	NotImplemented();
+	if (CanBlock())
+		kernel.Sleep((uint32_t)Milliseconds);
+	else
+		acpi->AcpiOsStall((UINT32)(Milliseconds * 1000));
 }
 
 void AcpiOsStall(UINT32 Microseconds)
 {
-	NotImplemented();
+	acpi->AcpiOsStall(Microseconds);
 }
 
 ACPI_STATUS AcpiOsCreateSemaphore(UINT32 MaxUnits, UINT32 InitialUnits, ACPI_SEMAPHORE* OutHandle)
 {
-	*OutHandle = new semaphore_t();
+	if (!OutHandle || InitialUnits > MaxUnits)
+		return AE_BAD_PARAMETER;
+
+	*OutHandle = new KSemaphore(InitialUnits, MaxUnits, "AcpiOsSemaphore");
 	return AE_OK;
 }
 
@@ -270,7 +286,7 @@ ACPI_STATUS AcpiOsDeleteSemaphore(ACPI_SEMAPHORE Handle)
 	if (!Handle)
 		return AE_BAD_PARAMETER;
 
-	delete Handle;
+	delete (KSemaphore*)Handle;
 	return AE_OK;
 }
 
@@ -295,7 +311,47 @@ ACPI_STATUS AcpiOsWaitSemaphore(ACPI_SEMAPHORE Handle, UINT32 Units, UINT16 Time
 	if (!Handle)
 		return AE_BAD_PARAMETER;
 
-	Assert(Units == 1);
+	KSemaphore* semaphore = (KSemaphore*)Handle;
+
+	//Timeout covers all units, not each of them
+	const bool forever = Timeout == ACPI_WAIT_FOREVER;
+	const uint64_t cyclesPerMs = (uint64_t)x64::TSCFreq * 1000;
+	const uint64_t deadline = __rdtsc() + (uint64_t)Timeout * cyclesPerMs;
+
+	for (UINT32 taken = 0; taken < Units; taken++)
+	{
+		milli_t timeout = std::numeric_limits<milli_t>::max();
+		if (!forever)
+		{
+			const uint64_t now = __rdtsc();
+			timeout = now < deadline ? (deadline - now + cyclesPerMs - 1) / cyclesPerMs : 0;
+		}
+
+		bool acquired;
+		if (timeout != 0 && CanBlock())
+		{
+			acquired = kernel.KeWait(*semaphore, timeout) == WaitStatus::Signaled;
+		}
+		else
+		{
+			//Nobody else can run to signal it, don't wait
+			const cpu_flags_t flags = SaveAndDisableInterrupts();
+			acquired = semaphore->IsSignalled();
+			if (acquired)
+				semaphore->Observed();
+			RestoreInterrupts(flags);
+		}
+
+		if (!acquired)
+		{
+			//All or nothing
+			const cpu_flags_t flags = SaveAndDisableInterrupts();
+			for (UINT32 i = 0; i < taken; i++)
+				semaphore->Signal();
+			RestoreInterrupts(flags);
+			return AE_TIME;
+		}
+	}
 
 	return AE_OK;
 }
@@ -305,31 +361,46 @@ ACPI_STATUS AcpiOsSignalSemaphore(ACPI_SEMAPHORE Handle, UINT32 Units)
 	if (!Handle)
 		return AE_BAD_PARAMETER;
 
+	//Waiters see the new count the next time the scheduler runs
+	KSemaphore* semaphore = (KSemaphore*)Handle;
+	const cpu_flags_t flags = SaveAndDisableInterrupts();
+	if (semaphore->Value() + (int)Units > semaphore->Limit())
+	{
+		RestoreInterrupts(flags);
+		return AE_LIMIT;
+	}
+
+	for (UINT32 i = 0; i < Units; i++)
+		semaphore->Signal();
+	RestoreInterrupts(flags);
 	return AE_OK;
 }
 
 ACPI_STATUS AcpiOsCreateLock(ACPI_SPINLOCK* OutHandle)
 {
-	*OutHandle = new spinlock_t();
+	if (!OutHandle)
+		return AE_BAD_PARAMETER;
+
+	//ACPICA takes these from GPE/SCI handlers, so they have to disable interrupts
+	*OutHandle = new KSpinLock("AcpiOsLock");
 	return AE_OK;
 }
 
 void AcpiOsDeleteLock(ACPI_SPINLOCK Handle)
 {
-	delete Handle;
+	delete (KSpinLock*)Handle;
 }
 
 ACPI_CPU_FLAGS AcpiOsAcquireLock(ACPI_SPINLOCK Handle)
 {
-	if (!Handle)
-		return AE_BAD_PARAMETER;
-
-	return 0;
+	Assert(Handle);
+	return ((KSpinLock*)Handle)->AcquireIrqSave();
 }
 
 void AcpiOsReleaseLock(ACPI_SPINLOCK Handle, ACPI_CPU_FLAGS Flags)
 {
-	//NOTE(tsharpe): Nothing to do, spinlocks aren't implemented
+	Assert(Handle);
+	((KSpinLock*)Handle)->ReleaseIrqRestore(Flags);
 }
 
 ACPI_STATUS AcpiOsSignal(UINT32 Function, void* Info)
@@ -433,29 +504,31 @@ UINT64 AcpiOsGetTimer()
 }
 UINT64 ACPI::AcpiOsGetTimer()
 {
-	return 0;
-	EFI_TIME time;
-	m_RuntimeServices->GetTime(&time, nullptr);
-	uint64_t timer;
-	uint16_t year = time.Year;
-	uint8_t month = time.Month;
-	uint8_t day = time.Day;
-	timer = ((uint64_t)(year / 4 - year / 100 + year / 400 + 367 * month / 12 + day) +
-		year * 365 - 719499);
-	timer *= 24;
-	timer += time.Hour;
-	timer *= 60;
-	timer += time.Minute;
-	timer *= 60;
-	timer += time.Second;
-	timer *= 10000000;	//100 n intervals
-	timer += time.Nanosecond / 100;
-	return timer;
+	//100ns units, only differences matter to ACPICA. TSC is calibrated before the namespace loads.
+	Assert(x64::TSCFreq != 0);
+	return (__rdtsc() * 10) / x64::TSCFreq;
+}
+
+void ACPI::AcpiOsStall(UINT32 Microseconds)
+{
+	//Spins, AML uses Stall for short hardware delays and Sleep for anything longer
+	HPET* hpet = m_HAL->GetHPET();
+	if (hpet->IsPresent())
+	{
+		hpet->Stall((nano_t)Microseconds * 1000);
+		return;
+	}
+
+	Assert(x64::TSCFreq != 0);
+	const uint64_t start = __rdtsc();
+	const uint64_t cycles = (uint64_t)Microseconds * x64::TSCFreq;
+	while (__rdtsc() - start < cycles)
+		_mm_pause();
 }
 
 void AcpiOsWaitEventsComplete()
 {
-	NotImplemented();
+	kernel.GetWorkQueue()->Flush();
 }
 
 ACPI_STATUS AcpiOsReadPciConfiguration(ACPI_PCI_ID* PciId, UINT32 Reg, UINT64* Value, UINT32 Width)
@@ -535,11 +608,8 @@ ACPI_TABLE_DESC* ACPI::GetAcpiTableBySignature(const char sig[4])
 }
 
 
-void ACPI::Init()
+void ACPI::InitTables()
 {
-
-	Printf("Loading ACPI Devices...\r\n");
-
 	ACPI_STATUS Status;
 	Status = AcpiInitializeSubsystem();
 	if (ACPI_FAILURE(Status))
@@ -554,6 +624,14 @@ void ACPI::Init()
 		Printf("Could not AcpiInitializeTables: %d\n", Status);
 		m_HAL->Wait();
 	}
+}
+
+void ACPI::Init()
+{
+
+	Printf("Loading ACPI Devices...\r\n");
+
+	ACPI_STATUS Status;
 
 	/* Install the default address space handlers. */
 	Status = AcpiInstallAddressSpaceHandler(ACPI_ROOT_OBJECT, ACPI_ADR_SPACE_SYSTEM_MEMORY, ACPI_DEFAULT_HANDLER, NULL, NULL);
@@ -577,12 +655,14 @@ void ACPI::Init()
 		m_HAL->Wait();
 	}
 
+	uint64_t start = __rdtsc();
 	Status = AcpiLoadTables();
 	if (ACPI_FAILURE(Status))
 	{
 		Printf("Could not AcpiLoadTables: %d\n", Status);
 		m_HAL->Wait();
 	}
+	const uint64_t loadCycles = __rdtsc() - start;
 
 	//Local handlers should be installed here
 
@@ -593,12 +673,16 @@ void ACPI::Init()
 		m_HAL->Wait();
 	}
 
+	//Runs _STA and _INI of every device
+	start = __rdtsc();
 	Status = AcpiInitializeObjects(ACPI_FULL_INITIALIZATION);
 	if (ACPI_FAILURE(Status))
 	{
 		Printf("Could not AcpiInitializeObjects: %d\n", Status);
 		m_HAL->Wait();
 	}
+	const uint64_t initCycles = __rdtsc() - start;
+	Printf("ACPI: namespace load %d us, _INI %d us\r\n", loadCycles / x64::TSCFreq, initCycles / x64::TSCFreq);
 
 	ACPI_TABLE_FADT* fadt = (ACPI_TABLE_FADT*)GetAcpiTableBySignature((char*)ACPI_SIG_FADT);
 	if (fadt)
@@ -685,7 +769,7 @@ void ACPI::parseMcfg()
 	else
 		mcfg = (ACPI_TABLE_MCFG*)(descr->Address);
 
-	if (!mcfg || mcfg->Header.Signature != ACPI_SIG_MCFG)
+	if (!mcfg || !ACPI_COMPARE_NAMESEG(mcfg->Header.Signature, ACPI_SIG_MCFG))
 	{
 	
 		Printf("Invalid MCFG table from ACPI\r\n");
@@ -697,7 +781,7 @@ void ACPI::parseMcfg()
 
 	mcfg_end = entry + mcfg->Header.Length;
 	entry += sizeof(ACPI_TABLE_MCFG);
-	while (entry + sizeof(ACPI_MCFG_ALLOCATION) < mcfg_end)
+	while (entry + sizeof(ACPI_MCFG_ALLOCATION) <= mcfg_end)
 	{
 		ACPI_MCFG_ALLOCATION* item = (ACPI_MCFG_ALLOCATION*)entry;
 		Printf("PCI enhanced segment, START_BUS = %d, END_BUS = %d, MMIO = 0x%x \r\n", static_cast<int>(item->StartBusNumber), static_cast<int>(item->EndBusNumber), item->Address);
@@ -20,6 +20,8 @@ public:
 	ACPI(HAL* hal, ConfigTables* configTables);
 
 
+	//Static tables only, enough to find the HPET. Init loads the namespace, which needs a calibrated TSC.
+	void InitTables();
 	void Init();
 
 	uint32_t RemapIRQ(uint32_t irq);
@@ -30,6 +32,9 @@ public:
 
 	void EnumerateDevices();
 
+	//ECAM regions from MCFG, empty if the platform only has port I/O config access
+	const std::vector<ACPI_MCFG_ALLOCATION*>& GetPciSegments() const { return m_PciEnhancedSegments; }
+
 	ACPI_TABLE_DESC acpi_tables[MAX_ACPI_TABLES];
 	bool HasPMTimer;
 
@@ -45,6 +50,7 @@ public:
 	ACPI_STATUS AcpiOsReadPort(ACPI_IO_ADDRESS Address, UINT32* Value, UINT32 Width);
 	ACPI_STATUS AcpiOsWritePort(ACPI_IO_ADDRESS Address, UINT32 Value, UINT32 Width);
 	UINT64 AcpiOsGetTimer();
+	void AcpiOsStall(UINT32 Microseconds);
 
 	ACPI_STATUS AcpiOsReadPciConfiguration(ACPI_PCI_ID* PciId, UINT32 Reg, UINT64* Value, UINT32 Width);
 	ACPI_STATUS AcpiOsWritePciConfiguration(ACPI_PCI_ID* PciId, UINT32 Reg, UINT64 Value, UINT32 Width);
@@ -3,6 +3,9 @@
 #include <os.internal.h>
 #include "kernel/Kernel.h"
 #include "kernel/hal/HAL.h"
+#include "kernel/hal/x64/x64.h"
+#include "kernel/objects/KSpinLock.h"
+#include <intrin.h>
 
 // ------------------------------------------------------------------------------------------------
 // Local APIC Registers
@@ -80,6 +83,16 @@
 #define PIT_CHANNEL2_DATA	0x42
 #define PIT_COMMAND	0x43
 
+#define LAPIC_CALIBRATION_TIME	(2 * 1000 * 1000) //2ms when using HPET
+
+// ------------------------------------------------------------------------------------------------
+// x2APIC, registers are MSRs at 0x800 + (MMIO offset >> 4)
+#define IA32_APIC_BASE_MSR			0x1B
+#define APIC_BASE_X2APIC_ENABLE		(1 << 10)
+#define APIC_BASE_ENABLE			(1 << 11)
+#define X2APIC_MSR_BASE				0x800
+#define X2APIC_SELF_IPI				0x83F
+
 
 
 LocalAPIC::LocalAPIC(HAL* hal)
@@ -97,7 +110,7 @@ void LocalAPIC::Initialize(void* context)
 	Assert(m_HAL);
 	Assert(context);
 
-	x2Apic = false;//x64::SupportsX2APIC();
+	x2Apic = x64::SupportsX2APIC();
 	
 	
 	m_Addr = (uint64_t)context;
@@ -105,13 +118,9 @@ void LocalAPIC::Initialize(void* context)
 
 	if (x2Apic)
 	{
-		// Enable x2APIC
-		uint64_t msr_info = __readmsr(0x1B);
-		Printf(__FUNCTION__": 0x%16x\r\n", msr_info);
-		msr_info |= (1 << 10);
-		__writemsr(0x1B, __readmsr(0x1B) | 0xc00);
+		// Enable x2APIC, EOI, timer and ICR become MSR writes and the MMIO page goes away
+		__writemsr(IA32_APIC_BASE_MSR, __readmsr(IA32_APIC_BASE_MSR) | APIC_BASE_ENABLE | APIC_BASE_X2APIC_ENABLE);
 		Printf(__FUNCTION__": x2APIC Enabled\r\n");
-		return;
 	}
 	else
 	{
@@ -130,7 +139,10 @@ void LocalAPIC::Initialize(void* context)
 	// Read the APIC version
 	uint32_t version = read(LAPIC_VER);
 	//Printf("LAPIC Version: 0x%x\n", version & 0xFF);
-	Printf("Local APIC Addr: 0x%16x, ver: 0x%x\r\n", m_Addr, version);
+	if (x2Apic)
+		Printf("Local APIC x2APIC mode, ID: %d, ver: 0x%x\r\n", id(), version);
+	else
+		Printf("Local APIC Addr: 0x%16x, ver: 0x%x\r\n", m_Addr, version);
 
 	//write(LAPIC_DFR, 0xffffffff); //flat mode
 	//write(LAPIC_LDR, 0x01000000); // All cpus use logical id 1
@@ -215,11 +227,45 @@ int LocalAPIC::EOIPending()
 		return 0;
 }
 
-void LocalAPIC::ipi(int vector)
+void LocalAPIC::ipi(uint32_t apicId, uint8_t vector)
 {
-	write(LAPIC_ICRLO, ICR_ALL_EXCLUDING_SELF | ICR_FIXED | vector);
+	writeIcr(apicId, ICR_NO_SHORTHAND | ICR_PHYSICAL | ICR_ASSERT | ICR_EDGE | ICR_FIXED | vector);
+}
+
+void LocalAPIC::broadcastIpi(uint8_t vector)
+{
+	writeIcr(0, ICR_ALL_EXCLUDING_SELF | ICR_ASSERT | ICR_EDGE | ICR_FIXED | vector);
+}
+
+void LocalAPIC::selfIpi(uint8_t vector)
+{
+	if (x2Apic)
+	{
+		_mm_mfence();
+		__writemsr(X2APIC_SELF_IPI, vector);
+	}
+	else
+		writeIcr(0, ICR_SELF | ICR_ASSERT | ICR_EDGE | ICR_FIXED | vector);
+}
+
+void LocalAPIC::writeIcr(uint32_t destination, uint32_t command)
+{
+	if (x2Apic)
+	{
+		//MSR writes to the x2APIC aren't serializing, publish stores the receiver looks at first.
+		//ICR is a single 64bit register here and has no delivery status.
+		_mm_mfence();
+		__writemsr(X2APIC_MSR_BASE + (LAPIC_ICRLO >> 4), ((uint64_t)destination << 32) | command);
+		return;
+	}
+
+	//Let the previous IPI leave, then write both halves without an interrupt in between
+	const cpu_flags_t flags = SaveAndDisableInterrupts();
 	while (read(LAPIC_ICRLO) & ICR_SEND_PENDING)
-		;
+		_mm_pause();
+	write(LAPIC_ICRHI, destination << ICR_DESTINATION_SHIFT);
+	write(LAPIC_ICRLO, command);
+	RestoreInterrupts(flags);
 }
 
 void LocalAPIC::SetProcessorAPIC(uint8_t processorID, uint8_t apicID)
@@ -255,6 +301,33 @@ void LocalAPIC::CalibrateTimer()
 	write(LAPIC_LINT0, APIC_DISABLE);
 	write(LAPIC_LINT1, APIC_DISABLE);
 
+	HPET* hpet = m_HAL->GetHPET();
+	if (hpet->IsPresent())
+	{
+		/* Set the intial count to max and measure against the HPET main counter */
+		write(LAPIC_TICR, 0xffffffff);
+		const uint64_t start = hpet->ReadCounter();
+		hpet->Stall(LAPIC_CALIBRATION_TIME);
+		const uint32_t count = 0xffffffff - read(LAPIC_TCCR);
+		const uint64_t end = hpet->ReadCounter();
+
+		write(LAPIC_TIMER, APIC_DISABLE);
+
+		//we used divide value of 16, scale to a whole second
+		Freq = (uint32_t)(((uint64_t)count * 16 * Second) / hpet->ToNano(end - start));
+	}
+	else
+	{
+		CalibrateTimerPIT();
+	}
+
+	apicCalibVal = Freq / APIC_TICKS_PER_SEC;
+	
+	Printf("APIC Freq: %d\r\n", Freq);
+}
+
+void LocalAPIC::CalibrateTimerPIT()
+{
 	uint8_t inp = m_HAL->ReadPort(PIT_OUTPUT_CHANNEL2, 8);
 	inp &= 0xFD;
 	inp |= 1;
@@ -295,15 +368,12 @@ void LocalAPIC::CalibrateTimer()
 	Freq *= 16; //we used divide value different than 1, so now we have to multiply the result by 16
 	Freq *= 100;	//moreover, PIT did not wait a whole sec, only a fraction, so multiply by that too	
 #endif
-	apicCalibVal = Freq / APIC_TICKS_PER_SEC;
-	
-	Printf("APIC Freq: %d\r\n", Freq);
 }
 
 uint32_t LocalAPIC::read(uint32_t reg)
 {
 	if(x2Apic)
-		return __readmsr((reg >> 4) + 0x800);
+		return (uint32_t)__readmsr((reg >> 4) + X2APIC_MSR_BASE);
 	else
 		return *(volatile uint32_t*)(m_Addr + reg);
 }
@@ -312,7 +382,7 @@ void LocalAPIC::write(uint32_t reg, uint32_t data)
 {
 	if (x2Apic)
 	{
-		__writemsr((reg >> 4) + 0x800, data);
+		__writemsr((reg >> 4) + X2APIC_MSR_BASE, data);
 	}
 	else
 		*(volatile uint32_t*)(m_Addr + reg) = data;
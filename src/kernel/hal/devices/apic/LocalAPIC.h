@@ -19,7 +19,12 @@ public:
 	void NotifyEOIRequired(int vector);
 	void SignalEOI();
 	int EOIPending();
-	void ipi(int vector);
+	//Fixed, edge triggered IPI to the local APIC apicId. Doesn't wait for delivery.
+	void ipi(uint32_t apicId, uint8_t vector);
+	void broadcastIpi(uint8_t vector); //All CPUs except this one
+	void selfIpi(uint8_t vector);
+
+	bool IsX2Apic() const { return x2Apic; }
 
 	const uint64_t GetAddr() { return m_Addr; }
 	const uint64_t GetPhysicalAddr() { return m_PhysicalAddr; }
@@ -28,9 +33,11 @@ public:
 
 private:
 	void CalibrateTimer();
+	void CalibrateTimerPIT();
 
 	uint32_t read(uint32_t reg);
 	void write(uint32_t reg, uint32_t data);
+	void writeIcr(uint32_t destination, uint32_t command);
 
 	uint64_t m_Addr;
 	uint64_t m_PhysicalAddr;
@@ -5,58 +5,128 @@
 #include <kernel\hal\devices\DeviceTree.h>
 #include <kernel\drivers\io\AHCI.h>
 #include <kernel\drivers\video\vmware_svga2.h>
+#include "kernel/Kernel.h"
+#include "kernel/hal/x64/x64.h"
+#include <intrin.h>
 
 #define PCI_PORT_COMMAND	0xCF8
 #define PCI_PORT_DATA		0xCFC
 
 PCIBus::PCIBus(HAL* hal)
-	: m_HAL(hal)
+	: m_HAL(hal), g_routingTable(), m_DeviceDescriptors(), m_EcamBus(), m_EcamBase(), m_EcamStartBus(), m_EcamEndBus(),
+	m_PortLock("PCI"), m_ConfigReads(), m_BusCount()
 {
 
 }
 
 void PCIBus::Initialize(void* context)
 {	
-	Printf("- Listing all PCI Devices: -\r\n");
-	//Brute force all busses
-	for (int bus = 0; bus < 8; ++bus) {
-		for (int device = 0; device < 32; ++device) {
-			
-			int numFunctions = (device_has_functions(bus, device)) ? 8 : 1;
-			for (int function = 0; function < numFunctions; ++function) 
-			{
-				// Get the device descriptor, if the vendor id is 0x0000 or 0xFFFF, the device is not present/ready
-				PCIDeviceDescriptor deviceDescriptor = get_device_descriptor(bus, device, function);
-				if (deviceDescriptor.vendor_id == 0x0000 || deviceDescriptor.vendor_id == 0x0001 || deviceDescriptor.vendor_id == 0xFFFF)
-					continue;
-
-				// Get port number
-				for (int barNum = 5; barNum >= 0; barNum--) {
-					BaseAddressRegister bar = get_base_address_register(bus, device, function, barNum);
-					
-					if (bar.address && (bar.type == InputOutput))
-					{
-						deviceDescriptor.port_base = (uint32_t)bar.address;
-						deviceDescriptor.has_port_base = true;
-					}
-
-					deviceDescriptor.bars[barNum] = bar;
-				}
+	InitializeEcam();
+	MapEcamBus(0);
 
-				m_DeviceDescriptors.push_back(deviceDescriptor);
-				//Printf("----- PCI: %s, VID: 0x%x, DEV: 0x%x\r\n", deviceDescriptor.GetType(), deviceDescriptor.vendor_id, deviceDescriptor.device_id);
-				PCIDevice* device = new PCIDevice(this, deviceDescriptor);
-				device->Initialize(this);
+	Printf("- Listing all PCI Devices: -\r\n");
+	const uint64_t start = __rdtsc();
 
-				DeviceTree::AddPCIDevice(device);
-			}
+	//Walk down from the host bridge, a multi function host bridge has one root bus per function
+	if (device_has_functions(0, 0))
+	{
+		for (int function = 0; function < PciLimits::Functions; ++function)
+		{
+			if ((read(0, 0, function, PCI_DESCR_OFFSET_VEN_ID) & 0xFFFF) == 0xFFFF)
+				continue;
+			ScanBus(function);
 		}
 	}
+	else
+		ScanBus(0);
+
+	const uint64_t cycles = __rdtsc() - start;
+	if (x64::TSCFreq != 0)
+		Printf("PCI: %d devices on %d buses in %d us, %d config reads via %s\r\n", m_DeviceDescriptors.size(), m_BusCount,
+			cycles / x64::TSCFreq, m_ConfigReads, m_EcamBus[0] ? "ECAM" : "port I/O");
+
 	FindDeviceDrivers();
 
 	Printf("---------------------\r\n");
 }
 
+void PCIBus::InitializeEcam()
+{
+	for (const ACPI_MCFG_ALLOCATION* segment : m_HAL->GetACPI()->GetPciSegments())
+	{
+		//Only segment group 0 is reachable through the legacy ports as well, stay with that one
+		if (segment->PciSegment != 0)
+			continue;
+
+		//Base address is that of bus 0, even if the region starts later
+		m_EcamBase = segment->Address;
+		m_EcamStartBus = segment->StartBusNumber;
+		m_EcamEndBus = segment->EndBusNumber;
+	}
+}
+
+void PCIBus::MapEcamBus(uint16_t bus)
+{
+	//Buses are scanned at init only, config accesses after that must not have to map anything
+	if (m_EcamBase == 0 || bus < m_EcamStartBus || bus > m_EcamEndBus || m_EcamBus[bus])
+		return;
+
+	m_EcamBus[bus] = (uint8_t*)kernel.DriverMapPages(m_EcamBase + ((paddr_t)bus << 20), (1 << 20) / PageSize);
+}
+
+void PCIBus::ScanBus(uint16_t bus)
+{
+	m_BusCount++;
+	MapEcamBus(bus);
+
+	for (int device = 0; device < PciLimits::Devices; ++device)
+	{
+		//Skip the rest of an empty slot after a single read
+		if ((read(bus, device, 0, PCI_DESCR_OFFSET_VEN_ID) & 0xFFFF) == 0xFFFF)
+			continue;
+
+		int numFunctions = (device_has_functions(bus, device)) ? PciLimits::Functions : 1;
+		for (int function = 0; function < numFunctions; ++function)
+			ScanFunction(bus, device, function);
+	}
+}
+
+void PCIBus::ScanFunction(uint16_t bus, uint16_t device, uint16_t function)
+{
+	// Get the device descriptor, if the vendor id is 0x0000 or 0xFFFF, the device is not present/ready
+	PCIDeviceDescriptor deviceDescriptor = get_device_descriptor(bus, device, function);
+	if (deviceDescriptor.vendor_id == 0x0000 || deviceDescriptor.vendor_id == 0x0001 || deviceDescriptor.vendor_id == 0xFFFF)
+		return;
+
+	// Get port number
+	for (int barNum = 5; barNum >= 0; barNum--) {
+		BaseAddressRegister bar = get_base_address_register(bus, device, function, barNum);
+
+		if (bar.address && (bar.type == InputOutput))
+		{
+			deviceDescriptor.port_base = (uint32_t)bar.address;
+			deviceDescriptor.has_port_base = true;
+		}
+
+		deviceDescriptor.bars[barNum] = bar;
+	}
+
+	m_DeviceDescriptors.push_back(deviceDescriptor);
+	//Printf("----- PCI: %s, VID: 0x%x, DEV: 0x%x\r\n", deviceDescriptor.GetType(), deviceDescriptor.vendor_id, deviceDescriptor.device_id);
+	PCIDevice* pciDevice = new PCIDevice(this, deviceDescriptor);
+	pciDevice->Initialize(this);
+
+	DeviceTree::AddPCIDevice(pciDevice);
+
+	//Follow bridges to the buses behind them, firmware has numbered them already
+	if (deviceDescriptor.class_id == 0x06 && deviceDescriptor.subclass_id == 0x04)
+	{
+		const uint16_t secondary = read(bus, device, function, PCI_DESCR_OFFSET_SECONDARY_BUS) & 0xFF;
+		if (secondary > bus)
+			ScanBus(secondary);
+	}
+}
+
 bool PCIBus::RegisterRoutingBus(uint32_t bus, uint32_t parentBus, uint32_t device)
 {
 	if ((bus >= PciLimits::Buses) || (parentBus >= PciLimits::Buses) || (device >= PciLimits::Devices))
@@ -143,29 +213,71 @@ void PCIBus::FindDeviceDrivers()
 	}
 }
 
+volatile uint8_t* PCIBus::GetEcamAddress(uint16_t bus, uint16_t device, uint16_t function, uint32_t registeroffset)
+{
+	AssertOp(registeroffset, <, PciLimits::ExtendedConfigSpace);
+
+	bus &= 0xFF;
+	if (!m_EcamBus[bus])
+		return nullptr;
+
+	return m_EcamBus[bus]
+		+ ((device & 0x1F) << 15)
+		+ ((function & 0x07) << 12)
+		+ (registeroffset & ~3u);
+}
+
 uint32_t PCIBus::read(uint16_t bus, uint16_t device, uint16_t function, uint32_t registeroffset)
 {
-	// Calculate the id
-	uint32_t id = 0x1 << 31
-		| ((bus & 0xFF) << 16)
-		| ((device & 0x1F) << 11)
-		| ((function & 0x07) << 8)
-		| (registeroffset & 0xFC);
-	m_HAL->WritePort(PCI_PORT_COMMAND, id, 32);
+	m_ConfigReads++;
+
+	uint32_t result;
+	volatile uint8_t* ecam = GetEcamAddress(bus, device, function, registeroffset);
+	if (ecam)
+	{
+		result = *(volatile uint32_t*)ecam;
+	}
+	else
+	{
+		if (registeroffset >= PciLimits::ConfigSpace)
+			return 0xFFFFFFFF;
+
+		// Calculate the id
+		uint32_t id = 0x1 << 31
+			| ((bus & 0xFF) << 16)
+			| ((device & 0x1F) << 11)
+			| ((function & 0x07) << 8)
+			| (registeroffset & 0xFC);
 
-	// read the data from the port
-	uint32_t result = m_HAL->ReadPort(PCI_PORT_DATA, 32);
+		KLockGuard<KSpinLock> guard(m_PortLock);
+		m_HAL->WritePort(PCI_PORT_COMMAND, id, 32);
+
+		// read the data from the port
+		result = m_HAL->ReadPort(PCI_PORT_DATA, 32);
+	}
 	return result >> (8 * (registeroffset % 4));
 }
 
 void PCIBus::write(uint16_t bus, uint16_t device, uint16_t function, uint32_t registeroffset, uint32_t value)
 {
+	volatile uint8_t* ecam = GetEcamAddress(bus, device, function, registeroffset);
+	if (ecam)
+	{
+		*(volatile uint32_t*)ecam = value;
+		return;
+	}
+
+	if (registeroffset >= PciLimits::ConfigSpace)
+		return;
+
 	// Calculate the id
 	uint32_t id = 0x1 << 31
 		| ((bus & 0xFF) << 16)
 		| ((device & 0x1F) << 11)
 		| ((function & 0x07) << 8)
 		| (registeroffset & 0xFC);
+
+	KLockGuard<KSpinLock> guard(m_PortLock);
 	m_HAL->WritePort(PCI_PORT_COMMAND, id, 32);
 
 	// write the data to the port
@@ -205,7 +317,7 @@ PCIDeviceDescriptor PCIBus::get_device_descriptor(uint16_t bus, uint16_t device,
 
 BaseAddressRegister PCIBus::get_base_address_register(uint16_t bus, uint16_t device, uint16_t function, uint16_t bar)
 {
-	BaseAddressRegister result;
+	BaseAddressRegister result = {};
 
 	// only types 0x00 (normal devices) and 0x01 (PCI-to-PCI bridges) are supported:
 	uint32_t headerType = read(bus, device, function, PCI_DESCR_OFFSET_HEAD_TYPE);
@@ -1,6 +1,8 @@
 #pragma once
 
+#include "OS.System.h"
 #include "kernel/hal/devices/Device.h"
+#include "kernel/objects/KSpinLock.h"
 #include <string>
 #include <vector>
 
@@ -13,7 +15,9 @@ namespace PciLimits
 		Functions = 8,
 		Devices = 32,
 		Buses = 256,
-		Pins = 4
+		Pins = 4,
+		ConfigSpace = 0x100,
+		ExtendedConfigSpace = 0x1000
 	};
 }
 
@@ -69,6 +73,42 @@ struct BaseAddressRegister {
 #define PCI_DESCR_OFFSET_INTF_ID	0x09
 #define PCI_DESCR_OFFSET_HEAD_TYPE	0x0E
 #define PCI_DESCR_OFFSET_BAR0		0x10
+#define PCI_DESCR_OFFSET_CAP_PTR	0x34
+#define PCI_DESCR_OFFSET_SECONDARY_BUS	0x19 //PCI-to-PCI bridges
+#define PCI_EXT_CAP_OFFSET			0x100
+
+#define PCI_COMMAND_INTX_DISABLE	(1 << 10)
+#define PCI_STATUS_CAP_LIST			(1 << 4)
+
+//Capability IDs
+#define PCI_CAP_ID_MSI		0x05
+#define PCI_CAP_ID_PCIE		0x10
+#define PCI_CAP_ID_MSIX		0x11
+
+//Extended capability IDs
+#define PCI_EXT_CAP_ID_AER	0x0001
+
+//MSI capability, message control is the upper half of the header dword
+#define PCI_MSI_CTRL_ENABLE		(1 << 0)
+#define PCI_MSI_CTRL_MME_MASK	(7 << 4)
+#define PCI_MSI_CTRL_64BIT		(1 << 7)
+#define PCI_MSI_ADDR_LO			0x04
+#define PCI_MSI_ADDR_HI			0x08
+#define PCI_MSI_DATA_32			0x08
+#define PCI_MSI_DATA_64			0x0C
+
+//MSI-X capability
+#define PCI_MSIX_CTRL_SIZE_MASK		0x7FF
+#define PCI_MSIX_CTRL_FUNC_MASK		(1 << 14)
+#define PCI_MSIX_CTRL_ENABLE		(1 << 15)
+#define PCI_MSIX_TABLE				0x04
+#define PCI_MSIX_BIR_MASK			0x7
+#define PCI_MSIX_ENTRY_SIZE			16
+#define PCI_MSIX_ENTRY_CTRL_MASKED	(1 << 0)
+
+//Message address/data for the local APIC, fixed delivery, edge triggered
+#define MSI_ADDRESS_BASE		0xFEE00000
+#define MSI_ADDRESS_DEST_SHIFT	12
 
 
 typedef struct 
@@ -258,9 +298,16 @@ public:
 	uint32_t getPciDeviceIrq(uint32_t bus, uint32_t device, uint32_t pin);
 
 	void FindDeviceDrivers();
-protected:
 
+	//Extended config space (0x100 - 0xFFF) is only reachable through ECAM
+	bool HasExtendedConfig(uint16_t bus) const { return m_EcamBus[bus & 0xFF] != nullptr; }
 
+protected:
+	void InitializeEcam();
+	void MapEcamBus(uint16_t bus);
+	void ScanBus(uint16_t bus);
+	void ScanFunction(uint16_t bus, uint16_t device, uint16_t function);
+	volatile uint8_t* GetEcamAddress(uint16_t bus, uint16_t device, uint16_t function, uint32_t registeroffset);
 
 	// I/O
 	uint32_t read(uint16_t bus, uint16_t device, uint16_t function, uint32_t registeroffset);
@@ -274,4 +321,18 @@ protected:
 
 	PciBusRounting* g_routingTable[PciLimits::Buses];
 	std::vector<PCIDeviceDescriptor> m_DeviceDescriptors;
+
+	//ECAM window of each bus (1MB), mapped when the bus is scanned. Mapping all of MCFG's range would take
+	//page tables for up to 256MB out of the fixed boot pool.
+	uint8_t* m_EcamBus[PciLimits::Buses];
+	paddr_t m_EcamBase; //Bus 0 of segment 0, 0 without ECAM
+	uint16_t m_EcamStartBus;
+	uint16_t m_EcamEndBus;
+
+	//0xCF8/0xCFC is an address/data pair, accesses must not interleave
+	KSpinLock m_PortLock;
+
+	//Scan stats
+	size_t m_ConfigReads;
+	size_t m_BusCount;
 };
\ No newline at end of file
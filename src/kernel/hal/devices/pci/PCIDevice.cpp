@@ -2,11 +2,12 @@
 #include <Assert.h>
 #include "PCIBus.h"
 #include <map>
+#include "kernel/Kernel.h"
 
 
 
 PCIDevice::PCIDevice(PCIBus* pciBus, PCIDeviceDescriptor descr)
-: m_PCIBus(pciBus), m_Descriptor(descr)
+: m_PCIBus(pciBus), m_Descriptor(descr), m_MsiCap(), m_MsixCap(), m_AerCap(), m_MsixTable(), m_MsiVectors()
 {
 	Name = "Unknown";
 	Description = "Unknown PCI Device";
@@ -18,6 +19,10 @@ PCIDevice::PCIDevice(PCIBus* pciBus, PCIDeviceDescriptor descr)
 
 void PCIDevice::Initialize(void* context)
 {
+	m_MsiCap = FindCapability(PCI_CAP_ID_MSI);
+	m_MsixCap = FindCapability(PCI_CAP_ID_MSIX);
+	m_AerCap = FindExtendedCapability(PCI_EXT_CAP_ID_AER);
+
 	DisplayDetails();
 }
 
@@ -33,6 +38,8 @@ void PCIDevice::DisplayDetails() const
 	Printf("   Ven=0x%x, DevID=0x%x\r\n", m_Descriptor.vendor_id, m_Descriptor.device_id);
 	Printf("   Class=0x%x, SubClass=0x%x, IF=0x%x\r\n", m_Descriptor.class_id, m_Descriptor.vendor_id, m_Descriptor.interface_id);
 	Printf("   Rev=0x%x, INT=0x%x\r\n", m_Descriptor.revision, m_Descriptor.interruptLine);
+	if (m_MsiCap || m_MsixCap || m_AerCap)
+		Printf("   MSI=%s, MSI-X=%s, AER=%s\r\n", m_MsiCap ? "yes" : "no", m_MsixCap ? "yes" : "no", m_AerCap ? "yes" : "no");
 }
 
 uint32_t PCIDevice::readBus(uint32_t registeroffset)
@@ -60,5 +67,168 @@ void PCIDevice::SetMemEnabled(bool enabled)
 	else
 		m_Descriptor.command &= ~flags;
 
-	m_PCIBus->write(m_Descriptor.bus, m_Descriptor.device, m_Descriptor.function, PCI_DESCR_OFFSET_COMMAND, m_Descriptor.command);
+	WriteCommand();
+}
+
+uint8_t PCIDevice::FindCapability(uint8_t id)
+{
+	if (!(m_Descriptor.status & PCI_STATUS_CAP_LIST))
+		return 0;
+
+	uint8_t offset = readBus(PCI_DESCR_OFFSET_CAP_PTR) & 0xFC;
+
+	//48 capabilities fit into the 256 byte config space, more means the list loops
+	for (int i = 0; offset != 0 && i < 48; i++)
+	{
+		const uint32_t header = readBus(offset);
+		if ((header & 0xFF) == id)
+			return offset;
+
+		offset = (header >> 8) & 0xFC;
+	}
+	return 0;
+}
+
+uint16_t PCIDevice::FindExtendedCapability(uint16_t id)
+{
+	if (!m_PCIBus->HasExtendedConfig(m_Descriptor.bus))
+		return 0;
+
+	uint16_t offset = PCI_EXT_CAP_OFFSET;
+	for (int i = 0; offset >= PCI_EXT_CAP_OFFSET && i < (PciLimits::ExtendedConfigSpace - PCI_EXT_CAP_OFFSET) / 4; i++)
+	{
+		const uint32_t header = readBus(offset);
+		if (header == 0 || header == 0xFFFFFFFF)
+			return 0;
+		if ((header & 0xFFFF) == id)
+			return offset;
+
+		offset = (header >> 20) & 0xFFC;
+	}
+	return 0;
+}
+
+size_t PCIDevice::EnableMsi(const InterruptContext* handlers, size_t count, uint8_t apicId)
+{
+	Assert(m_MsiVectors.empty());
+	if (count == 0 || (!m_MsiCap && !m_MsixCap))
+		return 0;
+
+	HAL* hal = m_PCIBus->m_HAL;
+	const uint32_t address = MSI_ADDRESS_BASE | ((uint32_t)apicId << MSI_ADDRESS_DEST_SHIFT);
+
+	size_t enabled = 0;
+	if (m_MsixCap)
+	{
+		enabled = EnableMsix(handlers, count, address);
+	}
+	else
+	{
+		const uint8_t vector = hal->AllocateVector();
+		if (!vector)
+			return 0;
+
+		hal->RegisterInterrupt(vector, handlers[0]);
+		m_MsiVectors.push_back(vector);
+
+		uint32_t header = readBus(m_MsiCap);
+		writeBus(m_MsiCap + PCI_MSI_ADDR_LO, address);
+		if ((header >> 16) & PCI_MSI_CTRL_64BIT)
+		{
+			writeBus(m_MsiCap + PCI_MSI_ADDR_HI, 0);
+			writeBus(m_MsiCap + PCI_MSI_DATA_64, vector);
+		}
+		else
+		{
+			writeBus(m_MsiCap + PCI_MSI_DATA_32, vector);
+		}
+
+		//Single message, multiple messages would need a block of aligned vectors
+		header &= ~((uint32_t)PCI_MSI_CTRL_MME_MASK << 16);
+		header |= (uint32_t)PCI_MSI_CTRL_ENABLE << 16;
+		writeBus(m_MsiCap, header);
+		enabled = 1;
+	}
+
+	if (enabled == 0)
+		return 0;
+
+	//The pin would still fire on its IOAPIC vector
+	m_Descriptor.command |= PCI_COMMAND_INTX_DISABLE;
+	WriteCommand();
+
+	Printf("PCI: %d message interrupts for Bus=%d, Device=%d, Func=%d, first vector 0x%x\r\n",
+		enabled, m_Descriptor.bus, m_Descriptor.device, m_Descriptor.function, m_MsiVectors[0]);
+	return enabled;
+}
+
+void PCIDevice::DisableMsi()
+{
+	if (m_MsiVectors.empty())
+		return;
+
+	const uint8_t cap = m_MsixCap ? m_MsixCap : m_MsiCap;
+	const uint32_t enable = m_MsixCap ? PCI_MSIX_CTRL_ENABLE : PCI_MSI_CTRL_ENABLE;
+	writeBus(cap, readBus(cap) & ~(enable << 16));
+
+	HAL* hal = m_PCIBus->m_HAL;
+	for (uint8_t vector : m_MsiVectors)
+		hal->FreeVector(vector);
+	m_MsiVectors.clear();
+
+	m_Descriptor.command &= ~PCI_COMMAND_INTX_DISABLE;
+	WriteCommand();
+}
+
+void PCIDevice::WriteCommand()
+{
+	writeBus(PCI_DESCR_OFFSET_COMMAND, m_Descriptor.command);
+}
+
+size_t PCIDevice::EnableMsix(const InterruptContext* handlers, size_t count, uint32_t address)
+{
+	uint32_t header = readBus(m_MsixCap);
+	const size_t tableSize = ((header >> 16) & PCI_MSIX_CTRL_SIZE_MASK) + 1;
+	const uint32_t table = readBus(m_MsixCap + PCI_MSIX_TABLE);
+
+	const BaseAddressRegister& bar = m_Descriptor.bars[table & PCI_MSIX_BIR_MASK];
+	if (bar.type != MemoryMapping || !bar.address)
+		return 0;
+
+	if (!m_MsixTable)
+	{
+		const uintptr_t physical = (uintptr_t)bar.address + (table & ~PCI_MSIX_BIR_MASK);
+		m_MsixTable = (volatile uint32_t*)kernel.MapPhysicalMemory(physical, tableSize * PCI_MSIX_ENTRY_SIZE);
+	}
+
+	//Hold the whole function masked while the table is written
+	header |= (uint32_t)(PCI_MSIX_CTRL_ENABLE | PCI_MSIX_CTRL_FUNC_MASK) << 16;
+	writeBus(m_MsixCap, header);
+
+	HAL* hal = m_PCIBus->m_HAL;
+	for (size_t i = 0; i < tableSize; i++)
+	{
+		volatile uint32_t* entry = m_MsixTable + i * (PCI_MSIX_ENTRY_SIZE / sizeof(uint32_t));
+		const uint8_t vector = (i < count) ? hal->AllocateVector() : 0;
+		if (!vector)
+		{
+			entry[3] |= PCI_MSIX_ENTRY_CTRL_MASKED;
+			continue;
+		}
+
+		hal->RegisterInterrupt(vector, handlers[i]);
+		m_MsiVectors.push_back(vector);
+
+		entry[0] = address;
+		entry[1] = 0;
+		entry[2] = vector;
+		entry[3] &= ~PCI_MSIX_ENTRY_CTRL_MASKED;
+	}
+
+	if (m_MsiVectors.empty())
+		header &= ~((uint32_t)PCI_MSIX_CTRL_ENABLE << 16);
+	header &= ~((uint32_t)PCI_MSIX_CTRL_FUNC_MASK << 16);
+	writeBus(m_MsixCap, header);
+
+	return m_MsiVectors.size();
 }
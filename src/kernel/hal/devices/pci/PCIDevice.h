@@ -1,7 +1,9 @@
 #pragma once
 
 #include "kernel/hal/devices/Device.h"
+#include "kernel/hal/Interrupt.h"
 #include "PCIBus.h"
+#include <vector>
 
 
 #define PCI_VEN_ID_INTEL	0x8086
@@ -93,7 +95,37 @@ public:
 	 */
 	void SetMemEnabled(bool enabled);
 
+	//Offset of the capability in config space, 0 if the device doesn't have it
+	uint8_t FindCapability(uint8_t id);
+	//Same for the extended list, needs ECAM
+	uint16_t FindExtendedCapability(uint16_t id);
+
+	bool HasMsi() const { return m_MsiCap != 0; }
+	bool HasMsix() const { return m_MsixCap != 0; }
+	bool HasAer() const { return m_AerCap != 0; }
+
+	/*
+	 * EnableMsi --
+	 *
+	 *    Gives each handler its own vector, targeted at the local APIC apicId,
+	 *    and switches the device from its pin to message signalled interrupts.
+	 *    MSI-X is used if present, plain MSI only ever gets one vector.
+	 *    Returns how many handlers got a vector, 0 means keep using the pin.
+	 */
+	size_t EnableMsi(const InterruptContext* handlers, size_t count, uint8_t apicId);
+	void DisableMsi();
+	const std::vector<uint8_t>& GetMsiVectors() const { return m_MsiVectors; }
+
 private:
+	void WriteCommand();
+	size_t EnableMsix(const InterruptContext* handlers, size_t count, uint32_t address);
+
 	PCIBus* m_PCIBus;
 	PCIDeviceDescriptor m_Descriptor;
+
+	uint8_t m_MsiCap;
+	uint8_t m_MsixCap;
+	uint16_t m_AerCap;
+	volatile uint32_t* m_MsixTable;
+	std::vector<uint8_t> m_MsiVectors;
 };
\ No newline at end of file
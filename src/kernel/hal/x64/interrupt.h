@@ -78,10 +78,15 @@ enum class X64_INTERRUPT_VECTOR : uint8_t
 	MouseInterrupt = 0x2C,
 	IRQ_ERROR = 0x33,
 
+	MSI_BASE = 0x40, //0x40 - 0x7F, handed out by HAL::AllocateVector
+	MSI_LAST = 0x7F,
+
 	Timer0 = 0x80,
 	COM2 = 0x83,
 	COM1 = 0x84,
+	HPET = 0x88, //0x88 - 0x8B, one per comparator
 	HypervisorVmBus = 0x90,
+	IpiCall = 0xF0, //HAL::CallCpus mailbox
 };
 
 
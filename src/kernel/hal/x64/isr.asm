@@ -2,6 +2,17 @@ INCLUDE x64.s
 
 ;Interrupt handler
 EXTERN INTERRUPT_HANDLER: proc
+;Saves the SIMD owner's state if CR0.TS was set on entry
+EXTERN INTERRUPT_SIMD_RELEASE: proc
+;#NM, lazy SIMD switch
+EXTERN SIMD_TRAP_HANDLER: proc
+
+CR0_TS EQU 8h
+
+; XMM0-5 are volatile in the Microsoft x64 ABI and the kernel's C++ uses them freely.
+; Below the interrupt frame: 6 registers, a flag set if TS was set on entry, padding to keep 16 byte alignment
+XmmFrameSize EQU 70h
+XmmReleased EQU 60h
 
 ISR_PROLOG MACRO
 	push rbp
@@ -70,16 +81,58 @@ noswap_start:
 	; Push Complete frame
 	ISR_PROLOG
 	PUSH_INTERRUPT_FRAME
-
+	sub rsp, XmmFrameSize
+
+	; With TS set the registers hold another thread's SIMD state, save it to that thread and leave them to the handler.
+	; Otherwise they are the interrupted thread's, keep its volatile ones.
+	mov rax, cr0
+	test rax, CR0_TS
+	jz save_xmm
+	mov qword ptr [rsp+XmmReleased], 1
+	clts
+	sub rsp, StackReserve
+	call INTERRUPT_SIMD_RELEASE
+	add rsp, StackReserve
+	jmp xmm_saved
+
+save_xmm:
+	mov qword ptr [rsp+XmmReleased], 0
+	movdqu xmmword ptr [rsp+00h], xmm0
+	movdqu xmmword ptr [rsp+10h], xmm1
+	movdqu xmmword ptr [rsp+20h], xmm2
+	movdqu xmmword ptr [rsp+30h], xmm3
+	movdqu xmmword ptr [rsp+40h], xmm4
+	movdqu xmmword ptr [rsp+50h], xmm5
+
+xmm_saved:
 	; INTERRUPT_HANDLER arguments
 	mov rcx, number
-	mov rdx, rsp
+	lea rdx, [rsp+XmmFrameSize]
 
 	sub rsp, StackReserve; Reserve 32bytes for register parameter area
 	call INTERRUPT_HANDLER; Call OS handler
 	add rsp, StackReserve; Reclaim register parameter area
 
+	; Trap the next SIMD use again, it brings the right state in. A restore below may trap if the
+	; scheduler switched threads in between, #NM loads the thread's state first.
+	cmp qword ptr [rsp+XmmReleased], 0
+	je restore_xmm
+	mov rax, cr0
+	or rax, CR0_TS
+	mov cr0, rax
+	jmp xmm_restored
+
+restore_xmm:
+	movdqu xmm0, xmmword ptr [rsp+00h]
+	movdqu xmm1, xmmword ptr [rsp+10h]
+	movdqu xmm2, xmmword ptr [rsp+20h]
+	movdqu xmm3, xmmword ptr [rsp+30h]
+	movdqu xmm4, xmmword ptr [rsp+40h]
+	movdqu xmm5, xmmword ptr [rsp+50h]
+
+xmm_restored:
 	; Restore previous frame
+	add rsp, XmmFrameSize
 	POP_INTERRUPT_FRAME
 	ISR_EPILOG
 
@@ -97,6 +150,39 @@ noswap_stop:
 x64_interrupt_handler_&number& ENDP
 ENDM
 
+; #NM, taken with CR0.TS set. Clears TS before any C++ runs so nothing in between can fault again,
+; doesn't touch XMM and never signals EOI since it's an exception.
+x64_SIMD_TRAP_HANDLER MACRO number
+x64_interrupt_handler_&number& PROC
+	cli
+	push 0
+
+	cmp qword ptr [rsp+10h], 8h
+	je noswap_start
+	swapgs
+
+noswap_start:
+	ISR_PROLOG
+	PUSH_INTERRUPT_FRAME
+	clts
+
+	sub rsp, StackReserve
+	call SIMD_TRAP_HANDLER
+	add rsp, StackReserve
+
+	POP_INTERRUPT_FRAME
+	ISR_EPILOG
+
+	cmp qword ptr [rsp+10h], 8h
+	je noswap_stop
+	swapgs
+
+noswap_stop:
+	add rsp, 8
+	iretq
+x64_interrupt_handler_&number& ENDP
+ENDM
+
 x64_INTERRUPT_HANDLER_BLOCK MACRO hasCode:REQ, startNumber:REQ, stopNumber:REQ
 count = startNumber
 WHILE count LT stopNumber
@@ -115,7 +201,7 @@ x64_INTERRUPT_HANDLER 0, 3
 x64_INTERRUPT_HANDLER 0, 4
 x64_INTERRUPT_HANDLER 0, 5
 x64_INTERRUPT_HANDLER 0, 6
-x64_INTERRUPT_HANDLER 0, 7
+x64_SIMD_TRAP_HANDLER 7
 x64_INTERRUPT_HANDLER 1, 8
 x64_INTERRUPT_HANDLER 0, 9
 x64_INTERRUPT_HANDLER 1, 10
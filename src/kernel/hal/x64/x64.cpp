@@ -393,27 +393,25 @@ void x64::SetupDescriptorTables()
 	__writecr4(__readcr4() | (1 << 16));
 	
 	
+	//Estimate in MHz, like the calibrated value that replaces it once the HPET is up
 	int regs[4];
 	__cpuid(regs, 0x15); //get TSC frequency
 	if (regs[2] == 0)  //On some processors (e.g. Intel Skylake), CPUID_15h_ECX is zero but CPUID_16h_EAX is present
 	{
-		int eax = regs[0];
-		int ebx = regs[1];
 		__cpuid(regs, 0x16);
-
-		if(regs[0] != 0 && regs[1] != 0 && eax != 0 && ebx != 0)
-			TSCFreq = (regs[0] * 10000000) * (eax/ebx);
+		TSCFreq = regs[0] & 0xFFFF; //Base frequency, MHz
 	}
-	else if (regs[1] != 0 && regs[2] != 0)
+	else if (regs[0] != 0 && regs[1] != 0)
 	{
-		TSCFreq = regs[2]* (regs[1]/regs[0]); // ECX * (EBX/EAX)
+		//Crystal Hz * EBX/EAX
+		TSCFreq = (uint32_t)(((uint64_t)(uint32_t)regs[2] * (uint32_t)regs[1] / (uint32_t)regs[0]) / 1000000);
 	}
 
 	//fallback on Intel
 	if(TSCFreq == 0)
 	{
 		uint64_t platform_info = __readmsr((uint32_t)MSR::IA32_MSR_PLATFORM_INFO);
-		TSCFreq = ((platform_info >> 8) && 0xFF) * 100;
+		TSCFreq = ((platform_info >> 8) & 0xFF) * 100;
 	}
 
 #if _VERBOSE_
@@ -513,7 +511,7 @@ bool x64::SupportsX2APIC()
 	int regs[4];
 	__cpuid(regs, 0x01);
 
-	if(regs[2] & (1 < 21))
+	if(regs[2] & (1 << 21))
 		return true;
 	return false;
 }
@@ -528,6 +526,7 @@ void x64::InitSIMD()
 {
 	uint64_t cr0 = __readcr0();
 	cr0 &= ~((uint64_t)CR0_EM);
+	cr0 &= ~((uint64_t)CR0_TS);
 	cr0 |= CR0_MONITOR_COPROC;
 	cr0 |= CR0_NUMERIC_ERROR;
 	__writecr0(cr0);
@@ -535,18 +534,67 @@ void x64::InitSIMD()
 	uint64_t cr4 = __readcr4();
 	cr4 |= CR4_FXSR;
 	cr4 |= CR4_SIMD_EXCEPTION;
+
+	g_hasXSAVE = HasECXFeature(ECX_XSAVE);
+	if (g_hasXSAVE)
+		cr4 |= CR4_OSXSAVE;
 	__writecr4(cr4);
 	_finit();
+
+	if (!g_hasXSAVE)
+		return;
+
+	//Enable every component we know how to handle that the CPU supports
+	int regs[4];
+	__cpuidex(regs, 0xD, 0);
+	const uint64_t supported = ((uint64_t)(uint32_t)regs[3] << 32) | (uint32_t)regs[0];
+	g_xsaveMask = supported & (XCR0_X87 | XCR0_SSE | XCR0_AVX | XCR0_OPMASK | XCR0_ZMM_HI256 | XCR0_HI16_ZMM);
+	_xsetbv(0, g_xsaveMask);
+
+	//EBX reflects the size required by the features now enabled in XCR0
+	__cpuidex(regs, 0xD, 0);
+	SIMDContextSize = regs[1];
+
+	__cpuidex(regs, 0xD, 1);
+	g_hasXSAVEOPT = regs[0] & 1;
+
+#if _VERBOSE_
+	Printf(__FUNCTION__ ": XSAVE mask 0x%x, area %d bytes, XSAVEOPT: %d\r\n", g_xsaveMask, SIMDContextSize, g_hasXSAVEOPT);
+#endif
+}
+
+void x64::SIMD_InitContext(void* ctx)
+{
+	//Zeroed XSAVE header means every component is in its init state, only MXCSR/FCW are loaded from memory
+	memset(ctx, 0, SIMDContextSize);
+	*(uint16_t*)((uint8_t*)ctx + 0) = 0x037F; //FCW
+	*(uint32_t*)((uint8_t*)ctx + 24) = 0x1F80; //MXCSR
 }
 
 void x64::SIMD_SaveContext(void* ctx)
 {
-	_fxsave(ctx);
+	if (g_hasXSAVEOPT)
+		_xsaveopt64(ctx, g_xsaveMask);
+	else if (g_hasXSAVE)
+		_xsave64(ctx, g_xsaveMask);
+	else
+		_fxsave64(ctx);
 }
 
 void x64::SIMD_RestoreContext(void* ctx)
 {
-	_fxrstor(ctx);
+	if (g_hasXSAVE)
+		_xrstor64(ctx, g_xsaveMask);
+	else
+		_fxrstor64(ctx);
+}
+
+void x64::SIMD_SetTrap(bool trap)
+{
+	if (trap)
+		__writecr0(__readcr0() | CR0_TS);
+	else
+		__writecr0(__readcr0() & ~((uint64_t)CR0_TS));
 }
 
 void x64::InitPIC()
@@ -575,6 +623,10 @@ void x64::InitPIC()
 volatile uint32_t x64::g_pitTicks = 0;
 
 uint32_t x64::TSCFreq = 0;
+uint32_t x64::SIMDContextSize = SIMD_CONTEXT_SIZE;
+bool x64::g_hasXSAVE = false;
+bool x64::g_hasXSAVEOPT = false;
+uint64_t x64::g_xsaveMask = 0;
 
 uint32_t x64::OnPITTimer0(void* arg)
 {
@@ -85,13 +85,24 @@ enum CPU_FEATURE
 	EDX_PBE = 1 << 31
 };
 
-#define SIMD_CONTEXT_SIZE 512
+#define SIMD_CONTEXT_SIZE 512 //FXSAVE area, XSAVE area size is read from CPUID 0xD
+#define SIMD_CONTEXT_ALIGN 64
 
 #define CR0_MONITOR_COPROC (1 << 1)
 #define CR0_EM (1 << 2)
+#define CR0_TS (1 << 3)
 #define CR0_NUMERIC_ERROR (1 << 5)
 #define CR4_FXSR (1 << 9)
 #define CR4_SIMD_EXCEPTION (1 << 10)
+#define CR4_OSXSAVE (1 << 18)
+
+//XCR0 state components we manage
+#define XCR0_X87 (1 << 0)
+#define XCR0_SSE (1 << 1)
+#define XCR0_AVX (1 << 2)
+#define XCR0_OPMASK (1 << 5)
+#define XCR0_ZMM_HI256 (1 << 6)
+#define XCR0_HI16_ZMM (1 << 7)
 
 class x64
 {
@@ -117,8 +128,13 @@ public:
 
 	static void EnableFSGSBASE();
 	static void InitSIMD();
+	static void SIMD_InitContext(void* ctx);
 	static void SIMD_SaveContext(void* ctx);
 	static void SIMD_RestoreContext(void* ctx);
+	static void SIMD_SetTrap(bool trap);
+
+	//Size of per thread SIMD area, depends on enabled XCR0 features
+	static uint32_t SIMDContextSize;
 
 	//TSC Frequency in mhz
 	static uint32_t TSCFreq;
@@ -127,6 +143,10 @@ private:
 
 	static volatile uint32_t g_pitTicks;
 
+	static bool g_hasXSAVE;
+	static bool g_hasXSAVEOPT;
+	static uint64_t g_xsaveMask;
+
 	static constexpr size_t IdtCount = 256;
 	static constexpr size_t IstStackSize = (1 << 12);//4k Stack
 	
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include "OS.System.h"
+#include "kernel/objects/KEvent.h"
+
+//Largest run of blocks the elevator builds out of adjacent requests
+#define BLOCK_MAX_MERGE		2048
+
+//Waiters drive the queue themselves after this long in case the completion interrupt got lost
+#define BLOCK_WAIT_TIMEOUT	20 //ms
+
+struct BlockSegment
+{
+	uint8_t* Buffer; //Word aligned
+	uint32_t Length; //Bytes, whole blocks
+};
+
+//Physically contiguous run of a request's segments
+struct BlockExtent
+{
+	paddr_t Address;
+	uint32_t Length; //Bytes
+};
+
+class Disk;
+struct BlockRequest;
+typedef void (*BlockCompletion)(BlockRequest* request, void* context);
+
+//Read or write of Count blocks at Lba, scattered over Segments. Owned by the submitter, which must not touch it
+//until it completes. Completion runs in interrupt context without locks held and may submit again. Without one
+//Done is set and Event, if any, signalled.
+struct BlockRequest
+{
+	bool Write;
+	uint64_t Lba;
+	uint32_t Count;
+	BlockSegment* Segments;
+	uint32_t SegmentCount;
+
+	BlockCompletion Completion;
+	void* Context;
+	KEvent* Event;
+
+	//Set on completion, 0 on success like the rest of the disk API
+	char Result;
+	volatile bool Done;
+
+	//Queue state, owned by Disk and the driver
+	Disk* Target;
+	uint64_t Sequence; //Submission order, overlapping requests that aren't both reads complete in it
+	BlockExtent* Extents; //Segments resolved by Submit in the submitter's address space, dispatch may run in any
+	uint32_t ExtentCount;
+	BlockRequest* Next; //Submission queue sorted by Lba then Sequence, or the in flight list
+	BlockRequest* MergeNext; //Adjacent requests transferred with this one as a single command
+	BlockRequest* MergeTail;
+	uint32_t MergedCount; //Blocks of the whole chain
+	uint32_t Progress; //Blocks of the chain already transferred
+};
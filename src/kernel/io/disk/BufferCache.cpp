@@ -0,0 +1,347 @@
+#include "BufferCache.h"
+#include "Disk.h"
+#include "kernel/Kernel.h"
+#include <Assert.h>
+#include <intrin.h>
+#include <cstring>
+#include <algorithm>
+
+BufferCache::BufferCache() :
+	m_lock("BufferCache"),
+	m_buffers(),
+	m_hash(),
+	m_data(new uint8_t[BUFFER_CACHE_BLOCKS * BUFFER_BLOCK_SIZE]),
+	m_hand(),
+	m_dirty(),
+	m_flushKick(false, false),
+	m_sorted(),
+	m_requests(),
+	m_segments(),
+	m_pending(),
+	m_flushDone(false, false),
+	m_hits(),
+	m_misses(),
+	m_evictions(),
+	m_written(),
+	m_batches(),
+	m_invalidated(),
+	m_bypassed()
+{
+	for (size_t i = 0; i < BUFFER_CACHE_BLOCKS; i++)
+		m_buffers[i].Data = m_data + i * BUFFER_BLOCK_SIZE;
+}
+
+char BufferCache::Read(Disk* disk, uint64_t lba, uint8_t* buf)
+{
+	if (disk->GetBlockSize() != BUFFER_BLOCK_SIZE)
+	{
+		m_bypassed++;
+		return disk->ReadSector(lba, buf);
+	}
+
+	KMutexGuard guard(m_lock);
+	Buffer* buffer = Lookup(disk, lba);
+	if (buffer)
+	{
+		m_hits++;
+		buffer->Referenced = true;
+		memcpy(buf, buffer->Data, BUFFER_BLOCK_SIZE);
+		return 0;
+	}
+
+	m_misses++;
+	buffer = Allocate(disk, lba);
+	if (!buffer)
+	{
+		m_bypassed++;
+		return disk->ReadSector(lba, buf);
+	}
+
+	//Allocated buffers aren't hashed yet, a failed read just leaves it free
+	const char result = disk->ReadSector(lba, buffer->Data);
+	if (result != 0)
+		return result;
+
+	const size_t index = Hash(disk, lba);
+	buffer->HashNext = m_hash[index];
+	m_hash[index] = buffer;
+	buffer->Valid = true;
+	memcpy(buf, buffer->Data, BUFFER_BLOCK_SIZE);
+	return 0;
+}
+
+char BufferCache::Write(Disk* disk, uint64_t lba, const uint8_t* buf)
+{
+	if (disk->GetBlockSize() != BUFFER_BLOCK_SIZE)
+	{
+		m_bypassed++;
+		return disk->WriteSector(lba, const_cast<uint8_t*>(buf));
+	}
+
+	KMutexGuard guard(m_lock);
+	Buffer* buffer = Lookup(disk, lba);
+	if (buffer)
+	{
+		m_hits++;
+	}
+	else
+	{
+		//Whole block is overwritten, nothing to read first
+		m_misses++;
+		buffer = Allocate(disk, lba);
+		if (!buffer)
+		{
+			m_bypassed++;
+			return disk->WriteSector(lba, const_cast<uint8_t*>(buf));
+		}
+
+		const size_t index = Hash(disk, lba);
+		buffer->HashNext = m_hash[index];
+		m_hash[index] = buffer;
+		buffer->Valid = true;
+	}
+
+	memcpy(buffer->Data, buf, BUFFER_BLOCK_SIZE);
+	buffer->Referenced = true;
+	if (!buffer->Dirty)
+	{
+		buffer->Dirty = true;
+		if (++m_dirty >= BUFFER_DIRTY_LIMIT)
+			m_flushKick.Set();
+	}
+	return 0;
+}
+
+void BufferCache::Invalidate(Disk* disk, uint64_t lba, uint32_t count)
+{
+	if (disk->GetBlockSize() != BUFFER_BLOCK_SIZE)
+		return;
+
+	KMutexGuard guard(m_lock);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		Buffer* buffer = Lookup(disk, lba + i);
+		if (!buffer)
+			continue;
+
+		//The disk has newer data than a dirty copy, don't write it back over it
+		if (buffer->Dirty)
+		{
+			buffer->Dirty = false;
+			m_dirty--;
+		}
+		Unhash(buffer);
+		m_invalidated++;
+	}
+}
+
+char BufferCache::Sync(Disk* disk)
+{
+	KMutexGuard guard(m_lock);
+	return WriteBack(disk);
+}
+
+void BufferCache::Purge(Disk* disk)
+{
+	KMutexGuard guard(m_lock);
+	WriteBack(disk);
+	for (size_t i = 0; i < BUFFER_CACHE_BLOCKS; i++)
+	{
+		Buffer* buffer = &m_buffers[i];
+		if (buffer->Valid && !buffer->Dirty && (!disk || buffer->Owner == disk))
+			Unhash(buffer);
+	}
+}
+
+void BufferCache::Start()
+{
+	kernel.KeCreateThread(&BufferCache::FlushThread, this, "BufferFlush");
+}
+
+size_t BufferCache::FlushThread(void* arg)
+{
+	BufferCache* cache = (BufferCache*)arg;
+	while (true)
+	{
+		kernel.KeWait(cache->m_flushKick, BUFFER_FLUSH_INTERVAL);
+		if (cache->m_dirty != 0)
+			cache->Sync();
+	}
+}
+
+void BufferCache::OnWritten(BlockRequest* request, void* context)
+{
+	BufferCache* cache = (BufferCache*)context;
+	if (_InterlockedDecrement(&cache->m_pending) == 0)
+	{
+		cache->m_flushDone.Set();
+		kernel.GetHAL()->RequestReschedule();
+	}
+}
+
+size_t BufferCache::Hash(const Disk* disk, const uint64_t lba) const
+{
+	return (size_t)(lba ^ ((uintptr_t)disk >> 6)) & (BUFFER_HASH_BUCKETS - 1);
+}
+
+BufferCache::Buffer* BufferCache::Lookup(const Disk* disk, const uint64_t lba) const
+{
+	for (Buffer* buffer = m_hash[Hash(disk, lba)]; buffer; buffer = buffer->HashNext)
+	{
+		if (buffer->Owner == disk && buffer->Lba == lba)
+			return buffer;
+	}
+	return nullptr;
+}
+
+void BufferCache::Unhash(Buffer* buffer)
+{
+	Buffer** link = &m_hash[Hash(buffer->Owner, buffer->Lba)];
+	while (*link != buffer)
+	{
+		Assert(*link != nullptr);
+		link = &(*link)->HashNext;
+	}
+	*link = buffer->HashNext;
+	buffer->HashNext = nullptr;
+	buffer->Valid = false;
+}
+
+BufferCache::Buffer* BufferCache::Allocate(Disk* disk, const uint64_t lba)
+{
+	//Caller holds m_lock. Two turns of the hand clear every reference bit, only dirty buffers can stop it.
+	for (size_t pass = 0; pass < 2; pass++)
+	{
+		for (size_t i = 0; i < 2 * BUFFER_CACHE_BLOCKS; i++)
+		{
+			Buffer* buffer = &m_buffers[m_hand];
+			m_hand = (m_hand + 1) % BUFFER_CACHE_BLOCKS;
+
+			if (buffer->Valid)
+			{
+				if (buffer->Referenced)
+				{
+					buffer->Referenced = false;
+					continue;
+				}
+				if (buffer->Dirty)
+					continue;
+
+				Unhash(buffer);
+				m_evictions++;
+			}
+
+			buffer->Owner = disk;
+			buffer->Lba = lba;
+			buffer->Dirty = false;
+			buffer->Referenced = true;
+			return buffer;
+		}
+
+		//Everything is dirty, clean it and go around again
+		if (WriteBack(nullptr) != 0)
+			break;
+	}
+	return nullptr;
+}
+
+char BufferCache::WriteBack(Disk* disk)
+{
+	//Caller holds m_lock
+	size_t count = 0;
+	for (size_t i = 0; i < BUFFER_CACHE_BLOCKS; i++)
+	{
+		Buffer* buffer = &m_buffers[i];
+		if (buffer->Valid && buffer->Dirty && (!disk || buffer->Owner == disk))
+			m_sorted[count++] = buffer;
+	}
+
+	//Ascending per disk, the elevator merges runs of neighbours into single commands
+	std::sort(m_sorted, m_sorted + count, [](const Buffer* a, const Buffer* b)
+	{
+		return a->Owner != b->Owner ? a->Owner < b->Owner : a->Lba < b->Lba;
+	});
+
+	for (size_t i = 0; i < count; i += BUFFER_FLUSH_BATCH)
+	{
+		if (Flush(m_sorted + i, std::min<size_t>(count - i, BUFFER_FLUSH_BATCH)) != 0)
+			return 1;
+	}
+	return 0;
+}
+
+char BufferCache::Flush(Buffer** buffers, const size_t count)
+{
+	m_pending = (long)count;
+	size_t i = 0;
+	while (i < count)
+	{
+		Disk* disk = buffers[i]->Owner;
+		disk->Plug();
+		for (; i < count && buffers[i]->Owner == disk; i++)
+		{
+			m_segments[i] = { buffers[i]->Data, BUFFER_BLOCK_SIZE };
+			m_requests[i] = {};
+			m_requests[i].Write = true;
+			m_requests[i].Lba = buffers[i]->Lba;
+			m_requests[i].Count = 1;
+			m_requests[i].Segments = &m_segments[i];
+			m_requests[i].SegmentCount = 1;
+			m_requests[i].Completion = OnWritten;
+			m_requests[i].Context = this;
+			disk->Submit(&m_requests[i]);
+		}
+		disk->Unplug();
+	}
+
+	const bool canBlock = (__readeflags() & RFLAGS_IF) && kernel.GetScheduler()->Enabled;
+	while (m_pending != 0)
+	{
+		if (canBlock && kernel.KeWait(m_flushDone, BLOCK_WAIT_TIMEOUT) == WaitStatus::Signaled)
+			continue;
+
+		//Interrupt lost or not usable, drive the queues ourselves
+		for (size_t j = 0; j < count; j++)
+		{
+			if (j == 0 || buffers[j]->Owner != buffers[j - 1]->Owner)
+				buffers[j]->Owner->Poll();
+		}
+		if (!canBlock)
+			_mm_pause();
+	}
+
+	//Failed blocks stay dirty for the next round
+	char result = 0;
+	for (size_t j = 0; j < count; j++)
+	{
+		if (m_requests[j].Result != 0)
+		{
+			result = 1;
+			continue;
+		}
+		buffers[j]->Dirty = false;
+		m_dirty--;
+		m_written++;
+	}
+	m_batches++;
+	return result;
+}
+
+void BufferCache::Display() const
+{
+	const uint64_t lookups = m_hits + m_misses;
+	Printf("BufferCache: %d blocks, %d dirty, %d hits, %d misses (%d%% hit), %d evictions, %d invalidated, %d bypassed\r\n",
+		BUFFER_CACHE_BLOCKS, m_dirty, m_hits, m_misses, lookups != 0 ? (m_hits * 100) / lookups : 0, m_evictions, m_invalidated, m_bypassed);
+	Printf("    Write back: %d blocks in %d batches\r\n", m_written, m_batches);
+}
+
+void BufferCache::ResetStats()
+{
+	m_hits = 0;
+	m_misses = 0;
+	m_evictions = 0;
+	m_written = 0;
+	m_batches = 0;
+	m_invalidated = 0;
+	m_bypassed = 0;
+}
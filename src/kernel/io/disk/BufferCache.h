@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <os.internal.h>
+#include "BlockRequest.h"
+#include "kernel/objects/KMutex.h"
+#include "kernel/objects/KEvent.h"
+
+#define BUFFER_CACHE_BLOCKS		1024
+#define BUFFER_BLOCK_SIZE		512 //Disks with other block sizes bypass the cache
+#define BUFFER_HASH_BUCKETS		256 //Power of two
+#define BUFFER_DIRTY_LIMIT		(BUFFER_CACHE_BLOCKS / 4) //Wakes the flusher early
+#define BUFFER_FLUSH_INTERVAL	1000 //ms
+#define BUFFER_FLUSH_BATCH		64 //Writes submitted under one plug
+
+class Disk;
+
+//Block cache keyed by (Disk, Lba) for filesystem metadata. Writes only dirty the cached copy, a flusher thread
+//writes them back sorted by Lba so the disk queue can merge neighbours. Eviction is CLOCK over all buffers.
+class BufferCache
+{
+public:
+	BufferCache();
+
+	//Single block, 0 on success like Disk
+	char Read(Disk* disk, uint64_t lba, uint8_t* buf);
+	char Write(Disk* disk, uint64_t lba, const uint8_t* buf);
+	//Drops cached copies of blocks written around the cache, dirty ones included
+	void Invalidate(Disk* disk, uint64_t lba, uint32_t count);
+	//Writes back dirty blocks of disk, or of all disks
+	char Sync(Disk* disk = nullptr);
+	//Sync, then forget the clean blocks. For unmounting and cold measurements.
+	void Purge(Disk* disk = nullptr);
+
+	//Creates the flusher thread, needs the scheduler
+	void Start();
+
+	void Display() const;
+	void ResetStats();
+
+private:
+	struct Buffer
+	{
+		Disk* Owner;
+		uint64_t Lba;
+		Buffer* HashNext;
+		uint8_t* Data;
+		bool Valid;
+		bool Dirty;
+		bool Referenced; //Second chance for CLOCK
+	};
+
+	static size_t FlushThread(void* arg);
+	static void OnWritten(BlockRequest* request, void* context);
+
+	size_t Hash(const Disk* disk, const uint64_t lba) const;
+	Buffer* Lookup(const Disk* disk, const uint64_t lba) const;
+	void Unhash(Buffer* buffer);
+	Buffer* Allocate(Disk* disk, const uint64_t lba);
+	char WriteBack(Disk* disk);
+	char Flush(Buffer** buffers, const size_t count);
+
+	//Held across disk I/O, never taken from interrupt context
+	KMutex m_lock;
+	Buffer m_buffers[BUFFER_CACHE_BLOCKS];
+	Buffer* m_hash[BUFFER_HASH_BUCKETS];
+	uint8_t* m_data;
+	size_t m_hand;
+	size_t m_dirty;
+	KEvent m_flushKick;
+
+	//Write back in progress, guarded by m_lock
+	Buffer* m_sorted[BUFFER_CACHE_BLOCKS];
+	BlockRequest m_requests[BUFFER_FLUSH_BATCH];
+	BlockSegment m_segments[BUFFER_FLUSH_BATCH];
+	volatile long m_pending;
+	KEvent m_flushDone;
+
+	//Stats
+	uint64_t m_hits;
+	uint64_t m_misses;
+	uint64_t m_evictions;
+	uint64_t m_written;
+	uint64_t m_batches;
+	uint64_t m_invalidated;
+	uint64_t m_bypassed;
+
+	::NO_COPY_OR_ASSIGN(BufferCache);
+};
@@ -1,23 +1,431 @@
 #include "Disk.h"
+#include "kernel/Kernel.h"
+#include <mem\pagetables.h>
+#include <algorithm>
+#include <cstring>
 
 Disk::Disk(DiskDriver* driver, uint32_t driverIndex, DiskType type, uint64_t size, uint32_t blocks, uint32_t blockSize)
-: m_Driver(driver), m_DriverIndex(driverIndex), m_Type(type), m_Size(size), m_BlockSize(blockSize), m_NumBlocks(blocks)
+: m_Driver(driver), m_DriverIndex(driverIndex), m_Type(type), m_Size(size), m_BlockSize(blockSize), m_NumBlocks(blocks),
+	m_queueLock("DiskQueue"), m_queue(), m_active(), m_sequence(), m_position(), m_inflight(), m_plugged(), m_submitted(), m_merged(), m_dispatched(), m_requeued(),
+	m_maxQueued(), m_queued()
 {
 
 }
 
 char Disk::ReadSector(uint64_t lba, uint8_t* buf)
 {
-	if(m_Driver)
-		return m_Driver->ReadSector(m_DriverIndex, lba, buf);
-	return 1;
+	return Transfer(false, lba, 1, buf);
 }
 
 char Disk::WriteSector(uint64_t lba, uint8_t* buf)
 {
-	if(m_Driver)
-		return m_Driver->WriteSector(m_DriverIndex, lba, buf);
-	return 1;
+	return Transfer(true, lba, 1, buf);
+}
+
+char Disk::ReadSectors(uint64_t lba, uint32_t count, uint8_t* buf)
+{
+	return Transfer(false, lba, count, buf);
+}
+
+char Disk::WriteSectors(uint64_t lba, uint32_t count, uint8_t* buf)
+{
+	return Transfer(true, lba, count, buf);
+}
+
+char Disk::Transfer(bool write, uint64_t lba, uint32_t count, uint8_t* buf)
+{
+	if (!m_Driver)
+		return 1;
+
+	//Scatter lists need word alignment, bounce anything else through an aligned copy
+	const uint32_t length = count * m_BlockSize;
+	uint8_t* data = buf;
+	if ((uintptr_t)buf & 1)
+	{
+		data = new uint8_t[length];
+		if (write)
+			memcpy(data, buf, length);
+	}
+
+	BlockSegment segment = { data, length };
+	KEvent event(false, false);
+	BlockRequest request = {};
+	request.Write = write;
+	request.Lba = lba;
+	request.Count = count;
+	request.Segments = &segment;
+	request.SegmentCount = 1;
+	request.Event = &event;
+
+	Submit(&request);
+	Wait(&request);
+
+	if (data != buf)
+	{
+		if (!write && request.Result == 0)
+			memcpy(buf, data, length);
+		delete[] data;
+	}
+	return request.Result;
+}
+
+void Disk::Submit(BlockRequest* request)
+{
+	Assert(request->Count != 0 && request->SegmentCount != 0);
+	request->Result = 0;
+	request->Done = false;
+	request->Target = this;
+	request->Next = nullptr;
+	request->MergeNext = nullptr;
+	request->MergeTail = request;
+	request->MergedCount = request->Count;
+	request->Progress = 0;
+	request->Extents = nullptr;
+	request->ExtentCount = 0;
+
+	if (!m_Driver || !Resolve(request))
+	{
+		request->Result = 1;
+		Finish(request);
+		return;
+	}
+
+	{
+		KLockGuard<KSpinLock> guard(m_queueLock);
+		m_submitted++;
+		request->Sequence = m_sequence++;
+
+		//Behind everything queued at the same Lba, it came later
+		BlockRequest** link = &m_queue;
+		BlockRequest* prev = nullptr;
+		while (*link && (*link)->Lba <= request->Lba)
+		{
+			prev = *link;
+			link = &(*link)->Next;
+		}
+		BlockRequest* next = *link;
+
+		if (prev && TryMerge(prev, request))
+		{
+			//Request may have closed the gap to the next one
+			m_merged++;
+			if (next && TryMerge(prev, next))
+			{
+				prev->Next = next->Next;
+				m_merged++;
+				m_queued--;
+			}
+		}
+		else if (next && TryMerge(request, next))
+		{
+			request->Next = next->Next;
+			*link = request;
+			m_merged++;
+		}
+		else
+		{
+			request->Next = next;
+			*link = request;
+			m_queued++;
+			if (m_queued > m_maxQueued)
+				m_maxQueued = m_queued;
+		}
+	}
+
+	Dispatch();
+}
+
+bool Disk::Resolve(BlockRequest* request)
+{
+	size_t pages = 0;
+	for (uint32_t i = 0; i < request->SegmentCount; i++)
+	{
+		const BlockSegment& segment = request->Segments[i];
+		Assert(((uintptr_t)segment.Buffer & 1) == 0);
+		pages += (((uintptr_t)segment.Buffer & PageMask) + segment.Length + PageMask) >> PageShift;
+	}
+
+	PageTables tables;
+	tables.OpenCurrent();
+
+	BlockExtent* extents = new BlockExtent[pages];
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < request->SegmentCount; i++)
+	{
+		const BlockSegment& segment = request->Segments[i];
+		for (size_t offset = 0; offset < segment.Length; )
+		{
+			const uintptr_t address = (uintptr_t)segment.Buffer + offset;
+			const size_t chunk = std::min<size_t>(PageSize - (address & PageMask), segment.Length - offset);
+
+			paddr_t physical;
+			if (!tables.TryResolveAddress(address, physical))
+			{
+				delete[] extents;
+				return false;
+			}
+
+			BlockExtent* last = count != 0 ? &extents[count - 1] : nullptr;
+			if (last && last->Address + last->Length == physical)
+				last->Length += (uint32_t)chunk;
+			else
+				extents[count++] = { physical, (uint32_t)chunk };
+			offset += chunk;
+		}
+	}
+
+	request->Extents = extents;
+	request->ExtentCount = count;
+	return true;
+}
+
+void Disk::Finish(BlockRequest* request)
+{
+	//Not queued, nothing else knows about it
+	delete[] request->Extents;
+	request->Extents = nullptr;
+	if (request->Completion)
+	{
+		request->Completion(request, request->Context);
+	}
+	else
+	{
+		request->Done = true;
+		if (request->Event)
+			request->Event->Set();
+	}
+}
+
+bool Disk::TryMerge(BlockRequest* front, BlockRequest* back)
+{
+	//Caller holds m_queueLock, both are queued or about to be
+	if (front->Write != back->Write || front->Progress != 0 || back->Progress != 0)
+		return false;
+	if (front->Lba + front->MergedCount != back->Lba || front->MergedCount + back->MergedCount > BLOCK_MAX_MERGE)
+		return false;
+
+	//A held back request would hold back the whole chain, including members older than what it waits for
+	if (IsBlocked(front) || IsBlocked(back))
+		return false;
+
+	front->MergeTail->MergeNext = back;
+	front->MergeTail = back->MergeTail;
+	front->MergedCount += back->MergedCount;
+	return true;
+}
+
+void Disk::Requeue(BlockRequest* request)
+{
+	//Caller holds m_queueLock
+	BlockRequest** link = &m_queue;
+	while (*link && ((*link)->Lba < request->Lba || ((*link)->Lba == request->Lba && (*link)->Sequence < request->Sequence)))
+		link = &(*link)->Next;
+	request->Next = *link;
+	*link = request;
+	m_queued++;
+}
+
+bool Disk::IsBlocked(const BlockRequest* chain) const
+{
+	//Caller holds m_queueLock. Queued chains and chains in flight both count, merged members by themselves.
+	const BlockRequest* lists[] = { m_active, m_queue };
+	for (const BlockRequest* list : lists)
+	{
+		for (const BlockRequest* other = list; other; other = other->Next)
+		{
+			if (other == chain)
+				continue;
+
+			for (const BlockRequest* mine = chain; mine; mine = mine->MergeNext)
+			{
+				for (const BlockRequest* theirs = other; theirs; theirs = theirs->MergeNext)
+				{
+					if (theirs->Sequence < mine->Sequence && (theirs->Write || mine->Write)
+						&& theirs->Lba < mine->Lba + mine->Count && mine->Lba < theirs->Lba + theirs->Count)
+						return true;
+				}
+			}
+		}
+	}
+	return false;
+}
+
+void Disk::Deactivate(BlockRequest* request)
+{
+	//Caller holds m_queueLock
+	BlockRequest** link = &m_active;
+	while (*link != request)
+	{
+		Assert(*link != nullptr);
+		link = &(*link)->Next;
+	}
+	*link = request->Next;
+	request->Next = nullptr;
+	m_inflight--;
+}
+
+void Disk::Plug()
+{
+	_InterlockedIncrement(&m_plugged);
+}
+
+void Disk::Unplug()
+{
+	if (_InterlockedDecrement(&m_plugged) == 0)
+		Dispatch();
+}
+
+void Disk::Dispatch()
+{
+	const uint32_t depth = m_Driver->GetQueueDepth(m_DriverIndex);
+	while (true)
+	{
+		BlockRequest* request;
+		{
+			KLockGuard<KSpinLock> guard(m_queueLock);
+			if (!m_queue || m_inflight >= depth || m_plugged != 0)
+				return;
+
+			//Next one up from where the head is, lowest once nothing is left above. Held back ones are passed over,
+			//the completion of what they wait for dispatches again.
+			BlockRequest** start = &m_queue;
+			while (*start && (*start)->Lba < m_position)
+				start = &(*start)->Next;
+
+			BlockRequest** link = start;
+			while (*link && IsBlocked(*link))
+				link = &(*link)->Next;
+			if (!*link)
+			{
+				link = &m_queue;
+				while (*link != *start && IsBlocked(*link))
+					link = &(*link)->Next;
+				if (*link == *start)
+					return;
+			}
+
+			request = *link;
+			*link = request->Next;
+			request->Next = m_active;
+			m_active = request;
+			m_queued--;
+			m_inflight++;
+			m_dispatched++;
+			m_position = request->Lba + request->MergedCount;
+		}
+
+		if (!m_Driver->SubmitRequest(m_DriverIndex, request))
+		{
+			//Slots taken by others, the next completion or a waiter's poll comes back here
+			KLockGuard<KSpinLock> guard(m_queueLock);
+			Deactivate(request);
+			m_dispatched--;
+			Requeue(request);
+			return;
+		}
+	}
+}
+
+void Disk::CompleteRequest(BlockRequest* request, uint32_t blocks, bool failed)
+{
+	if (!failed && request->Progress + blocks < request->MergedCount)
+	{
+		//Driver couldn't fit the whole chain in one command, queue the rest
+		{
+			KLockGuard<KSpinLock> guard(m_queueLock);
+			request->Progress += blocks;
+			Deactivate(request);
+			m_requeued++;
+			Requeue(request);
+		}
+		Dispatch();
+		return;
+	}
+
+	//Waiters take the lock before returning, so their events outlive this. Callbacks may submit, they run after.
+	BlockRequest* callbacks = nullptr;
+	BlockRequest** tail = &callbacks;
+	{
+		KLockGuard<KSpinLock> guard(m_queueLock);
+		Deactivate(request);
+
+		for (BlockRequest* current = request; current; )
+		{
+			BlockRequest* next = current->MergeNext;
+			current->Result = failed ? 1 : 0;
+			delete[] current->Extents;
+			current->Extents = nullptr;
+			if (current->Completion)
+			{
+				current->MergeNext = nullptr;
+				*tail = current;
+				tail = &current->MergeNext;
+			}
+			else
+			{
+				current->Done = true;
+				if (current->Event)
+				{
+					current->Event->Set();
+					kernel.GetHAL()->RequestReschedule();
+				}
+			}
+			current = next;
+		}
+	}
+
+	while (callbacks)
+	{
+		BlockRequest* next = callbacks->MergeNext;
+		callbacks->Completion(callbacks, callbacks->Context);
+		callbacks = next;
+	}
+
+	Dispatch();
+}
+
+void Disk::Wait(BlockRequest* request)
+{
+	Assert(request->Completion == nullptr);
+
+	const bool canBlock = request->Event && (__readeflags() & RFLAGS_IF) && kernel.GetScheduler()->Enabled;
+	while (!request->Done)
+	{
+		if (canBlock && kernel.KeWait(*request->Event, BLOCK_WAIT_TIMEOUT) == WaitStatus::Signaled)
+			continue;
+
+		//Interrupt lost or not usable, drive the queue ourselves
+		Poll();
+		if (!canBlock)
+			_mm_pause();
+	}
+
+	//Done may be seen while the completing CPU is still about to set the event
+	KLockGuard<KSpinLock> guard(m_queueLock);
+}
+
+void Disk::Poll()
+{
+	if (!m_Driver)
+		return;
+
+	m_Driver->Poll(m_DriverIndex);
+	Dispatch();
+}
+
+void Disk::DisplayQueue() const
+{
+	Printf("Disk %s: %d requests, %d merged, %d commands, %d requeued, max %d queued, %d in flight\r\n", identifier ? identifier : "",
+		m_submitted, m_merged, m_dispatched, m_requeued, m_maxQueued, m_inflight);
+}
+
+void Disk::ResetQueueStats()
+{
+	m_submitted = 0;
+	m_merged = 0;
+	m_dispatched = 0;
+	m_requeued = 0;
+	m_maxQueued = m_queued;
 }
 
 void Disk::AddPartitionInfo(PartitionInfo info)
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "kernel/drivers/io/DiskDriver.h"
+#include "kernel/objects/KSpinLock.h"
 
 enum DiskType
 {
@@ -26,12 +27,34 @@ public:
 	Disk(DiskDriver* driver, uint32_t driverIndex, DiskType type, uint64_t size, uint32_t blocks, uint32_t blockSize);
 
 
+	//Synchronous, through the request queue
 	virtual char ReadSector(uint64_t lba, uint8_t* buf);
 	virtual char WriteSector(uint64_t lba, uint8_t* buf);
+	//count blocks in one go, buf has to hold count * GetBlockSize() bytes
+	virtual char ReadSectors(uint64_t lba, uint32_t count, uint8_t* buf);
+	virtual char WriteSectors(uint64_t lba, uint32_t count, uint8_t* buf);
+
+	//Queue request, merged with adjacent queued ones and dispatched in Lba order as the drive has room. Segments
+	//are resolved to physical memory right here, so they have to be mapped in the current address space.
+	void Submit(BlockRequest* request);
+	//For requests without completion callback, sleeps on the event if there is one and blocking is possible
+	void Wait(BlockRequest* request);
+	//Hold back dispatch while submitting a batch so the elevator sees all of it, nests
+	void Plug();
+	void Unplug();
+	//Reap completions and dispatch, for waiters that can't rely on the interrupt
+	void Poll();
+	//Called by the driver
+	void CompleteRequest(BlockRequest* request, uint32_t blocks, bool failed);
+
+	void DisplayQueue() const;
+	void ResetQueueStats();
 
 	void AddPartitionInfo(PartitionInfo info);
 
 	DiskType GetType() { return m_Type; }
+	uint32_t GetBlockSize() const { return m_BlockSize; }
+	uint64_t GetSize() const { return m_Size; }
 
 	char* identifier = 0;
 private:
@@ -47,4 +70,31 @@ private:
 
 	uint8_t partitionCount = 0;
 	PartitionInfo m_Partitions[128]; //set to 128 to be GPT compatible
+
+	char Transfer(bool write, uint64_t lba, uint32_t count, uint8_t* buf);
+	bool Resolve(BlockRequest* request);
+	void Finish(BlockRequest* request);
+	void Dispatch();
+	bool TryMerge(BlockRequest* front, BlockRequest* back);
+	void Requeue(BlockRequest* request);
+	bool IsBlocked(const BlockRequest* chain) const;
+	void Deactivate(BlockRequest* request);
+
+	//Submission queue, sorted by Lba. C-LOOK: dispatch upwards from the end of the last request, then wrap around.
+	//Requests overlapping an older one are held back until it completes unless both read.
+	KSpinLock m_queueLock;
+	BlockRequest* m_queue;
+	BlockRequest* m_active; //Chains in flight
+	uint64_t m_sequence;
+	uint64_t m_position;
+	uint32_t m_inflight;
+	volatile long m_plugged;
+
+	//Stats
+	uint64_t m_submitted;
+	uint64_t m_merged;
+	uint64_t m_dispatched;
+	uint64_t m_requeued; //Driver covered only part of a chain
+	uint32_t m_maxQueued;
+	uint32_t m_queued;
 };
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 #include "Disk.h"
+#include "kernel/objects/KSpinLock.h"
 #include <list>
 
 #pragma pack(push, 1)
@@ -49,12 +50,15 @@ public:
 	char ReadSector(uint16_t diskIndex, uint64_t sector, uint8_t* buf);
 	char WriteSector(uint16_t diskIndex, uint64_t sector, uint8_t* buf);
 
+	//Callers must not add or remove disks while iterating
 	const std::list<Disk*>* GetDisks(){ return m_Disks; }
 
 private:
+	Disk* GetDisk(uint16_t diskIndex);
 
 	void AssignVFS(PartitionTableEntry partition, Disk* disk);
 	void DetectAndLoadFilesystem(Disk* disk);
 
 	std::list<Disk*>* m_Disks;
+	KSpinLock m_Lock; //Protects m_Disks, not held during I/O
 };
\ No newline at end of file
@@ -3,13 +3,16 @@
 #include <kernel\vfs\FAT.h>
 
 DiskManager::DiskManager()
+	: m_Lock("DiskManager")
 {
 	m_Disks = new std::list<Disk *>();
 }
 
 void DiskManager::AddDisk(Disk* d)
 {
+	const cpu_flags_t flags = m_Lock.AcquireIrqSave();
 	m_Disks->push_back(d);
+	m_Lock.ReleaseIrqRestore(flags);
 
 	DetectAndLoadFilesystem(d);
 
@@ -17,29 +20,41 @@ void DiskManager::AddDisk(Disk* d)
 
 void DiskManager::RemoveDisk(Disk* d)
 {
+	const cpu_flags_t flags = m_Lock.AcquireIrqSave();
 	m_Disks->remove(d);
+	m_Lock.ReleaseIrqRestore(flags);
 
 	//TODO: unmount filesystem
 }
 
 char DiskManager::ReadSector(uint16_t diskIndex, uint64_t sector, uint8_t* buf)
 {
-	if (diskIndex < m_Disks->size())
-	{
-		return (m_Disks->front() + diskIndex)->ReadSector(sector, buf);
-	}
+	Disk* disk = GetDisk(diskIndex);
+	if (disk)
+		return disk->ReadSector(sector, buf);
 	return 0;
 }
 
 char DiskManager::WriteSector(uint16_t diskIndex, uint64_t sector, uint8_t* buf)
 {
-	if (diskIndex < m_Disks->size())
-	{
-		return (m_Disks->front() + diskIndex)->WriteSector(sector, buf);
-	}
+	Disk* disk = GetDisk(diskIndex);
+	if (disk)
+		return disk->WriteSector(sector, buf);
 	return 0;
 }
 
+Disk* DiskManager::GetDisk(uint16_t diskIndex)
+{
+	KLockGuard<KSpinLock> guard(m_Lock);
+
+	if (diskIndex >= m_Disks->size())
+		return nullptr;
+
+	auto it = m_Disks->begin();
+	std::advance(it, diskIndex);
+	return *it;
+}
+
 void DiskManager::AssignVFS(PartitionTableEntry partition, Disk* disk)
 {
 	if (partition.partition_id == 0xCD)
@@ -14,6 +14,7 @@ namespace
 KHeap::KHeap(PMM& physicalMemory, void* const heapStart, void* const heapEnd) :
 	m_physicalMemory(physicalMemory),
 	m_isInitialized(false),
+	m_lock("KHeap"),
 	m_blocks(),
 	m_start(reinterpret_cast<uintptr_t>(heapStart)),
 	m_watermark(reinterpret_cast<uintptr_t>(heapStart)),
@@ -51,6 +52,8 @@ void* KHeap::Allocate(const size_t size)
 {
 	const size_t allocationSize = ByteAlign(size, HeapAlign);
 
+	KLockGuard<KSpinLock> guard(m_lock);
+
 	ListEntry* entry = m_blocks.Flink;
 	HeapBlock* block = LIST_CONTAINING_RECORD(entry, HeapBlock, Link);
 	while (!block->Free || block->Size < allocationSize)
@@ -121,6 +124,9 @@ void KHeap::Deallocate(void* const address)
 	AssertOp((uintptr_t)address, < , m_end);
 
 	HeapBlock* block = (HeapBlock*)((uintptr_t)address - sizeof(HeapBlock));
+
+	//Checked under the lock, a concurrent free of the same block would pass both otherwise
+	KLockGuard<KSpinLock> guard(m_lock);
 	AssertEqual(block->Magic, Magic);
 	Assert(!block->Free);
 	Assert(&block->Data == address);
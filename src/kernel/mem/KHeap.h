@@ -4,6 +4,7 @@
 #include <cstddef>
 #include <cstdint>
 #include "Kernel/mem/PMM.h"
+#include "kernel/objects/KSpinLock.h"
 
 //Needs to track every block so condensing works when deallocating, hence free bit
 class KHeap
@@ -42,6 +43,9 @@ private:
 
 	bool m_isInitialized;
 
+	//Allocations happen from interrupt handlers too
+	KSpinLock m_lock;
+
 	//Housekeeping
 	ListEntry m_blocks;
 	uintptr_t m_start;
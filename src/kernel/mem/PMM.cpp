@@ -24,6 +24,7 @@ namespace
 }
 
 PMM::PMM(void* const address, const size_t count) :
+	m_lock("PMM"),
 	m_frames(reinterpret_cast<PageFrame*>(address)),
 	m_count(count),
 	m_freeList(),
@@ -93,6 +94,8 @@ void PMM::Initialize(const MemoryMap& memoryMap)
 
 bool PMM::AllocatePage(paddr_t& address)
 {
+	KLockGuard<KSpinLock> guard(m_lock);
+
 	if (address != 0)
 	{
 		//Specific address requested
@@ -137,6 +140,7 @@ void PMM::DeallocatePage(const paddr_t address)
 bool PMM::AllocateContiguous(paddr_t& address, const size_t pageCount)
 {
 	//Printf("AllocateContiguous: 0x%016x, 0x%x\n", address, pageCount);
+	KLockGuard<KSpinLock> guard(m_lock);
 
 	const size_t length = m_buddyMap.Length;
 	const size_t buddyCount = DivRoundUp(pageCount, BuddySize);
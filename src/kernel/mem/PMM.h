@@ -5,6 +5,7 @@
 #include "os.List.h"
 #include "os.System.h"
 #include "kernel/types/BitVector.h"
+#include "kernel/objects/KSpinLock.h"
 
 
 #include <array>
@@ -28,6 +29,8 @@ public:
 private:
 	size_t GetIndex(const PageFrame* entry) const;
 
+	KSpinLock m_lock;
+
 	PageFrame* const m_frames;
 	const size_t m_count;
 	ListEntry m_freeList;
@@ -0,0 +1,137 @@
+#include "TlbShootdown.h"
+
+#include <Assert.h>
+#include <intrin.h>
+#include "kernel/Kernel.h"
+#include "kernel/hal/x64/x64.h"
+#include "kernel/proc/UProc.h"
+
+#define CR4_PGE (1 << 7)
+
+uint64_t TlbShootdown::s_flushes;
+uint64_t TlbShootdown::s_fullFlushes;
+uint64_t TlbShootdown::s_pages;
+uint64_t TlbShootdown::s_remoteCpus;
+uint64_t TlbShootdown::s_totalCycles;
+uint64_t TlbShootdown::s_maxCycles;
+
+TlbShootdown::TlbShootdown(UserProcess* process /*= nullptr*/) :
+	m_process(process),
+	m_ranges(),
+	m_count(),
+	m_pages(),
+	m_flushAll()
+{
+
+}
+
+TlbShootdown::~TlbShootdown()
+{
+	Flush();
+}
+
+void TlbShootdown::Add(const uintptr_t address, const size_t pages /*= 1*/)
+{
+	Assert((address & PageMask) == 0);
+
+	m_pages += pages;
+	if (m_flushAll || m_pages > TLB_FLUSH_ALL_PAGES)
+	{
+		m_flushAll = true;
+		return;
+	}
+
+	//Unmapping usually walks forward, extend the last range
+	if (m_count != 0)
+	{
+		Range& last = m_ranges[m_count - 1];
+		if (last.Address + (last.Pages << PageShift) == address)
+		{
+			last.Pages += pages;
+			return;
+		}
+	}
+
+	if (m_count == TLB_BATCH_RANGES)
+	{
+		m_flushAll = true;
+		return;
+	}
+
+	m_ranges[m_count++] = { address, pages };
+}
+
+void TlbShootdown::Flush()
+{
+	if (m_count == 0 && !m_flushAll)
+		return;
+
+	HAL* hal = kernel.GetHAL();
+
+	//Page table stores have to be visible before the active set is read. A CPU that loads the
+	//address space after this point walks the new tables anyway.
+	_mm_mfence();
+	uint64_t cpus = m_process ? m_process->GetActiveCpus() : hal->GetOnlineCpus();
+	cpus |= 1ULL << hal->CurrentCPU(); //Page table walks may have cached it here regardless
+
+	const uint64_t start = __rdtsc();
+	hal->CallCpus(cpus, &TlbShootdown::Invalidate, this);
+	const uint64_t cycles = __rdtsc() - start;
+
+	s_flushes++;
+	if (m_flushAll)
+		s_fullFlushes++;
+	s_pages += m_pages;
+	s_remoteCpus += __popcnt64(cpus & hal->GetOnlineCpus()) - 1;
+	s_totalCycles += cycles;
+	if (cycles > s_maxCycles)
+		s_maxCycles = cycles;
+
+	m_count = 0;
+	m_pages = 0;
+	m_flushAll = false;
+}
+
+void TlbShootdown::ResetStats()
+{
+	s_flushes = 0;
+	s_fullFlushes = 0;
+	s_pages = 0;
+	s_remoteCpus = 0;
+	s_totalCycles = 0;
+	s_maxCycles = 0;
+}
+
+void TlbShootdown::DisplayStats()
+{
+	Printf("TLB shootdowns: %d (%d full), %d pages, %d remote CPUs\r\n", s_flushes, s_fullFlushes, s_pages, s_remoteCpus);
+	if (s_flushes != 0 && x64::TSCFreq != 0)
+		Printf("    Latency: avg %d us, max %d us\r\n", (s_totalCycles / s_flushes) / x64::TSCFreq, s_maxCycles / x64::TSCFreq);
+}
+
+void TlbShootdown::Invalidate(void* context)
+{
+	const TlbShootdown* batch = (const TlbShootdown*)context;
+
+	if (!batch->m_flushAll)
+	{
+		for (size_t i = 0; i < batch->m_count; i++)
+		{
+			const Range& range = batch->m_ranges[i];
+			for (size_t page = 0; page < range.Pages; page++)
+				__invlpg((void*)(range.Address + (page << PageShift)));
+		}
+	}
+	else if (batch->m_process)
+	{
+		//Drops everything but global (kernel) entries
+		__writecr3(__readcr3());
+	}
+	else
+	{
+		//Toggling PGE drops global entries as well
+		const uint64_t cr4 = __readcr4();
+		__writecr4(cr4 & ~CR4_PGE);
+		__writecr4(cr4);
+	}
+}
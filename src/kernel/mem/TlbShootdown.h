@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <os.internal.h>
+
+#define TLB_BATCH_RANGES		16
+#define TLB_FLUSH_ALL_PAGES		64 //Past this one full flush is cheaper than invlpg per page
+
+class UserProcess;
+
+//Collects invalidations for one address space and flushes them in a single IPI round, on the CPUs that
+//have the address space loaded. Pass nullptr for kernel mappings, every CPU shares those.
+//Change the page tables first, then Add, then Flush (the destructor flushes too).
+class TlbShootdown
+{
+public:
+	TlbShootdown(UserProcess* process = nullptr);
+	~TlbShootdown();
+
+	void Add(const uintptr_t address, const size_t pages = 1);
+	void Flush();
+
+	static void ResetStats();
+	static void DisplayStats();
+
+private:
+	struct Range
+	{
+		uintptr_t Address;
+		size_t Pages;
+	};
+
+	static void Invalidate(void* context);
+
+	UserProcess* const m_process;
+	Range m_ranges[TLB_BATCH_RANGES];
+	size_t m_count;
+	size_t m_pages;
+	bool m_flushAll;
+
+	//Stats, cycles
+	static uint64_t s_flushes;
+	static uint64_t s_fullFlushes;
+	static uint64_t s_pages;
+	static uint64_t s_remoteCpus;
+	static uint64_t s_totalCycles;
+	static uint64_t s_maxCycles;
+
+	::NO_COPY_OR_ASSIGN(TlbShootdown);
+};
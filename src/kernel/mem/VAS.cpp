@@ -99,6 +99,27 @@ bool VirtualAddressSpace::Reserve(uintptr_t& address, const size_t count)
 	return true;
 }
 
+void VirtualAddressSpace::Release(const uintptr_t address)
+{
+	Assert(m_initialized);
+
+	ListEntry* entry = m_reservations.Flink;
+	while (entry != &m_reservations)
+	{
+		Reservation* res = LIST_CONTAINING_RECORD(entry, Reservation, Link);
+		if (res->Address == address)
+		{
+			ListRemoveEntry(&res->Link);
+			delete res;
+			return;
+		}
+
+		entry = entry->Flink;
+	}
+
+	Assert(false);
+}
+
 //Check to see if pointer is in a valid region
 bool VirtualAddressSpace::IsValidPointer(const void* p) const
 {
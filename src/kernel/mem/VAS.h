@@ -13,6 +13,8 @@ public:
 
 	void Initialize();
 	bool Reserve(uintptr_t& address, const size_t count);
+	//Gives back a reservation made by Reserve, only reusable by passing its address
+	void Release(const uintptr_t address);
 	bool IsValidPointer(const void* const p) const;
 
 	const bool IsGlobal;
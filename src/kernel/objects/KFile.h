@@ -5,18 +5,22 @@
 
 #include "Assert.h"
 
+class VirtualFileSystem;
+
 class KFile
 {
 public:
 	void Display() const
 	{
+		Printf("FileSystem: 0x%016x\n", FileSystem);
 		Printf("Context: 0x%016x\n", Context);
 		Printf("Position: 0x%016x\n", Position);
 		Printf("Length: 0x%016x\n", Length);
 		Printf("Access: %d\n", Access);
 	}
 
-	void* Context;
+	VirtualFileSystem* FileSystem; //Filesystem the file was opened on, null for other drivers
+	void* Context; //Driver's per file state, the node for filesystems
 	size_t Position;
 	size_t Length;
 	GenericAccess Access;
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "KSignalObject.h"
+#include "KSpinLock.h"
+
+#include "Assert.h"
+#include <os.internal.h>
+#include <string>
+
+class KThread;
+
+//Owned lock that blocks through the scheduler. Acquire/Release via Scheduler::AcquireMutex/ReleaseMutex
+//so waiters can lend their priority to the owner. The owner may acquire it again recursively.
+//Named mutexes keep contention stats.
+class KMutex : public KSignalObject
+{
+	friend class Scheduler;
+public:
+	KMutex(const std::string& name = "") :
+		KSignalObject(),
+		Name(name),
+		m_owner(),
+		m_recursion(),
+		m_stats(Name.empty() ? nullptr : Name.c_str())
+	{
+
+	}
+
+	~KMutex()
+	{
+		AssertEqual(m_owner, nullptr);
+	}
+
+	KThread* Owner() const
+	{
+		return m_owner;
+	}
+
+	virtual bool IsSignalled() const override
+	{
+		return m_owner == nullptr;
+	}
+
+	virtual void Display() const override
+	{
+		Printf("KMutex %s\n", Name.c_str());
+		Printf("    Owner: 0x%016x, Recursion: %d\n", m_owner, m_recursion);
+		if (m_stats.IsEnabled())
+			m_stats.Display();
+	}
+
+	const LockStats* Stats() const
+	{
+		return m_stats.IsEnabled() ? &m_stats : nullptr;
+	}
+
+	const std::string Name;
+
+private:
+	KThread* m_owner;
+	uint32_t m_recursion;
+	LockStats m_stats;
+
+	::NO_COPY_OR_ASSIGN(KMutex);
+};
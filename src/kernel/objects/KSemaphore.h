@@ -27,6 +27,11 @@ public:
 		return m_value;
 	}
 
+	int Limit() const
+	{
+		return m_limit;
+	}
+
 	void Signal()
 	{
 		m_value++;
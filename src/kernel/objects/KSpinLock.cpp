@@ -0,0 +1,285 @@
+#include "KSpinLock.h"
+#include <Assert.h>
+
+LockStats* LockStats::s_head = nullptr;
+volatile long LockStats::s_lock = 0;
+
+LockStats::LockStats(const char* name) :
+	Name(name),
+	Acquisitions(),
+	Contentions(),
+	Spins(),
+	WaitCycles(),
+	m_next(),
+	m_prev()
+{
+	if (!IsEnabled())
+		return;
+
+	const cpu_flags_t flags = SaveAndDisableInterrupts();
+	while (_InterlockedExchange(&s_lock, 1) != 0)
+		_mm_pause();
+
+	m_next = s_head;
+	if (s_head)
+		s_head->m_prev = this;
+	s_head = this;
+
+	_InterlockedExchange(&s_lock, 0);
+	RestoreInterrupts(flags);
+}
+
+LockStats::~LockStats()
+{
+	if (!IsEnabled())
+		return;
+
+	const cpu_flags_t flags = SaveAndDisableInterrupts();
+	while (_InterlockedExchange(&s_lock, 1) != 0)
+		_mm_pause();
+
+	if (m_prev)
+		m_prev->m_next = m_next;
+	else
+		s_head = m_next;
+	if (m_next)
+		m_next->m_prev = m_prev;
+
+	_InterlockedExchange(&s_lock, 0);
+	RestoreInterrupts(flags);
+}
+
+void LockStats::Reset()
+{
+	Acquisitions = 0;
+	Contentions = 0;
+	Spins = 0;
+	WaitCycles = 0;
+}
+
+void LockStats::Display() const
+{
+	Printf("    %s: acquired %d, contended %d, spins %d, wait cycles %d\n", Name, Acquisitions, Contentions, Spins, WaitCycles);
+}
+
+void LockStats::DisplayAll()
+{
+	Printf("LockStats\n");
+
+	const cpu_flags_t flags = SaveAndDisableInterrupts();
+	while (_InterlockedExchange(&s_lock, 1) != 0)
+		_mm_pause();
+
+	for (const LockStats* stats = s_head; stats != nullptr; stats = stats->m_next)
+		stats->Display();
+
+	_InterlockedExchange(&s_lock, 0);
+	RestoreInterrupts(flags);
+}
+
+KSpinLock::KSpinLock(const char* name /*= nullptr*/) :
+	m_lock(),
+	m_stats(name)
+{
+
+}
+
+KSpinLock::~KSpinLock()
+{
+	Assert(!IsLocked());
+}
+
+void KSpinLock::Acquire()
+{
+	if (_InterlockedExchange(&m_lock, 1) == 0)
+	{
+		if (m_stats.IsEnabled())
+			m_stats.Acquisitions++;
+		return;
+	}
+
+	//Contended, spin on a plain read so we don't bounce the cache line
+	const uint64_t start = __rdtsc();
+	uint64_t spins = 0;
+	do
+	{
+		while (m_lock != 0)
+		{
+			_mm_pause();
+			spins++;
+		}
+	} while (_InterlockedExchange(&m_lock, 1) != 0);
+
+	if (m_stats.IsEnabled())
+	{
+		m_stats.Acquisitions++;
+		m_stats.Contentions++;
+		m_stats.Spins += spins;
+		m_stats.WaitCycles += __rdtsc() - start;
+	}
+}
+
+bool KSpinLock::TryAcquire()
+{
+	if (_InterlockedExchange(&m_lock, 1) != 0)
+		return false;
+
+	if (m_stats.IsEnabled())
+		m_stats.Acquisitions++;
+	return true;
+}
+
+void KSpinLock::Release()
+{
+	Assert(IsLocked());
+	_InterlockedExchange(&m_lock, 0);
+}
+
+cpu_flags_t KSpinLock::AcquireIrqSave()
+{
+	const cpu_flags_t flags = SaveAndDisableInterrupts();
+	Acquire();
+	return flags;
+}
+
+void KSpinLock::ReleaseIrqRestore(const cpu_flags_t flags)
+{
+	Release();
+	RestoreInterrupts(flags);
+}
+
+KTicketLock::KTicketLock(const char* name /*= nullptr*/) :
+	m_next(),
+	m_serving(),
+	m_stats(name)
+{
+
+}
+
+KTicketLock::~KTicketLock()
+{
+	AssertEqual(m_next, m_serving);
+}
+
+void KTicketLock::Acquire()
+{
+	const long ticket = _InterlockedExchangeAdd(&m_next, 1);
+	if (m_serving == ticket)
+	{
+		if (m_stats.IsEnabled())
+			m_stats.Acquisitions++;
+		return;
+	}
+
+	const uint64_t start = __rdtsc();
+	uint64_t spins = 0;
+	while (m_serving != ticket)
+	{
+		_mm_pause();
+		spins++;
+	}
+
+	if (m_stats.IsEnabled())
+	{
+		m_stats.Acquisitions++;
+		m_stats.Contentions++;
+		m_stats.Spins += spins;
+		m_stats.WaitCycles += __rdtsc() - start;
+	}
+}
+
+void KTicketLock::Release()
+{
+	//Only the owner writes m_serving, the interlocked op is for the barrier
+	_InterlockedIncrement(&m_serving);
+}
+
+cpu_flags_t KTicketLock::AcquireIrqSave()
+{
+	const cpu_flags_t flags = SaveAndDisableInterrupts();
+	Acquire();
+	return flags;
+}
+
+void KTicketLock::ReleaseIrqRestore(const cpu_flags_t flags)
+{
+	Release();
+	RestoreInterrupts(flags);
+}
+
+KRWLock::KRWLock(const char* name /*= nullptr*/) :
+	m_state(),
+	m_writersWaiting(),
+	m_stats(name)
+{
+
+}
+
+KRWLock::~KRWLock()
+{
+	AssertEqual(m_state, 0);
+}
+
+void KRWLock::AcquireShared()
+{
+	const uint64_t start = __rdtsc();
+	uint64_t spins = 0;
+	while (true)
+	{
+		const long state = m_state;
+		if (state >= 0 && m_writersWaiting == 0 && _InterlockedCompareExchange(&m_state, state + 1, state) == state)
+			break;
+
+		_mm_pause();
+		spins++;
+	}
+
+	if (m_stats.IsEnabled())
+	{
+		m_stats.Acquisitions++;
+		if (spins)
+		{
+			m_stats.Contentions++;
+			m_stats.Spins += spins;
+			m_stats.WaitCycles += __rdtsc() - start;
+		}
+	}
+}
+
+void KRWLock::ReleaseShared()
+{
+	Assert(m_state > 0);
+	_InterlockedDecrement(&m_state);
+}
+
+void KRWLock::AcquireExclusive()
+{
+	_InterlockedIncrement(&m_writersWaiting);
+
+	const uint64_t start = __rdtsc();
+	uint64_t spins = 0;
+	while (_InterlockedCompareExchange(&m_state, -1, 0) != 0)
+	{
+		_mm_pause();
+		spins++;
+	}
+
+	_InterlockedDecrement(&m_writersWaiting);
+
+	if (m_stats.IsEnabled())
+	{
+		m_stats.Acquisitions++;
+		if (spins)
+		{
+			m_stats.Contentions++;
+			m_stats.Spins += spins;
+			m_stats.WaitCycles += __rdtsc() - start;
+		}
+	}
+}
+
+void KRWLock::ReleaseExclusive()
+{
+	AssertEqual(m_state, -1);
+	_InterlockedExchange(&m_state, 0);
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <cstdint>
+#include <intrin.h>
+#include <os.internal.h>
+
+typedef uint64_t cpu_flags_t;
+
+#define RFLAGS_IF 0x200
+
+//Disable interrupts, returns previous state for RestoreInterrupts
+inline cpu_flags_t SaveAndDisableInterrupts()
+{
+	const cpu_flags_t flags = __readeflags();
+	_disable();
+	return flags;
+}
+
+inline void RestoreInterrupts(const cpu_flags_t flags)
+{
+	if (flags & RFLAGS_IF)
+		_enable();
+}
+
+//Per lock contention counters, embedded in the lock so they work before the heap is up.
+//Only named locks count and register themselves so all of them can be dumped at runtime.
+class LockStats
+{
+public:
+	LockStats(const char* name);
+	~LockStats();
+
+	bool IsEnabled() const { return Name != nullptr; }
+
+	void Reset();
+	void Display() const;
+	static void DisplayAll();
+
+	const char* Name;
+	uint64_t Acquisitions;
+	uint64_t Contentions;
+	uint64_t Spins;
+	uint64_t WaitCycles;
+
+private:
+	LockStats* m_next;
+	LockStats* m_prev;
+
+	static LockStats* s_head;
+	static volatile long s_lock;
+
+	::NO_COPY_OR_ASSIGN(LockStats);
+};
+
+//Test and test-and-set spinlock. Use the IrqSave variants if the lock is also taken in interrupt context.
+class KSpinLock
+{
+public:
+	KSpinLock(const char* name = nullptr);
+	~KSpinLock();
+
+	void Acquire();
+	bool TryAcquire();
+	void Release();
+
+	cpu_flags_t AcquireIrqSave();
+	void ReleaseIrqRestore(const cpu_flags_t flags);
+
+	bool IsLocked() const { return m_lock != 0; }
+	const LockStats* Stats() const { return m_stats.IsEnabled() ? &m_stats : nullptr; }
+
+private:
+	volatile long m_lock;
+	LockStats m_stats;
+
+	::NO_COPY_OR_ASSIGN(KSpinLock);
+};
+
+//FIFO fair spinlock, waiters are served in arrival order
+class KTicketLock
+{
+public:
+	KTicketLock(const char* name = nullptr);
+	~KTicketLock();
+
+	void Acquire();
+	void Release();
+
+	cpu_flags_t AcquireIrqSave();
+	void ReleaseIrqRestore(const cpu_flags_t flags);
+
+	const LockStats* Stats() const { return m_stats.IsEnabled() ? &m_stats : nullptr; }
+
+private:
+	volatile long m_next;
+	volatile long m_serving;
+	LockStats m_stats;
+
+	::NO_COPY_OR_ASSIGN(KTicketLock);
+};
+
+//Spinning reader-writer lock, waiting writers block new readers
+class KRWLock
+{
+public:
+	KRWLock(const char* name = nullptr);
+	~KRWLock();
+
+	void AcquireShared();
+	void ReleaseShared();
+
+	void AcquireExclusive();
+	void ReleaseExclusive();
+
+	const LockStats* Stats() const { return m_stats.IsEnabled() ? &m_stats : nullptr; }
+
+private:
+	volatile long m_state; //-1 writer, otherwise number of readers
+	volatile long m_writersWaiting;
+	LockStats m_stats;
+
+	::NO_COPY_OR_ASSIGN(KRWLock);
+};
+
+//Scoped IRQ-safe acquisition of KSpinLock/KTicketLock
+template<class TLock>
+class KLockGuard
+{
+public:
+	KLockGuard(TLock& lock) :
+		m_lock(lock),
+		m_flags(lock.AcquireIrqSave())
+	{
+	}
+
+	~KLockGuard()
+	{
+		m_lock.ReleaseIrqRestore(m_flags);
+	}
+
+private:
+	TLock& m_lock;
+	const cpu_flags_t m_flags;
+
+	::NO_COPY_OR_ASSIGN(KLockGuard);
+};
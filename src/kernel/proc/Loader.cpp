@@ -3,6 +3,7 @@
 #include "Assert.h"
 #include "kernel/Kernel.h"
 #include <kernel\types\PortableExecutable.h>
+#include <cstring>
 
 //TODO: this is very similar to KernelAPI's loader, as well as create process
 Handle Loader::LoadLibrary(UserProcess& process, const char* path)
@@ -10,19 +11,18 @@ Handle Loader::LoadLibrary(UserProcess& process, const char* path)
 	KFile file;
 	Assert(kernel.KeCreateFile(file, std::string(path), GenericAccess::Read));
 
-	size_t read;
+	//Image is read through the page cache, only the pages touched below come from disk
+	void* image = kernel.KeMapFile(file, 0, file.Length);
+	Assert(image);
 
 	//Dos header
-	IMAGE_DOS_HEADER dosHeader;
-	Assert(kernel.KeReadFile(file, &dosHeader, sizeof(IMAGE_DOS_HEADER), &read));
-	AssertEqual(read, sizeof(IMAGE_DOS_HEADER));
+	AssertOp(file.Length, >=, sizeof(IMAGE_DOS_HEADER));
+	const IMAGE_DOS_HEADER& dosHeader = *static_cast<PIMAGE_DOS_HEADER>(image);
 	AssertEqual(dosHeader.e_magic, IMAGE_DOS_SIGNATURE);
 
 	//NT Header
-	IMAGE_NT_HEADERS peHeader;
-	Assert(kernel.KeSetFilePosition(file, dosHeader.e_lfanew));
-	Assert(kernel.KeReadFile(file, &peHeader, sizeof(IMAGE_NT_HEADERS), &read));
-	AssertEqual(read, sizeof(IMAGE_NT_HEADERS));
+	AssertOp((size_t)dosHeader.e_lfanew + sizeof(IMAGE_NT_HEADERS), <=, file.Length);
+	const IMAGE_NT_HEADERS& peHeader = *MakePointer<PIMAGE_NT_HEADERS>(image, dosHeader.e_lfanew);
 
 	//Verify image
 	AssertEqual(peHeader.Signature, IMAGE_NT_SIGNATURE);
@@ -32,10 +32,9 @@ Handle Loader::LoadLibrary(UserProcess& process, const char* path)
 	void* address = kernel.VirtualAlloc(process, (void*)peHeader.OptionalHeader.ImageBase, peHeader.OptionalHeader.SizeOfImage);
 	Assert(address);
 
-	//Read headers
-	Assert(kernel.KeSetFilePosition(file, 0));
-	Assert(kernel.KeReadFile(file, address, peHeader.OptionalHeader.SizeOfHeaders, &read));
-	AssertEqual(read, peHeader.OptionalHeader.SizeOfHeaders);
+	//Copy headers
+	AssertOp(peHeader.OptionalHeader.SizeOfHeaders, <=, file.Length);
+	memcpy(address, image, peHeader.OptionalHeader.SizeOfHeaders);
 	AssertEqual((ULONGLONG)address, peHeader.OptionalHeader.ImageBase);
 
 	PIMAGE_NT_HEADERS pNtHeader = MakePointer<PIMAGE_NT_HEADERS>(address, dosHeader.e_lfanew);
@@ -44,17 +43,19 @@ Handle Loader::LoadLibrary(UserProcess& process, const char* path)
 	PIMAGE_SECTION_HEADER section = IMAGE_FIRST_SECTION(pNtHeader);
 	for (WORD i = 0; i < pNtHeader->FileHeader.NumberOfSections; i++)
 	{
-		//If physical size is non-zero, read data to allocated address
+		//If physical size is non-zero, copy data to allocated address
 		DWORD rawSize = section[i].SizeOfRawData;
 		if (rawSize == 0)
 			continue;
 
+		AssertOp((size_t)section[i].PointerToRawData + rawSize, <=, file.Length);
 		void* destination = MakePointer<void*>(address, section[i].VirtualAddress);
-		Assert(kernel.KeSetFilePosition(file, section[i].PointerToRawData));
-		Assert(kernel.KeReadFile(file, destination, rawSize, &read));
-		AssertEqual(read, section[i].SizeOfRawData);
+		memcpy(destination, MakePointer<void*>(image, section[i].PointerToRawData), rawSize);
 	}
 
+	kernel.KeUnmapFile(image);
+	kernel.KeCloseFile(file);
+
 	//Imports are loaded from usermode, this is just for base kernelapi which shouldnt have any
 	AssertEqual(pNtHeader->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].Size, 0);
 
@@ -69,19 +70,18 @@ void* Loader::LoadKernelLibrary(const std::string& path)
 	KFile file;
 	Assert(kernel.KeCreateFile(file, path, GenericAccess::Read));
 
-	size_t read;
+	//Image is read through the page cache, only the pages touched below come from disk
+	void* image = kernel.KeMapFile(file, 0, file.Length);
+	Assert(image);
 
 	//Dos header
-	IMAGE_DOS_HEADER dosHeader;
-	Assert(kernel.KeReadFile(file, &dosHeader, sizeof(IMAGE_DOS_HEADER), &read));
-	AssertEqual(read, sizeof(IMAGE_DOS_HEADER));
+	AssertOp(file.Length, >=, sizeof(IMAGE_DOS_HEADER));
+	const IMAGE_DOS_HEADER& dosHeader = *static_cast<PIMAGE_DOS_HEADER>(image);
 	AssertEqual(dosHeader.e_magic, IMAGE_DOS_SIGNATURE);
 
 	//NT Header
-	IMAGE_NT_HEADERS peHeader;
-	Assert(kernel.KeSetFilePosition(file, dosHeader.e_lfanew));
-	Assert(kernel.KeReadFile(file, &peHeader, sizeof(IMAGE_NT_HEADERS), &read));
-	AssertEqual(read, sizeof(IMAGE_NT_HEADERS));
+	AssertOp((size_t)dosHeader.e_lfanew + sizeof(IMAGE_NT_HEADERS), <=, file.Length);
+	const IMAGE_NT_HEADERS& peHeader = *MakePointer<PIMAGE_NT_HEADERS>(image, dosHeader.e_lfanew);
 
 	//Verify image
 	AssertEqual(peHeader.Signature, IMAGE_NT_SIGNATURE);
@@ -95,10 +95,9 @@ void* Loader::LoadKernelLibrary(const std::string& path)
 	void* address = kernel.AllocateLibrary((void*)peHeader.OptionalHeader.ImageBase, SizeToPages(peHeader.OptionalHeader.SizeOfImage));
 	Assert(address);
 
-	//Read headers
-	Assert(kernel.KeSetFilePosition(file, 0));
-	Assert(kernel.KeReadFile(file, address, peHeader.OptionalHeader.SizeOfHeaders, &read));
-	AssertEqual(read, peHeader.OptionalHeader.SizeOfHeaders);
+	//Copy headers
+	AssertOp(peHeader.OptionalHeader.SizeOfHeaders, <=, file.Length);
+	memcpy(address, image, peHeader.OptionalHeader.SizeOfHeaders);
 
 	PIMAGE_NT_HEADERS pNtHeader = MakePointer<PIMAGE_NT_HEADERS>(address, dosHeader.e_lfanew);
 
@@ -106,17 +105,19 @@ void* Loader::LoadKernelLibrary(const std::string& path)
 	PIMAGE_SECTION_HEADER section = IMAGE_FIRST_SECTION(pNtHeader);
 	for (WORD i = 0; i < pNtHeader->FileHeader.NumberOfSections; i++)
 	{
-		//If physical size is non-zero, read data to allocated address
+		//If physical size is non-zero, copy data to allocated address
 		DWORD rawSize = section[i].SizeOfRawData;
 		if (rawSize == 0)
 			continue;
 
+		AssertOp((size_t)section[i].PointerToRawData + rawSize, <=, file.Length);
 		void* destination = MakePointer<void*>(address, section[i].VirtualAddress);
-		Assert(kernel.KeSetFilePosition(file, section[i].PointerToRawData));
-		Assert(kernel.KeReadFile(file, destination, rawSize, &read));
-		AssertEqual(read, section[i].SizeOfRawData);
+		memcpy(destination, MakePointer<void*>(image, section[i].PointerToRawData), rawSize);
 	}
 
+	kernel.KeUnmapFile(image);
+	kernel.KeCloseFile(file);
+
 	//Kernel libraries should never be relocated
 
 	//Kernel library dont have imports yet
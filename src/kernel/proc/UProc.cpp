@@ -14,6 +14,7 @@ UserProcess::UserProcess(const std::string& name, const bool isConsole) :
 	m_createTime(),
 	m_exitTime(),
 	m_pageTables(),
+	m_activeCpus(),
 	m_addressSpace(),
 	m_heap(),
 	m_peb(),
@@ -37,6 +37,8 @@ public:
 	uintptr_t GetModuleBase(uintptr_t ip) const;
 
 	uintptr_t GetCR3() const;
+	//CPUs with this address space loaded, bit per APIC ID. Maintained by the scheduler.
+	uint64_t GetActiveCpus() const { return m_activeCpus; }
 	VirtualAddressSpace& GetAddressSpace();
 
 	ThreadEnvironmentBlock* AllocTEB();
@@ -92,6 +94,7 @@ private:
 	time_t m_createTime;
 	time_t m_exitTime;
 	PageTables m_pageTables;
+	volatile uint64_t m_activeCpus;
 	UserAddressSpace m_addressSpace;
 	BootHeap* m_heap;
 	ProcessEnvironmentBlock* m_peb;
@@ -12,30 +12,47 @@ extern "C"
 }
 
 uint32_t KThread::LastId = 0;
-KThread::KThread(const ThreadStart start, void* const arg) :
+KThread::KThread(const ThreadStart start, void* const arg, const ThreadPriority priority) :
 	Id(++LastId),
 
 	Context(),
 	UserThread(),
 
 	Name(),
+	SimdContext(),
 
 	m_start(start),
 	m_arg(arg),
 	m_stack(),
+	m_stackPointer(),
+	m_simdBuffer(),
 
 	m_state(ThreadState::Ready),
 	m_waitStatus(WaitStatus::None),
 	m_timeout(),
-	m_signal()
+	m_signal(),
+
+	m_priority(priority),
+	m_level(),
+	m_quantum(),
+	m_inheritedRank(),
+	m_mutexCount(),
+	m_blockedOn()
 {
 	Context = new X64_CONTEXT();
+
+	HAL* hal = kernel.GetHAL();
+	const size_t simdSize = hal->SimdContextSize();
+	m_simdBuffer = new uint8_t[simdSize + SIMD_CONTEXT_ALIGN];
+	SimdContext = (void*)(((uintptr_t)m_simdBuffer + SIMD_CONTEXT_ALIGN - 1) & ~(uintptr_t)(SIMD_CONTEXT_ALIGN - 1));
+	hal->SimdInitContext(SimdContext);
 }
 
 KThread::~KThread()
 {
 	//Trace();
 	delete Context;
+	delete[] m_simdBuffer;
 }
 void KThread::Init(void* const entry)
 {
@@ -64,6 +81,7 @@ void KThread::Display() const
 	kernel.Printf("  Start: 0x%016x\n", m_start);
 	kernel.Printf("    Arg: 0x%016x\n", m_arg);
 	kernel.Printf("  State: %d\n", m_state);
+	kernel.Printf("   Prio: %d, Level: %d, Inherited: 0x%x, Blocked on: 0x%016x\n", m_priority, m_level, m_inheritedRank, m_blockedOn);
 	kernel.Printf("WStatus: %d\n", m_waitStatus);
 	kernel.Printf("Timeout: %d\n", m_timeout);
 	kernel.Printf("   User: 0x%016x\n", UserThread);
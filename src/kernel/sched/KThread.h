@@ -6,6 +6,8 @@
 #include "UThread.h"
 #include <kernel\os\Time.h>
 
+class KMutex;
+
 enum class ThreadState
 {
 	Ready,
@@ -15,11 +17,19 @@ enum class ThreadState
 	Terminated
 };
 
+//Strict ordering between classes, Normal threads are further ordered by their MLFQ level
+enum class ThreadPriority : uint8_t
+{
+	Idle,		//Only runs if nothing else is ready
+	Normal,		//Multilevel feedback queue
+	RealTime	//Driver bottom halves, always preempt Normal threads
+};
+
 class KThread
 {
 	friend class Scheduler;
 public:
-	KThread(const ThreadStart start, void* const arg);
+	KThread(const ThreadStart start, void* const arg, const ThreadPriority priority = ThreadPriority::Normal);
 	~KThread();
 
 	void Init(void* const entry);
@@ -27,12 +37,18 @@ public:
 
 	void Display() const;
 
+	ThreadPriority GetPriority() const { return m_priority; }
+	void SetPriority(const ThreadPriority priority) { m_priority = priority; }
+
 	const uint32_t Id;
 
 	CPU_CONTEXT* Context;
 	UserThread* UserThread;
 	std::string Name;
 
+	//FPU/SIMD state, aligned for XSAVE
+	void* SimdContext;
+
 private:
 	static uint32_t LastId;
 	static constexpr size_t StackPages = 8;
@@ -41,6 +57,7 @@ private:
 	void* const m_arg;
 	void* m_stack;
 	void* m_stackPointer;
+	uint8_t* m_simdBuffer;
 
 	//Scheduler
 	ThreadState m_state;
@@ -48,5 +65,13 @@ private:
 	nano_t m_timeout;
 	KSignalObject* m_signal;
 
+	//Priority
+	ThreadPriority m_priority;
+	uint8_t m_level; //MLFQ level, 0 is highest
+	uint8_t m_quantum; //Ticks left in current time slice
+	uint32_t m_inheritedRank; //Lent by waiters of a KMutex we own
+	uint32_t m_mutexCount;
+	KMutex* m_blockedOn; //Mutex we wait for, boosts are passed on to its owner
+
 	::NO_COPY_OR_ASSIGN(KThread);
 };
\ No newline at end of file
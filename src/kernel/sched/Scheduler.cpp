@@ -5,11 +5,28 @@
 #include <OS.arch.h>
 #include "kernel/drivers/HyperV/HyperVPlatform.h"
 #include <kernel\Kernel.h>
+#include "kernel/hal/x64/x64.h"
 
 
 const milli_t msPerTick = 1000 / APIC_TICKS_PER_SEC;
 const nano_t nsPerTick = Second / APIC_TICKS_PER_SEC;
 
+//Multilevel feedback queue for ThreadPriority::Normal. Level n gets a quantum of 2^n ticks,
+//threads using up their quantum move down a level, every MlfqBoostTicks all threads move back to the top.
+const uint8_t MlfqLevels = 4;
+const uint64_t MlfqBoostTicks = APIC_TICKS_PER_SEC;
+
+//Effective ranks, higher wins
+const uint32_t RankIdle = 0;
+const uint32_t RankNormal = 0x10;
+const uint32_t RankRealTime = 0x100;
+
+//Owners a priority boost is passed along, ends cycles of deadlocked threads
+const size_t MutexChainDepth = 8;
+
+//Use lazy SIMD switching if a save/restore pair costs more cycles than this
+const uint64_t SimdLazyThreshold = 1500;
+
 KThread* Scheduler::GetThread()
 {
 	Assert(_readgsbase_u64() != 0);
@@ -22,8 +39,14 @@ Scheduler::Scheduler(HAL* hal) :
 	Enabled(),
 	m_HAL(hal),
 	m_cpu(),
+	m_lock("Scheduler"),
 	m_threadIndex(),
-	m_threads()
+	m_threads(),
+	m_simdPolicy(SimdPolicy::Eager),
+	m_simdOwner(),
+	m_simdSwitches(),
+	m_simdCycles(),
+	m_simdTraps()
 {
 
 }
@@ -36,7 +59,22 @@ void Scheduler::Init()
 	boot->m_state = ThreadState::Running;
 	m_threads.push_back(boot);
 
-	
+	//Boot thread owns the live SIMD state
+	m_simdOwner = boot.get();
+	m_HAL->SetRescheduleHandler({ Scheduler::OnReschedule, this });
+
+	//Pick SIMD policy from measured cost. Lazy only pays off if the state is large (AVX-512) since a #NM trap isn't free either
+	const uint64_t start = __rdtsc();
+	for (int i = 0; i < 16; i++)
+	{
+		m_HAL->SimdSaveContext(boot->SimdContext);
+		m_HAL->SimdRestoreContext(boot->SimdContext);
+	}
+	const uint64_t cost = (__rdtsc() - start) / 16;
+	m_simdPolicy = cost > SimdLazyThreshold ? SimdPolicy::Lazy : SimdPolicy::Eager;
+	Printf("Scheduler: SIMD area %d bytes, save+restore %d cycles, %s switching\r\n", m_HAL->SimdContextSize(), cost,
+		m_simdPolicy == SimdPolicy::Lazy ? "lazy" : "eager");
+
 	//Write to CPU state
 	m_HAL->SetUserCpuContext(&m_cpu);
 }
@@ -47,6 +85,10 @@ void Scheduler::Schedule()
 
 	//Printf("Scheduling...\r\n");
 
+	//Flags live on this thread's stack, so they are restored for the right thread once it is switched back in
+	const cpu_flags_t flags = SaveAndDisableInterrupts();
+	m_lock.Acquire();
+
 	const uint64_t tsc = m_HAL->GetClock()->GetTicks();
 	//TODO:
 	//const uint64_t tsc = HyperV::ReadTsc();
@@ -64,6 +106,9 @@ void Scheduler::Schedule()
 			if (thread.UserThread != nullptr)
 				Assert(thread.UserThread->Deleted);
 
+			if (m_simdOwner == &thread)
+				m_simdOwner = nullptr;
+
 			it = m_threads.erase(it);
 			//Printf("//Purge deleted threads if its not the executing one\r\n");
 		}
@@ -73,6 +118,16 @@ void Scheduler::Schedule()
 		}
 	}
 
+	//Purging may have shifted the current thread
+	for (size_t i = 0; i < m_threads.size(); i++)
+	{
+		if (m_threads[i]->Id == current.Id)
+		{
+			m_threadIndex = i;
+			break;
+		}
+	}
+
 	//Iterate through threads and update their status
 	for (std::shared_ptr<KThread>& item : m_threads)
 	{
@@ -120,28 +175,48 @@ void Scheduler::Schedule()
 		}
 	}
 
-	//Mark current thread as ready
-	if (current.m_state == ThreadState::Running)
-		current.m_state = ThreadState::Ready;
-
-	//Printf("Selecting new thread\r\n");
-	// Select new thread, round robin
-	while (true)
+	//Select new thread. Highest rank wins, round robin within the same rank.
+	//Current thread keeps running while it has quantum left and nothing better is ready.
+	const bool keepCurrent = (current.m_state == ThreadState::Running) && (current.m_quantum > 0);
+	size_t nextIndex = m_threadIndex;
+	uint32_t bestRank = keepCurrent ? Rank(current) : 0;
+	bool found = keepCurrent;
+	for (size_t i = 1; i <= m_threads.size(); i++)
 	{
-		m_threadIndex = (m_threadIndex + 1) % m_threads.size();
+		const size_t index = (m_threadIndex + i) % m_threads.size();
+		const KThread& thread = *m_threads[index].get();
+		if (thread.m_state != ThreadState::Ready && !(&thread == &current && current.m_state == ThreadState::Running))
+			continue;
 
-		if (m_threads[m_threadIndex]->m_state == ThreadState::Ready)
-			break;
+		const uint32_t rank = Rank(thread);
+		if (!found || rank > bestRank)
+		{
+			bestRank = rank;
+			nextIndex = index;
+			found = true;
+		}
 	}
-	//Printf("new thread found\r\n");
+	Assert(found);
+
+	//Mark current thread as ready
+	if (current.m_state == ThreadState::Running)
+		current.m_state = ThreadState::Ready;
 
 	//Mark next thread as running
+	m_threadIndex = nextIndex;
 	KThread& next = *m_threads[m_threadIndex].get();
 	next.m_state = ThreadState::Running;
+	if (next.m_quantum == 0)
+		next.m_quantum = Quantum(next);
+
+	m_lock.Release();
 
 	//If both threads are the same short-circuit context switch
 	if (next.Id == current.Id)
+	{
+		RestoreInterrupts(flags);
 		return;
+	}
 
 #if FALSE
 	Printf("Scheduler: %d (%s) -> %d (%s)\n", current.Id, current.Name.c_str(), next.Id, next.Name.c_str());
@@ -155,6 +230,8 @@ void Scheduler::Schedule()
 		Printf("    New User Stack: 0x%016x\n", next.UserThread->Stack);
 #endif
 
+	SwitchSimd(current, next);
+
 	if (m_HAL->SaveContext(current.Context) == 0)
 	{
 		//Printf("context saved\r\n");
@@ -165,6 +242,7 @@ void Scheduler::Schedule()
 			//Printf("Userthread: id:%d\r\n", userThread->Id);
 			const uintptr_t cr3 = userThread->Process.GetCR3();
 			//Printf("CR3: 0x%16x\r\n", cr3);
+			SetActiveProcess(&userThread->Process);
 			m_HAL->SetupPaging(cr3);
 			//Printf("SetPaginRoot done\r\n");
 		}
@@ -186,6 +264,8 @@ void Scheduler::Schedule()
 
 		//Printf("context loaded\r\n");
 	}
+
+	RestoreInterrupts(flags);
 }
 
 void Scheduler::KillThread(KThread& thread)
@@ -205,6 +285,7 @@ void Scheduler::KillThread(KThread& thread)
 
 void Scheduler::KillCurrentThread()
 {
+	_disable();
 	KThread& current = GetCurrentThread();
 
 	this->KillThread(current);
@@ -223,6 +304,8 @@ UserProcess& Scheduler::GetCurrentProcess()
 
 void Scheduler::AddReady(std::shared_ptr<KThread>& thread)
 {
+	KLockGuard<KSpinLock> guard(m_lock);
+
 	//Mark thread ready
 	thread.get()->m_state = ThreadState::Ready;
 
@@ -238,6 +321,7 @@ void Scheduler::AddReady(std::shared_ptr<KThread>& thread)
 
 void Scheduler::Sleep(const nano_t value)
 {
+	const cpu_flags_t flags = SaveAndDisableInterrupts();
 	KThread& current = GetCurrentThread();
 
 	//set wakeup
@@ -248,6 +332,19 @@ void Scheduler::Sleep(const nano_t value)
 	current.m_state = ThreadState::Sleeping;
 
 	this->Schedule();
+	RestoreInterrupts(flags);
+}
+
+nano_t Scheduler::PredictIdle()
+{
+	//Sleep and wait timeouts are whole ticks, so the next tick is always the first deadline
+	//and every idle period ends there. Once the timer is one-shot this has to look at the timeouts.
+	const uint64_t last = m_HAL->GetClock()->GetLastTickTsc();
+	if (x64::TSCFreq == 0 || last == 0)
+		return 0;
+
+	const nano_t elapsed = ((__rdtsc() - last) * 1000) / x64::TSCFreq;
+	return elapsed < nsPerTick ? nsPerTick - elapsed : 0;
 }
 
 KThread& Scheduler::GetCurrentThread()
@@ -266,6 +363,8 @@ UserThread& Scheduler::GetCurrentUserThread()
 
 WaitStatus Scheduler::ObjectWait(KSignalObject& object, const milli_t timeout /*= std::numeric_limits<milli_t>::max()*/)
 {
+	//Signalling happens from interrupt context, keep it out between the check and the state change
+	const cpu_flags_t flags = SaveAndDisableInterrupts();
 	KThread& current = GetCurrentThread();
 	AssertEqual(current.m_state, ThreadState::Running);
 	AssertEqual(current.m_signal, nullptr);
@@ -274,6 +373,7 @@ WaitStatus Scheduler::ObjectWait(KSignalObject& object, const milli_t timeout /*
 	if (object.IsSignalled())
 	{
 		object.Observed();
+		RestoreInterrupts(flags);
 		return WaitStatus::Signaled;
 	}
 
@@ -286,7 +386,8 @@ WaitStatus Scheduler::ObjectWait(KSignalObject& object, const milli_t timeout /*
 	// Round the number of milliseconds to the nearest MS_PER_TICK
 	uint64_t rounded_ticks = ((timeout + (msPerTick - 1)) / msPerTick);
 
-	const uint64_t deadline = tscStart + rounded_ticks;
+	//Infinite waits must not wrap around
+	const uint64_t deadline = (timeout == std::numeric_limits<milli_t>::max()) ? std::numeric_limits<uint64_t>::max() : tscStart + rounded_ticks;
 
 	//Set signal
 	current.m_state = ThreadState::SignalWait;
@@ -294,13 +395,224 @@ WaitStatus Scheduler::ObjectWait(KSignalObject& object, const milli_t timeout /*
 	current.m_timeout = deadline;
 
 	this->Schedule();
+	RestoreInterrupts(flags);
 	return current.m_waitStatus;
 }
 
+void Scheduler::AcquireMutex(KMutex& mutex)
+{
+	//Test and take ownership without being preempted in between
+	const cpu_flags_t flags = SaveAndDisableInterrupts();
+	KThread& current = GetCurrentThread();
+
+	if (mutex.m_owner == &current)
+	{
+		mutex.m_recursion++;
+		RestoreInterrupts(flags);
+		return;
+	}
+
+	const bool contended = mutex.m_owner != nullptr;
+	const uint64_t start = contended ? __rdtsc() : 0;
+	while (mutex.m_owner != nullptr)
+	{
+		//Lend our rank to the owner so a lower priority owner can't be starved by threads between us.
+		//If the owner waits for another mutex itself, that one's owner is holding us up too.
+		const uint32_t rank = Rank(current);
+		KThread* owner = mutex.m_owner;
+		for (size_t depth = 0; owner != nullptr && depth < MutexChainDepth; depth++)
+		{
+			if (rank > Rank(*owner))
+				owner->m_inheritedRank = rank;
+			owner = owner->m_blockedOn ? owner->m_blockedOn->m_owner : nullptr;
+		}
+
+		current.m_blockedOn = &mutex;
+		ObjectWait(mutex);
+		current.m_blockedOn = nullptr;
+
+		//Mutexes block instead of spinning, count wakeups instead
+		if (mutex.m_stats.IsEnabled())
+			mutex.m_stats.Spins++;
+	}
+
+	mutex.m_owner = &current;
+	mutex.m_recursion = 1;
+	current.m_mutexCount++;
+
+	if (mutex.m_stats.IsEnabled())
+	{
+		mutex.m_stats.Acquisitions++;
+		if (contended)
+		{
+			mutex.m_stats.Contentions++;
+			mutex.m_stats.WaitCycles += __rdtsc() - start;
+		}
+	}
+
+	RestoreInterrupts(flags);
+}
+
+void Scheduler::ReleaseMutex(KMutex& mutex)
+{
+	const cpu_flags_t flags = SaveAndDisableInterrupts();
+	KThread& current = GetCurrentThread();
+	AssertEqual(mutex.m_owner, &current);
+	Assert(current.m_mutexCount > 0);
+
+	if (--mutex.m_recursion > 0)
+	{
+		RestoreInterrupts(flags);
+		return;
+	}
+
+	mutex.m_owner = nullptr;
+	current.m_mutexCount--;
+
+	//Drop inherited rank once we hold no more mutexes. Holding others keeps the boost, which is conservative but safe.
+	if (current.m_mutexCount == 0 && current.m_inheritedRank != 0)
+	{
+		current.m_inheritedRank = 0;
+
+		//A waiter outranks us now, let it run
+		if (this->Enabled)
+		{
+			current.m_quantum = 0;
+			this->Schedule();
+		}
+	}
+
+	RestoreInterrupts(flags);
+}
+
+uint32_t Scheduler::Rank(const KThread& thread)
+{
+	uint32_t rank = RankIdle;
+	switch (thread.m_priority)
+	{
+	case ThreadPriority::RealTime:
+		rank = RankRealTime;
+		break;
+	case ThreadPriority::Normal:
+		rank = RankNormal + (MlfqLevels - 1 - thread.m_level);
+		break;
+	}
+
+	return rank > thread.m_inheritedRank ? rank : thread.m_inheritedRank;
+}
+
+uint8_t Scheduler::Quantum(const KThread& thread)
+{
+	if (thread.m_priority == ThreadPriority::Normal)
+		return 1 << thread.m_level;
+	return 1;
+}
+
+void Scheduler::SetActiveProcess(UserProcess* process)
+{
+	//Kept per process so TLB shootdowns only interrupt CPUs that can hold its entries
+	if (m_cpu.Process == process)
+		return;
+
+	const int64_t cpu = 1LL << m_HAL->CurrentCPU();
+	if (m_cpu.Process)
+		_InterlockedAnd64((volatile int64_t*)&m_cpu.Process->m_activeCpus, ~cpu);
+	_InterlockedOr64((volatile int64_t*)&process->m_activeCpus, cpu);
+	m_cpu.Process = process;
+}
+
+void Scheduler::SwitchSimd(KThread& current, KThread& next)
+{
+	const uint64_t start = __rdtsc();
+
+	if (m_simdPolicy == SimdPolicy::Eager)
+	{
+		m_HAL->SimdSaveContext(current.SimdContext);
+		m_HAL->SimdRestoreContext(next.SimdContext);
+		m_simdOwner = &next;
+	}
+	else
+	{
+		//Registers still hold next's state if nobody used SIMD in between
+		m_HAL->SimdSetTrap(m_simdOwner != &next);
+	}
+
+	m_simdSwitches++;
+	m_simdCycles += __rdtsc() - start;
+}
+
+void Scheduler::OnSimdTrap()
+{
+	//Interrupt stub cleared TS already. Nothing here may touch XMM before the owner's state is saved.
+	const uint64_t start = __rdtsc();
+
+	KThread& current = GetCurrentThread();
+	if (m_simdOwner != &current)
+	{
+		if (m_simdOwner != nullptr)
+			m_HAL->SimdSaveContext(m_simdOwner->SimdContext);
+		m_HAL->SimdRestoreContext(current.SimdContext);
+		m_simdOwner = &current;
+	}
+
+	m_simdTraps++;
+	m_simdCycles += __rdtsc() - start;
+}
+
+void Scheduler::ReleaseSimd()
+{
+	//Interrupt arrived while TS was set. Registers belong to the owner, put them away so the handler can use them.
+	if (m_simdOwner != nullptr)
+	{
+		m_HAL->SimdSaveContext(m_simdOwner->SimdContext);
+		m_simdOwner = nullptr;
+	}
+}
+
+void Scheduler::SetSimdPolicy(const SimdPolicy policy)
+{
+	if (policy == m_simdPolicy)
+		return;
+
+	KThread& current = GetCurrentThread();
+	if (policy == SimdPolicy::Eager)
+	{
+		//Make current thread's state live again, eager switching assumes it is
+		m_HAL->SimdSetTrap(false);
+		if (m_simdOwner != &current)
+		{
+			if (m_simdOwner != nullptr)
+				m_HAL->SimdSaveContext(m_simdOwner->SimdContext);
+			m_HAL->SimdRestoreContext(current.SimdContext);
+		}
+	}
+
+	m_simdOwner = &current;
+	m_simdPolicy = policy;
+}
+
+void Scheduler::ResetSimdStats()
+{
+	m_simdSwitches = 0;
+	m_simdCycles = 0;
+	m_simdTraps = 0;
+}
+
+void Scheduler::DisplaySimdStats() const
+{
+	Printf("SIMD: %s, area: %d bytes\n", m_simdPolicy == SimdPolicy::Lazy ? "lazy" : "eager", m_HAL->SimdContextSize());
+	Printf("    Switches: %d, #NM traps: %d, cycles: %d", m_simdSwitches, m_simdTraps, m_simdCycles);
+	if (m_simdSwitches != 0)
+		Printf(" (%d per switch)", m_simdCycles / m_simdSwitches);
+	Printf("\n");
+}
+
 void Scheduler::Display() const
 {
 	Printf("Scheduler::Display\n");
 	Printf("    Threads: %d\n", m_threads.size());
+	if (m_lock.Stats())
+		m_lock.Stats()->Display();
 
 	for (size_t i = 0; i < m_threads.size(); i++)
 	{
@@ -310,10 +622,34 @@ void Scheduler::Display() const
 
 void Scheduler::onTimerTick(uint64_t totalTicks)
 {
+	//Runs from the clock DPC with interrupts enabled
 	if(this->Enabled)
 	{
-		if(m_HAL->EOIPending())
-			m_HAL->EOI();	//Signal EOI before scheduling since we might switch context and then EOI might never get called!
-		this->Schedule();
+		KLockGuard<KSpinLock> guard(m_lock);
+
+		//Charge tick to current thread, demote it if it used its whole slice
+		KThread& current = GetCurrentThread();
+		if (current.m_quantum > 0)
+			current.m_quantum--;
+		if (current.m_quantum == 0 && current.m_priority == ThreadPriority::Normal && current.m_level < MlfqLevels - 1)
+			current.m_level++;
+
+		//Prevent starvation of CPU bound threads
+		if ((totalTicks % MlfqBoostTicks) == 0)
+		{
+			for (std::shared_ptr<KThread>& thread : m_threads)
+				thread->m_level = 0;
+		}
+
+		//Switch at interrupt exit, not from inside the DPC
+		m_HAL->RequestReschedule();
 	}
 }
+
+uint32_t Scheduler::OnReschedule(void* arg)
+{
+	Scheduler* scheduler = (Scheduler*)arg;
+	if (scheduler->Enabled)
+		scheduler->Schedule();
+	return 0;
+}
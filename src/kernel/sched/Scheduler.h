@@ -4,8 +4,19 @@
 #include <map>
 #include <vector>
 #include "KThread.h"
+#include "kernel/objects/KMutex.h"
+#include "kernel/objects/KSpinLock.h"
 #include "kernel/hal/HAL.h"
 
+class UserProcess;
+
+//How FPU/SIMD state is switched between threads
+enum class SimdPolicy
+{
+	Eager,	//Save and restore on every context switch
+	Lazy	//Trap first use after a switch (#NM) and switch then
+};
+
 class Scheduler : public TickEventHandler
 {
 public:
@@ -30,10 +41,26 @@ public:
 	//Waits
 	//NOTE(tsharpe): Signals were removed in favor of a simplied scheduler. This may or may not have been smart.
 	WaitStatus ObjectWait(KSignalObject& object, const milli_t timeout = std::numeric_limits<milli_t>::max());
-	
+
+	//Time until the next timer deadline, drives the idle C-state choice
+	nano_t PredictIdle();
+
+	//Mutexes with priority inheritance
+	void AcquireMutex(KMutex& mutex);
+	void ReleaseMutex(KMutex& mutex);
 
 	void Display() const;
 
+	//SIMD state switching
+	void SetSimdPolicy(const SimdPolicy policy);
+	SimdPolicy GetSimdPolicy() const { return m_simdPolicy; }
+	void ResetSimdStats();
+	void DisplaySimdStats() const;
+	//From the interrupt stubs, CR0.TS is already clear. #NM loads the current thread's state, an interrupt
+	//that came in while TS was set only saves the owner's.
+	void OnSimdTrap();
+	void ReleaseSimd();
+
 	bool Enabled;
 
 
@@ -44,21 +71,40 @@ private:
 	{
 		CpuContext() :
 			SelfPointer(*this),
-			Thread()
+			Thread(),
+			Process()
 		{}
 
 		const CpuContext& SelfPointer;
 		KThread* Thread;
+		UserProcess* Process; //Address space in CR3, kernel threads keep the previous one
 	};
+	static uint32_t Rank(const KThread& thread);
+	static uint8_t Quantum(const KThread& thread);
+
+	void SwitchSimd(KThread& current, KThread& next);
+	void SetActiveProcess(UserProcess* process);
+	static uint32_t OnReschedule(void* arg);
+
 	//Reference to clock
 	HAL* m_HAL;
 
 	//Cpu context
 	CpuContext m_cpu;
 
+	//Protects the thread list. Only held with interrupts disabled and never across a context switch.
+	KSpinLock m_lock;
+
 	//Threads and current thread
 	size_t m_threadIndex;
 	std::vector<std::shared_ptr<KThread>> m_threads;
 
+	//Thread whose SIMD state is live in the registers (lazy policy)
+	SimdPolicy m_simdPolicy;
+	KThread* m_simdOwner;
+	uint64_t m_simdSwitches;
+	uint64_t m_simdCycles;
+	uint64_t m_simdTraps;
+
 	::NO_COPY_OR_ASSIGN(Scheduler);
 };
\ No newline at end of file
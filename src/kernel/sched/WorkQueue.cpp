@@ -0,0 +1,258 @@
+#include "WorkQueue.h"
+
+#include "Assert.h"
+#include <intrin.h>
+#include "kernel/Kernel.h"
+#include "kernel/objects/KPredicate.h"
+
+const milli_t msPerTick = 1000 / APIC_TICKS_PER_SEC;
+
+WorkQueue::WorkQueue(const char* name) :
+	Name(name),
+	m_lock(name),
+	m_ready(),
+	m_delayed(),
+	m_available(0, INT32_MAX, "WorkQueue"),
+	m_workers(),
+	m_workerCount(),
+	m_sequence(),
+	m_depth(),
+	m_maxDepth(),
+	m_executed(),
+	m_totalLatency(),
+	m_maxLatency(),
+	m_totalRuntime(),
+	m_maxRuntime()
+{
+	ListInitializeHead(&m_ready);
+	ListInitializeHead(&m_delayed);
+}
+
+void WorkQueue::Start(const size_t workers, const ThreadPriority priority /*= ThreadPriority::Normal*/)
+{
+	AssertEqual(m_workerCount, 0);
+	AssertOp(workers, <=, WORKQUEUE_MAX_WORKERS);
+
+	kernel.GetHAL()->GetClock()->RegisterTickHandler(this);
+
+	for (size_t i = 0; i < workers; i++)
+	{
+		m_workers[i] = { this, 0 };
+		kernel.KeCreateThread(&WorkQueue::WorkerThread, &m_workers[i], Name, priority);
+	}
+	m_workerCount = workers;
+}
+
+bool WorkQueue::Queue(KWorkItem& item)
+{
+	Assert(item.Routine);
+	KLockGuard<KSpinLock> guard(m_lock);
+
+	if (item.m_state == WorkState::Queued || item.m_state == WorkState::Delayed)
+		return false;
+
+	Enqueue(item);
+	return true;
+}
+
+bool WorkQueue::QueueDelayed(KWorkItem& item, const milli_t delay)
+{
+	Assert(item.Routine);
+	if (delay == 0)
+		return Queue(item);
+
+	KLockGuard<KSpinLock> guard(m_lock);
+
+	if (item.m_state == WorkState::Queued || item.m_state == WorkState::Delayed)
+		return false;
+
+	item.m_state = WorkState::Delayed;
+	item.m_dueTick = kernel.GetHAL()->GetClock()->GetTicks() + (delay + msPerTick - 1) / msPerTick;
+	ListInsertTail(&m_delayed, &item.m_link);
+	return true;
+}
+
+void WorkQueue::Submit(const WorkRoutine routine, void* const context)
+{
+	KWorkItem* item = new KWorkItem(routine, context);
+	item->m_owned = true;
+	Queue(*item);
+}
+
+bool WorkQueue::Cancel(KWorkItem& item)
+{
+	KLockGuard<KSpinLock> guard(m_lock);
+
+	switch (item.m_state)
+	{
+	case WorkState::Queued:
+		//Worker woken for it finds one item less, that is fine
+		m_depth--;
+		break;
+
+	case WorkState::Delayed:
+		break;
+
+	default:
+		return false;
+	}
+
+	ListRemoveEntry(&item.m_link);
+	item.m_state = WorkState::Idle;
+	return true;
+}
+
+void WorkQueue::Flush()
+{
+	FlushContext ctx;
+	{
+		KLockGuard<KSpinLock> guard(m_lock);
+		ctx = { this, m_sequence };
+		if (OldestSequence() > ctx.Target)
+			return;
+	}
+
+	Assert(kernel.GetScheduler()->Enabled);
+	KPredicate flushed(&WorkQueue::IsFlushed, &ctx);
+	kernel.KeWait(flushed);
+}
+
+void WorkQueue::onTimerTick(uint64_t totalTicks)
+{
+	//Clock DPC, promote delayed items that are due
+	KLockGuard<KSpinLock> guard(m_lock);
+
+	ListEntry* entry = m_delayed.Flink;
+	while (entry != &m_delayed)
+	{
+		KWorkItem* item = LIST_CONTAINING_RECORD(entry, KWorkItem, m_link);
+		entry = entry->Flink;
+
+		if (item->m_dueTick > totalTicks)
+			continue;
+
+		ListRemoveEntry(&item->m_link);
+		Enqueue(*item);
+	}
+}
+
+void WorkQueue::Display() const
+{
+	Printf("WorkQueue %s: %d workers, depth %d (max %d), executed %d\n", Name, m_workerCount, m_depth, m_maxDepth, m_executed);
+	if (m_executed != 0 && x64::TSCFreq != 0)
+		Printf("    Latency: avg %d us, max %d us, runtime: avg %d us, max %d us\n",
+			(m_totalLatency / m_executed) / x64::TSCFreq, m_maxLatency / x64::TSCFreq,
+			(m_totalRuntime / m_executed) / x64::TSCFreq, m_maxRuntime / x64::TSCFreq);
+	if (m_lock.Stats())
+		m_lock.Stats()->Display();
+}
+
+void WorkQueue::ResetStats()
+{
+	KLockGuard<KSpinLock> guard(m_lock);
+	m_maxDepth = m_depth;
+	m_executed = 0;
+	m_totalLatency = 0;
+	m_maxLatency = 0;
+	m_totalRuntime = 0;
+	m_maxRuntime = 0;
+}
+
+size_t WorkQueue::WorkerThread(void* arg)
+{
+	Worker& worker = *(Worker*)arg;
+	WorkQueue* queue = worker.Queue;
+
+	while (true)
+	{
+		kernel.KeWait(queue->m_available);
+
+		KWorkItem* item = queue->Dequeue(worker);
+		if (!item)
+			continue;
+
+		//Item may be gone once the routine returns, take what is needed now
+		const WorkRoutine routine = item->Routine;
+		void* const context = item->Context;
+		const bool owned = item->m_owned;
+
+		const uint64_t start = __rdtsc();
+		routine(context);
+		queue->Complete(worker, __rdtsc() - start);
+
+		if (owned)
+			delete item;
+	}
+}
+
+bool WorkQueue::IsFlushed(void* const arg)
+{
+	//Evaluated by the scheduler with interrupts disabled
+	const FlushContext* flush = (const FlushContext*)arg;
+	return flush->Queue->OldestSequence() > flush->Target;
+}
+
+void WorkQueue::Enqueue(KWorkItem& item)
+{
+	Assert(m_lock.IsLocked());
+
+	item.m_state = WorkState::Queued;
+	item.m_sequence = ++m_sequence;
+	item.m_queuedAt = __rdtsc();
+	ListInsertTail(&m_ready, &item.m_link);
+
+	m_depth++;
+	if (m_depth > m_maxDepth)
+		m_maxDepth = m_depth;
+
+	m_available.Signal();
+}
+
+KWorkItem* WorkQueue::Dequeue(Worker& worker)
+{
+	KLockGuard<KSpinLock> guard(m_lock);
+
+	if (ListIsEmpty(&m_ready))
+		return nullptr;
+
+	KWorkItem* item = LIST_CONTAINING_RECORD(ListRemoveHead(&m_ready), KWorkItem, m_link);
+	//Completion is recorded before the routine runs, Flush waits on worker.Sequence
+	item->m_state = WorkState::Idle;
+	worker.Sequence = item->m_sequence;
+	m_depth--;
+
+	const uint64_t latency = __rdtsc() - item->m_queuedAt;
+	m_totalLatency += latency;
+	if (latency > m_maxLatency)
+		m_maxLatency = latency;
+
+	return item;
+}
+
+void WorkQueue::Complete(Worker& worker, const uint64_t runtime)
+{
+	KLockGuard<KSpinLock> guard(m_lock);
+	worker.Sequence = 0;
+
+	m_executed++;
+	m_totalRuntime += runtime;
+	if (runtime > m_maxRuntime)
+		m_maxRuntime = runtime;
+}
+
+uint64_t WorkQueue::OldestSequence() const
+{
+	//Ready list is in submission order, so the head is the oldest queued item
+	uint64_t oldest = UINT64_MAX;
+	if (!ListIsEmpty(&m_ready))
+		oldest = LIST_CONTAINING_RECORD(m_ready.Flink, KWorkItem, m_link)->m_sequence;
+
+	for (size_t i = 0; i < m_workerCount; i++)
+	{
+		const uint64_t sequence = m_workers[i].Sequence;
+		if (sequence != 0 && sequence < oldest)
+			oldest = sequence;
+	}
+
+	return oldest;
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <os.internal.h>
+#include "os.List.h"
+#include "KThread.h"
+#include "kernel/os/Time.h"
+#include "kernel/objects/KSpinLock.h"
+#include "kernel/objects/KSemaphore.h"
+#include "kernel/drivers/platform/Clock.h"
+
+#define WORKQUEUE_MAX_WORKERS	8
+
+typedef void(*WorkRoutine)(void* context);
+
+enum class WorkState : uint8_t
+{
+	Idle,
+	Queued,
+	Delayed
+};
+
+//Unit of work for a WorkQueue. Embed it in the owning object or let WorkQueue::Submit wrap a closure.
+//The item is Idle again before its routine runs, so the routine may queue it again or free it, the queue
+//doesn't touch it afterwards.
+class KWorkItem
+{
+	friend class WorkQueue;
+public:
+	KWorkItem(WorkRoutine routine = nullptr, void* context = nullptr) :
+		Routine(routine),
+		Context(context),
+		m_link(),
+		m_state(WorkState::Idle),
+		m_sequence(),
+		m_queuedAt(),
+		m_dueTick(),
+		m_owned()
+	{
+
+	}
+
+	virtual ~KWorkItem() {}
+
+	WorkState GetState() const { return m_state; }
+
+	WorkRoutine Routine;
+	void* Context;
+
+private:
+	ListEntry m_link;
+	volatile WorkState m_state;
+	uint64_t m_sequence; //Submission order, for Flush
+	uint64_t m_queuedAt; //TSC
+	uint64_t m_dueTick; //Delayed items
+	bool m_owned; //Allocated by Submit, deleted after it ran
+
+	::NO_COPY_OR_ASSIGN(KWorkItem);
+};
+
+//Heap allocated work item running a lambda
+template<typename F>
+class KClosureWorkItem : public KWorkItem
+{
+public:
+	KClosureWorkItem(F&& fn) :
+		KWorkItem(&KClosureWorkItem::Invoke, this),
+		m_fn(std::forward<F>(fn))
+	{
+
+	}
+
+private:
+	static void Invoke(void* context)
+	{
+		((KClosureWorkItem*)context)->m_fn();
+	}
+
+	typename std::decay<F>::type m_fn;
+};
+
+//Pool of kernel threads running work items in FIFO order. Delayed items are promoted on the clock tick.
+class WorkQueue : public TickEventHandler
+{
+public:
+	WorkQueue(const char* name);
+
+	void Start(const size_t workers, const ThreadPriority priority = ThreadPriority::Normal);
+
+	//Safe from any context. Return false if item is already pending.
+	bool Queue(KWorkItem& item);
+	bool QueueDelayed(KWorkItem& item, const milli_t delay);
+
+	//Fire and forget
+	void Submit(const WorkRoutine routine, void* const context);
+	template<typename F>
+	void Submit(F&& fn)
+	{
+		KWorkItem* item = new KClosureWorkItem<F>(std::forward<F>(fn));
+		item->m_owned = true;
+		Queue(*item);
+	}
+
+	//Removes a queued or delayed item, false if it isn't pending
+	bool Cancel(KWorkItem& item);
+
+	//Blocks until everything queued before the call has finished. Pending delayed items are not waited for.
+	//Must not be called from a work item of the same queue.
+	void Flush();
+
+	void onTimerTick(uint64_t totalTicks) override;
+
+	void Display() const;
+	void ResetStats();
+
+	const char* const Name;
+
+private:
+	struct Worker
+	{
+		WorkQueue* Queue;
+		volatile uint64_t Sequence; //Of the running item, 0 if idle
+	};
+
+	struct FlushContext
+	{
+		WorkQueue* Queue;
+		uint64_t Target;
+	};
+
+	static size_t WorkerThread(void* arg);
+	static bool IsFlushed(void* const arg);
+
+	void Enqueue(KWorkItem& item);
+	KWorkItem* Dequeue(Worker& worker);
+	void Complete(Worker& worker, const uint64_t runtime);
+	uint64_t OldestSequence() const;
+
+	KSpinLock m_lock;
+	ListEntry m_ready;
+	ListEntry m_delayed;
+	KSemaphore m_available;
+
+	Worker m_workers[WORKQUEUE_MAX_WORKERS];
+	size_t m_workerCount;
+	uint64_t m_sequence;
+
+	//Stats, latency and runtime in cycles
+	size_t m_depth;
+	size_t m_maxDepth;
+	uint64_t m_executed;
+	uint64_t m_totalLatency;
+	uint64_t m_maxLatency;
+	uint64_t m_totalRuntime;
+	uint64_t m_maxRuntime;
+
+	::NO_COPY_OR_ASSIGN(WorkQueue);
+};
@@ -0,0 +1,185 @@
+#include "DentryCache.h"
+#include <Assert.h>
+#include <cstring>
+
+DentryCache::DentryCache() :
+	m_lock("DentryCache"),
+	m_entries(),
+	m_buckets(),
+	m_hand(),
+	m_enabled(true),
+	m_hits(),
+	m_negativeHits(),
+	m_misses(),
+	m_evictions(),
+	m_invalidated(),
+	m_skipped()
+{
+
+}
+
+bool DentryCache::Lookup(const void* mount, uint64_t parent, const char* name, void* data, size_t size, bool& negative)
+{
+	AssertOp(size, <=, DENTRY_DATA_MAX);
+	const uint32_t hash = Hash(mount, parent, name);
+
+	KLockGuard<KSpinLock> guard(m_lock);
+	Dentry* dentry = m_enabled ? Find(mount, parent, name, hash) : nullptr;
+	if (!dentry)
+	{
+		m_misses++;
+		return false;
+	}
+
+	dentry->Referenced = true;
+	negative = dentry->Negative;
+	if (negative)
+		m_negativeHits++;
+	else
+		memcpy(data, dentry->Data, size);
+	m_hits++;
+	return true;
+}
+
+void DentryCache::Insert(const void* mount, uint64_t parent, const char* name, const void* data, size_t size)
+{
+	AssertOp(size, <=, DENTRY_DATA_MAX);
+	const size_t length = strlen(name);
+	const uint32_t hash = Hash(mount, parent, name);
+
+	KLockGuard<KSpinLock> guard(m_lock);
+	if (!m_enabled)
+		return;
+
+	if (length >= DENTRY_NAME_MAX)
+	{
+		m_skipped++;
+		return;
+	}
+
+	Dentry* dentry = Find(mount, parent, name, hash);
+	if (!dentry)
+	{
+		//CLOCK, two turns clear every reference bit
+		while (true)
+		{
+			dentry = &m_entries[m_hand];
+			m_hand = (m_hand + 1) % DENTRY_ENTRIES;
+			if (!dentry->Valid)
+				break;
+			if (!dentry->Referenced)
+			{
+				Unhash(dentry);
+				m_evictions++;
+				break;
+			}
+			dentry->Referenced = false;
+		}
+
+		dentry->Mount = mount;
+		dentry->Parent = parent;
+		dentry->Hash = hash;
+		memcpy(dentry->Name, name, length + 1);
+		dentry->HashNext = m_buckets[hash & (DENTRY_BUCKETS - 1)];
+		m_buckets[hash & (DENTRY_BUCKETS - 1)] = dentry;
+		dentry->Valid = true;
+	}
+
+	dentry->Referenced = true;
+	dentry->Negative = data == nullptr;
+	if (data)
+		memcpy(dentry->Data, data, size);
+}
+
+void DentryCache::Invalidate(const void* mount, uint64_t parent, const char* name)
+{
+	const uint32_t hash = Hash(mount, parent, name);
+
+	KLockGuard<KSpinLock> guard(m_lock);
+	Dentry* dentry = Find(mount, parent, name, hash);
+	if (dentry)
+	{
+		Unhash(dentry);
+		m_invalidated++;
+	}
+}
+
+void DentryCache::InvalidateMount(const void* mount)
+{
+	KLockGuard<KSpinLock> guard(m_lock);
+	for (Dentry& dentry : m_entries)
+	{
+		if (dentry.Valid && dentry.Mount == mount)
+		{
+			Unhash(&dentry);
+			m_invalidated++;
+		}
+	}
+}
+
+void DentryCache::SetEnabled(bool enabled)
+{
+	KLockGuard<KSpinLock> guard(m_lock);
+	m_enabled = enabled;
+	if (enabled)
+		return;
+
+	//Nothing is invalidated while disabled, start over
+	for (Dentry& dentry : m_entries)
+	{
+		if (dentry.Valid)
+			Unhash(&dentry);
+	}
+}
+
+void DentryCache::Display() const
+{
+	const uint64_t lookups = m_hits + m_misses;
+	Printf("DentryCache: %d lookups, %d hits (%d negative), %d misses (%d%% hit), %d evictions, %d invalidated, %d names too long\r\n",
+		lookups, m_hits, m_negativeHits, m_misses, lookups != 0 ? (m_hits * 100) / lookups : 0, m_evictions, m_invalidated, m_skipped);
+}
+
+void DentryCache::ResetStats()
+{
+	m_hits = 0;
+	m_negativeHits = 0;
+	m_misses = 0;
+	m_evictions = 0;
+	m_invalidated = 0;
+	m_skipped = 0;
+}
+
+uint32_t DentryCache::Hash(const void* mount, uint64_t parent, const char* name)
+{
+	//FNV-1a
+	uint32_t hash = 2166136261u;
+	const uint64_t key = (uint64_t)mount ^ (parent * 0x9E3779B97F4A7C15ull);
+	for (size_t i = 0; i < sizeof(key); i++)
+		hash = (hash ^ (uint8_t)(key >> (i * 8))) * 16777619u;
+	while (*name)
+		hash = (hash ^ (uint8_t)*name++) * 16777619u;
+	return hash;
+}
+
+DentryCache::Dentry* DentryCache::Find(const void* mount, uint64_t parent, const char* name, uint32_t hash) const
+{
+	for (Dentry* dentry = m_buckets[hash & (DENTRY_BUCKETS - 1)]; dentry; dentry = dentry->HashNext)
+	{
+		if (dentry->Hash == hash && dentry->Mount == mount && dentry->Parent == parent && strcmp(dentry->Name, name) == 0)
+			return dentry;
+	}
+	return nullptr;
+}
+
+void DentryCache::Unhash(Dentry* dentry)
+{
+	Dentry** link = &m_buckets[dentry->Hash & (DENTRY_BUCKETS - 1)];
+	while (*link != dentry)
+	{
+		Assert(*link != nullptr);
+		link = &(*link)->HashNext;
+	}
+	*link = dentry->HashNext;
+	dentry->HashNext = nullptr;
+	dentry->Valid = false;
+}
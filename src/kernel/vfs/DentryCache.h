@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <os.internal.h>
+#include "kernel/objects/KSpinLock.h"
+
+#define DENTRY_ENTRIES		1024
+#define DENTRY_BUCKETS		256 //Power of two
+#define DENTRY_NAME_MAX		64 //Including the terminator, longer names aren't cached
+#define DENTRY_DATA_MAX		48 //Filesystem's copy of the entry
+
+//Path component lookups of all mounted filesystems, keyed by (mount, parent directory, name). Parent is whatever
+//number the filesystem identifies directories by. Entries carry a small blob the filesystem needs to use the
+//result without going to disk, or nothing for names known not to exist. Filesystems invalidate names they
+//create, change or remove.
+class DentryCache
+{
+public:
+	DentryCache();
+
+	//True if (mount, parent, name) is cached. Copies size bytes of data out unless the entry is negative.
+	bool Lookup(const void* mount, uint64_t parent, const char* name, void* data, size_t size, bool& negative);
+	//Caches a found entry, or a negative one if data is null
+	void Insert(const void* mount, uint64_t parent, const char* name, const void* data, size_t size);
+	void Invalidate(const void* mount, uint64_t parent, const char* name);
+	void InvalidateMount(const void* mount);
+
+	//Every lookup misses and nothing is inserted. Only for comparisons.
+	void SetEnabled(bool enabled);
+
+	void Display() const;
+	void ResetStats();
+
+private:
+	struct Dentry
+	{
+		const void* Mount;
+		uint64_t Parent;
+		Dentry* HashNext;
+		uint32_t Hash;
+		bool Valid;
+		bool Negative;
+		bool Referenced; //Second chance for CLOCK
+		char Name[DENTRY_NAME_MAX];
+		uint8_t Data[DENTRY_DATA_MAX];
+	};
+
+	static uint32_t Hash(const void* mount, uint64_t parent, const char* name);
+	Dentry* Find(const void* mount, uint64_t parent, const char* name, uint32_t hash) const;
+	void Unhash(Dentry* dentry);
+
+	KSpinLock m_lock;
+	Dentry m_entries[DENTRY_ENTRIES];
+	Dentry* m_buckets[DENTRY_BUCKETS];
+	size_t m_hand;
+	bool m_enabled;
+
+	//Stats
+	uint64_t m_hits;
+	uint64_t m_negativeHits;
+	uint64_t m_misses;
+	uint64_t m_evictions;
+	uint64_t m_invalidated;
+	uint64_t m_skipped; //Names too long
+
+	::NO_COPY_OR_ASSIGN(DentryCache);
+};
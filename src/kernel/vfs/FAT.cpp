@@ -1,5 +1,7 @@
 #include "FAT.h"
 #include <ctype.h>
+#include <intrin.h>
+#include <Assert.h>
 #include "kernel/Kernel.h"
 
 int IndexOf(const char* str, char c, uint32_t skip)
@@ -92,13 +94,23 @@ std::list<char*> StrSplit(const char* str, char d)
 }
 
 FAT::FAT(Disk* disk, uint64_t start, uint64_t size)
-	: VirtualFileSystem(disk, start, size, "FAT Filesystem")
+	: VirtualFileSystem(disk, start, size, "FAT Filesystem"), cache(kernel.GetBufferCache()), readahead(new Readahead(disk)), fsLock("FAT")
 {
 	memset(&fsInfo, 0, sizeof(FAT32_FSInfo));
 }
 
 FAT::~FAT()
 {
+	// KFile handles point at the nodes, VFSManager doesn't unmount while there are any
+	Assert(this->nodes.empty());
+
+	kernel.VFS()->GetDentries()->InvalidateMount(this);
+	if (!SyncTable())
+		Printf("FAT: Table changes lost on unmount\r\n");
+	delete[] table;
+	delete[] dirtySectors;
+	delete[] usedClusters;
+	delete readahead;
 	delete readBuffer;
 }
 
@@ -107,7 +119,7 @@ bool FAT::Initialize()
 	Printf("Initializing FAT Filesystem\r\n");
 
 	FAT32_BPB bpb;
-	if (this->disk->ReadSector(this->StartLBA, (uint8_t*)&bpb) != 0)
+	if (this->cache->Read(this->disk, this->StartLBA, (uint8_t*)&bpb) != 0)
 		return false;
 
 	this->bytesPerSector = bpb.bytesPerSector;
@@ -121,6 +133,8 @@ bool FAT::Initialize()
 
 	// Size of one FAT in clusters
 	uint32_t FatSize = bpb.SectorsPerFat12_16 != 0 ? bpb.SectorsPerFat12_16 : bpb.SectorsPerFat32;
+	this->fatSize = FatSize;
+	this->numFats = bpb.NumOfFats;
 
 	// Calculate first data sector
 	this->firstDataSector = bpb.ReservedSectors + (bpb.NumOfFats * FatSize) + this->rootDirSectors;
@@ -155,8 +169,9 @@ bool FAT::Initialize()
 
 	// Check for FSInfo structure and read it into this->fsInfo
 	if (this->FatType == FAT32 && bpb.FSInfoSector > 0) {
-		if (this->disk->ReadSector(this->StartLBA + bpb.FSInfoSector, (uint8_t*)&this->fsInfo) != 0)
+		if (this->cache->Read(this->disk, this->StartLBA + bpb.FSInfoSector, (uint8_t*)&this->fsInfo) != 0)
 			return false;
+		this->fsInfoSector = bpb.FSInfoSector;
 	}
 
 #if 1
@@ -178,14 +193,12 @@ bool FAT::Initialize()
 	else if (this->FatType == FAT12 || this->FatType == FAT16)
 		this->fsInfo.startSearchCluster = 2; // Might as well still use this variable for FAT12/FAT16
 
-	return true;
+	return LoadTable();
 }
 
 int FAT::ReadFile(const char* path, uint8_t* buffer, uint32_t offset /*= 0*/, uint32_t len /*= -1*/)
 {
-	if ((int)len == -1)
-		len = GetFileSize(path);
-
+	KMutexGuard guard(fsLock);
 	FATEntryInfo* entry = GetEntryByPath((char*)path);
 	if (entry == 0)
 		return -1;
@@ -196,47 +209,136 @@ int FAT::ReadFile(const char* path, uint8_t* buffer, uint32_t offset /*= 0*/, ui
 		return -1;
 	}
 
-	uint32_t cluster = GET_CLUSTER(entry->entry);
-	uint8_t* bufferPointer = buffer;
-	uint32_t bytesRead = 0;
+	const uint32_t firstCluster = GET_CLUSTER(entry->entry);
+	const uint32_t fileSize = entry->entry.FileSize;
 
 	// Not needed anymore
 	delete entry->filename;
 	delete entry;
 
-	while ((cluster != CLUSTER_FREE) && (cluster < CLUSTER_END))
+	// Nothing past the end of the file
+	if (offset >= fileSize)
+		return 0;
+
+	return ReadExtents(firstCluster, fileSize, GetExtents(firstCluster, fileSize), buffer, offset, len) < 0 ? -1 : 0;
+}
+
+int FAT::ReadExtents(uint32_t firstCluster, uint32_t fileSize, std::vector<FATExtent>* extents, uint8_t* buffer, uint32_t offset, uint32_t len)
+{
+	if (offset >= fileSize)
+		return 0;
+	if ((int)len == -1 || len > fileSize - offset)
+		len = fileSize - offset;
+
+	ReadaheadStream* stream = this->readahead->Begin(firstCluster, offset);
+
+	uint32_t index = offset / this->clusterSize;    // Cluster inside the file
+	size_t e = FindExtent(*extents, index);
+
+	uint8_t* bufferPointer = buffer;
+	uint32_t bytesRead = 0;
+	uint32_t position = offset % this->clusterSize; // Byte inside the current cluster
+
+	while (e < extents->size() && bytesRead < len)
 	{
-		uint32_t sector = ClusterToSector(cluster);
+		const FATExtent& extent = (*extents)[e];
+		uint32_t sector = ClusterToSector(extent.Cluster + index - extent.Offset);
 
-		for (uint16_t i = 0; i < this->sectorsPerCluster; i++) // Loop through sectors in this cluster
+		// Whole clusters, the rest of the extent goes straight into the caller's buffer in as few commands as possible
+		if (position == 0 && len - bytesRead >= this->clusterSize)
 		{
-			if (this->disk->ReadSector(this->StartLBA + sector + i, this->readBuffer) != 0) {
-				Printf("Error reading disk at lba %d", this->StartLBA + sector + i);
+			uint32_t run = extent.Offset + extent.Count - index;
+			if (run > (len - bytesRead) / this->clusterSize)
+				run = (len - bytesRead) / this->clusterSize;
+			if (run * this->sectorsPerCluster > READAHEAD_MAX && this->sectorsPerCluster <= READAHEAD_MAX)
+				run = READAHEAD_MAX / this->sectorsPerCluster;
+
+			if (this->readahead->Read(stream, this->StartLBA + sector, run * this->sectorsPerCluster, bufferPointer) != 0) {
+				this->readahead->Drain();
+				Printf("Error reading disk at lba %d", this->StartLBA + sector);
 				return -1;
 			}
 
-			uint32_t remaingBytes = len - bytesRead;
+			bytesRead += run * this->clusterSize;
+			bufferPointer += run * this->clusterSize;
+			index += run;
+		}
+		else
+		{
+			// Partial cluster at either end of the read, a sector at a time through readBuffer
+			for (uint32_t i = position / this->bytesPerSector; i < this->sectorsPerCluster && bytesRead < len; i++)
+			{
+				if (this->readahead->Read(stream, this->StartLBA + sector + i, 1, this->readBuffer) != 0 || this->readahead->Drain() != 0) {
+					Printf("Error reading disk at lba %d", this->StartLBA + sector + i);
+					return -1;
+				}
 
-			//Copy the required part of the buffer
-			memcpy(bufferPointer, this->readBuffer, remaingBytes <= this->bytesPerSector ? remaingBytes : this->bytesPerSector);
+				const uint32_t skip = position % this->bytesPerSector;
+				uint32_t count = this->bytesPerSector - skip;
+				if (count > len - bytesRead)
+					count = len - bytesRead;
 
-			bytesRead += this->bytesPerSector;
-			bufferPointer += this->bytesPerSector;
+				//Copy the required part of the buffer
+				memcpy(bufferPointer, this->readBuffer + skip, count);
+
+				bytesRead += count;
+				bufferPointer += count;
+				position += count;
+			}
+
+			if (position == this->clusterSize) {
+				position = 0;
+				index++;
+			}
 		}
-		cluster = ReadTable(cluster);
+
+		if (index >= extent.Offset + extent.Count)
+			e++;
 	}
 
-	return 0;
+	if (this->readahead->Drain() != 0) {
+		Printf("Error reading file at cluster %d", firstCluster);
+		return -1;
+	}
+
+	// Point the readahead at what follows in the file, it only fetches it for sequential readers. Prefetches stay
+	// inside one extent, that's one command.
+	uint64_t aheadLba = 0;
+	uint32_t ahead = 0;
+	const uint32_t remaining = fileSize - offset - bytesRead;
+	if (this->readahead->IsSequential(stream) && remaining != 0 && e < extents->size())
+	{
+		const FATExtent& extent = (*extents)[e];
+		const uint32_t first = position / this->bytesPerSector;
+		uint32_t limit = (position % this->bytesPerSector + remaining + this->bytesPerSector - 1) / this->bytesPerSector;
+		if (limit > this->readahead->GetWindow(stream))
+			limit = this->readahead->GetWindow(stream);
+
+		aheadLba = this->StartLBA + ClusterToSector(extent.Cluster + index - extent.Offset) + first;
+		ahead = (extent.Offset + extent.Count - index) * this->sectorsPerCluster - first;
+		if (ahead > limit)
+			ahead = limit;
+	}
+	this->readahead->End(stream, offset + bytesRead, aheadLba, ahead);
+
+	return (int)bytesRead;
 }
 
 int FAT::WriteFile(const char* path, uint8_t* buffer, uint32_t len, bool create /*= true*/)
 {
+	KMutexGuard guard(fsLock);
+
+	// Prefetched blocks and cluster chains may be about to change
+	this->readahead->Invalidate();
+	DropExtents();
+
 	if (FileExists(path) == false && create)
 		if (CreateFile(path) != 0)
 			return -1;
 
 	// Get entry
-	FATEntryInfo* entry = GetEntryByPath((char*)path);
+	uint32_t parentKey = 0;
+	FATEntryInfo* entry = GetEntryByPath((char*)path, &parentKey);
 	if (entry == 0)
 		return -1;
 
@@ -250,9 +352,14 @@ int FAT::WriteFile(const char* path, uint8_t* buffer, uint32_t len, bool create
 	uint32_t cluster = GET_CLUSTER(entry->entry);
 	for (uint32_t i = 0; i < reqClusters; i++) {
 		uint32_t sector = ClusterToSector(cluster);
-		for (uint32_t s = 0; s < this->sectorsPerCluster; s++) {
+
+		// Sectors past the data keep what the cache holds for them, like the zeros of a freshly cleared cluster
+		for (uint32_t s = 0; s < this->sectorsPerCluster && bytesWritten < len; s++) {
 			uint32_t bytesLeft = len - bytesWritten;
 
+			// File data goes straight to the disk, drop the cached copy of the sector it replaces
+			this->cache->Invalidate(this->disk, this->StartLBA + sector + s, 1);
+
 			// Use readbuffer for partial writing when there is not a complete sector left
 			if (bytesLeft < this->bytesPerSector) {
 				memset(this->readBuffer, 0, this->bytesPerSector);
@@ -262,6 +369,7 @@ int FAT::WriteFile(const char* path, uint8_t* buffer, uint32_t len, bool create
 				if (this->disk->WriteSector(this->StartLBA + sector + s, this->readBuffer) != 0) {
 					delete entry->filename;
 					delete entry;
+					SyncTable();
 					return -1;
 				}
 			}
@@ -270,6 +378,7 @@ int FAT::WriteFile(const char* path, uint8_t* buffer, uint32_t len, bool create
 				if (this->disk->WriteSector(this->StartLBA + sector + s, buffer + i * this->clusterSize + s * this->bytesPerSector) != 0) {
 					delete entry->filename;
 					delete entry;
+					SyncTable();
 					return -1;
 				}
 			}
@@ -290,20 +399,33 @@ int FAT::WriteFile(const char* path, uint8_t* buffer, uint32_t len, bool create
 	newEntry.ModifyDate = FatDate();
 	newEntry.ModifyTime = FatTime();
 
-	// Modify entry
+	// Modify entry, the cached copy has the old size
+	kernel.VFS()->GetDentries()->Invalidate(this, parentKey, entry->filename);
 	if (ModifyEntry(entry, newEntry) == false) {
 		delete entry->filename;
 		delete entry;
+		SyncTable();
 		return -1;
 	}
 
+	// Handles open on the file see the new size and chain
+	FATNode* node = FindNode(entry->sector, entry->offsetInSector);
+	if (node != 0) {
+		node->info.entry = newEntry;
+		node->extents.clear();
+		BuildExtents(GET_CLUSTER(newEntry), this->totalClusters, node->extents);
+	}
+
 	delete entry->filename;
 	delete entry;
-	return 0;
+
+	// Chain changes of the whole write go out in one batch, the data is unreachable without them
+	return SyncTable() ? 0 : -1;
 }
 
 bool FAT::FileExists(const char* path)
 {
+	KMutexGuard guard(fsLock);
 	FATEntryInfo* entry = GetEntryByPath((char*)path);
 	bool exists = false;
 	if (entry == 0)
@@ -319,6 +441,7 @@ bool FAT::FileExists(const char* path)
 
 bool FAT::DirectoryExists(const char* path)
 {
+	KMutexGuard guard(fsLock);
 	FATEntryInfo* entry = GetEntryByPath((char*)path);
 	bool exists = false;
 	if (entry == 0)
@@ -334,16 +457,25 @@ bool FAT::DirectoryExists(const char* path)
 
 int FAT::CreateFile(const char* path)
 {
-	return CreateNewDirFileEntry(path, 0);
+	KMutexGuard guard(fsLock);
+	const int result = CreateNewDirFileEntry(path, 0);
+	if (!SyncTable())
+		return -1;
+	return result;
 }
 
 int FAT::CreateDirectory(const char* path)
 {
-	return CreateNewDirFileEntry(path, ATTR_DIRECTORY);
+	KMutexGuard guard(fsLock);
+	const int result = CreateNewDirFileEntry(path, ATTR_DIRECTORY);
+	if (!SyncTable())
+		return -1;
+	return result;
 }
 
 uint32_t FAT::GetFileSize(const char* path)
 {
+	KMutexGuard guard(fsLock);
 	FATEntryInfo* entry = GetEntryByPath((char*)path);
 	uint32_t fileSize = 0;
 	if (entry == 0)
@@ -362,6 +494,7 @@ uint32_t FAT::GetFileSize(const char* path)
 
 std::list<VFSEntry>* FAT::DirectoryList(const char* path)
 {
+	KMutexGuard guard(fsLock);
 	std::list<VFSEntry>* ret = new std::list<VFSEntry>();
 	uint32_t parentCluster = this->rootDirCluster;
 	bool rootdir = strlen(path) == 0;
@@ -401,6 +534,253 @@ std::list<VFSEntry>* FAT::DirectoryList(const char* path)
 	return ret;
 }
 
+bool FAT::Open(KFile& file, const char* path, GenericAccess access, bool create /*= false*/)
+{
+	KMutexGuard guard(fsLock);
+	uint32_t parentKey = 0;
+	FATEntryInfo* entry = GetEntryByPath((char*)path, &parentKey);
+	if (entry == 0 && create) {
+		const int result = CreateNewDirFileEntry(path, 0);
+		if (!SyncTable() || result != 0)
+			return false;
+		entry = GetEntryByPath((char*)path, &parentKey);
+	}
+	if (entry == 0)
+		return false;
+
+	if (entry->entry.Attributes & ATTR_DIRECTORY) {
+		delete entry->filename;
+		delete entry;
+		return false;
+	}
+
+	// Every handle on a file shares one node, so they agree on its size and chain
+	FATNode* node = FindNode(entry->sector, entry->offsetInSector);
+	if (node != 0) {
+		node->refs++;
+		delete entry->filename;
+		delete entry;
+	}
+	else {
+		node = new FATNode();
+		node->info = *entry;
+		node->parentKey = parentKey;
+		node->refs = 1;
+		BuildExtents(GET_CLUSTER(node->info.entry), this->totalClusters, node->extents);
+		this->nodes.push_back(node);
+		delete entry;
+	}
+
+	file.Context = node;
+	file.Length = node->info.entry.FileSize;
+	return true;
+}
+
+int FAT::Write(KFile& file, const uint8_t* buffer, uint32_t len)
+{
+	KMutexGuard guard(fsLock);
+	FATNode* node = (FATNode*)file.Context;
+	if (file.Position > node->info.entry.FileSize)
+		return -1;
+
+	const int bytesWritten = WriteData(node, buffer, (uint32_t)file.Position, len);
+	if (bytesWritten > 0)
+		file.Position += bytesWritten;
+	file.Length = node->info.entry.FileSize;
+	return bytesWritten;
+}
+
+int FAT::WriteData(FATNode* node, const uint8_t* buffer, uint32_t offset, uint32_t len)
+{
+	const uint32_t fileSize = node->info.entry.FileSize;
+
+	// FAT sizes are 32 bits
+	if (len > 0xFFFFFFFF - offset)
+		len = 0xFFFFFFFF - offset;
+	if (len == 0)
+		return 0;
+
+	DirectoryEntry newEntry = node->info.entry;
+
+	// Only clusters past the current chain are allocated, the rest of the file is left alone
+	const uint32_t needed = (uint32_t)(((uint64_t)offset + len + this->clusterSize - 1) / this->clusterSize);
+	const uint32_t chain = node->extents.empty() ? 0 : node->extents.back().Offset + node->extents.back().Count;
+	if (needed > chain && !ExtendChain(node, needed - chain, newEntry)) {
+		SyncTable();
+		return -1;
+	}
+
+	// Prefetched blocks and cached extent maps of the file are stale
+	this->readahead->Invalidate();
+	DropExtents();
+
+	uint32_t bytesWritten = 0;
+	uint32_t position = offset;
+	size_t e = FindExtent(node->extents, position / this->clusterSize);
+	while (bytesWritten < len)
+	{
+		const FATExtent& extent = node->extents[e];
+		const uint32_t index = position / this->clusterSize;
+		const uint32_t sectorInExtent = (index - extent.Offset) * this->sectorsPerCluster + (position % this->clusterSize) / this->bytesPerSector;
+		const uint32_t lba = this->StartLBA + ClusterToSector(extent.Cluster) + sectorInExtent;
+		const uint32_t skip = position % this->bytesPerSector;
+		uint32_t count;
+
+		if (skip == 0 && len - bytesWritten >= this->bytesPerSector)
+		{
+			// Whole sectors go straight from the caller's buffer, as far as the extent reaches
+			uint32_t sectors = extent.Count * this->sectorsPerCluster - sectorInExtent;
+			if (sectors > (len - bytesWritten) / this->bytesPerSector)
+				sectors = (len - bytesWritten) / this->bytesPerSector;
+			if (sectors > FAT_WRITE_CHUNK)
+				sectors = FAT_WRITE_CHUNK;
+
+			this->cache->Invalidate(this->disk, lba, sectors);
+			if (this->disk->WriteSectors(lba, sectors, (uint8_t*)buffer + bytesWritten) != 0) {
+				Printf("Error writing disk at lba %d", lba);
+				break;
+			}
+			count = sectors * this->bytesPerSector;
+		}
+		else
+		{
+			// Partial sector, what is around the new bytes has to survive if it belongs to the file
+			count = this->bytesPerSector - skip;
+			if (count > len - bytesWritten)
+				count = len - bytesWritten;
+
+			this->cache->Invalidate(this->disk, lba, 1);
+			if (position - skip < fileSize) {
+				if (this->disk->ReadSector(lba, this->readBuffer) != 0) {
+					Printf("Error reading disk at lba %d", lba);
+					break;
+				}
+				this->sectorsMerged++;
+			}
+			else
+				memset(this->readBuffer, 0, this->bytesPerSector);
+
+			memcpy(this->readBuffer + skip, buffer + bytesWritten, count);
+			if (this->disk->WriteSector(lba, this->readBuffer) != 0) {
+				Printf("Error writing disk at lba %d", lba);
+				break;
+			}
+		}
+
+		bytesWritten += count;
+		position += count;
+		if (position / this->clusterSize >= extent.Offset + extent.Count)
+			e++;
+	}
+
+	const uint32_t overwritten = (position < fileSize ? position : fileSize) - offset;
+	this->bytesOverwritten += overwritten;
+	this->bytesAppended += bytesWritten - overwritten;
+
+	// Entry only changes in size, dates and maybe the first cluster. One sector, whatever the size of the file.
+	if (position > fileSize)
+		newEntry.FileSize = position;
+	newEntry.ModifyDate = FatDate();
+	newEntry.ModifyTime = FatTime();
+
+	kernel.VFS()->GetDentries()->Invalidate(this, node->parentKey, node->info.filename);
+	if (ModifyEntry(&node->info, newEntry))
+		node->info.entry = newEntry;
+	else
+		Printf("Could not update entry of %s\r\n", node->info.filename);
+
+	if (!SyncTable())
+		return -1;
+	return bytesWritten != 0 ? (int)bytesWritten : -1;
+}
+
+void FAT::Close(KFile& file)
+{
+	KMutexGuard guard(fsLock);
+	FATNode* node = (FATNode*)file.Context;
+	file.Context = 0;
+	if (node == 0 || --node->refs != 0)
+		return;
+
+	this->nodes.remove(node);
+	delete node->info.filename;
+	delete node;
+}
+
+uint64_t FAT::GetFileId(const KFile& file)
+{
+	// Directory entries don't move while the file exists
+	const FATNode* node = (const FATNode*)file.Context;
+	return ((uint64_t)node->info.sector << 32) | node->info.offsetInSector;
+}
+
+uint64_t FAT::GetLength(const KFile& file)
+{
+	KMutexGuard guard(fsLock);
+	return ((const FATNode*)file.Context)->info.entry.FileSize;
+}
+
+bool FAT::HasOpenFiles()
+{
+	KMutexGuard guard(fsLock);
+	return !this->nodes.empty();
+}
+
+bool FAT::ReadPage(KFile& file, uint32_t index, uint8_t* page)
+{
+	KMutexGuard guard(fsLock);
+	FATNode* node = (FATNode*)file.Context;
+	const uint32_t fileSize = node->info.entry.FileSize;
+	const uint64_t offset = (uint64_t)index << PageShift;
+
+	uint32_t count = 0;
+	if (offset < fileSize) {
+		count = fileSize - (uint32_t)offset < PageSize ? fileSize - (uint32_t)offset : (uint32_t)PageSize;
+		if (ReadExtents(GET_CLUSTER(node->info.entry), fileSize, &node->extents, page, (uint32_t)offset, count) != (int)count)
+			return false;
+	}
+
+	memset(page + count, 0, PageSize - count);
+	return true;
+}
+
+bool FAT::WritePage(KFile& file, uint32_t index, const uint8_t* page)
+{
+	KMutexGuard guard(fsLock);
+	FATNode* node = (FATNode*)file.Context;
+	const uint32_t fileSize = node->info.entry.FileSize;
+	const uint64_t offset = (uint64_t)index << PageShift;
+
+	// Pages past a shrunken end have nothing to go to
+	if (offset >= fileSize)
+		return true;
+
+	const uint32_t count = fileSize - (uint32_t)offset < PageSize ? fileSize - (uint32_t)offset : (uint32_t)PageSize;
+	return WriteData(node, page, (uint32_t)offset, count) == (int)count;
+}
+
+void FAT::DisplayStats()
+{
+	KMutexGuard guard(fsLock);
+	if (this->table)
+		Printf("%s: %d of %d clusters free, table in memory (%d KB)\r\n", this->FatTypeString, this->freeClusters, this->totalClusters, (this->fatSize * this->bytesPerSector) / 1024);
+	Printf("Extents: %d lookups, %d maps built walking %d clusters\r\n", this->extentLookups, this->extentBuilds, this->extentClusters);
+	Printf("Handles: %d files open, %d bytes appended, %d overwritten, %d partial sectors merged\r\n", this->nodes.size(), this->bytesAppended, this->bytesOverwritten, this->sectorsMerged);
+	this->readahead->Display();
+}
+
+void FAT::ResetStats()
+{
+	KMutexGuard guard(fsLock);
+	this->extentLookups = 0;
+	this->extentBuilds = 0;
+	this->extentClusters = 0;
+	this->bytesAppended = 0;
+	this->bytesOverwritten = 0;
+	this->sectorsMerged = 0;
+	this->readahead->ResetStats();
+}
+
 uint32_t FAT::ClusterToSector(uint32_t cluster)
 {
 	return ((cluster - 2) * this->sectorsPerCluster) + this->firstDataSector;
@@ -413,13 +793,16 @@ uint32_t FAT::ReadTable(uint32_t cluster)
 		return 0;
 	}
 
+	if (this->table)
+		return TableEntry(cluster);
+
 	if (this->FatType == FAT32)
 	{
 		uint32_t fatOffset = cluster * 4;
 		uint32_t fatSector = this->firstFatSector + (fatOffset / this->bytesPerSector);
 		uint32_t entOffset = fatOffset % this->bytesPerSector;
 
-		if (this->disk->ReadSector(this->StartLBA + fatSector, this->readBuffer) != 0)
+		if (this->cache->Read(this->disk, this->StartLBA + fatSector, this->readBuffer) != 0)
 			return 0;
 
 		//remember to ignore the high 4 bits.
@@ -431,7 +814,7 @@ uint32_t FAT::ReadTable(uint32_t cluster)
 		uint32_t fatSector = this->firstFatSector + (fatOffset / this->bytesPerSector);
 		uint32_t entOffset = fatOffset % this->bytesPerSector;
 
-		if (this->disk->ReadSector(this->StartLBA + fatSector, this->readBuffer) != 0)
+		if (this->cache->Read(this->disk, this->StartLBA + fatSector, this->readBuffer) != 0)
 			return 0;
 
 		return *(uint16_t*)&this->readBuffer[entOffset];
@@ -442,7 +825,7 @@ uint32_t FAT::ReadTable(uint32_t cluster)
 		uint32_t fatSector = this->firstFatSector + (fatOffset / this->bytesPerSector);
 		uint32_t entOffset = fatOffset % this->bytesPerSector;
 
-		if (this->disk->ReadSector(this->StartLBA + fatSector, this->readBuffer) != 0)
+		if (this->cache->Read(this->disk, this->StartLBA + fatSector, this->readBuffer) != 0)
 			return 0;
 
 		uint16_t tableValue = *(uint16_t*)&this->readBuffer[entOffset];
@@ -463,18 +846,23 @@ void FAT::WriteTable(uint32_t cluster, uint32_t value)
 		return;
 	}
 
+	if (this->table) {
+		SetTableEntry(cluster, value);
+		return;
+	}
+
 	if (this->FatType == FAT32)
 	{
 		uint32_t fatOffset = cluster * 4;
 		uint32_t fatSector = this->firstFatSector + (fatOffset / this->bytesPerSector);
 		uint32_t entOffset = fatOffset % this->bytesPerSector;
 
-		if (this->disk->ReadSector(this->StartLBA + fatSector, this->readBuffer) != 0)
+		if (this->cache->Read(this->disk, this->StartLBA + fatSector, this->readBuffer) != 0)
 			return;
 
 		*(uint32_t*)&this->readBuffer[entOffset] = value;
 
-		if (this->disk->WriteSector(this->StartLBA + fatSector, this->readBuffer) != 0)
+		if (this->cache->Write(this->disk, this->StartLBA + fatSector, this->readBuffer) != 0)
 			Printf(__FUNCTION__": Could not write new FAT value for cluster %d", cluster);
 	}
 	else if (this->FatType == FAT16)
@@ -483,12 +871,12 @@ void FAT::WriteTable(uint32_t cluster, uint32_t value)
 		uint32_t fatSector = this->firstFatSector + (fatOffset / this->bytesPerSector);
 		uint32_t entOffset = fatOffset % this->bytesPerSector;
 
-		if (this->disk->ReadSector(this->StartLBA + fatSector, this->readBuffer) != 0)
+		if (this->cache->Read(this->disk, this->StartLBA + fatSector, this->readBuffer) != 0)
 			return;
 
 		*(uint16_t*)&this->readBuffer[entOffset] = (uint16_t)value;
 
-		if (this->disk->WriteSector(this->StartLBA + fatSector, this->readBuffer) != 0)
+		if (this->cache->Write(this->disk, this->StartLBA + fatSector, this->readBuffer) != 0)
 			Printf(__FUNCTION__": Could not write new FAT value for cluster %d", cluster);
 	}
 	else // FAT12
@@ -497,7 +885,7 @@ void FAT::WriteTable(uint32_t cluster, uint32_t value)
 		uint32_t fatSector = this->firstFatSector + (fatOffset / this->bytesPerSector);
 		uint32_t entOffset = fatOffset % this->bytesPerSector;
 
-		if (this->disk->ReadSector(this->StartLBA + fatSector, this->readBuffer) != 0)
+		if (this->cache->Read(this->disk, this->StartLBA + fatSector, this->readBuffer) != 0)
 			return;
 
 		if (cluster & 0x0001) {
@@ -511,13 +899,35 @@ void FAT::WriteTable(uint32_t cluster, uint32_t value)
 		*((uint16_t*)(&this->readBuffer[entOffset])) = (*((uint16_t*)(&this->readBuffer[entOffset]))) | value;
 
 
-		if (this->disk->WriteSector(this->StartLBA + fatSector, this->readBuffer) != 0)
+		if (this->cache->Write(this->disk, this->StartLBA + fatSector, this->readBuffer) != 0)
 			Printf(__FUNCTION__": Could not write new FAT value for cluster %d", cluster);
 	}
 }
 
 uint32_t FAT::AllocateCluster()
 {
+	if (this->table) {
+		// Next fit over the bitmap, a word of clusters at a time. The last round revisits the first word whole.
+		const uint32_t words = (this->totalClusters + 1 + 63) / 64;
+		uint32_t word = this->nextFree / 64;
+		for (uint32_t i = 0; i <= words; i++, word = (word + 1) % words) {
+			uint64_t used = this->usedClusters[word];
+			if (i == 0)
+				used |= (1ull << (this->nextFree % 64)) - 1;
+			if (used == ~0ull)
+				continue;
+
+			unsigned long bit;
+			_BitScanForward64(&bit, ~used);
+			const uint32_t cluster = word * 64 + bit;
+			this->nextFree = cluster < this->totalClusters ? cluster + 1 : 2;
+			this->fsInfo.startSearchCluster = cluster;
+			WriteTable(cluster, CLUSTER_END);
+			return cluster;
+		}
+		return 0;
+	}
+
 	// Use start cluster from fsInfo, this is also valid for FAT12/FAT16 thanks to some magic.
 	uint32_t cluster = this->fsInfo.startSearchCluster;
 
@@ -544,12 +954,264 @@ void FAT::ClearCluster(uint32_t cluster)
 
 	// Clear each sector of cluster
 	for (uint8_t i = 0; i < this->sectorsPerCluster; i++)
-		if (this->disk->WriteSector(this->StartLBA + sector + i, this->readBuffer) != 0) {
+		if (this->cache->Write(this->disk, this->StartLBA + sector + i, this->readBuffer) != 0) {
 			Printf(__FUNCTION__": Could not clear sector %d of cluster %d", sector, cluster);
 			return;
 		}
 }
 
+std::vector<FATExtent>* FAT::GetExtents(uint32_t firstCluster, uint32_t fileSize)
+{
+	this->extentLookups++;
+
+	FATExtentMap* map = 0;
+	FATExtentMap* victim = &this->extentMaps[0];
+	for (FATExtentMap& candidate : this->extentMaps) {
+		if (candidate.LastUse != 0 && candidate.FirstCluster == firstCluster) {
+			map = &candidate;
+			break;
+		}
+		if (candidate.LastUse < victim->LastUse)
+			victim = &candidate;
+	}
+
+	if (map == 0) {
+		map = victim;
+		map->FirstCluster = firstCluster;
+		map->Extents.clear();
+
+		// A chain longer than the file (plus the spare cluster WriteFile leaves) is a loop
+		BuildExtents(firstCluster, fileSize / this->clusterSize + 2, map->Extents);
+	}
+
+	map->LastUse = ++this->extentClock;
+	return &map->Extents;
+}
+
+uint32_t FAT::BuildExtents(uint32_t firstCluster, uint32_t maxClusters, std::vector<FATExtent>& extents)
+{
+	uint32_t cluster = firstCluster;
+	uint32_t index = 0;
+	while ((cluster != CLUSTER_FREE) && (cluster < CLUSTER_END) && index < maxClusters) {
+		if (!extents.empty() && extents.back().Cluster + extents.back().Count == cluster)
+			extents.back().Count++;
+		else
+			extents.push_back({ index, cluster, 1 });
+
+		index++;
+		cluster = ReadTable(cluster);
+	}
+
+	this->extentBuilds++;
+	this->extentClusters += index;
+	return index;
+}
+
+size_t FAT::FindExtent(const std::vector<FATExtent>& extents, uint32_t index)
+{
+	// Binary search, extents are sorted by Offset
+	size_t low = 0;
+	size_t high = extents.size();
+	while (low < high) {
+		const size_t mid = (low + high) / 2;
+		if (extents[mid].Offset + extents[mid].Count <= index)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+bool FAT::ExtendChain(FATNode* node, uint32_t count, DirectoryEntry& newEntry)
+{
+	for (uint32_t i = 0; i < count; i++) {
+		const uint32_t cluster = AllocateCluster();
+		if (cluster == 0) {
+			Printf("%s: no free clusters left\r\n", this->FatTypeString);
+			return false;
+		}
+
+		if (node->extents.empty()) {
+			newEntry.LowFirstCluster = cluster & 0xFFFF;
+			newEntry.HighFirstCluster = (cluster >> 16) & 0xFFFF;
+			node->extents.push_back({ 0, cluster, 1 });
+			continue;
+		}
+
+		FATExtent& last = node->extents.back();
+		WriteTable(last.Cluster + last.Count - 1, cluster);
+		if (last.Cluster + last.Count == cluster)
+			last.Count++;
+		else
+			node->extents.push_back({ last.Offset + last.Count, cluster, 1 });
+	}
+	return true;
+}
+
+FATNode* FAT::FindNode(uint32_t sector, uint32_t offsetInSector)
+{
+	for (FATNode* node : this->nodes)
+		if (node->info.sector == sector && node->info.offsetInSector == offsetInSector)
+			return node;
+	return 0;
+}
+
+void FAT::DropExtents()
+{
+	for (FATExtentMap& map : this->extentMaps)
+		map.LastUse = 0;
+}
+
+bool FAT::LoadTable()
+{
+	const size_t bytes = (size_t)this->fatSize * this->bytesPerSector;
+	if (bytes > FAT_TABLE_MAX) {
+		Printf("%s table of %d KB stays on disk\r\n", this->FatTypeString, bytes / 1024);
+		return true;
+	}
+
+	this->table = new uint8_t[bytes];
+	for (uint32_t s = 0; s < this->fatSize; s += FAT_LOAD_CHUNK) {
+		const uint32_t count = this->fatSize - s < FAT_LOAD_CHUNK ? this->fatSize - s : FAT_LOAD_CHUNK;
+		if (this->disk->ReadSectors(this->StartLBA + this->firstFatSector + s, count, this->table + s * this->bytesPerSector) != 0) {
+			Printf(__FUNCTION__": Could not read %s table\r\n", this->FatTypeString);
+			delete[] this->table;
+			this->table = 0;
+			return false;
+		}
+	}
+
+	// Copies the buffer cache may hold are stale from now on
+	this->cache->Invalidate(this->disk, this->StartLBA + this->firstFatSector, this->fatSize);
+
+	this->dirtySectors = new uint64_t[(this->fatSize + 63) / 64]();
+
+	// Clusters 0 and 1 don't exist, neither do the bits past the last one ReadTable accepts. Keep them marked as used.
+	const uint32_t clusters = this->totalClusters + 1;
+	const uint32_t words = (clusters + 63) / 64;
+	this->usedClusters = new uint64_t[words]();
+	this->freeClusters = 0;
+	for (uint32_t cluster = 0; cluster < words * 64; cluster++) {
+		if (cluster < 2 || cluster >= clusters || TableEntry(cluster) != CLUSTER_FREE)
+			this->usedClusters[cluster / 64] |= 1ull << (cluster % 64);
+		else
+			this->freeClusters++;
+	}
+
+	this->nextFree = this->fsInfo.startSearchCluster >= 2 && this->fsInfo.startSearchCluster < clusters ? this->fsInfo.startSearchCluster : 2;
+	return true;
+}
+
+uint32_t FAT::TableEntry(uint32_t cluster)
+{
+	if (this->FatType == FAT32)
+		return *(uint32_t*)&this->table[cluster * 4] & 0x0FFFFFFF; //remember to ignore the high 4 bits.
+	else if (this->FatType == FAT16)
+		return *(uint16_t*)&this->table[cluster * 2];
+
+	// FAT12, entries may straddle sectors but the table is contiguous here
+	const uint16_t tableValue = *(uint16_t*)&this->table[cluster + (cluster / 2)];
+	return (cluster & 0x0001) ? tableValue >> 4 : tableValue & 0x0FFF;
+}
+
+void FAT::SetTableEntry(uint32_t cluster, uint32_t value)
+{
+	const bool wasUsed = TableEntry(cluster) != CLUSTER_FREE;
+	uint32_t fatOffset;
+	uint32_t width;
+
+	if (this->FatType == FAT32) {
+		fatOffset = cluster * 4;
+		width = 4;
+		uint32_t* entry = (uint32_t*)&this->table[fatOffset];
+		*entry = (*entry & 0xF0000000) | (value & 0x0FFFFFFF); // High 4 bits are reserved, keep them
+	}
+	else if (this->FatType == FAT16) {
+		fatOffset = cluster * 2;
+		width = 2;
+		*(uint16_t*)&this->table[fatOffset] = (uint16_t)value;
+	}
+	else {
+		fatOffset = cluster + (cluster / 2);
+		width = 2;
+		uint16_t* entry = (uint16_t*)&this->table[fatOffset];
+		if (cluster & 0x0001)
+			*entry = (*entry & 0x000F) | (uint16_t)(value << 4);
+		else
+			*entry = (*entry & 0xF000) | (uint16_t)(value & 0x0FFF);
+	}
+
+	for (uint32_t sector = fatOffset / this->bytesPerSector; sector <= (fatOffset + width - 1) / this->bytesPerSector; sector++)
+		this->dirtySectors[sector / 64] |= 1ull << (sector % 64);
+
+	const bool used = value != CLUSTER_FREE;
+	if (used != wasUsed) {
+		if (used) {
+			this->usedClusters[cluster / 64] |= 1ull << (cluster % 64);
+			this->freeClusters--;
+		}
+		else {
+			this->usedClusters[cluster / 64] &= ~(1ull << (cluster % 64));
+			this->freeClusters++;
+		}
+	}
+}
+
+bool FAT::SyncTable()
+{
+	if (this->table == 0)
+		return true;
+
+	// Runs of dirty sectors, each written to every copy of the FAT
+	bool written = false;
+	bool failed = false;
+	uint32_t sector = 0;
+	while (sector < this->fatSize) {
+		if (this->dirtySectors[sector / 64] == 0) {
+			sector = (sector / 64 + 1) * 64;
+			continue;
+		}
+		if (!(this->dirtySectors[sector / 64] & (1ull << (sector % 64)))) {
+			sector++;
+			continue;
+		}
+
+		uint32_t run = 0;
+		while (sector + run < this->fatSize && run < FAT_LOAD_CHUNK && (this->dirtySectors[(sector + run) / 64] & (1ull << ((sector + run) % 64))))
+			run++;
+
+		bool copied = true;
+		for (uint8_t copy = 0; copy < this->numFats; copy++) {
+			if (this->disk->WriteSectors(this->StartLBA + this->firstFatSector + copy * this->fatSize + sector, run, this->table + sector * this->bytesPerSector) != 0) {
+				Printf(__FUNCTION__": Could not write sectors %d-%d of FAT %d\r\n", sector, sector + run - 1, copy);
+				copied = false;
+			}
+		}
+
+		// Only clean once every copy has it, otherwise the next sync retries the run
+		if (copied) {
+			for (uint32_t i = sector; i < sector + run; i++)
+				this->dirtySectors[i / 64] &= ~(1ull << (i % 64));
+			written = true;
+		}
+		else {
+			failed = true;
+		}
+		sector += run;
+	}
+
+	// Keep FSInfo in step so other systems don't have to count
+	if (written && this->fsInfoSector != 0) {
+		this->fsInfo.lastFreeCluster = this->freeClusters;
+		this->fsInfo.startSearchCluster = this->nextFree;
+		if (this->cache->Write(this->disk, this->StartLBA + this->fsInfoSector, (uint8_t*)&this->fsInfo) != 0) {
+			Printf(__FUNCTION__": Could not write FSInfo\r\n");
+			failed = true;
+		}
+	}
+	return !failed;
+}
+
 // Parse a list of long file name entries, also pass the 8.3 entry for the checksum
 char* FAT::ParseLFNEntries(std::list<LFNEntry>* entries, DirectoryEntry sfnEntry)
 {
@@ -655,7 +1317,7 @@ std::list<FATEntryInfo> FAT::GetDirectoryEntries(uint32_t dirCluster, bool rootD
 
 		for (uint16_t i = 0; i < this->sectorsPerCluster; i++) // Loop through sectors in this cluster
 		{
-			if (this->disk->ReadSector(this->StartLBA + sector + i, this->readBuffer) != 0) {
+			if (this->cache->Read(this->disk, this->StartLBA + sector + i, this->readBuffer) != 0) {
 				Printf(__FUNCTION__ ": Error reading disk at lba % d\r\n", this->StartLBA + sector + i);
 				return results;
 			}
@@ -734,15 +1396,52 @@ FATEntryInfo* FAT::SeachInDirectory(char* name, uint32_t dirCluster, bool rootDi
 	return ret;
 }
 
-FATEntryInfo* FAT::GetEntryByPath(char* path)
+FATEntryInfo* FAT::LookupEntry(char* name, uint32_t dirCluster, bool rootDirectory)
+{
+	// The root directory is 0, on FAT12/FAT16 dirCluster is a sector there and could collide with a cluster
+	DentryCache* dentries = kernel.VFS()->GetDentries();
+	const uint32_t parentKey = rootDirectory ? 0 : dirCluster;
+
+	FATDentry cached;
+	bool negative = false;
+	if (dentries->Lookup(this, parentKey, name, &cached, sizeof(FATDentry), negative)) {
+		if (negative)
+			return 0;
+
+		FATEntryInfo* ret = new FATEntryInfo();
+		ret->entry = cached.entry;
+		ret->filename = new char[strlen(name) + 1];
+		strcpy(ret->filename, name);
+		ret->sector = cached.sector;
+		ret->offsetInSector = cached.offsetInSector;
+		return ret;
+	}
+
+	FATEntryInfo* ret = SeachInDirectory(name, dirCluster, rootDirectory);
+	if (ret) {
+		cached.entry = ret->entry;
+		cached.sector = ret->sector;
+		cached.offsetInSector = ret->offsetInSector;
+		dentries->Insert(this, parentKey, name, &cached, sizeof(FATDentry));
+	}
+	else
+		dentries->Insert(this, parentKey, name, 0, 0);
+
+	return ret;
+}
+
+FATEntryInfo* FAT::GetEntryByPath(char* path, uint32_t* parentKey /*= 0*/)
 {
 	uint32_t searchCluster = this->rootDirCluster;
 	std::list<char*> pathList = StrSplit(path, PATH_SEPERATOR_C);
 	FATEntryInfo* ret = 0;
 
 	// The path represents a entry in the root directory, for example just: "test.txt"
-	if (pathList.size() == 0)
-		return SeachInDirectory(path, searchCluster, true);
+	if (pathList.size() == 0) {
+		if (parentKey)
+			*parentKey = 0;
+		return LookupEntry(path, searchCluster, true);
+	}
 
 
 	// Loop through each part in the filename
@@ -750,7 +1449,10 @@ FATEntryInfo* FAT::GetEntryByPath(char* path)
 	auto e = pathList.begin();
 	for (int i=0; i < pathList.size(); i++)
 	{	
-		FATEntryInfo* entry = SeachInDirectory(*e, searchCluster, i == 0);
+		if (parentKey)
+			*parentKey = i == 0 ? 0 : searchCluster;
+
+		FATEntryInfo* entry = LookupEntry(*e, searchCluster, i == 0);
 		if (entry == 0) { // Error while getting entry in directory
 			ret = 0;
 			goto end;
@@ -904,7 +1606,7 @@ bool FAT::WriteLongFilenameEntries(std::list<LFNEntry>* entries, uint32_t target
 		else if (this->FatType == FAT32 || !rootDirectory)
 			sector = ClusterToSector(targetCluster);
 
-		if (this->disk->ReadSector(this->StartLBA + sector + targetSector, this->readBuffer) != 0)
+		if (this->cache->Read(this->disk, this->StartLBA + sector + targetSector, this->readBuffer) != 0)
 			return false;
 
 		// Copy entry to free spot
@@ -914,7 +1616,7 @@ bool FAT::WriteLongFilenameEntries(std::list<LFNEntry>* entries, uint32_t target
 		memcpy(this->readBuffer + entryOffset, &target, sizeof(LFNEntry));
 
 		// And copy back to the disk
-		if (this->disk->WriteSector(this->StartLBA + sector + targetSector, this->readBuffer) != 0)
+		if (this->cache->Write(this->disk, this->StartLBA + sector + targetSector, this->readBuffer) != 0)
 			return false;
 
 		if (entryOffset + sizeof(DirectoryEntry) >= this->bytesPerSector) { // Check if we get outside of sector border for next write
@@ -936,14 +1638,14 @@ bool FAT::WriteLongFilenameEntries(std::list<LFNEntry>* entries, uint32_t target
 bool FAT::WriteDirectoryEntry(DirectoryEntry entry, uint32_t targetSector, uint32_t sectorOffset, bool rootDirectory)
 {
 	// Read disk at sector
-	if (this->disk->ReadSector(this->StartLBA + targetSector, this->readBuffer) != 0)
+	if (this->cache->Read(this->disk, this->StartLBA + targetSector, this->readBuffer) != 0)
 		return false;
 
 	// Copy entry to free spot
 	memcpy(this->readBuffer + sectorOffset, &entry, sizeof(DirectoryEntry));
 
 	// And copy back to the disk
-	if (this->disk->WriteSector(this->StartLBA + targetSector, this->readBuffer) != 0)
+	if (this->cache->Write(this->disk, this->StartLBA + targetSector, this->readBuffer) != 0)
 		return false;
 
 	return true;
@@ -964,7 +1666,7 @@ bool FAT::FindEntryStartpoint(uint32_t cluster, uint32_t entryCount, bool rootDi
 
 		for (uint16_t i = 0; i < this->sectorsPerCluster; i++) // Loop through sectors in this cluster
 		{
-			if (this->disk->ReadSector(this->StartLBA + sector + i, this->readBuffer) != 0) {
+			if (this->cache->Read(this->disk, this->StartLBA + sector + i, this->readBuffer) != 0) {
 				Printf("Error reading disk at lba %d\r\n", this->StartLBA + sector + i);
 				return false;
 			}
@@ -1132,6 +1834,7 @@ int FAT::CreateNewDirFileEntry(const char* path, uint8_t attributes)
 	{
 		uint32_t newCluster = AllocateCluster();
 		ret = CreateEntry(this->rootDirCluster, (char*)path, attributes, true, newCluster, 0);
+		kernel.VFS()->GetDentries()->Invalidate(this, 0, path); // Might be cached as missing
 	}
 	else
 	{
@@ -1152,6 +1855,7 @@ int FAT::CreateNewDirFileEntry(const char* path, uint8_t attributes)
 		{
 			uint32_t newCluster = AllocateCluster();
 			ret = CreateEntry(GET_CLUSTER(parentEntry->entry), name, attributes, false, newCluster, 0);
+			kernel.VFS()->GetDentries()->Invalidate(this, GET_CLUSTER(parentEntry->entry), name); // Might be cached as missing
 
 			// Extract cluster of root directory for the .. entry
 			entryRootCluster = GET_CLUSTER(parentEntry->entry);
@@ -1199,7 +1903,7 @@ int FAT::CreateNewDirFileEntry(const char* path, uint8_t attributes)
 			dotEntry.HighFirstCluster = (directoryCluster >> 16) & 0xFFFF;
 
 			// Read first sector of new cluster, should be all zero's since we cleared it
-			if (this->disk->ReadSector(this->StartLBA + sector, this->readBuffer) != 0)
+			if (this->cache->Read(this->disk, this->StartLBA + sector, this->readBuffer) != 0)
 				return -1;
 
 			// Copy first . entry
@@ -1214,7 +1918,7 @@ int FAT::CreateNewDirFileEntry(const char* path, uint8_t attributes)
 			memcpy(this->readBuffer + sizeof(DirectoryEntry), &dotEntry, sizeof(DirectoryEntry));
 
 			// Finaly write it back to the disk
-			if (this->disk->WriteSector(this->StartLBA + sector, this->readBuffer) != 0)
+			if (this->cache->Write(this->disk, this->StartLBA + sector, this->readBuffer) != 0)
 				return -1;
 		}
 
@@ -1229,7 +1933,7 @@ bool FAT::ModifyEntry(FATEntryInfo* entry, DirectoryEntry newVersion)
 	if (entry == 0)
 		return false;
 
-	if (this->disk->ReadSector(this->StartLBA + entry->sector, this->readBuffer) != 0)
+	if (this->cache->Read(this->disk, this->StartLBA + entry->sector, this->readBuffer) != 0)
 		return false;
 
 	// Create pointer to entry for easy access
@@ -1243,7 +1947,7 @@ bool FAT::ModifyEntry(FATEntryInfo* entry, DirectoryEntry newVersion)
 	memcpy(entryPtr, &newVersion, sizeof(DirectoryEntry));
 
 	// And finally write sector back to disk
-	if (this->disk->WriteSector(this->StartLBA + entry->sector, this->readBuffer) != 0)
+	if (this->cache->Write(this->disk, this->StartLBA + entry->sector, this->readBuffer) != 0)
 		return false;
 
 	return true;
@@ -1,5 +1,10 @@
 #pragma once
 #include "virtualFileSystem.h"
+#include "kernel/objects/KMutex.h"
+#include "kernel/io/disk/BufferCache.h"
+#include "Readahead.h"
+#include "DentryCache.h"
+#include <vector>
 
 #pragma pack(push,1)
 struct FAT32_BPB
@@ -116,9 +121,54 @@ struct FATEntryInfo
 #define ENTRY_UNUSED    0xE5
 #define LFN_ENTRY_END   0x40
 
+// Tables up to this size are kept in memory, larger ones are read through the buffer cache
+#define FAT_TABLE_MAX   (16 * 1024 * 1024)
+// Sectors per command when loading or writing back the table
+#define FAT_LOAD_CHUNK  128
+
+// Files whose extent maps are kept
+#define FAT_EXTENT_FILES 16
+
+// Sectors per command when writing file data through a handle
+#define FAT_WRITE_CHUNK 128
+
 // Extract cluster from directory entry
 #define GET_CLUSTER(e) (e.LowFirstCluster | (e.HighFirstCluster << (16)))
 
+// Run of contiguous clusters in a file
+struct FATExtent
+{
+	uint32_t Offset;                    // Index of its first cluster inside the file
+	uint32_t Cluster;                   // First cluster on disk
+	uint32_t Count;                     // Clusters in the run
+};
+
+// Cluster chain of a file as extents sorted by Offset, cached by first cluster
+struct FATExtentMap
+{
+	uint32_t FirstCluster;
+	uint64_t LastUse;                   // 0 if unused
+	std::vector<FATExtent> Extents;
+};
+
+// What the dentry cache keeps of a FATEntryInfo, the name is the key
+struct FATDentry
+{
+	DirectoryEntry entry;
+	uint32_t sector;
+	uint32_t offsetInSector;
+};
+static_assert(sizeof(FATDentry) <= DENTRY_DATA_MAX, "FATDentry doesn't fit a dentry");
+
+// Open file, shared by every handle on it. KFile::Context points to it.
+struct FATNode
+{
+	FATEntryInfo info;                  // Entry as it is on disk, where it lives and its name
+	uint32_t parentKey;                 // Dentry key of its directory
+	uint32_t refs;                      // Handles open on it
+	std::vector<FATExtent> extents;     // Whole chain, including clusters past the end of the file
+};
+
 enum FATType
 {
 	FAT12,
@@ -154,6 +204,26 @@ public:
 
 	std::list<VFSEntry>* DirectoryList(const char* path) override;
 
+	bool Open(KFile& file, const char* filename, GenericAccess access, bool create = false) override;
+
+	int Write(KFile& file, const uint8_t* buffer, uint32_t len) override;
+
+	void Close(KFile& file) override;
+
+	uint64_t GetFileId(const KFile& file) override;
+
+	uint64_t GetLength(const KFile& file) override;
+
+	bool HasOpenFiles() override;
+
+	bool ReadPage(KFile& file, uint32_t index, uint8_t* page) override;
+
+	bool WritePage(KFile& file, uint32_t index, const uint8_t* page) override;
+
+	void DisplayStats() override;
+
+	void ResetStats() override;
+
 private:
 	///////////////////////
 	/// Helper Functions
@@ -174,6 +244,37 @@ private:
 	// Clear the data of a cluster
 	void ClearCluster(uint32_t cluster);
 
+	// Read the first FAT into memory and build the free cluster bitmap
+	bool LoadTable();
+
+	// Entry of a cluster in the in-memory table
+	uint32_t TableEntry(uint32_t cluster);
+
+	// Change an entry in the in-memory table, marks its sector dirty
+	void SetTableEntry(uint32_t cluster, uint32_t value);
+
+	// Write dirty table sectors to every FAT copy, and FSInfo on FAT32. False if a sector didn't make it to every
+	// copy, it stays dirty for the next sync.
+	bool SyncTable();
+
+	// Extent map of the file starting at firstCluster, walks the chain the first time
+	std::vector<FATExtent>* GetExtents(uint32_t firstCluster, uint32_t fileSize);
+
+	// Walk at most maxClusters of the chain at firstCluster into extents, returns clusters walked
+	uint32_t BuildExtents(uint32_t firstCluster, uint32_t maxClusters, std::vector<FATExtent>& extents);
+
+	// Index of the extent holding cluster index of a file, extents.size() if it's past the chain
+	size_t FindExtent(const std::vector<FATExtent>& extents, uint32_t index);
+
+	// Append count clusters to the chain of node, newEntry gets the first cluster if there was no chain yet
+	bool ExtendChain(FATNode* node, uint32_t count, DirectoryEntry& newEntry);
+
+	// Open node of the entry at sector and offsetInSector, 0 if there is none
+	FATNode* FindNode(uint32_t sector, uint32_t offsetInSector);
+
+	// Forget all extent maps, chains changed
+	void DropExtents();
+
 	// Parse a list of long file name entries, also pass the 8.3 entry for the checksum
 	char* ParseLFNEntries(std::list<LFNEntry>* entries, DirectoryEntry sfnEntry);
 
@@ -193,8 +294,14 @@ private:
 	// Search in a directory for a specific entry and return this entry if found
 	FATEntryInfo* SeachInDirectory(char* name, uint32_t dirCluster, bool rootDirectory = false);
 
-	// Return the entry specified by a complete filename path
-	FATEntryInfo* GetEntryByPath(char* path);
+	// SeachInDirectory through the dentry cache
+	FATEntryInfo* LookupEntry(char* name, uint32_t dirCluster, bool rootDirectory);
+
+	// Return the entry specified by a complete filename path, parentKey receives the dentry key of its directory
+	FATEntryInfo* GetEntryByPath(char* path, uint32_t* parentKey = 0);
+
+	// Read len bytes at offset of a file into buffer, returns bytes read or -1
+	int ReadExtents(uint32_t firstCluster, uint32_t fileSize, std::vector<FATExtent>* extents, uint8_t* buffer, uint32_t offset, uint32_t len);
 
 	///////////////////////
 	/// Write Functions
@@ -212,6 +319,9 @@ private:
 	// Write a regulair Directory entry to the disk
 	bool WriteDirectoryEntry(DirectoryEntry entry, uint32_t targetSector, uint32_t sectorOffset, bool rootDirectory);
 
+	// Write len bytes at offset of an open file, offset must not be past its end. Returns bytes written or -1
+	int WriteData(FATNode* node, const uint8_t* buffer, uint32_t offset, uint32_t len);
+
 	// Find a starting point for entries in a directory. Returns cluster and sector offset inside cluster.
 	bool FindEntryStartpoint(uint32_t cluster, uint32_t entryCount, bool rootdir, uint32_t* targetCluster, uint32_t* targetSector, uint32_t* sectorOffset);
 
@@ -250,8 +360,31 @@ private:
 	uint32_t firstFatSector = 0;        // The first sector in the File Allocation Table
 	uint32_t rootDirCluster = 0;        // Cluster of the root directory, only used by FAT32
 	uint32_t totalClusters = 0;         // Total amount of clusters used by data region
+	uint32_t fatSize = 0;               // Sectors per copy of the FAT
+	uint8_t numFats = 0;                // Copies of the FAT on disk
+	uint16_t fsInfoSector = 0;          // FAT32 FSInfo sector, 0 if there is none
+
+	uint8_t* table = 0;                 // First FAT in memory, 0 if it's too large
+	uint64_t* dirtySectors = 0;         // Bit per table sector not written back yet
+	uint64_t* usedClusters = 0;         // Bit per cluster, set if allocated
+	uint32_t freeClusters = 0;          // Clear bits in usedClusters
+	uint32_t nextFree = 2;              // Next fit hint for AllocateCluster
+
+	FATExtentMap extentMaps[FAT_EXTENT_FILES] = {}; // Least recently used one is rebuilt
+	uint64_t extentClock = 0;
+	uint64_t extentLookups = 0;
+	uint64_t extentBuilds = 0;
+	uint64_t extentClusters = 0;        // Walked while building maps
+
+	std::list<FATNode*> nodes;          // Open files
+	uint64_t bytesAppended = 0;
+	uint64_t bytesOverwritten = 0;
+	uint64_t sectorsMerged = 0;         // Partial sectors read back before writing
 
 	uint8_t* readBuffer = 0;            // Buffer used for reading the disk
+	BufferCache* cache;                 // Metadata goes through it, file data doesn't
+	Readahead* readahead;               // File data reads, prefetches for sequential readers
+	KMutex fsLock;                      // Serializes VFS calls, guards readBuffer and on-disk structures
 	FAT32_FSInfo fsInfo;                // Structure used by FAT32 for extra info
 
 };
\ No newline at end of file
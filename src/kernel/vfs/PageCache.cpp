@@ -0,0 +1,521 @@
+#include "PageCache.h"
+#include "virtualFileSystem.h"
+#include "kernel/Kernel.h"
+#include "kernel/mem/TlbShootdown.h"
+#include "kernel/objects/KPredicate.h"
+#include "kernel/proc/UProc.h"
+#include "mem/PageTables.h"
+#include <Assert.h>
+#include <intrin.h>
+#include <cstring>
+
+PageCache::PageCache() :
+	m_lock("PageCache"),
+	m_pages(new CachedPage[PAGE_CACHE_PAGES]()),
+	m_buckets(),
+	m_count(),
+	m_hand(),
+	m_reserved(),
+	m_dirty(),
+	m_mappings(),
+	m_userMappings(),
+	m_kernelSpace(KernelFileMapStart, KernelFileMapEnd, true),
+	m_hits(),
+	m_misses(),
+	m_evictions(),
+	m_faults(),
+	m_writtenBack(),
+	m_invalidated()
+{
+	m_kernelSpace.Initialize();
+}
+
+int PageCache::Read(KFile& file, uint8_t* buffer, uint32_t len)
+{
+	VirtualFileSystem* fs = file.FileSystem;
+	const uint64_t id = fs->GetFileId(file);
+	file.Length = fs->GetLength(file);
+	if (file.Position >= file.Length || len == 0)
+		return 0;
+	if (len > file.Length - file.Position)
+		len = (uint32_t)(file.Length - file.Position);
+
+	KMutexGuard guard(m_lock);
+	uint32_t bytesRead = 0;
+	while (bytesRead < len)
+	{
+		const uint64_t position = file.Position + bytesRead;
+		CachedPage* page = Get(file, id, (uint32_t)(position >> PageShift));
+		if (!page)
+			break;
+
+		const uint32_t skip = (uint32_t)(position & PageMask);
+		uint32_t count = (uint32_t)PageSize - skip;
+		if (count > len - bytesRead)
+			count = len - bytesRead;
+
+		memcpy(buffer + bytesRead, page->Data + skip, count);
+		bytesRead += count;
+	}
+
+	file.Position += bytesRead;
+	return bytesRead != 0 ? (int)bytesRead : -1;
+}
+
+void PageCache::Update(KFile& file, uint64_t offset, const uint8_t* buffer, uint32_t len)
+{
+	const VirtualFileSystem* fs = file.FileSystem;
+	const uint64_t id = fs->GetFileId(file);
+
+	KMutexGuard guard(m_lock);
+	uint64_t position = offset;
+	while (position < offset + len)
+	{
+		const uint32_t skip = (uint32_t)(position & PageMask);
+		uint32_t count = (uint32_t)PageSize - skip;
+		if (count > offset + len - position)
+			count = (uint32_t)(offset + len - position);
+
+		//A fill in flight may have read the disk before the write, let it finish first
+		CachedPage* page = Lookup(fs, id, (uint32_t)(position >> PageShift));
+		if (page && page->Busy)
+		{
+			WaitIdle(page);
+			continue;
+		}
+		if (page)
+			memcpy(page->Data + skip, buffer + (position - offset), count);
+		position += count;
+	}
+}
+
+char PageCache::Sync(KFile& file)
+{
+	VirtualFileSystem* fs = file.FileSystem;
+	const uint64_t id = fs->GetFileId(file);
+
+	KMutexGuard guard(m_lock);
+	for (FileMapping* mapping : m_mappings)
+	{
+		if (mapping->File->FileSystem == fs && mapping->FileId == id)
+			CollectDirty(mapping);
+	}
+
+	//Only mappings dirty pages, most files never had one
+	if (m_dirty == 0)
+		return 0;
+
+	char result = 0;
+	for (size_t i = 0; i < m_count; i++)
+	{
+		CachedPage* page = &m_pages[i];
+		while (page->Busy)
+			WaitIdle(page);
+		if (!page->Valid || !page->Dirty || page->Owner != fs || page->File != id)
+			continue;
+
+		if (!WriteBack(file, page))
+			result = 1;
+	}
+	return result;
+}
+
+void PageCache::Invalidate(const VirtualFileSystem* fs, uint64_t file)
+{
+	KMutexGuard guard(m_lock);
+	for (size_t i = 0; i < m_count; i++)
+	{
+		CachedPage* page = &m_pages[i];
+		while (page->Busy)
+			WaitIdle(page);
+		if (page->Valid && page->Owner == fs && page->File == file)
+			Release(page);
+	}
+}
+
+void PageCache::InvalidateMount(const VirtualFileSystem* fs)
+{
+	KMutexGuard guard(m_lock);
+	for (size_t i = 0; i < m_count; i++)
+	{
+		CachedPage* page = &m_pages[i];
+		while (page->Busy)
+			WaitIdle(page);
+		if (page->Valid && page->Owner == fs)
+			Release(page);
+	}
+}
+
+void* PageCache::MapFile(KFile& file, uint64_t offset, size_t length, UserProcess* process)
+{
+	Assert((offset & PageMask) == 0);
+	if (length == 0)
+		return nullptr;
+
+	const size_t pages = (length + PageMask) >> PageShift;
+
+	KMutexGuard guard(m_lock);
+
+	//Mapped pages can't be evicted, every page of every mapping has to fit at once
+	if (m_reserved + pages > PAGE_CACHE_PAGES)
+		return nullptr;
+
+	uintptr_t address = 0;
+	VirtualAddressSpace& space = process ? process->GetAddressSpace() : m_kernelSpace;
+	if (!space.Reserve(address, pages))
+		return nullptr;
+
+	FileMapping* mapping = new FileMapping();
+	mapping->Address = address;
+	mapping->Pages = pages;
+	mapping->FirstIndex = (uint32_t)(offset >> PageShift);
+	mapping->File = &file;
+	mapping->FileId = file.FileSystem->GetFileId(file);
+	mapping->Process = process;
+	mapping->Root = process ? process->GetCR3() : 0;
+	mapping->Writable = (file.Access & GenericAccess::Write) != 0;
+	mapping->Mapped = new CachedPage*[pages]();
+	m_mappings.push_back(mapping);
+	m_reserved += pages;
+	if (process)
+		m_userMappings++;
+	return (void*)address;
+}
+
+void PageCache::UnmapFile(void* address)
+{
+	KMutexGuard guard(m_lock);
+	FileMapping* mapping = FindMapping((uintptr_t)address);
+	Assert(mapping && mapping->Address == (uintptr_t)address);
+
+	//Collected and unmapped before m_lock is dropped for the write back, nothing dirties the pages after that
+	CollectDirty(mapping);
+	m_mappings.remove(mapping);
+
+	PageTables tables(mapping->Root);
+	if (!mapping->Process)
+		tables.OpenCurrent();
+
+	TlbShootdown shootdown(mapping->Process);
+	for (size_t i = 0; i < mapping->Pages; i++)
+	{
+		if (!mapping->Mapped[i])
+			continue;
+
+		tables.UnmapPages(mapping->Address + (i << PageShift), 1);
+		shootdown.Add(mapping->Address + (i << PageShift));
+	}
+	shootdown.Flush();
+
+	VirtualAddressSpace& space = mapping->Process ? mapping->Process->GetAddressSpace() : m_kernelSpace;
+	space.Release(mapping->Address);
+	if (mapping->Process)
+		m_userMappings--;
+
+	//Still counted as mapped so they can't be evicted yet, failures stay dirty for the next Sync of the file
+	for (size_t i = 0; i < mapping->Pages; i++)
+	{
+		CachedPage* page = mapping->Mapped[i];
+		if (!page)
+			continue;
+
+		while (page->Busy)
+			WaitIdle(page);
+		if (mapping->Writable && page->Valid && page->Dirty)
+			WriteBack(*mapping->File, page);
+		page->Mapped--;
+	}
+
+	m_reserved -= mapping->Pages;
+	delete[] mapping->Mapped;
+	delete mapping;
+}
+
+bool PageCache::IsMapped(const KFile& file)
+{
+	KMutexGuard guard(m_lock);
+	for (const FileMapping* mapping : m_mappings)
+	{
+		if (mapping->File == &file)
+			return true;
+	}
+	return false;
+}
+
+bool PageCache::OnPageFault(uintptr_t address, uint64_t errorCode, bool interrupts)
+{
+	//Present pages fault on protection, a write to a read only mapping is a bug of the caller
+	if (errorCode & 1)
+		return false;
+
+	//Every other fault of the kernel comes through here too, don't take the lock for those
+	const bool kernelWindow = address >= KernelFileMapStart && address < KernelFileMapEnd;
+	if (!kernelWindow && (address >= UserAddress::UserStop || m_userMappings == 0))
+		return false;
+
+	//Filling the page blocks on the disk and m_lock may sleep, not with interrupts off
+	if (!interrupts)
+		return false;
+
+	_enable();
+
+	bool handled = false;
+	{
+		KMutexGuard guard(m_lock);
+		FileMapping* mapping = FindMapping(address);
+		const size_t i = mapping ? (address - mapping->Address) >> PageShift : 0;
+
+		//Another thread of the process may have faulted it in meanwhile
+		if (mapping && !mapping->Mapped[i])
+		{
+			CachedPage* page = Get(*mapping->File, mapping->FileId, mapping->FirstIndex + (uint32_t)i);
+
+			//Get drops m_lock while it reads. Unmapped meanwhile fails the fault, replaced by another mapping
+			//retries it.
+			FileMapping* current = FindMapping(address);
+			if (current != mapping)
+			{
+				page = nullptr;
+				handled = current != nullptr;
+				mapping = nullptr;
+			}
+
+			if (page && !mapping->Mapped[i])
+			{
+				PageTables tables(mapping->Root);
+				if (!mapping->Process)
+					tables.OpenCurrent();
+
+				//Entry was not present, nothing to invalidate
+				Assert(tables.MapPages(mapping->Address + (i << PageShift), page->Frame, 1, mapping->Process == nullptr, mapping->Writable));
+				page->Mapped++;
+				mapping->Mapped[i] = page;
+				m_faults++;
+			}
+		}
+		if (mapping)
+			handled = mapping->Mapped[i] != nullptr;
+	}
+
+	_disable();
+	return handled;
+}
+
+size_t PageCache::Hash(const VirtualFileSystem* fs, uint64_t file, uint32_t index) const
+{
+	return (size_t)((file * 0x9E3779B97F4A7C15ull) ^ index ^ ((uintptr_t)fs >> 6)) & (PAGE_CACHE_BUCKETS - 1);
+}
+
+PageCache::CachedPage* PageCache::Lookup(const VirtualFileSystem* fs, uint64_t file, uint32_t index) const
+{
+	for (CachedPage* page = m_buckets[Hash(fs, file, index)]; page; page = page->HashNext)
+	{
+		if (page->Owner == fs && page->File == file && page->Index == index)
+			return page;
+	}
+	return nullptr;
+}
+
+void PageCache::Unhash(CachedPage* page)
+{
+	CachedPage** link = &m_buckets[Hash(page->Owner, page->File, page->Index)];
+	while (*link != page)
+	{
+		Assert(*link != nullptr);
+		link = &(*link)->HashNext;
+	}
+	*link = page->HashNext;
+	page->HashNext = nullptr;
+	page->Valid = false;
+}
+
+PageCache::CachedPage* PageCache::Allocate()
+{
+	//Caller holds m_lock. Frames are added until the cache is full, after that CLOCK takes a page nobody maps.
+	if (m_count < PAGE_CACHE_PAGES)
+	{
+		CachedPage* page = &m_pages[m_count++];
+		page->Frame = kernel.AllocatePhysical(1);
+		page->Data = (uint8_t*)kernel.DriverMapPages(page->Frame, 1);
+		return page;
+	}
+
+	//Two turns of the hand clear every reference bit
+	for (size_t i = 0; i < 2 * PAGE_CACHE_PAGES; i++)
+	{
+		CachedPage* page = &m_pages[m_hand];
+		m_hand = (m_hand + 1) % PAGE_CACHE_PAGES;
+
+		//Dirty pages are left by a failed write back, Sync tries them again
+		if (page->Mapped != 0 || page->Dirty || page->Busy)
+			continue;
+
+		if (page->Valid)
+		{
+			if (page->Referenced)
+			{
+				page->Referenced = false;
+				continue;
+			}
+
+			Unhash(page);
+			m_evictions++;
+		}
+		return page;
+	}
+	return nullptr;
+}
+
+PageCache::CachedPage* PageCache::Get(KFile& file, uint64_t id, uint32_t index)
+{
+	//Caller holds m_lock, it is dropped while the page is read
+	CachedPage* page = Lookup(file.FileSystem, id, index);
+	while (page && page->Busy)
+	{
+		WaitIdle(page);
+		page = Lookup(file.FileSystem, id, index);
+	}
+	if (page)
+	{
+		m_hits++;
+		page->Referenced = true;
+		return page;
+	}
+
+	m_misses++;
+	page = Allocate();
+	if (!page)
+		return nullptr;
+
+	//Hashed busy, others faulting on the same page wait for this read instead of reading it too
+	page->Owner = file.FileSystem;
+	page->File = id;
+	page->Index = index;
+	page->Dirty = false;
+	page->Referenced = true;
+
+	const size_t bucket = Hash(page->Owner, page->File, page->Index);
+	page->HashNext = m_buckets[bucket];
+	m_buckets[bucket] = page;
+	page->Valid = true;
+	page->Busy = true;
+
+	kernel.KeReleaseMutex(m_lock);
+	const bool read = file.FileSystem->ReadPage(file, index, page->Data);
+	kernel.KeAcquireMutex(m_lock);
+	page->Busy = false;
+
+	//A failed read just leaves it free
+	if (!read)
+	{
+		Unhash(page);
+		return nullptr;
+	}
+	return page;
+}
+
+bool PageCache::WriteBack(KFile& file, CachedPage* page)
+{
+	//Caller holds m_lock, it is dropped while the page is written. Writes through a mapping meanwhile set the
+	//dirty bit of the entry again, the next CollectDirty finds them.
+	page->Busy = true;
+	kernel.KeReleaseMutex(m_lock);
+	const bool written = file.FileSystem->WritePage(file, page->Index, page->Data);
+	kernel.KeAcquireMutex(m_lock);
+	page->Busy = false;
+
+	if (!written)
+		return false;
+	page->Dirty = false;
+	m_dirty--;
+	m_writtenBack++;
+	return true;
+}
+
+void PageCache::WaitIdle(CachedPage* page)
+{
+	//Caller holds m_lock and looks at the page again afterwards, it may have been evicted or invalidated
+	kernel.KeReleaseMutex(m_lock);
+	KPredicate idle(&PageCache::IsIdle, page);
+	kernel.KeWait(idle);
+	kernel.KeAcquireMutex(m_lock);
+}
+
+bool PageCache::IsIdle(void* const arg)
+{
+	//Evaluated by the scheduler with interrupts disabled
+	return !((const CachedPage*)arg)->Busy;
+}
+
+void PageCache::Release(CachedPage* page)
+{
+	//The file changed on disk, what the page holds is dropped even if a mapping wrote to it
+	if (page->Dirty)
+	{
+		page->Dirty = false;
+		m_dirty--;
+	}
+	Unhash(page);
+	m_invalidated++;
+}
+
+PageCache::FileMapping* PageCache::FindMapping(uintptr_t address) const
+{
+	//User mappings only count in the address space they were made for
+	const paddr_t root = __readcr3() & ~PageMask;
+	for (FileMapping* mapping : m_mappings)
+	{
+		if (address < mapping->Address || address >= mapping->Address + (mapping->Pages << PageShift))
+			continue;
+		if (!mapping->Process || mapping->Root == root)
+			return mapping;
+	}
+	return nullptr;
+}
+
+void PageCache::CollectDirty(FileMapping* mapping)
+{
+	//Caller holds m_lock. Bits are cleared before the flush, writes after it set them again.
+	if (!mapping->Writable)
+		return;
+
+	PageTables tables(mapping->Root);
+	if (!mapping->Process)
+		tables.OpenCurrent();
+
+	TlbShootdown shootdown(mapping->Process);
+	for (size_t i = 0; i < mapping->Pages; i++)
+	{
+		CachedPage* page = mapping->Mapped[i];
+		const uintptr_t address = mapping->Address + (i << PageShift);
+		if (!page || !tables.ClearDirty(address))
+			continue;
+
+		//Invalidated pages are no longer in the file, nothing writes them back or frees them while dirty
+		shootdown.Add(address);
+		if (page->Valid && !page->Dirty)
+		{
+			page->Dirty = true;
+			m_dirty++;
+		}
+	}
+	shootdown.Flush();
+}
+
+void PageCache::Display() const
+{
+	const uint64_t lookups = m_hits + m_misses;
+	Printf("PageCache: %d of %d pages, %d dirty, %d hits, %d misses (%d%% hit), %d evictions, %d invalidated\r\n",
+		m_count, PAGE_CACHE_PAGES, m_dirty, m_hits, m_misses, lookups != 0 ? (m_hits * 100) / lookups : 0, m_evictions, m_invalidated);
+	Printf("    Mappings: %d, %d pages reserved, %d faults, %d pages written back\r\n", m_mappings.size(), m_reserved, m_faults, m_writtenBack);
+}
+
+void PageCache::ResetStats()
+{
+	m_hits = 0;
+	m_misses = 0;
+	m_evictions = 0;
+	m_faults = 0;
+	m_writtenBack = 0;
+	m_invalidated = 0;
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <os.internal.h>
+#include "OS.System.h"
+#include "kernel/objects/KMutex.h"
+#include "kernel/objects/KFile.h"
+#include "kernel/mem/VAS.h"
+
+#define PAGE_CACHE_PAGES	16384 //64MB, frames are taken from the PMM as the cache fills and kept
+#define PAGE_CACHE_BUCKETS	4096 //Power of two
+
+class VirtualFileSystem;
+class UserProcess;
+
+//File contents in page sized frames, keyed by (filesystem, file, page index). Handle reads copy out of it and
+//file mappings map its frames, so both see the same pages. Handle writes go to the filesystem and into the
+//resident pages. Pages written through a mapping are found by the dirty bit of its page table entries and
+//written back by Sync, on unmap and when the last handle closes. m_lock isn't held across disk I/O, the page
+//is marked busy instead and whoever needs it waits for it.
+class PageCache
+{
+public:
+	PageCache();
+
+	//Read from file.Position through the cache, returns bytes read or -1
+	int Read(KFile& file, uint8_t* buffer, uint32_t len);
+	//Bytes just written at offset through a handle, copied into the pages that are resident
+	void Update(KFile& file, uint64_t offset, const uint8_t* buffer, uint32_t len);
+	//Writes back what mappings of the file changed, 0 if all of it made it to disk
+	char Sync(KFile& file);
+	//File changed behind the cache. Pages still mapped stay with their mapping until it goes away.
+	void Invalidate(const VirtualFileSystem* fs, uint64_t file);
+	void InvalidateMount(const VirtualFileSystem* fs);
+
+	//Maps length bytes of the file from offset, page aligned, into the kernel or into process. Nothing is read
+	//until a page is touched. file has to stay open until UnmapFile. Fails if the cache can't hold the mapping.
+	//Read only unless file was opened for writing.
+	void* MapFile(KFile& file, uint64_t offset, size_t length, UserProcess* process = nullptr);
+	void UnmapFile(void* address);
+	bool IsMapped(const KFile& file);
+
+	//Page fault at address, true if it was a file mapping and the page is in place now. Filling a page reads
+	//the disk, faults with interrupts disabled are refused.
+	bool OnPageFault(uintptr_t address, uint64_t errorCode, bool interrupts);
+
+	void Display() const;
+	void ResetStats();
+
+private:
+	struct CachedPage
+	{
+		const VirtualFileSystem* Owner;
+		uint64_t File;
+		uint32_t Index;
+		paddr_t Frame;
+		uint8_t* Data; //Kernel view of Frame
+		CachedPage* HashNext;
+		uint32_t Mapped; //Page table entries pointing at Frame, it isn't evicted while there are any
+		bool Valid; //Hashed, stale pages that are still mapped aren't
+		bool Dirty;
+		bool Referenced; //Second chance for CLOCK
+		volatile bool Busy; //Filled or written back without m_lock, nobody else touches it meanwhile
+	};
+
+	struct FileMapping
+	{
+		uintptr_t Address;
+		size_t Pages;
+		uint32_t FirstIndex; //Page of the file at Address
+		KFile* File;
+		uint64_t FileId;
+		UserProcess* Process; //Null for kernel mappings
+		paddr_t Root; //Page tables of Process
+		bool Writable;
+		CachedPage** Mapped; //Per page, null until faulted in
+	};
+
+	size_t Hash(const VirtualFileSystem* fs, uint64_t file, uint32_t index) const;
+	CachedPage* Lookup(const VirtualFileSystem* fs, uint64_t file, uint32_t index) const;
+	void Unhash(CachedPage* page);
+	CachedPage* Allocate();
+	CachedPage* Get(KFile& file, uint64_t id, uint32_t index);
+	bool WriteBack(KFile& file, CachedPage* page);
+	void WaitIdle(CachedPage* page);
+	static bool IsIdle(void* const arg);
+	void Release(CachedPage* page);
+	FileMapping* FindMapping(uintptr_t address) const;
+	void CollectDirty(FileMapping* mapping);
+
+	KMutex m_lock;
+	CachedPage* m_pages;
+	CachedPage* m_buckets[PAGE_CACHE_BUCKETS];
+	size_t m_count; //Pages with a frame
+	size_t m_hand;
+	size_t m_reserved; //Pages promised to mappings
+	size_t m_dirty;
+	std::list<FileMapping*> m_mappings;
+	volatile size_t m_userMappings; //Read without m_lock, faults outside any mapping don't take it
+	VirtualAddressSpace m_kernelSpace;
+
+	//Stats
+	uint64_t m_hits;
+	uint64_t m_misses;
+	uint64_t m_evictions;
+	uint64_t m_faults;
+	uint64_t m_writtenBack;
+	uint64_t m_invalidated;
+
+	::NO_COPY_OR_ASSIGN(PageCache);
+};
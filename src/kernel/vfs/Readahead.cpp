@@ -0,0 +1,224 @@
+#include "Readahead.h"
+#include "kernel/io/disk/Disk.h"
+#include "kernel/Kernel.h"
+#include <Assert.h>
+#include <cstring>
+
+Readahead::Readahead(Disk* disk) :
+	m_disk(disk),
+	m_blockSize(disk->GetBlockSize()),
+	m_streams(),
+	m_clock(),
+	m_requests(),
+	m_segments(),
+	m_head(),
+	m_inflight(),
+	m_result(),
+	m_event(false, false),
+	m_sequential(),
+	m_random(),
+	m_queued(),
+	m_prefetched(),
+	m_used(),
+	m_wasted()
+{
+
+}
+
+Readahead::~Readahead()
+{
+	Drain();
+	Invalidate();
+	for (ReadaheadStream& stream : m_streams)
+		delete[] stream.Buffer;
+}
+
+ReadaheadStream* Readahead::Begin(uint32_t file, uint64_t offset)
+{
+	ReadaheadStream* stream = nullptr;
+	ReadaheadStream* victim = &m_streams[0];
+	for (ReadaheadStream& candidate : m_streams)
+	{
+		if (candidate.LastUse != 0 && candidate.File == file)
+		{
+			stream = &candidate;
+			break;
+		}
+		if (candidate.LastUse < victim->LastUse)
+			victim = &candidate;
+	}
+
+	if (!stream)
+	{
+		//A file read from its start counts as sequential right away
+		Reset(*victim);
+		stream = victim;
+		stream->File = file;
+	}
+
+	if (offset == stream->NextOffset)
+	{
+		stream->Window = stream->Window == 0 ? READAHEAD_MIN : stream->Window * 2;
+		if (stream->Window > READAHEAD_MAX)
+			stream->Window = READAHEAD_MAX;
+		m_sequential++;
+	}
+	else
+	{
+		Reset(*stream);
+		m_random++;
+	}
+
+	stream->LastUse = ++m_clock;
+	return stream;
+}
+
+char Readahead::Read(ReadaheadStream* stream, uint64_t lba, uint32_t count, uint8_t* buf)
+{
+	const uint32_t used = Consume(*stream, lba, count, buf);
+	lba += used;
+	count -= used;
+	buf += (size_t)used * m_blockSize;
+	if (count == 0)
+		return 0;
+
+	//Scatter lists need word alignment, Disk bounces anything else synchronously
+	if ((uintptr_t)buf & 1)
+		return m_disk->ReadSectors(lba, count, buf);
+
+	//Ring is full, the oldest command is the one to wait for
+	if (m_inflight == READAHEAD_REQUESTS)
+	{
+		Wait(&m_requests[m_head]);
+		if (m_requests[m_head].Result != 0)
+			m_result = m_requests[m_head].Result;
+		m_inflight--;
+	}
+
+	BlockSegment& segment = m_segments[m_head];
+	segment = { buf, count * m_blockSize };
+
+	BlockRequest& request = m_requests[m_head];
+	request = {};
+	request.Lba = lba;
+	request.Count = count;
+	request.Segments = &segment;
+	request.SegmentCount = 1;
+	request.Event = &m_event;
+	m_disk->Submit(&request);
+
+	m_head = (m_head + 1) % READAHEAD_REQUESTS;
+	m_inflight++;
+	m_queued += count;
+	return 0;
+}
+
+char Readahead::Drain()
+{
+	while (m_inflight != 0)
+	{
+		BlockRequest& oldest = m_requests[(m_head + READAHEAD_REQUESTS - m_inflight) % READAHEAD_REQUESTS];
+		Wait(&oldest);
+		if (oldest.Result != 0)
+			m_result = oldest.Result;
+		m_inflight--;
+	}
+
+	const char result = m_result;
+	m_result = 0;
+	return result;
+}
+
+void Readahead::End(ReadaheadStream* stream, uint64_t offset, uint64_t lba, uint32_t count)
+{
+	stream->NextOffset = offset;
+
+	//Whatever is left of the last prefetch still lies ahead
+	if (stream->Window == 0 || count == 0 || stream->Count != 0)
+		return;
+
+	AssertOp(count, <=, stream->Window);
+	if (!stream->Buffer)
+		stream->Buffer = new uint8_t[READAHEAD_MAX * m_blockSize];
+
+	stream->Segment = { stream->Buffer, count * m_blockSize };
+	stream->Prefetch = {};
+	stream->Prefetch.Lba = lba;
+	stream->Prefetch.Count = count;
+	stream->Prefetch.Segments = &stream->Segment;
+	stream->Prefetch.SegmentCount = 1;
+	stream->Prefetch.Event = &m_event;
+	stream->Lba = lba;
+	stream->Count = count;
+	m_disk->Submit(&stream->Prefetch);
+	m_prefetched += count;
+}
+
+uint32_t Readahead::GetWindow(const ReadaheadStream* stream) const
+{
+	return stream->Window;
+}
+
+void Readahead::Invalidate()
+{
+	for (ReadaheadStream& stream : m_streams)
+	{
+		Reset(stream);
+		stream.LastUse = 0;
+	}
+}
+
+void Readahead::Reset(ReadaheadStream& stream)
+{
+	if (stream.Count != 0)
+	{
+		Wait(&stream.Prefetch);
+		m_wasted += stream.Count;
+		stream.Count = 0;
+	}
+	stream.NextOffset = 0;
+	stream.Window = 0;
+}
+
+uint32_t Readahead::Consume(ReadaheadStream& stream, uint64_t lba, uint32_t count, uint8_t* buf)
+{
+	if (stream.Count == 0 || lba != stream.Lba)
+		return 0;
+
+	Wait(&stream.Prefetch);
+	if (stream.Prefetch.Result != 0)
+	{
+		m_wasted += stream.Count;
+		stream.Count = 0;
+		return 0;
+	}
+
+	const uint32_t blocks = count < stream.Count ? count : stream.Count;
+	memcpy(buf, stream.Buffer + (stream.Lba - stream.Prefetch.Lba) * m_blockSize, (size_t)blocks * m_blockSize);
+	stream.Lba += blocks;
+	stream.Count -= blocks;
+	m_used += blocks;
+	return blocks;
+}
+
+void Readahead::Wait(BlockRequest* request)
+{
+	//Commands share one event, Disk::Wait keeps going until this one is done
+	m_disk->Wait(request);
+}
+
+void Readahead::Display() const
+{
+	Printf("Readahead: %d sequential, %d random reads, %d blocks queued, %d prefetched, %d used, %d wasted\r\n",
+		m_sequential, m_random, m_queued, m_prefetched, m_used, m_wasted);
+}
+
+void Readahead::ResetStats()
+{
+	m_sequential = 0;
+	m_random = 0;
+	m_queued = 0;
+	m_prefetched = 0;
+	m_used = 0;
+	m_wasted = 0;
+}
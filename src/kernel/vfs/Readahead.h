@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstdint>
+#include <os.internal.h>
+#include "kernel/io/disk/BlockRequest.h"
+#include "kernel/objects/KEvent.h"
+
+#define READAHEAD_STREAMS	4 //Files tracked at once, least recently used one is dropped
+#define READAHEAD_MIN		16 //Blocks prefetched after the first sequential read
+#define READAHEAD_MAX		512 //Blocks, the window doubles up to this on every sequential read
+#define READAHEAD_REQUESTS	16 //Commands in flight while reading into the caller's buffer
+
+class Disk;
+
+//Sequential access state of one file. Filesystems key it by anything that identifies the file, FAT uses the
+//first cluster.
+struct ReadaheadStream
+{
+	uint32_t File;
+	uint64_t NextOffset; //Where the last read ended, a read starting here is sequential
+	uint32_t Window; //Blocks
+	uint64_t LastUse;
+
+	//Blocks read ahead of NextOffset, in flight until Prefetch.Done
+	uint8_t* Buffer;
+	uint64_t Lba;
+	uint32_t Count;
+	BlockRequest Prefetch;
+	BlockSegment Segment;
+};
+
+//Sits between a filesystem and Disk. Reads are queued as asynchronous commands straight into the caller's
+//buffer, several in flight. Once a file is read sequentially the blocks that follow the read are fetched in the
+//background and handed to the next read. Not thread safe, the filesystem serializes calls.
+class Readahead
+{
+public:
+	Readahead(Disk* disk);
+	~Readahead();
+
+	//Start of a read of file at offset
+	ReadaheadStream* Begin(uint32_t file, uint64_t offset);
+	//Read count blocks at lba into buf. Takes what was prefetched, queues the rest without waiting unless
+	//READAHEAD_REQUESTS are already in flight. buf has to stay valid until Drain.
+	char Read(ReadaheadStream* stream, uint64_t lba, uint32_t count, uint8_t* buf);
+	//Waits for everything Read queued, 0 if all of it succeeded
+	char Drain();
+	//End of a successful read at offset. Sequential streams fetch the following count blocks at lba, which the
+	//filesystem picked from its allocation, count is at most GetWindow.
+	void End(ReadaheadStream* stream, uint64_t offset, uint64_t lba, uint32_t count);
+	uint32_t GetWindow(const ReadaheadStream* stream) const;
+	bool IsSequential(const ReadaheadStream* stream) const { return stream->Window != 0; }
+
+	//File contents changed, forget everything
+	void Invalidate();
+
+	void Display() const;
+	void ResetStats();
+
+private:
+	void Reset(ReadaheadStream& stream);
+	uint32_t Consume(ReadaheadStream& stream, uint64_t lba, uint32_t count, uint8_t* buf);
+	void Wait(BlockRequest* request);
+
+	Disk* m_disk;
+	uint32_t m_blockSize;
+	ReadaheadStream m_streams[READAHEAD_STREAMS];
+	uint64_t m_clock;
+
+	//Commands queued by Read, ring
+	BlockRequest m_requests[READAHEAD_REQUESTS];
+	BlockSegment m_segments[READAHEAD_REQUESTS];
+	size_t m_head;
+	size_t m_inflight;
+	char m_result;
+	KEvent m_event; //Shared by all commands, waiters check Done
+
+	//Stats
+	uint64_t m_sequential;
+	uint64_t m_random;
+	uint64_t m_queued; //Blocks read into caller buffers
+	uint64_t m_prefetched;
+	uint64_t m_used; //Prefetched blocks handed to a read
+	uint64_t m_wasted; //Prefetched blocks dropped unused
+
+	::NO_COPY_OR_ASSIGN(Readahead);
+};
@@ -1,6 +1,7 @@
 #include "VFSManager.h"
 #include "kernel/Kernel.h"
 #include <list>
+#include <Assert.h>
 
 VFSManager::VFSManager()
 {
@@ -12,16 +13,27 @@ void VFSManager::Mount(VirtualFileSystem* vfs)
 	Filesystems->push_back(vfs); //Just add it to the list of known filesystems, easy.
 }
 
-void VFSManager::Unmount(VirtualFileSystem* vfs)
+bool VFSManager::Unmount(VirtualFileSystem* vfs)
 {
+	// Handles and the mappings behind them still use its nodes
+	if (vfs->HasOpenFiles())
+		return false;
+
+	m_dentries.InvalidateMount(vfs);
+	m_pages.InvalidateMount(vfs);
 	Filesystems->erase(std::remove(Filesystems->begin(), Filesystems->end(), vfs), Filesystems->end());
+	return true;
 }
 
-void VFSManager::UnmountByDisk(Disk* disk)
+bool VFSManager::UnmountByDisk(Disk* disk)
 {
-	for (VirtualFileSystem* vfs : *Filesystems)
-		if (vfs->disk == disk)
-			Unmount(vfs);
+	// Unmount changes the list, walk a copy
+	const std::vector<VirtualFileSystem*> filesystems = *Filesystems;
+	bool unmounted = true;
+	for (VirtualFileSystem* vfs : filesystems)
+		if (vfs->disk == disk && !Unmount(vfs))
+			unmounted = false;
+	return unmounted;
 }
 
 int VFSManager::ExtractDiskNumber(const char* path, uint8_t* idSizeReturn)
@@ -30,32 +42,27 @@ int VFSManager::ExtractDiskNumber(const char* path, uint8_t* idSizeReturn)
 	if (idPos != NULL && strchr(path, PATH_SEPERATOR_C) != NULL)
 	{
 		int idLength = idPos - path;
-		char* idStr = new char[idLength];
-		memcpy(idStr, path, idLength);
-
 		int idValue = 0;
 
-		if (isalpha(idStr[0])) //are we using a character instead of a integer?
+		// Parsed in place, every path based call comes through here
+		if (isalpha(path[0])) //are we using a character instead of a integer?
 		{
-			switch (idStr[0])
+			switch (path[0])
 			{
 				case 'b':
 				case 'B':
 					idValue = this->bootPartitionID;
 					break;
 				default:
-					delete[] idStr;
 					return -1;
 					break;
 			}
 		}
 		else
 		{
-			idValue = strtol(idStr, NULL, 10);
+			idValue = strtol(path, NULL, 10); // Stops at the ':'
 		}
 
-		delete[] idStr;
-
 		if(idSizeReturn != 0)
 			*idSizeReturn = idLength;
 
@@ -119,10 +126,19 @@ int VFSManager::WriteFile(const char* path, uint8_t* buffer, uint32_t len, bool
 	uint8_t idSize = 0;
 	int disk = ExtractDiskNumber(path, &idSize);
 
-	if (disk != -1 && Filesystems->size() > disk)
-		return Filesystems->at(disk)->WriteFile(path + idSize + 2, buffer, len, create);
-	else
+	if (disk == -1 || Filesystems->size() <= disk)
 		return -1;
+
+	VirtualFileSystem* fs = Filesystems->at(disk);
+	const int result = fs->WriteFile(path + idSize + 2, buffer, len, create);
+
+	// Whole file was replaced, cached pages of it are stale. Filesystems never call into the page cache.
+	KFile file = KFile();
+	if (fs->Open(file, path + idSize + 2, GenericAccess::Read)) {
+		m_pages.Invalidate(fs, fs->GetFileId(file));
+		fs->Close(file);
+	}
+	return result;
 }
 
 bool VFSManager::FileExists(const char* path)
@@ -201,6 +217,92 @@ std::list<VFSEntry>* VFSManager::DirectoryList(const char* path)
 		return 0;
 }
 
+bool VFSManager::Open(KFile& file, const char* path, GenericAccess access, bool create /*= false*/)
+{
+	uint8_t idSize = 0;
+	int disk = ExtractDiskNumber(path, &idSize);
+
+	file = KFile();
+	if (disk == -1 || Filesystems->size() <= disk)
+		return false;
+
+	VirtualFileSystem* fs = Filesystems->at(disk);
+	if (!fs->Open(file, path + idSize + 2, access, create))
+		return false;
+
+	file.FileSystem = fs;
+	file.Position = 0;
+	file.Access = access;
+	return true;
+}
+
+int VFSManager::Read(KFile& file, uint8_t* buffer, uint32_t len)
+{
+	if (file.FileSystem == 0 || !(file.Access & GenericAccess::Read))
+		return -1;
+
+	return m_pages.Read(file, buffer, len);
+}
+
+int VFSManager::Write(KFile& file, const uint8_t* buffer, uint32_t len)
+{
+	if (file.FileSystem == 0 || !(file.Access & GenericAccess::Write))
+		return -1;
+
+	const size_t offset = file.Position;
+	const int result = file.FileSystem->Write(file, buffer, len);
+	if (result > 0)
+		m_pages.Update(file, offset, buffer, result);
+	return result;
+}
+
+bool VFSManager::Seek(KFile& file, size_t position)
+{
+	if (file.FileSystem == 0)
+		return false;
+
+	// Other handles of the file may have grown it, ask the filesystem instead of trusting file.Length
+	file.Length = file.FileSystem->GetLength(file);
+	if (position > file.Length)
+		return false;
+
+	file.Position = position;
+	return true;
+}
+
+char VFSManager::Sync(KFile& file)
+{
+	if (file.FileSystem == 0)
+		return -1;
+
+	return m_pages.Sync(file);
+}
+
+void VFSManager::Close(KFile& file)
+{
+	if (file.FileSystem == 0)
+		return;
+
+	//Mappings keep a pointer to the handle, they have to be gone first
+	Assert(!m_pages.IsMapped(file));
+	m_pages.Sync(file);
+	file.FileSystem->Close(file);
+	file = KFile();
+}
+
+void* VFSManager::MapFile(KFile& file, uint64_t offset, size_t length, UserProcess* process /*= nullptr*/)
+{
+	if (file.FileSystem == 0 || !(file.Access & GenericAccess::Read))
+		return nullptr;
+
+	return m_pages.MapFile(file, offset, length, process);
+}
+
+void VFSManager::UnmapFile(void* address)
+{
+	m_pages.UnmapFile(address);
+}
+
 bool VFSManager::EjectDrive(const char* path)
 {
 	uint8_t idSize = 0;
@@ -1,6 +1,8 @@
 #pragma once
 #include <vector>
 #include "virtualFileSystem.h"
+#include "DentryCache.h"
+#include "PageCache.h"
 
 class VFSManager
 {
@@ -8,12 +10,18 @@ public:
 
 	VFSManager();
 	void Mount(VirtualFileSystem* vfs);
-	void Unmount(VirtualFileSystem* vfs);
-	void UnmountByDisk(Disk* disk);
+	// Refused while files of the filesystem are open
+	bool Unmount(VirtualFileSystem* vfs);
+	bool UnmountByDisk(Disk* disk);
 
 	int ExtractDiskNumber(const char* path, uint8_t* idSizeReturn);
 	bool SearchBootPartition();
 
+	// Path component cache shared by all filesystems
+	DentryCache* GetDentries() { return &m_dentries; }
+	// File pages shared by handle reads and file mappings
+	PageCache* GetPages() { return &m_pages; }
+
 	/////////////
 	// Filesystem functions
 	/////////////
@@ -38,6 +46,28 @@ public:
 	// Returns list of context inside a directory
 	std::list<VFSEntry>* DirectoryList(const char* path);
 
+	/////////////
+	// Handle functions, the path is only resolved by Open
+	/////////////
+
+	// Open a file, it will be created when create equals true. Position starts at 0.
+	bool Open(KFile& file, const char* path, GenericAccess access, bool create = false);
+	// Read from the position on, returns bytes read, 0 at the end of the file, -1 on error
+	int Read(KFile& file, uint8_t* buffer, uint32_t len);
+	// Write at the position, partial writes only touch the sectors they cover and appending doesn't rewrite the file
+	int Write(KFile& file, const uint8_t* buffer, uint32_t len);
+	// Move the position, at most to the end of the file
+	bool Seek(KFile& file, size_t position);
+	// Writes back what mappings of the file changed, 0 on success
+	char Sync(KFile& file);
+	// Dirty mapped pages are written back before the handle goes
+	void Close(KFile& file);
+
+	// Map length bytes from the page aligned offset into the kernel, or into process. Pages are read when touched.
+	// The handle stays open until the mapping is gone.
+	void* MapFile(KFile& file, uint64_t offset, size_t length, UserProcess* process = nullptr);
+	void UnmapFile(void* address);
+
 
 	///////////////////
 	// Higher Level Functions
@@ -49,4 +79,8 @@ public:
 public:
 	std::vector<VirtualFileSystem*>* Filesystems;
 	int bootPartitionID = -1;
+
+private:
+	DentryCache m_dentries;
+	PageCache m_pages;
 };
\ No newline at end of file
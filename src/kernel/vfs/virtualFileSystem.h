@@ -1,5 +1,6 @@
 #pragma once
 #include <kernel\io\disk\Disk.h>
+#include <kernel\objects\KFile.h>
 
 #define VFS_NAME_LENGTH 255
 
@@ -61,6 +62,37 @@ public:
 	// Returns list of context inside a directory
 	virtual std::list<VFSEntry>* DirectoryList(const char* path) = 0;
 
+	/////////////
+	// Handle Functions, file.Context points to the filesystem's node of the file. Reads of a handle go
+	// through the page cache, see ReadPage.
+	/////////////
+
+	// Open a file, fills in Context and Length. File will be created when create equals true
+	virtual bool Open(KFile& file, const char* filename, GenericAccess access, bool create = false) = 0;
+	// Write at file.Position, the file grows if needed. Moves file.Position past what was written, returns bytes written or -1
+	virtual int Write(KFile& file, const uint8_t* buffer, uint32_t len) = 0;
+	// Release the node, file.Context is cleared
+	virtual void Close(KFile& file) = 0;
+
+	/////////////
+	// Page Functions, used by the page cache on open files
+	/////////////
+
+	// Identifies the file on this filesystem for as long as it exists, the same for every handle
+	virtual uint64_t GetFileId(const KFile& file) = 0;
+	// Current size of the file in bytes
+	virtual uint64_t GetLength(const KFile& file) = 0;
+	// Read page index of the file, whatever lies past the end of the file is zeroed
+	virtual bool ReadPage(KFile& file, uint32_t index, uint8_t* page) = 0;
+	// Write page index back, the file does not grow
+	virtual bool WritePage(KFile& file, uint32_t index, const uint8_t* page) = 0;
+	// Handles still point into the filesystem, it can't go away
+	virtual bool HasOpenFiles() = 0;
+
+	// Print and clear the statistics of whatever the filesystem caches
+	virtual void DisplayStats() {}
+	virtual void ResetStats() {}
+
 public:
 	Disk* disk;
 
@@ -41,7 +41,7 @@ bool PageTables::IsActive() const
 }
 
 //TODO(tsharpe): Rewrite to use larger page blocks (2MB, 1GB)
-bool PageTables::MapPages(const uintptr_t virtualBase, const paddr_t physicalBase, const size_t count, const bool global) const
+bool PageTables::MapPages(const uintptr_t virtualBase, const paddr_t physicalBase, const size_t count, const bool global, const bool writable /*= true*/) const
 {
 	CPrintf(Debug, "V: 0x%016x P: 0x%016x C: 0x%x G: %d\r\n", virtualBase, physicalBase, count, global);
 
@@ -51,14 +51,25 @@ bool PageTables::MapPages(const uintptr_t virtualBase, const paddr_t physicalBas
 	for (size_t i = 0; i < count; i++)
 	{
 		const uintptr_t offset = (i << PageShift);
-		if (!MapPage(virtualBase + offset, physicalBase + offset, global))
+		if (!MapPage(virtualBase + offset, physicalBase + offset, global, writable))
 			return false;
 	}
 
 	return true;
 }
 
-paddr_t PageTables::ResolveAddress(const uintptr_t virtualAddress) const
+void PageTables::UnmapPages(const uintptr_t virtualBase, const size_t count) const
+{
+	CPrintf(Debug, "Unmap V: 0x%016x C: 0x%x\r\n", virtualBase, count);
+
+	Assert(Pool);
+	Assert(m_root);
+
+	for (size_t i = 0; i < count; i++)
+		UnmapPage(virtualBase + (i << PageShift));
+}
+
+bool PageTables::TryResolveAddress(const uintptr_t virtualAddress, paddr_t& physical) const
 {
 	//loading->WriteLineFormat("Resolving: 0x%16x", virtualAddress);
 
@@ -68,26 +79,50 @@ paddr_t PageTables::ResolveAddress(const uintptr_t virtualAddress) const
 	const PPML4E map4 = (PPML4E)Pool->GetVirtualAddress(m_root);
 	const PML4E level4 = map4[addr.index4];
 	CPrintf(Debug, "L4: 0x%016x, P: %d, RW: %d S: %d -\r\n", level4.Value, level4.Present, level4.ReadWrite, level4.UserSupervisor);
+	if (!level4.Present)
+		return false;
 
 	const PPDPTE_DIR map3 = (PPDPTE_DIR)Pool->GetVirtualAddress(level4.Value & ~0xFFF);
 	const PDPTE_DIR level3 = map3[addr.index3];
 	CPrintf(Debug, "L3: 0x%016x, P: %d, RW: %d S: %d -\r\n", level3.Value, level3.Present, level3.ReadWrite, level3.UserSupervisor);
+	if (!level3.Present)
+		return false;
+
+	if (level3.PageSize == 1)
+	{
+		//L3 maps a 1GB page
+		physical = (level3.Value & ~0x3FFFFFFF) | (virtualAddress & 0x3FFFFFFF);
+		return true;
+	}
 
 	const PPDE_DIR map2 = (PPDE_DIR)Pool->GetVirtualAddress(level3.Value & ~0xFFF);
 	const PDE_DIR level2 = map2[addr.index2];
 	CPrintf(Debug, "L2: 0x%016x, P: %d, RW: %d S: %d -\r\n", level2.Value, level2.Present, level2.ReadWrite, level2.UserSupervisor);
+	if (!level2.Present)
+		return false;
+
 	if (level2.PageSize == 1)
 	{
 		//L2 maps a 2MB page
-		return (level2.Value & ~0x1FFFFF) | (virtualAddress & 0x1FFFFF);
+		physical = (level2.Value & ~0x1FFFFF) | (virtualAddress & 0x1FFFFF);
+		return true;
 	}
 
 	//L2 maps a 4k page
 	const PPTE map1 = (PPTE)Pool->GetVirtualAddress(level2.Value & ~0xFFF);
 	const PTE level1 = map1[addr.index1];
 	CPrintf(Debug, "L1: 0x%016x, P: %d, RW: %d S: %d -\r\n", level1.Value, level1.Present, level1.ReadWrite, level1.UserSupervisor);
+	if (!level1.Present)
+		return false;
 
-	return (level1.Value & ~0xFFF) + addr.offset;
+	physical = (level1.Value & ~0xFFF) + addr.offset;
+	return true;
+}
+
+paddr_t PageTables::ResolveAddress(const uintptr_t virtualAddress) const
+{
+	paddr_t physical;
+	return TryResolveAddress(virtualAddress, physical) ? physical : 0;
 }
 
 void PageTables::ClearKernelEntries() const
@@ -189,7 +224,7 @@ void PageTables::DisplayRoot() const
 	}
 }
 
-bool PageTables::MapPage(const uintptr_t virtualAddress, const paddr_t physicalAddress, const bool global) const
+bool PageTables::MapPage(const uintptr_t virtualAddress, const paddr_t physicalAddress, const bool global, const bool writable) const
 {
 	CPrintf(Debug, "MapPage-V: 0x%016x P: 0x%016x G: %d\r\n", virtualAddress, physicalAddress, global);
 
@@ -254,13 +289,64 @@ bool PageTables::MapPage(const uintptr_t virtualAddress, const paddr_t physicalA
 	CPrintf(Debug, "L1: 0x%016x, Index: %d, V: 0x%016x\r\n", map1, addr.index1, level1.Value);
 	level1.Value = physicalAddress;
 	level1.Present = true;
-	level1.ReadWrite = true;
+	level1.ReadWrite = writable; //Tables above stay writable, the leaf decides
 	level1.UserSupervisor = !global;
 	level1.Global = global;
 
 	return true;
 }
 
+void PageTables::UnmapPage(const uintptr_t virtualAddress) const
+{
+	VirtualAddress addr;
+	addr.AsUint64 = virtualAddress;
+
+	const PPML4E map4 = (PPML4E)Pool->GetVirtualAddress(m_root);
+	if (!map4[addr.index4].Present)
+		return;
+
+	const PPDPTE_DIR map3 = (PPDPTE_DIR)Pool->GetVirtualAddress(map4[addr.index4].Value & ~0xFFF);
+	if (!map3[addr.index3].Present)
+		return;
+
+	const PPDE_DIR map2 = (PPDE_DIR)Pool->GetVirtualAddress(map3[addr.index3].Value & ~0xFFF);
+	const PDE_DIR level2 = map2[addr.index2];
+	Assert(level2.PageSize == 0);
+	if (!level2.Present)
+		return;
+
+	PPTE map1 = (PPTE)Pool->GetVirtualAddress(level2.Value & ~0xFFF);
+	map1[addr.index1].Value = 0;
+}
+
+bool PageTables::ClearDirty(const uintptr_t virtualAddress) const
+{
+	VirtualAddress addr;
+	addr.AsUint64 = virtualAddress;
+
+	const PPML4E map4 = (PPML4E)Pool->GetVirtualAddress(m_root);
+	if (!map4[addr.index4].Present)
+		return false;
+
+	const PPDPTE_DIR map3 = (PPDPTE_DIR)Pool->GetVirtualAddress(map4[addr.index4].Value & ~0xFFF);
+	if (!map3[addr.index3].Present)
+		return false;
+
+	const PPDE_DIR map2 = (PPDE_DIR)Pool->GetVirtualAddress(map3[addr.index3].Value & ~0xFFF);
+	const PDE_DIR level2 = map2[addr.index2];
+	Assert(level2.PageSize == 0);
+	if (!level2.Present)
+		return false;
+
+	PPTE map1 = (PPTE)Pool->GetVirtualAddress(level2.Value & ~0xFFF);
+	PTE& level1 = map1[addr.index1];
+	if (!level1.Present || !level1.Dirty)
+		return false;
+
+	level1.Dirty = false;
+	return true;
+}
+
 uintptr_t PageTables::BuildAddress(const size_t i4, const size_t i3, const size_t i2, const size_t i1, const size_t offset) const
 {
 	VirtualAddress addr = { offset, i1, i2, i3, i4, 0 };
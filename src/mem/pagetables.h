@@ -30,8 +30,14 @@ public:
 	bool IsActive() const;
 
 	//TODO(tsharpe): page attributes
-	bool MapPages(const uintptr_t virtualBase, const paddr_t physicalBase, const size_t count, const bool global) const;
-	//TODO: unmap
+	bool MapPages(const uintptr_t virtualBase, const paddr_t physicalBase, const size_t count, const bool global, const bool writable = true) const;
+	//Clears the leaf entries, tables stay allocated. The caller invalidates the TLB.
+	void UnmapPages(const uintptr_t virtualBase, const size_t count) const;
+	//True if the page was written to since it was mapped or last asked, clears the bit. The caller invalidates the TLB.
+	bool ClearDirty(const uintptr_t virtualAddress) const;
+	//False if the address isn't mapped at some level
+	bool TryResolveAddress(const uintptr_t virtualAddress, paddr_t& physical) const;
+	//0 if the address isn't mapped
 	paddr_t ResolveAddress(const uintptr_t virtualAddress) const;
 
 	//Table manipulation
@@ -231,7 +237,8 @@ private:
 	static_assert(sizeof(VirtualAddress) == sizeof(uint64_t), "Size mismatch");
 #pragma pack(pop)
 
-	bool MapPage(const uintptr_t virtualAddress, const paddr_t physicalAddress, const bool global) const;
+	bool MapPage(const uintptr_t virtualAddress, const paddr_t physicalAddress, const bool global, const bool writable) const;
+	void UnmapPage(const uintptr_t virtualAddress) const;
 	uintptr_t BuildAddress(const size_t i4, const size_t i3, const size_t i2, const size_t i1, const size_t offset) const;
 
 	paddr_t m_root;
@@ -66,6 +66,10 @@ enum KernelAddress : uintptr_t
 	KernelIoStart = KernelAcpiEnd,
 	KernelIoEnd = KernelIoStart + KernelSectionLength,
 
+	//File mappings 0xFFFF'8060'0000'0000
+	KernelFileMapStart = KernelIoEnd,
+	KernelFileMapEnd = KernelFileMapStart + KernelSectionLength,
+
 	//Windows
 	KernelSharedPageStart = 0xFFFF'F780'0000'0000,
 	KernelSharedPageStop = 0xFFFF'F780'0000'1000,